@@ -0,0 +1,26 @@
+#!/bin/bash
+# Compare two results files written by bench.sh.
+#
+# Usage: bench-compare.sh <before.tsv> <after.tsv>
+#
+# For each file and action in both, prints the median time from each and
+# the change as a percentage, which is negative if "after" is faster.
+
+set -e
+
+BEFORE=${1:?usage: bench-compare.sh <before.tsv> <after.tsv>}
+AFTER=${2:?usage: bench-compare.sh <before.tsv> <after.tsv>}
+
+awk -F '\t' '
+    FNR == 1 { next }
+    NR == FNR { before[$2 "\t" $3] = $7; next }
+    ($2 "\t" $3) in before {
+        b = before[$2 "\t" $3]
+        change = b > 0 ? ($7 - b) * 100 / b : 0
+        if (!header) {
+            printf "%-16s %-8s %12s %12s %8s\n", "case", "action", "before_ms", "after_ms", "change"
+            header = 1
+        }
+        printf "%-16s %-8s %12.3f %12.3f %+7.1f%%\n", $2, $3, b, $7, change
+    }
+' "$BEFORE" "$AFTER"
@@ -0,0 +1,107 @@
+#!/bin/bash
+# Benchmark cfbfinfo on a corpus of synthetic files made by cfbfgen.
+#
+# Usage: bench.sh <cfbfinfo> <cfbfgen> [results.tsv]
+#
+# Each file in the matrix below is generated into $BENCH_DIR (default
+# bench-corpus) unless it's already there, then each action is run on it
+# $BENCH_RUNS times (default 5) with its output thrown away. One line per
+# file and action is written to the results file, tab-separated:
+#
+#     build  case  action  file_bytes  runs  min_ms  median_ms
+#
+# where build is the git commit of the tree, so results files from
+# different builds can be put side by side. Files are read from the page
+# cache - the first run of each action warms it, and isn't counted.
+#
+# BENCH_LARGE=1 adds some files of several hundred megabytes.
+
+set -e
+
+CFBFINFO=${1:?usage: bench.sh <cfbfinfo> <cfbfgen> [results.tsv]}
+CFBFGEN=${2:?usage: bench.sh <cfbfinfo> <cfbfgen> [results.tsv]}
+OUT=${3:-bench-results.tsv}
+DIR=${BENCH_DIR:-bench-corpus}
+RUNS=${BENCH_RUNS:-5}
+
+BUILD=$(git describe --always --dirty 2>/dev/null || echo unknown)
+
+# name, then cfbfgen arguments
+CASES=(
+    "v3-small|-s 9 -n 20 --max-size 64K --publisher 32"
+    "v3-many|-s 9 -n 5000 --depth 3 --width 6 --max-size 32K --mini-share 80"
+    "v3-frag|-s 9 -n 200 --max-size 1M --frag 50 --publisher 512"
+    "v3-difat|-s 9 -n 50 --max-size 4M --difat 3 --publisher 256"
+    "v4-large|-s 12 -n 100 --max-size 8M --frag 10 --publisher 1024"
+    "v4-deep|-s 12 -n 2000 --depth 6 --width 2 --max-size 256K --mini-share 30"
+)
+if [ -n "$BENCH_LARGE" ]; then
+    CASES+=(
+        "v3-difat-large|-s 9 -n 1000 --max-size 16M --difat 40 --frag 5"
+        "v4-difat|-s 12 -n 200 --max-size 32M --difat 1 --publisher 4096"
+    )
+fi
+
+# name, then cfbfinfo arguments. "open" just parses the file and prints
+# the header, so it's the cost of cfbf_open() and little else.
+ACTIONS=(
+    "open|-H"
+    "list|-l"
+    "walk|-w -q"
+    "dump|-r"
+    "text|-t"
+)
+
+now_ns() {
+    date +%s%N
+}
+
+mkdir -p "$DIR"
+printf 'build\tcase\taction\tfile_bytes\truns\tmin_ms\tmedian_ms\n' > "$OUT"
+
+for c in "${CASES[@]}"; do
+    name=${c%%|*}
+    args=${c#*|}
+    file="$DIR/$name.cfb"
+
+    if [ ! -f "$file" ]; then
+        echo "Generating $file" >&2
+        $CFBFGEN $args "$file"
+    fi
+    bytes=$(stat -c %s "$file")
+
+    for a in "${ACTIONS[@]}"; do
+        action=${a%%|*}
+        action_args=${a#*|}
+
+        # Only files made with --publisher have a CONTENTS stream
+        if [ "$action" = text ] && [[ "$args" != *--publisher* ]]; then
+            continue
+        fi
+
+        if [ "$action" = dump ]; then
+            cmd=("$CFBFINFO" -r "Root Entry/Stream0" -o /dev/null "$file")
+        else
+            cmd=("$CFBFINFO" $action_args -o /dev/null "$file")
+        fi
+
+        "${cmd[@]}" 2>/dev/null || true
+        times=()
+        for ((i = 0; i < RUNS; ++i)); do
+            start=$(now_ns)
+            "${cmd[@]}" 2>/dev/null || true
+            end=$(now_ns)
+            times+=($(( (end - start) / 1000 )))
+        done
+
+        sorted=($(printf '%s\n' "${times[@]}" | sort -n))
+        min=${sorted[0]}
+        median=${sorted[$((RUNS / 2))]}
+        printf '%s\t%s\t%s\t%s\t%d\t%d.%03d\t%d.%03d\n' "$BUILD" "$name" \
+            "$action" "$bytes" "$RUNS" $((min / 1000)) $((min % 1000)) \
+            $((median / 1000)) $((median % 1000)) >> "$OUT"
+        echo "$name $action: median $((median / 1000)) ms" >&2
+    done
+done
+
+echo "Results written to $OUT" >&2
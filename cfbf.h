@@ -2,6 +2,7 @@
 #define _CFBF_H
 
 #include <stdint.h>
+#include <time.h>
 
 // https://en.wikipedia.org/wiki/Compound_File_Binary_Format
 // Modified to fix type sizes for Linux
@@ -24,6 +25,7 @@ typedef unsigned char CLSID[16];// 16 Bytes
 #define CFBF_FREESECT 0xFFFFFFFF
 #define CFBF_FATSECT 0xFFFFFFFD
 #define CFBF_DIFSECT 0xFFFFFFFC
+#define CFBF_MAXREGSECT 0xFFFFFFFA
 
 #define CFBF_IS_SECTOR(x) (((uint32_t) (x)) < 0xFFFFFFFCUL)
 
@@ -89,27 +91,163 @@ struct DirEntry {
  * https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-cfb/28488197-8193-49d7-84d8-dfd692418ccd
  */
 
+struct cfbf;
+
 struct cfbf_fat {
+    /* Copy of the whole FAT. For the main FAT of a file opened with a
+     * window, this is NULL, and entries are looked up in the file. */
     SECT *sector_entries;
-    int sector_entries_count;
+    unsigned long sector_entries_count;
     int sector_size;
 
-    /* Pointers into the actual cfbf file */
-    SECT **fat_sectors;
-    int num_fat_sectors;
+    /* The file's FAT sectors, in order */
+    SECT *fat_sectors;
+    unsigned long num_fat_sectors;
+
+    struct cfbf *cfbf;
+};
+
+/* One window on a file too big to map all at once */
+struct cfbf_window {
+    char *base;
+    int64_t offset;
+    size_t length;
+    unsigned long last_used;
+};
+
+/* Arena allocator, see cfbf_arena.c */
+struct cfbf_arena_block;
+
+struct cfbf_arena {
+    struct cfbf_arena_block *head;
+    struct cfbf_arena_block *spare;
+
+    /* Most recent allocation, which cfbf_arena_grow() can extend */
+    void *last;
+
+    /* Total size of the blocks in use, and the most it has been */
+    size_t bytes_allocated;
+    size_t peak_bytes_allocated;
+};
+
+struct cfbf_arena_mark {
+    struct cfbf_arena_block *block;
+    size_t used;
 };
 
+#define CFBF_ARENA_BLOCK_SIZE (64 * 1024)
+
 struct cfbf {
     int fd;
+
+    /* The whole file, or NULL if it's being mapped a window at a time */
     void *file;
     long long file_size;
     struct StructuredStorageHeader *header;
     struct cfbf_fat fat, mini_fat;
 
+    /* Sector and mini-sector sizes from the header, checked and cached at
+     * open so the chain-following code doesn't keep working them out */
+    int sector_shift, sector_size;
+    int mini_sector_shift, mini_sector_size;
+
+    /* Number of directory sectors, if the header gives it (version 4
+     * files only), or 0 if we have to follow the chain to find out */
+    FSINDEX num_dir_sectors;
+
     void *mini_stream;
     size_t mini_stream_size;
+
+    /* How many sectors ahead along a chain to ask the kernel to read, as
+     * we follow it. 0 to leave readahead to the kernel. */
+    int readahead_sectors;
+
+    /* Set if file is a buffer given to cfbf_open_memory() rather than a
+     * mapping of fd */
+    int in_memory;
+
+    /* If window_size isn't 0, the file is mapped in windows of this many
+     * bytes rather than all at once, see cfbf_file.c. Window 0 is kept for
+     * looking up FAT entries; the others hold everything else. */
+    size_t window_size;
+    struct cfbf_window *windows;
+    int num_windows;
+    unsigned long window_clock;
+
+    /* Last advice given to cfbf_advise(), for windows mapped later */
+    int advice;
+
+    /* With windows, the header and directory are copied here so pointers
+     * to them stay valid */
+    struct StructuredStorageHeader header_copy;
+    char *dir_copy;
+    int dir_copy_sectors;
+
+    /* The directory chain, found once at open */
+    void **dir_chain;
+    int dir_chain_length;
+
+    /* When the file was last modified, to check an index against */
+    struct timespec file_mtime;
+
+    /* The sidecar index the FATs and directory came from, or NULL, see
+     * cfbf_index.c */
+    struct cfbf_index *index;
+
+    /* Memory for everything above, and for anything returned by the
+     * functions below which doesn't say to free it. All freed by
+     * cfbf_close(). */
+    struct cfbf_arena arena;
+};
+
+/* Options for cfbf_open_with_options() */
+struct cfbf_open_options {
+    /* See struct cfbf */
+    int readahead_sectors;
+
+    /* Map the file with MAP_POPULATE, reading all of it in at once, if it
+     * is no bigger than this many bytes */
+    long long populate_max_size;
+
+    /* If not 0, try to keep the memory used for the file within this many
+     * bytes, by mapping it a window at a time if it's too big to map
+     * whole */
+    long long max_memory;
+
+    /* Load the FAT, mini-FAT and directory from the file's sidecar index
+     * if it has an up-to-date one, and write one if it hasn't. The index is
+     * kept in index_dir if that's set, or next to the file if not. */
+    int use_index;
+    const char *index_dir;
+};
+
+/* Largest window to map at once */
+#define CFBF_MAX_WINDOW_SIZE (64 * 1024 * 1024)
+
+#define CFBF_DEFAULT_READAHEAD_SECTORS 64
+
+/* Chain-aware readahead state, see cfbf_fat.c */
+struct cfbf_readahead {
+    struct cfbf *cfbf;
+
+    /* Next sector along the chain to read ahead */
+    SECT ahead;
+
+    /* Run of adjacent sectors not yet passed to madvise() */
+    int64_t run_start;
+    int64_t run_length;
 };
 
+void
+cfbf_readahead_begin(struct cfbf_readahead *ra, struct cfbf *cfbf,
+        SECT first_sector, int use_mini_stream);
+
+void
+cfbf_readahead_advance(struct cfbf_readahead *ra);
+
+void
+cfbf_readahead_flush(struct cfbf_readahead *ra);
+
 void
 cfbf_fat_close(struct cfbf_fat *fat);
 
@@ -131,6 +269,36 @@ cfbf_close(struct cfbf *cfbf);
 int
 cfbf_open(const char *filename, struct cfbf *cfbf);
 
+int
+cfbf_open_with_options(const char *filename, struct cfbf *cfbf,
+        const struct cfbf_open_options *opts);
+
+/* A file's last sector may be cut short, and is still read whole. A mapped
+ * file is followed by zeros to the end of the page, so a buffer given to
+ * cfbf_open_memory() must be too, to the next multiple of this. */
+#define CFBF_MEMORY_PADDING 4096
+#define CFBF_MEMORY_PADDED_SIZE(size) \
+    (((size) + CFBF_MEMORY_PADDING - 1) & ~((size_t) CFBF_MEMORY_PADDING - 1))
+
+int
+cfbf_open_memory(const void *data, size_t size, const char *name,
+        struct cfbf *cfbf);
+
+void
+cfbf_advise(struct cfbf *cfbf, int advice);
+
+void *
+cfbf_get_ptr_at_offset(struct cfbf *cfbf, int64_t offset);
+
+void *
+cfbf_get_fat_ptr_at_offset(struct cfbf *cfbf, int64_t offset);
+
+void
+cfbf_prefetch(struct cfbf *cfbf, int64_t offset, int64_t length);
+
+int
+cfbf_same_window(struct cfbf *cfbf, int64_t offset_a, int64_t offset_b);
+
 int
 cfbf_get_sector_size(struct cfbf *cfbf);
 
@@ -149,12 +317,42 @@ cfbf_get_sector_ptr_in_mini_stream(struct cfbf *cfbf, SECT sector);
 int
 cfbf_is_sector_in_file(struct cfbf *cfbf, SECT sect);
 
+void
+cfbf_arena_init(struct cfbf_arena *arena);
+
+void *
+cfbf_arena_alloc(struct cfbf_arena *arena, size_t size);
+
+void *
+cfbf_arena_calloc(struct cfbf_arena *arena, size_t count, size_t size);
+
+void *
+cfbf_arena_grow(struct cfbf_arena *arena, void *p, size_t old_size,
+        size_t new_size);
+
+struct cfbf_arena_mark
+cfbf_arena_mark(struct cfbf_arena *arena);
+
+void
+cfbf_arena_release(struct cfbf_arena *arena, struct cfbf_arena_mark mark);
+
+void
+cfbf_arena_free(struct cfbf_arena *arena);
+
+/* The cfbf_get_chain_ptrs functions, cfbf_alloc_chain_contents_from_fat()
+ * and cfbf_dir_entry_get_sector_ptrs() return memory from cfbf->arena. Don't
+ * free it; use cfbf_arena_mark() and cfbf_arena_release() to give it back
+ * early if need be. */
 void **
 cfbf_get_chain_ptrs(struct cfbf *cfbf, SECT first_sector, int *num_sectors_r);
 
 void **
 cfbf_get_chain_ptrs_from_mini_stream(struct cfbf *cfbf, SECT first_sector, int *num_sectors_r);
 
+void **
+cfbf_get_chain_ptrs_sized(struct cfbf *cfbf, SECT first_sector,
+        int *num_sectors_r, int use_mini_stream, int64_t size);
+
 void *
 cfbf_alloc_chain_contents_from_fat(struct cfbf *cfbf, SECT first_sector, size_t size);
 
@@ -164,6 +362,12 @@ cfbf_follow_chain(struct cfbf *cfbf, SECT first_sector, int64_t data_size,
         int (*callback)(void *cookie, const void *sector_data, int length,
             FSINDEX sector_index, int64_t file_offset), void *cookie);
 
+int
+cfbf_follow_chain_extents(struct cfbf *cfbf, SECT first_sector,
+        int64_t data_size, int use_mini_stream,
+        int (*callback)(void *cookie, const void *data, int64_t length,
+            int64_t data_offset, int64_t sector_offset), void *cookie);
+
 int
 cfbf_walk(struct cfbf *cfbf, FILE *out, int verbosity);
 
@@ -177,6 +381,37 @@ cfbf_walk_dir_tree(struct cfbf *cfbf,
 struct DirEntry *
 cfbf_dir_entry_find_path(struct cfbf *cfbf, char *sought_path_utf8);
 
+/* Longest possible UTF-8 conversion of a 31-character UTF-16 name, plus
+ * the terminating null */
+#define CFBF_NAME_UTF8_MAX 97
+
+struct cfbf_dir_path {
+    struct DirEntry *entry;
+    unsigned long entry_id;
+
+    /* Index in the list of this entry's parent, or -1 for the root entry */
+    int parent;
+    int depth;
+
+    /* UTF-8 name of this entry, and its full path from the root entry */
+    char *name;
+    char *path;
+
+    /* Path relative to the root entry, each component escaped with
+     * cfbf_escape_name(). This is empty for the root entry. */
+    char *escaped_path;
+};
+
+int
+cfbf_dir_list_paths(struct cfbf *cfbf, struct cfbf_dir_path **paths_r,
+        int *num_paths_r);
+
+void
+cfbf_dir_free_paths(struct cfbf_dir_path *paths, int num_paths);
+
+void
+cfbf_escape_name(const char *name, char *dest, size_t dest_max);
+
 void
 cfbf_object_type_to_string(int object_type, char *dest, int dest_max);
 
@@ -186,10 +421,445 @@ cfbf_dir_stored_in_mini_stream(struct cfbf *cfbf, struct DirEntry *entry);
 void **
 cfbf_dir_entry_get_sector_ptrs(struct cfbf *cfbf, struct DirEntry *entry, int *num_sectors_r, int *sector_size_r);
 
+void **
+cfbf_dir_get_chain(struct cfbf *cfbf, int *num_sectors_r);
+
+/* Publisher CONTENTS stream segment descriptor - see
+ * cfbf_publisher_text.c for the layout of the stream. */
+#define PUB_CONTENTS_SEGMENT_TAG 0x18
+
+struct pub_contents_segment_desc {
+    uint16_t tag;  // 0x18 if this is valid
+    char data_type[4];
+    uint16_t data_type_args[3]; // usually 0 1 0
+    char data_format[4];
+    uint32_t offset;  // offset from start of CONTENTS stream
+    uint32_t length; // length of segment in bytes
+};
+
+/* Every segment descriptor in a CONTENTS stream, in stream order, read once
+ * by pub_contents_index_load(). */
+struct pub_contents_index {
+    struct pub_contents_segment_desc *segments;
+    int num_segments;
+    int num_segment_lists;
+
+    /* Counts claimed by the CONTENTS header */
+    int expected_segments;
+    int expected_segment_lists;
+};
+
+int
+pub_contents_index_load(struct pub_contents_index *index,
+        void **contents_chain, int num_sectors, int sector_size,
+        size_t stream_size, int verbosity);
+
+void
+pub_contents_index_free(struct pub_contents_index *index);
+
+int
+pub_contents_index_find(const struct pub_contents_index *index,
+        const char *data_type, const char *data_format, int from);
+
+int
+pub_contents_segment_read(void **contents_chain, int num_sectors,
+        int sector_size, size_t stream_size,
+        const struct pub_contents_segment_desc *seg,
+        int (*callback)(void *cookie, const char *data, size_t length),
+        void *cookie);
+
+int
+cfbf_extract_all(struct cfbf *cfbf, const char *dest_dir, FILE *out,
+        int num_threads, int64_t read_window, int verbosity);
+
+int
+cfbf_write_tar(struct cfbf *cfbf, int fd, int verbosity);
+
+/* Sidecar indexes, see cfbf_index.c */
+struct cfbf_index;
+
+/* A run of sectors next to each other in the file, or in the mini-stream */
+struct cfbf_index_extent {
+    SECT first_sector;
+    uint32_t num_sectors;
+};
+
+int
+cfbf_index_open(struct cfbf *cfbf, const char *filename, const char *index_dir);
+
+void
+cfbf_index_load_fats(struct cfbf *cfbf);
+
+int
+cfbf_index_load_directory(struct cfbf *cfbf);
+
+const struct cfbf_index_extent *
+cfbf_index_find_chain(struct cfbf *cfbf, SECT first_sector,
+        int use_mini_stream, int64_t data_size, int *num_extents_r);
+
+int
+cfbf_index_write(struct cfbf *cfbf, const char *filename, const char *index_dir);
+
+void
+cfbf_index_close(struct cfbf *cfbf);
+
+/* Batch manifests, see cfbf_manifest.c */
+struct cfbf_manifest;
+struct stat;
+struct cfbf_action;
+struct cfbf_action_options;
+struct cfbf_xxh64_state;
+
+struct cfbf_manifest *
+cfbf_manifest_open(const char *filename, uint64_t actions_hash);
+
+int
+cfbf_manifest_unchanged(struct cfbf_manifest *m, const char *path,
+        const struct stat *st);
+
+int
+cfbf_manifest_add(struct cfbf_manifest *m, const char *path,
+        const struct stat *st, uint64_t structure_hash,
+        const uint64_t *results, int num_results, int failed);
+
+int
+cfbf_manifest_close(struct cfbf_manifest *m, const char * const *operands,
+        int num_operands, FILE *report, int verbosity);
+
+uint64_t
+cfbf_manifest_actions_hash(const struct cfbf_action *actions, int num_actions,
+        const struct cfbf_action_options *opts);
+
+uint64_t
+cfbf_manifest_structure_hash(struct cfbf *cfbf);
+
+FILE *
+cfbf_manifest_hash_stream(FILE *out, struct cfbf_xxh64_state *state);
+
+/* Streaming XXH64 and SHA-256, see cfbf_hash.c */
+struct cfbf_xxh64_state {
+    uint64_t v[4];
+    uint64_t seed;
+    uint64_t total_len;
+    unsigned char buf[32];
+    size_t buf_len;
+};
+
+struct cfbf_sha256_state {
+    uint32_t h[8];
+    uint64_t total_len;
+    unsigned char buf[64];
+    size_t buf_len;
+};
+
+void
+cfbf_xxh64_init(struct cfbf_xxh64_state *state, uint64_t seed);
+
+void
+cfbf_xxh64_update(struct cfbf_xxh64_state *state, const void *data, size_t length);
+
+uint64_t
+cfbf_xxh64_digest(const struct cfbf_xxh64_state *state);
+
+void
+cfbf_sha256_init(struct cfbf_sha256_state *state);
+
+void
+cfbf_sha256_update(struct cfbf_sha256_state *state, const void *data, size_t length);
+
+void
+cfbf_sha256_final(struct cfbf_sha256_state *state, unsigned char *digest);
+
+int
+cfbf_hash_streams(struct cfbf *cfbf, FILE *out, int num_threads,
+        int64_t read_window, int use_sha256);
+
+int
+cfbf_diff(struct cfbf *cfbf_a, struct cfbf *cfbf_b, FILE *out, int verbosity);
+
+/* Writing CFB files, see cfbf_write.c */
+struct cfbf_writer {
+    FILE *out;
+    const char *filename;
+    int sector_shift;
+    int sector_size;
+
+    /* The whole FAT, built up as sectors are appended */
+    SECT *fat;
+    SECT fat_size;
+
+    SECT num_fat_sectors;
+    SECT num_difat_sectors;
+
+    /* Total number of sectors planned, and the next one to be written */
+    SECT num_sectors;
+    SECT next_sector;
+
+    char *zero_sector;
+};
+
+/* A chain being written a piece at a time */
+struct cfbf_writer_chain {
+    SECT first_sector;
+    SECT last_sector;
+    char *buf;
+    int buf_len;
+};
+
+int
+cfbf_writer_open(struct cfbf_writer *w, const char *filename,
+        int sector_shift, SECT num_data_sectors);
+
+SECT
+cfbf_writer_next_sector(struct cfbf_writer *w);
+
+SECT
+cfbf_writer_append_sector(struct cfbf_writer *w, const void *data,
+        int length, SECT prev_sector);
+
+void
+cfbf_writer_chain_begin(struct cfbf_writer_chain *chain);
+
+int
+cfbf_writer_chain_write(struct cfbf_writer *w, struct cfbf_writer_chain *chain,
+        const void *data, size_t length);
+
+SECT
+cfbf_writer_chain_end(struct cfbf_writer *w, struct cfbf_writer_chain *chain);
+
+SECT
+cfbf_writer_write_chain(struct cfbf_writer *w, const void *data, size_t size);
+
+int
+cfbf_writer_finish(struct cfbf_writer *w,
+        const struct StructuredStorageHeader *header);
+
+void
+cfbf_writer_abort(struct cfbf_writer *w);
+
+int
+cfbf_repack(struct cfbf *cfbf, const char *dest_filename, FILE *out,
+        int verbosity);
+
+int
+cfbf_frag_report(struct cfbf *cfbf, FILE *out, int top_n,
+        double seek_latency_ms);
+
+/* Options for cfbf_batch_read() */
+struct cfbf_batch_options {
+    /* How many files to read at once */
+    int queue_depth;
+
+    /* Total size of the buffers files are read into. Each file in flight
+     * gets buffer_pool_size / queue_depth bytes. */
+    size_t buffer_pool_size;
+
+    /* Use io_uring if the kernel has it. If not set, or io_uring isn't
+     * available, read one file at a time with pread(). */
+    int use_io_uring;
+};
+
+#define CFBF_DEFAULT_BATCH_QUEUE_DEPTH 32
+#define CFBF_DEFAULT_BATCH_BUFFER_POOL_SIZE (32 * 1024 * 1024)
+
+int
+cfbf_batch_read(const char * const *filenames, int num_files,
+        const struct cfbf_batch_options *opts,
+        int (*callback)(void *cookie, int file_index, const void *data,
+            size_t size, int err), void *cookie);
+
+int
+cfbf_default_num_threads(void);
+
+int
+cfbf_run_parallel(int num_threads, int num_jobs,
+        int (*job)(void *cookie, int job_index), void *cookie);
+
+int
+cfbf_run_scheduled(struct cfbf *cfbf, struct DirEntry **entries, int num_jobs,
+        int64_t window, int num_threads,
+        int (*job)(void *cookie, int job_index), void *cookie);
+
 int
 extract_text_from_contents_chain(void **contents_chain, int num_sectors,
         int sector_size, size_t stream_size, int verbosity,
         int (*callback)(void *cookie, const char *text, size_t length),
         void *cookie);
 
+/* Actions which cfbfinfo can carry out on an opened CFB file. Any number of
+ * them may be run, in order, on the same struct cfbf. */
+enum cfbf_action_type {
+    CFBF_ACTION_HEADER,
+    CFBF_ACTION_LIST,
+    CFBF_ACTION_WALK,
+    CFBF_ACTION_DUMP,
+    CFBF_ACTION_TEXT,
+    CFBF_ACTION_SEGMENTS,
+    CFBF_ACTION_EXTRACT,
+    CFBF_ACTION_TAR,
+    CFBF_ACTION_HASH,
+    CFBF_ACTION_REPACK,
+    CFBF_ACTION_FRAG
+};
+
+struct cfbf_action {
+    enum cfbf_action_type type;
+
+    /* Object path for CFBF_ACTION_DUMP, directory for CFBF_ACTION_EXTRACT,
+     * output CFB file for CFBF_ACTION_REPACK */
+    const char *arg;
+
+    /* Where to write the output, or NULL for the default */
+    const char *output_filename;
+};
+
+struct cfbf_action_options {
+    int verbosity;
+    const char *publisher_contents_path;
+    int convert_text_to_utf8;
+    int num_threads;
+    int use_sha256;
+
+    /* For CFBF_ACTION_FRAG: how many chains to list (0 for all), and the
+     * seek time to assume when estimating the cost of reading each one */
+    int frag_top_n;
+    double seek_latency_ms;
+
+    /* For CFBF_ACTION_EXTRACT and CFBF_ACTION_HASH: most bytes to prefetch
+     * at once, or 0 to read streams in directory order without scheduling */
+    int64_t read_window;
+};
+
+int
+cfbf_run_action(struct cfbf *cfbf, const char *filename,
+        const struct cfbf_action *action, FILE *out,
+        const struct cfbf_action_options *opts);
+
+int
+cfbf_dump_entry(struct cfbf *cfbf, struct DirEntry *entry, const char *path,
+        FILE *out);
+
+/* Options for cfbf_serve() */
+struct cfbf_server_options {
+    /* Unix socket to listen on, or NULL to read requests from stdin and
+     * write the responses to stdout */
+    const char *socket_path;
+
+    /* Number of requests to work on at once */
+    int num_workers;
+
+    /* Most memory the parsed files kept open between requests may use,
+     * and most files to keep open */
+    size_t cache_size;
+    int cache_files;
+};
+
+#define CFBF_DEFAULT_SERVER_CACHE_SIZE (256 * 1024 * 1024)
+#define CFBF_DEFAULT_SERVER_CACHE_FILES 1024
+
+int
+cfbf_serve(const struct cfbf_server_options *opts,
+        const struct cfbf_action_options *action_opts,
+        const struct cfbf_open_options *open_opts);
+
+/* Options for cfbf_watch() */
+struct cfbf_watch_options {
+    /* Directory to write each file's output to, or NULL to write it to the
+     * actions' outputs */
+    const char *output_dir;
+
+    /* Number of files to work on at once */
+    int num_workers;
+
+    /* How long a file must go without being written to before it's
+     * processed */
+    int debounce_ms;
+};
+
+#define CFBF_DEFAULT_WATCH_DEBOUNCE_MS 50
+
+int
+cfbf_watch(const char *dir, const struct cfbf_watch_options *opts,
+        const struct cfbf_action *actions, int num_actions, FILE **action_out,
+        const struct cfbf_action_options *action_opts,
+        const struct cfbf_open_options *open_opts);
+
+/* Header-only triage of many files, see cfbf_triage.c */
+int
+cfbf_triage(const char * const *operands, int num_operands, int num_threads,
+        int verbosity, FILE *out);
+
+
+/* Timings and counters for --stats, see cfbf_stats.c. Nothing is recorded
+ * unless cfbf_stats_enable() has been called. */
+enum cfbf_stats_phase {
+    CFBF_PHASE_OPEN,
+    CFBF_PHASE_OPEN_MAP,
+    CFBF_PHASE_OPEN_FAT,
+    CFBF_PHASE_OPEN_MINI_FAT,
+    CFBF_PHASE_OPEN_MINI_STREAM,
+    CFBF_PHASE_OPEN_DIRECTORY,
+    CFBF_PHASE_CLOSE,
+    CFBF_PHASE_CHAIN_PTRS,
+    CFBF_PHASE_DIR_LOOKUP,
+    CFBF_PHASE_ICONV,
+    CFBF_PHASE_OUTPUT_FLUSH,
+
+    /* One for each enum cfbf_action_type, in the same order */
+    CFBF_PHASE_ACTION,
+
+    CFBF_NUM_PHASES = CFBF_PHASE_ACTION + CFBF_ACTION_FRAG + 1
+};
+
+enum cfbf_stats_counter {
+    CFBF_STAT_SECTORS,
+    CFBF_STAT_BYTES_COPIED,
+    CFBF_STAT_CALLBACKS,
+    CFBF_STAT_ICONV_CALLS,
+    CFBF_STAT_CHAIN_GROWS,
+    CFBF_STAT_DIR_LOOKUPS,
+    CFBF_NUM_COUNTERS
+};
+
+struct cfbf_stats_phase_total {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+struct cfbf_stats {
+    int enabled;
+    uint64_t start_ns;
+    uint64_t counters[CFBF_NUM_COUNTERS];
+    struct cfbf_stats_phase_total phases[CFBF_NUM_PHASES];
+
+    /* The most any one file's arena has held */
+    uint64_t arena_peak_bytes;
+};
+
+/* There's one set of statistics for the whole process, so that a batch run
+ * adds up every file's. They're updated atomically, as jobs on the thread
+ * pool count things too. */
+extern struct cfbf_stats cfbf_stats;
+
+#define CFBF_STAT_ADD(counter, n) do { \
+    if (cfbf_stats.enabled) \
+        __atomic_fetch_add(&cfbf_stats.counters[counter], (uint64_t) (n), __ATOMIC_RELAXED); \
+} while (0)
+
+void
+cfbf_stats_enable(void);
+
+uint64_t
+cfbf_stats_now(void);
+
+void
+cfbf_stats_phase_end(enum cfbf_stats_phase phase, uint64_t start_ns);
+
+void
+cfbf_stats_arena_peak(uint64_t bytes);
+
+void
+cfbf_stats_print(FILE *out);
+
 #endif
@@ -0,0 +1,416 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <error.h>
+#include <iconv.h>
+
+#include "cfbf.h"
+
+struct write_pub_text_state {
+    iconv_t iconv_desc;
+    FILE *out;
+};
+
+static int
+print_dir_entry(void *cookie, struct cfbf *cfbf, struct DirEntry *e,
+        struct DirEntry *parent, unsigned long entry_id, int depth) {
+    char name[129];
+    char *in_p;
+    int name_length;
+    char *out_p;
+    size_t in_left, out_left, ret;
+    int indent = depth * 4;
+    int retval = 1;
+    char obj_type_str[10];
+    FILE *out = (FILE *) cookie;
+
+    iconv_t cd = iconv_open("UTF-8", "UTF-16");
+    if (cd == (iconv_t) -1) {
+        error(0, errno, "iconv_open");
+        goto fail;
+    }
+
+    if (e->name_length > 64) {
+        error(0, 0, "warning: dir entry %lu: name_length is %hu which is > 64", entry_id, (unsigned short) e->name_length);
+        name_length = 64;
+    }
+    else {
+        name_length = (int) e->name_length;
+    }
+
+    in_p = (char *) e->name;
+    out_p = name;
+    in_left = name_length;
+    out_left = sizeof(name);
+    CFBF_STAT_ADD(CFBF_STAT_ICONV_CALLS, 1);
+    ret = iconv(cd, &in_p, &in_left, &out_p, &out_left);
+    if (ret == (size_t) -1) {
+        error(0, errno, "dir entry %lu: failed to convert filename from UTF-16", entry_id);
+        goto fail;
+    }
+    *out_p = '\0';
+
+    cfbf_object_type_to_string(e->object_type, obj_type_str, sizeof(obj_type_str));
+
+    fprintf(out, "%-8s %10lu%s %10llu    ", obj_type_str,
+            (unsigned long) e->start_sector,
+            cfbf_dir_stored_in_mini_stream(cfbf, e) ? "m" : " ",
+            (unsigned long long) e->stream_size);
+
+    fprintf(out, "%*s", indent, "");
+    fprintf(out, "%s\n", name);
+
+end:
+    iconv_close(cd);
+
+    return retval;
+
+fail:
+    retval = -1;
+    goto end;
+}
+
+static int
+write_publisher_text(void *cookie, const char *data, size_t data_length) {
+    struct write_pub_text_state *state = (struct write_pub_text_state *) cookie;
+    if (state->iconv_desc == (iconv_t) -1) {
+        /* We're not converting the character encoding, we're just writing
+         * it all straight out */
+        size_t ret = fwrite(data, 1, data_length, state->out);
+        if (ret != data_length) {
+            error(0, errno, "fwrite()");
+            return -1;
+        }
+    }
+    else {
+        /* Convert text using iconv_desc before writing it out */
+        char *in_p = (char *) data;
+        char *out_p;
+        size_t in_left, out_left;
+
+        char buf[1024];
+
+        in_left = data_length;
+
+        while (in_left > 0) {
+            size_t ret;
+            uint64_t start = cfbf_stats_now();
+            out_left = sizeof(buf);
+            out_p = buf;
+
+            CFBF_STAT_ADD(CFBF_STAT_ICONV_CALLS, 1);
+            ret = iconv(state->iconv_desc, &in_p, &in_left, &out_p, &out_left);
+            cfbf_stats_phase_end(CFBF_PHASE_ICONV, start);
+            if (ret == (size_t) -1 && errno != E2BIG) {
+                error(0, errno, "write_publisher_text()");
+                return -1;
+            }
+
+            ret = fwrite(buf, 1, out_p - buf, state->out);
+            if (ret != out_p - buf) {
+                error(0, errno, "fwrite()");
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Write a four-character segment type or format, escaping anything that
+ * isn't printable so that each record stays on one line. */
+static void
+print_segment_fourcc(FILE *out, const char *fourcc) {
+    for (int i = 0; i < 4; ++i) {
+        unsigned char c = (unsigned char) fourcc[i];
+        if (c >= 0x20 && c < 0x7f && c != '\\' && c != '\t')
+            fputc(c, out);
+        else
+            fprintf(out, "\\x%02x", c);
+    }
+}
+
+/* Print the segment table of a Publisher CONTENTS stream, one segment per
+ * line, tab-separated, with a header line naming the fields. */
+static void
+print_contents_segments(FILE *out, const struct pub_contents_index *index) {
+    fprintf(out, "index\ttag\tdata_type\tdata_type_args\tdata_format\toffset\tlength\n");
+    for (int i = 0; i < index->num_segments; ++i) {
+        const struct pub_contents_segment_desc *seg = &index->segments[i];
+
+        fprintf(out, "%d\t0x%02x\t", i, (unsigned int) seg->tag);
+        print_segment_fourcc(out, seg->data_type);
+        fprintf(out, "\t%hu,%hu,%hu\t",
+                (unsigned short) seg->data_type_args[0],
+                (unsigned short) seg->data_type_args[1],
+                (unsigned short) seg->data_type_args[2]);
+        print_segment_fourcc(out, seg->data_format);
+        fprintf(out, "\t%lu\t%lu\n", (unsigned long) seg->offset,
+                (unsigned long) seg->length);
+    }
+}
+
+static int
+write_sector_to_file(void *cookie, const void *sector_data, int length,
+        FSINDEX sector_index, int64_t file_offset) {
+    FILE *out = (FILE *) cookie;
+    size_t ret;
+
+    ret = fwrite(sector_data, 1, length, out);
+    if (ret != length) {
+        error(0, errno, "write_sector_to_file()");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+action_header(struct cfbf *cfbf, FILE *out) {
+    struct StructuredStorageHeader *header = cfbf->header;
+
+    fprintf(out, "DllVersion, MinorVersion:     %hu, %hu\n", (unsigned short) header->_uDllVersion, (unsigned short) header->_uMinorVersion);
+    fprintf(out, "Byte-order mark:              %02X %02X\n", ((unsigned char *) header)[0x1c], ((unsigned char *) header)[0x1d]);
+    fprintf(out, "Main FAT sector size:         2^%hu (%d)\n", (unsigned short) header->_uSectorShift, cfbf_get_sector_size(cfbf));
+    fprintf(out, "Mini-stream sector size:      2^%hu (%d)\n", (unsigned short) header->_uMiniSectorShift, cfbf_get_mini_fat_sector_size(cfbf));
+    fprintf(out, "FAT chain sector count:       %lu\n", (unsigned long) header->_csectFat);
+    if (header->_uSectorShift >= 12)
+        fprintf(out, "Directory chain sector count: %lu\n", (unsigned long) header->_csectDir);
+    fprintf(out, "Directory chain first sector: %lu\n", (unsigned long) header->_sectDirStart);
+    fprintf(out, "Max file size in mini-stream: %lu\n", (unsigned long) header->_ulMiniSectorCutoff);
+    fprintf(out, "MiniFAT first sector, count:  %lu, %lu\n", (unsigned long) header->_sectMiniFatStart, (unsigned long) header->_csectMiniFat);
+    fprintf(out, "DIFAT first sector, count:    %lu, %lu\n", (unsigned long) header->_sectDifStart, (unsigned long) header->_csectDif);
+    fprintf(out, "\n");
+
+    return 0;
+}
+
+static int
+action_list(struct cfbf *cfbf, FILE *out) {
+    fprintf(out, "%-8s %10s  %10s    NAME\n", "TYPE", "START SEC", "SIZE");
+
+    if (cfbf_walk_dir_tree(cfbf, print_dir_entry, out) < 0)
+        return -1;
+    else
+        return 0;
+}
+
+/* Write the contents of the stream entry, found at path, to out */
+int
+cfbf_dump_entry(struct cfbf *cfbf, struct DirEntry *entry, const char *path,
+        FILE *out) {
+    if (entry->object_type == 5) {
+        error(0, 0, "you're not allowed to dump the root entry");
+        return -1;
+    }
+    else if (entry->object_type != 2) {
+        error(0, 0, "%s is not a stream object", path);
+        return -1;
+    }
+
+    if (cfbf_follow_chain(cfbf, entry->start_sector, entry->stream_size,
+                entry->stream_size < cfbf->header->_ulMiniSectorCutoff,
+                write_sector_to_file, out)) {
+        error(0, 0, "failed to read %s", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+action_dump(struct cfbf *cfbf, const char *filename, const char *path,
+        FILE *out) {
+    struct DirEntry *entry = cfbf_dir_entry_find_path(cfbf, (char *) path);
+
+    if (entry == NULL) {
+        error(0, 0, "object \"%s\" not found in %s", path, filename);
+        return -1;
+    }
+
+    return cfbf_dump_entry(cfbf, entry, path, out);
+}
+
+/* Extract the text from the Publisher CONTENTS stream, or if list_segments
+ * is set, list the segments in it. */
+static int
+action_contents(struct cfbf *cfbf, FILE *out, int list_segments,
+        const struct cfbf_action_options *opts) {
+    struct DirEntry *entry = cfbf_dir_entry_find_path(cfbf, (char *) opts->publisher_contents_path);
+    void **contents_chain;
+    int sector_size, chain_length;
+    int retval = 0;
+    struct cfbf_arena_mark mark;
+
+    if (entry == NULL) {
+        error(0, 0, "Can't %s: no entry named \"%s\" in directory",
+                list_segments ? "list segments" : "extract text",
+                opts->publisher_contents_path);
+        return -1;
+    }
+
+    mark = cfbf_arena_mark(&cfbf->arena);
+    contents_chain = cfbf_dir_entry_get_sector_ptrs(cfbf, entry, &chain_length, &sector_size);
+    if (contents_chain == NULL) {
+        cfbf_arena_release(&cfbf->arena, mark);
+        return -1;
+    }
+
+    if (list_segments) {
+        struct pub_contents_index index;
+
+        if (pub_contents_index_load(&index, contents_chain,
+                    chain_length, sector_size, entry->stream_size,
+                    opts->verbosity) < 0) {
+            retval = -1;
+        }
+        else {
+            print_contents_segments(out, &index);
+            pub_contents_index_free(&index);
+        }
+    }
+    else {
+        struct write_pub_text_state state;
+
+        memset(&state, 0, sizeof(state));
+
+        if (opts->convert_text_to_utf8) {
+            state.iconv_desc = iconv_open("UTF-8", "UTF-16LE");
+            if (state.iconv_desc == (iconv_t) -1) {
+                error(0, errno, "failed to create iconv descriptor");
+                cfbf_arena_release(&cfbf->arena, mark);
+                return -1;
+            }
+        }
+        else {
+            state.iconv_desc = (iconv_t) -1;
+        }
+        state.out = out;
+
+        if (extract_text_from_contents_chain(contents_chain,
+                    chain_length, sector_size, entry->stream_size,
+                    opts->verbosity, write_publisher_text, &state) < 0) {
+            retval = -1;
+        }
+
+        if (state.iconv_desc != (iconv_t) -1)
+            iconv_close(state.iconv_desc);
+    }
+    cfbf_arena_release(&cfbf->arena, mark);
+
+    return retval;
+}
+
+/* Write the storage tree to out as a tar archive. The archive is written
+ * straight to the underlying file descriptor, bypassing stdio. */
+static int
+action_tar(struct cfbf *cfbf, FILE *out, int verbosity) {
+    if (fflush(out) == EOF) {
+        error(0, errno, "fflush()");
+        return -1;
+    }
+    return cfbf_write_tar(cfbf, fileno(out), verbosity);
+}
+
+/* How the action is going to read the file, to pass to madvise().
+ *
+ * Actions which read most of the file, more or less from front to back,
+ * get MADV_SEQUENTIAL. The others only touch metadata and the odd chain,
+ * so the kernel's readahead mostly reads pages we won't look at. For those
+ * we turn it off with MADV_RANDOM, and rely on the chain-aware readahead
+ * in cfbf_fat.c to fetch what we're about to read - unless that's turned
+ * off too, in which case leave the kernel to it. */
+static int
+action_access_advice(struct cfbf *cfbf, enum cfbf_action_type type) {
+    switch (type) {
+        case CFBF_ACTION_DUMP:
+        case CFBF_ACTION_EXTRACT:
+        case CFBF_ACTION_TAR:
+        case CFBF_ACTION_HASH:
+        case CFBF_ACTION_REPACK:
+            return MADV_SEQUENTIAL;
+
+        default:
+            return cfbf->readahead_sectors > 0 ? MADV_RANDOM : MADV_NORMAL;
+    }
+}
+
+/* Carry out one action on an already-opened CFB file, writing the results to
+ * out. Any number of actions may be run one after the other on the same
+ * struct cfbf. filename is used only in error messages.
+ * Returns 0 on success or -1 on failure. */
+int
+cfbf_run_action(struct cfbf *cfbf, const char *filename,
+        const struct cfbf_action *action, FILE *out,
+        const struct cfbf_action_options *opts) {
+    int num_threads = opts->num_threads;
+    uint64_t start;
+    int ret;
+
+    /* Windows are shared by everything using cfbf, so only one thread at a
+     * time can read through them */
+    if (cfbf->window_size != 0)
+        num_threads = 1;
+
+    cfbf_advise(cfbf, action_access_advice(cfbf, action->type));
+
+    start = cfbf_stats_now();
+
+    switch (action->type) {
+        case CFBF_ACTION_HEADER:
+            ret = action_header(cfbf, out);
+            break;
+
+        case CFBF_ACTION_LIST:
+            ret = action_list(cfbf, out);
+            break;
+
+        case CFBF_ACTION_WALK:
+            ret = cfbf_walk(cfbf, out, opts->verbosity) ? -1 : 0;
+            break;
+
+        case CFBF_ACTION_DUMP:
+            ret = action_dump(cfbf, filename, action->arg, out);
+            break;
+
+        case CFBF_ACTION_TEXT:
+            ret = action_contents(cfbf, out, 0, opts);
+            break;
+
+        case CFBF_ACTION_SEGMENTS:
+            ret = action_contents(cfbf, out, 1, opts);
+            break;
+
+        case CFBF_ACTION_EXTRACT:
+            ret = cfbf_extract_all(cfbf, action->arg, out, num_threads,
+                    opts->read_window, opts->verbosity);
+            break;
+
+        case CFBF_ACTION_TAR:
+            ret = action_tar(cfbf, out, opts->verbosity);
+            break;
+
+        case CFBF_ACTION_HASH:
+            ret = cfbf_hash_streams(cfbf, out, num_threads,
+                    opts->read_window, opts->use_sha256);
+            break;
+
+        case CFBF_ACTION_REPACK:
+            ret = cfbf_repack(cfbf, action->arg, out, opts->verbosity);
+            break;
+
+        case CFBF_ACTION_FRAG:
+            ret = cfbf_frag_report(cfbf, out, opts->frag_top_n,
+                    opts->seek_latency_ms);
+            break;
+
+        default:
+            error(0, 0, "unknown action %d", (int) action->type);
+            return -1;
+    }
+
+    cfbf_stats_phase_end(CFBF_PHASE_ACTION + action->type, start);
+    return ret;
+}
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+
+#include "cfbf.h"
+
+/* Arena allocator.
+ *
+ * Everything an open file needs for as long as it's open - the FAT and
+ * mini-FAT copies, the mini-stream, the directory chain - and most of what
+ * actions allocate along the way, such as lists of chain pointers, comes
+ * from the arena in its struct cfbf. Allocating is a pointer bump, and
+ * cfbf_close() frees the lot in one go, so a long-running process going
+ * through many files doesn't leave the heap fragmented with the remains of
+ * each one.
+ *
+ * Memory is taken in blocks of at least CFBF_ARENA_BLOCK_SIZE bytes. Nothing
+ * is freed on its own, but cfbf_arena_mark() and cfbf_arena_release() let a
+ * caller give back everything allocated since a given point, and the most
+ * recent allocation can be grown in place with cfbf_arena_grow().
+ *
+ * An arena isn't thread-safe. Jobs run by cfbf_run_parallel() mustn't
+ * allocate from their file's arena.
+ */
+
+#define ARENA_ALIGN 16
+
+struct cfbf_arena_block {
+    /* The block allocated before this one */
+    struct cfbf_arena_block *prev;
+    size_t size;
+    size_t used;
+
+    /* Padded so the data that follows is aligned */
+    char pad[ARENA_ALIGN - (2 * sizeof(size_t) + sizeof(void *)) % ARENA_ALIGN];
+    char data[];
+};
+
+static size_t
+arena_round_up(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+}
+
+void
+cfbf_arena_init(struct cfbf_arena *arena) {
+    memset(arena, 0, sizeof(*arena));
+}
+
+static struct cfbf_arena_block *
+arena_new_block(struct cfbf_arena *arena, size_t min_size) {
+    struct cfbf_arena_block *block;
+    size_t size = CFBF_ARENA_BLOCK_SIZE;
+
+    if (min_size > size)
+        size = min_size;
+
+    /* Reuse the spare block left by cfbf_arena_release() if it's big
+     * enough, so a caller who marks and releases in a loop doesn't go back
+     * to malloc() each time round */
+    if (arena->spare != NULL && arena->spare->size >= size) {
+        block = arena->spare;
+        arena->spare = NULL;
+    }
+    else {
+        block = malloc(sizeof(*block) + size);
+        if (block == NULL)
+            return NULL;
+        block->size = size;
+    }
+
+    block->used = 0;
+    block->prev = arena->head;
+    arena->head = block;
+    arena->bytes_allocated += block->size;
+    if (arena->bytes_allocated > arena->peak_bytes_allocated)
+        arena->peak_bytes_allocated = arena->bytes_allocated;
+
+    return block;
+}
+
+/* Allocate size bytes from the arena. The memory isn't zeroed. Returns NULL,
+ * having reported the error, if we run out of memory. */
+void *
+cfbf_arena_alloc(struct cfbf_arena *arena, size_t size) {
+    struct cfbf_arena_block *block = arena->head;
+    void *p;
+
+    size = arena_round_up(size ? size : 1);
+
+    if (block == NULL || block->size - block->used < size) {
+        block = arena_new_block(arena, size);
+        if (block == NULL) {
+            error(0, ENOMEM, "cfbf_arena_alloc(): can't allocate %zu bytes", size);
+            return NULL;
+        }
+    }
+
+    p = block->data + block->used;
+    block->used += size;
+    arena->last = p;
+
+    return p;
+}
+
+/* Like cfbf_arena_alloc(), but zero the memory */
+void *
+cfbf_arena_calloc(struct cfbf_arena *arena, size_t count, size_t size) {
+    void *p;
+
+    if (size != 0 && count > (size_t) -1 / size) {
+        error(0, ENOMEM, "cfbf_arena_calloc(): %zu items of %zu bytes is too big", count, size);
+        return NULL;
+    }
+
+    p = cfbf_arena_alloc(arena, count * size);
+    if (p != NULL)
+        memset(p, 0, count * size);
+    return p;
+}
+
+/* Make the allocation at p, which is old_size bytes long, new_size bytes
+ * long. If p was the last thing allocated and there's room after it, it
+ * grows where it is; otherwise it's copied to a new allocation and the old
+ * one is wasted until the arena is released. Returns the new pointer, or
+ * NULL on failure, in which case p is still valid. */
+void *
+cfbf_arena_grow(struct cfbf_arena *arena, void *p, size_t old_size,
+        size_t new_size) {
+    struct cfbf_arena_block *block = arena->head;
+    void *new_p;
+
+    if (p == NULL)
+        return cfbf_arena_alloc(arena, new_size);
+
+    old_size = arena_round_up(old_size ? old_size : 1);
+    new_size = arena_round_up(new_size);
+    if (new_size <= old_size)
+        return p;
+
+    if (p == arena->last && block != NULL &&
+            block->size - block->used >= new_size - old_size) {
+        block->used += new_size - old_size;
+        return p;
+    }
+
+    new_p = cfbf_arena_alloc(arena, new_size);
+    if (new_p != NULL)
+        memcpy(new_p, p, old_size);
+    return new_p;
+}
+
+/* Note where the arena has got to, so everything allocated after this can
+ * be given back with cfbf_arena_release() */
+struct cfbf_arena_mark
+cfbf_arena_mark(struct cfbf_arena *arena) {
+    struct cfbf_arena_mark mark;
+
+    mark.block = arena->head;
+    mark.used = arena->head ? arena->head->used : 0;
+
+    return mark;
+}
+
+/* Free everything allocated since mark was taken. Pointers to any of it are
+ * no longer valid. */
+void
+cfbf_arena_release(struct cfbf_arena *arena, struct cfbf_arena_mark mark) {
+    while (arena->head != NULL && arena->head != mark.block) {
+        struct cfbf_arena_block *block = arena->head;
+
+        arena->head = block->prev;
+        arena->bytes_allocated -= block->size;
+
+        /* Keep one ordinary-sized block back for next time */
+        if (arena->spare == NULL && block->size == CFBF_ARENA_BLOCK_SIZE) {
+            arena->spare = block;
+        }
+        else {
+            free(block);
+        }
+    }
+
+    if (arena->head != NULL)
+        arena->head->used = mark.used;
+    arena->last = NULL;
+}
+
+/* Free everything in the arena */
+void
+cfbf_arena_free(struct cfbf_arena *arena) {
+    struct cfbf_arena_mark empty;
+
+    cfbf_stats_arena_peak(arena->peak_bytes_allocated);
+
+    memset(&empty, 0, sizeof(empty));
+    cfbf_arena_release(arena, empty);
+    free(arena->spare);
+    memset(arena, 0, sizeof(*arena));
+}
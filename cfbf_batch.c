@@ -0,0 +1,566 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <error.h>
+#include <linux/io_uring.h>
+
+#include "cfbf.h"
+
+/* Reading many small files.
+ *
+ * When the files are small, opening each one, mapping it and faulting it in
+ * costs more than parsing it. So for a batch of files we read them whole
+ * into a pool of buffers with io_uring, keeping up to queue_depth files in
+ * flight. For each file we submit openat and statx together, then a read
+ * of the whole file once we know its size, then a close. Each buffer in the
+ * pool holds one file, so a file bigger than a buffer is left for the
+ * caller to open the ordinary way.
+ *
+ * The files are handed to the callback in the order they were given, so
+ * the output doesn't depend on which read finished first. While the
+ * callback works on one file, the reads of the files after it carry on.
+ *
+ * We talk to io_uring with the raw system calls rather than liburing, so
+ * there's nothing extra to build against. If io_uring isn't available (old
+ * kernel, or forbidden by seccomp), we read each file with open(), fstat()
+ * and pread() instead.
+ */
+
+/* Stages a buffer slot goes through */
+enum batch_slot_state {
+    SLOT_FREE,
+    SLOT_OPENING,
+    SLOT_READING,
+    SLOT_DONE
+};
+
+/* What each submission was for, kept in the bottom bits of its user_data */
+enum {
+    BATCH_OP_OPEN,
+    BATCH_OP_STATX,
+    BATCH_OP_READ,
+    BATCH_OP_CLOSE,
+    BATCH_OP_BITS = 2
+};
+
+struct batch_slot {
+    enum batch_slot_state state;
+    int file_index;
+    char *buf;
+
+    int fd;
+    int open_done;
+    int statx_done;
+    struct statx stx;
+    size_t size;
+    size_t bytes_read;
+
+    /* errno value if anything went wrong */
+    int err;
+};
+
+struct batch_ring {
+    int fd;
+
+    void *sq_ptr;
+    size_t sq_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    void *cq_ptr;
+    size_t cq_len;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Submissions queued but not yet passed to io_uring_enter() */
+    unsigned to_submit;
+
+    /* Submissions we haven't had the completion for */
+    unsigned in_flight;
+};
+
+struct batch_state {
+    const char * const *filenames;
+    int num_files;
+    int (*callback)(void *cookie, int file_index, const void *data,
+            size_t size, int err);
+    void *cookie;
+
+    struct batch_slot *slots;
+    int num_slots;
+    size_t slot_size;
+    size_t slot_stride;
+    char *pool;
+};
+
+static void
+batch_ring_close(struct batch_ring *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_len);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    ring->fd = -1;
+}
+
+/* Set up an io_uring with room for at least entries submissions. Returns 0
+ * on success, or -1 with errno set if io_uring isn't available. */
+static int
+batch_ring_open(struct batch_ring *ring, unsigned entries) {
+    struct io_uring_params p;
+    int saved_errno;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+    else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+
+    ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+
+    return 0;
+
+fail:
+    saved_errno = errno;
+    batch_ring_close(ring);
+    errno = saved_errno;
+    return -1;
+}
+
+/* Pass queued submissions to the kernel, and if wait is set, wait until at
+ * least one has completed */
+static int
+batch_ring_enter(struct batch_ring *ring, int wait) {
+    for (;;) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+                wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            error(0, errno, "io_uring_enter");
+            return -1;
+        }
+        ring->to_submit -= ret;
+        return 0;
+    }
+}
+
+static struct io_uring_sqe *
+batch_ring_get_sqe(struct batch_ring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    if (tail - head >= ring->sq_entries) {
+        /* Full - the kernel hasn't taken what we've queued yet */
+        if (batch_ring_enter(ring, 0) < 0)
+            return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ring->sq_entries) {
+            error(0, 0, "io_uring submission queue full");
+            return NULL;
+        }
+    }
+
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    return sqe;
+}
+
+/* Queue the sqe most recently returned by batch_ring_get_sqe() */
+static void
+batch_ring_queue(struct batch_ring *ring, struct io_uring_sqe *sqe,
+        int slot_index, int op) {
+    sqe->user_data = ((uint64_t) slot_index << BATCH_OP_BITS) | op;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    ring->in_flight++;
+}
+
+static int
+batch_queue_read(struct batch_ring *ring, struct batch_slot *slot,
+        int slot_index) {
+    struct io_uring_sqe *sqe = batch_ring_get_sqe(ring);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot->fd;
+    sqe->addr = (uint64_t) (uintptr_t) (slot->buf + slot->bytes_read);
+    sqe->len = slot->size - slot->bytes_read;
+    sqe->off = slot->bytes_read;
+    batch_ring_queue(ring, sqe, slot_index, BATCH_OP_READ);
+    return 0;
+}
+
+static int
+batch_queue_close(struct batch_ring *ring, struct batch_slot *slot,
+        int slot_index) {
+    struct io_uring_sqe *sqe = batch_ring_get_sqe(ring);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = slot->fd;
+    batch_ring_queue(ring, sqe, slot_index, BATCH_OP_CLOSE);
+    slot->fd = -1;
+    return 0;
+}
+
+/* Start reading the file with index file_index into a free slot */
+static int
+batch_start_slot(struct batch_state *state, struct batch_ring *ring,
+        int slot_index, int file_index) {
+    struct batch_slot *slot = &state->slots[slot_index];
+    struct io_uring_sqe *sqe;
+
+    slot->state = SLOT_OPENING;
+    slot->file_index = file_index;
+    slot->fd = -1;
+    slot->open_done = 0;
+    slot->statx_done = 0;
+    slot->size = 0;
+    slot->bytes_read = 0;
+    slot->err = 0;
+
+    sqe = batch_ring_get_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t) (uintptr_t) state->filenames[file_index];
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    batch_ring_queue(ring, sqe, slot_index, BATCH_OP_OPEN);
+
+    sqe = batch_ring_get_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t) (uintptr_t) state->filenames[file_index];
+    sqe->len = STATX_SIZE | STATX_TYPE;
+    sqe->off = (uint64_t) (uintptr_t) &slot->stx;
+    batch_ring_queue(ring, sqe, slot_index, BATCH_OP_STATX);
+
+    return 0;
+}
+
+/* Deal with one completion, moving its slot on to the next stage */
+static int
+batch_complete(struct batch_state *state, struct batch_ring *ring,
+        const struct io_uring_cqe *cqe) {
+    int slot_index = cqe->user_data >> BATCH_OP_BITS;
+    int op = cqe->user_data & ((1 << BATCH_OP_BITS) - 1);
+    struct batch_slot *slot = &state->slots[slot_index];
+
+    ring->in_flight--;
+
+    switch (op) {
+        case BATCH_OP_OPEN:
+            slot->open_done = 1;
+            if (cqe->res < 0)
+                slot->err = -cqe->res;
+            else
+                slot->fd = cqe->res;
+            break;
+
+        case BATCH_OP_STATX:
+            slot->statx_done = 1;
+            if (cqe->res < 0 && slot->err == 0)
+                slot->err = -cqe->res;
+            break;
+
+        case BATCH_OP_READ:
+            if (cqe->res < 0) {
+                slot->err = -cqe->res;
+            }
+            else if (cqe->res == 0) {
+                /* The file got shorter since we looked at it */
+                slot->size = slot->bytes_read;
+            }
+            else {
+                slot->bytes_read += cqe->res;
+                if (slot->bytes_read < slot->size)
+                    return batch_queue_read(ring, slot, slot_index);
+            }
+            slot->state = SLOT_DONE;
+            return batch_queue_close(ring, slot, slot_index);
+
+        case BATCH_OP_CLOSE:
+            /* Nothing waits for this */
+            return 0;
+    }
+
+    /* Open and statx both finished: read the file, or give up on it */
+    if (slot->state == SLOT_OPENING && slot->open_done && slot->statx_done) {
+        if (slot->err == 0) {
+            if (!S_ISREG(slot->stx.stx_mode))
+                slot->err = EINVAL;
+            else if (slot->stx.stx_size > state->slot_size)
+                slot->err = EFBIG;
+        }
+
+        if (slot->err != 0) {
+            slot->state = SLOT_DONE;
+            if (slot->fd >= 0)
+                return batch_queue_close(ring, slot, slot_index);
+            return 0;
+        }
+
+        slot->size = slot->stx.stx_size;
+        if (slot->size == 0) {
+            slot->state = SLOT_DONE;
+            return batch_queue_close(ring, slot, slot_index);
+        }
+        slot->state = SLOT_READING;
+        return batch_queue_read(ring, slot, slot_index);
+    }
+
+    return 0;
+}
+
+/* Wait for at least one completion, and deal with all that are ready */
+static int
+batch_reap(struct batch_state *state, struct batch_ring *ring) {
+    unsigned head, tail;
+
+    if (batch_ring_enter(ring, 1) < 0)
+        return -1;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+
+        /* Give the entry back before handling it, as handling it may
+         * queue more work */
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (batch_complete(state, ring, &cqe) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Zero the rest of the file's last sector, as cfbf_open_memory() wants */
+static void
+batch_pad_buffer(char *buf, size_t size) {
+    memset(buf + size, 0, CFBF_MEMORY_PADDED_SIZE(size) - size);
+}
+
+static int
+batch_read_io_uring(struct batch_state *state, struct batch_ring *ring) {
+    int next_file = 0;
+    int retval = 0;
+
+    for (int i = 0; i < state->num_slots && next_file < state->num_files; ++i) {
+        if (batch_start_slot(state, ring, i, next_file++) < 0)
+            return -1;
+    }
+
+    /* File i is always in slot i % num_slots, so we hand them over in
+     * order by waiting on each slot in turn */
+    for (int i = 0; i < state->num_files; ++i) {
+        int slot_index = i % state->num_slots;
+        struct batch_slot *slot = &state->slots[slot_index];
+
+        while (slot->state != SLOT_DONE) {
+            if (batch_reap(state, ring) < 0)
+                return -1;
+        }
+
+        if (slot->err == 0)
+            batch_pad_buffer(slot->buf, slot->size);
+        if (state->callback(state->cookie, i, slot->err ? NULL : slot->buf,
+                    slot->size, slot->err) < 0)
+            retval = -1;
+
+        slot->state = SLOT_FREE;
+        if (next_file < state->num_files) {
+            if (batch_start_slot(state, ring, slot_index, next_file++) < 0)
+                return -1;
+        }
+    }
+
+    /* Wait for the last closes */
+    while (ring->in_flight > 0) {
+        if (batch_reap(state, ring) < 0)
+            return -1;
+    }
+
+    return retval;
+}
+
+/* Without io_uring: read each file in turn with pread() */
+static int
+batch_read_simple(struct batch_state *state) {
+    char *buf = state->slots[0].buf;
+    int retval = 0;
+
+    for (int i = 0; i < state->num_files; ++i) {
+        struct stat st;
+        size_t bytes_read = 0;
+        int err = 0;
+        int fd;
+
+        fd = open(state->filenames[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            err = errno;
+        }
+        else if (fstat(fd, &st) < 0) {
+            err = errno;
+        }
+        else if (!S_ISREG(st.st_mode)) {
+            err = EINVAL;
+        }
+        else if (st.st_size > state->slot_size) {
+            err = EFBIG;
+        }
+        else {
+            while (bytes_read < st.st_size) {
+                ssize_t ret = pread(fd, buf + bytes_read, st.st_size - bytes_read, bytes_read);
+                if (ret < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    err = errno;
+                    break;
+                }
+                else if (ret == 0) {
+                    break;
+                }
+                bytes_read += ret;
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+
+        if (err == 0)
+            batch_pad_buffer(buf, bytes_read);
+        if (state->callback(state->cookie, i, err ? NULL : buf, bytes_read, err) < 0)
+            retval = -1;
+    }
+
+    return retval;
+}
+
+/* Read each of the named files whole, and call callback() for each one, in
+ * the order given, with file_index being its index in filenames. If the
+ * file couldn't be read, data is NULL and err is an errno value: in
+ * particular EFBIG means it's too big for a buffer, and should be read some
+ * other way. The data is followed by zeros to the end of its last sector,
+ * so it can be given to cfbf_open_memory(), and is only valid until
+ * callback() returns.
+ *
+ * Up to opts->queue_depth files are read at once, each into its own buffer
+ * of opts->buffer_pool_size / opts->queue_depth bytes.
+ *
+ * Returns 0 if callback() returned 0 every time, or -1 if it failed for
+ * any file, or if reading failed altogether. */
+int
+cfbf_batch_read(const char * const *filenames, int num_files,
+        const struct cfbf_batch_options *opts,
+        int (*callback)(void *cookie, int file_index, const void *data,
+            size_t size, int err), void *cookie) {
+    struct batch_state state;
+    struct batch_ring ring;
+    int use_io_uring = opts->use_io_uring;
+    int retval;
+
+    memset(&state, 0, sizeof(state));
+    state.filenames = filenames;
+    state.num_files = num_files;
+    state.callback = callback;
+    state.cookie = cookie;
+    state.num_slots = opts->queue_depth > 0 ? opts->queue_depth : 1;
+    if (state.num_slots > num_files && num_files > 0)
+        state.num_slots = num_files;
+
+    ring.fd = -1;
+    if (use_io_uring && batch_ring_open(&ring, state.num_slots * 4) < 0) {
+        /* Not having io_uring isn't an error, just slower */
+        use_io_uring = 0;
+    }
+    if (!use_io_uring)
+        state.num_slots = 1;
+
+    state.slot_size = opts->buffer_pool_size / (opts->queue_depth > 0 ? opts->queue_depth : 1);
+    state.slots = calloc(state.num_slots, sizeof(struct batch_slot));
+    /* Each slot has room for padding after the biggest file it takes */
+    state.slot_stride = state.slot_size + CFBF_MEMORY_PADDING;
+    state.pool = malloc(state.slot_stride * state.num_slots);
+    if (state.slots == NULL || state.pool == NULL) {
+        error(0, errno, "cfbf_batch_read()");
+        retval = -1;
+        goto end;
+    }
+    for (int i = 0; i < state.num_slots; ++i) {
+        state.slots[i].buf = state.pool + i * state.slot_stride;
+        state.slots[i].fd = -1;
+    }
+
+    if (use_io_uring)
+        retval = batch_read_io_uring(&state, &ring);
+    else
+        retval = batch_read_simple(&state);
+
+end:
+    if (use_io_uring)
+        batch_ring_close(&ring);
+    free(state.pool);
+    free(state.slots);
+    return retval;
+}
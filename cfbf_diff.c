@@ -0,0 +1,298 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+
+#include "cfbf.h"
+
+/* Compare the storage trees of two CFB files, matching entries by path, and
+ * report which entries have been added or removed and which streams have
+ * been modified.
+ *
+ * Streams of different sizes are modified without further ado. For streams
+ * of the same size, both files are already mapped, so rather than hashing
+ * each stream we compare them directly with memcmp(), one extent-sized
+ * piece at a time, and stop at the first difference. A stream that changes
+ * near the start therefore costs almost nothing to detect.
+ *
+ * If a is mapped in windows, its extents may not still be mapped by the
+ * time we compare them, so for those we keep the offset in the file and
+ * look the data up again when we need it.
+ */
+
+struct diff_extent {
+    const char *data;
+    int64_t length;
+    int64_t data_offset;
+
+    /* Offset in the file, or -1 if the extent is in the mini-stream */
+    int64_t sector_offset;
+};
+
+struct diff_extent_list {
+    struct diff_extent *extents;
+    int num_extents;
+    int size;
+};
+
+struct diff_compare_state {
+    struct cfbf *cfbf_a;
+    struct diff_extent_list *a;
+
+    /* Which extent of a we're comparing with, and how far into it */
+    int a_index;
+    int64_t a_pos;
+
+    /* Offset of the first difference, or -1 if none found yet */
+    int64_t first_difference;
+};
+
+static int
+collect_extent(void *cookie, const void *data, int64_t length,
+        int64_t data_offset, int64_t sector_offset) {
+    struct diff_extent_list *list = (struct diff_extent_list *) cookie;
+
+    if (list->num_extents >= list->size) {
+        int new_size = list->size ? list->size * 2 : 16;
+        struct diff_extent *new_extents = realloc(list->extents, new_size * sizeof(struct diff_extent));
+        if (new_extents == NULL) {
+            error(0, errno, "cfbf_diff()");
+            return -1;
+        }
+        list->extents = new_extents;
+        list->size = new_size;
+    }
+
+    list->extents[list->num_extents].data = data;
+    list->extents[list->num_extents].length = length;
+    list->extents[list->num_extents].data_offset = data_offset;
+    list->extents[list->num_extents].sector_offset = sector_offset;
+    list->num_extents++;
+
+    return 0;
+}
+
+/* Compare an extent of stream b with the corresponding bytes of stream a.
+ * Returns 1 to stop the walk once a difference is found, or once we reach
+ * the end of a. */
+static int
+compare_extent(void *cookie, const void *data, int64_t length,
+        int64_t data_offset, int64_t sector_offset) {
+    struct diff_compare_state *state = (struct diff_compare_state *) cookie;
+    const char *b = (const char *) data;
+
+    while (length > 0) {
+        struct diff_extent *a_extent;
+        int64_t to_compare;
+        const char *a;
+
+        if (state->a_index >= state->a->num_extents)
+            return 1;
+
+        a_extent = &state->a->extents[state->a_index];
+        to_compare = a_extent->length - state->a_pos;
+        if (a_extent->sector_offset >= 0)
+            a = cfbf_get_ptr_at_offset(state->cfbf_a, a_extent->sector_offset);
+        else
+            a = a_extent->data;
+        if (a == NULL)
+            return -1;
+        a += state->a_pos;
+
+        if (to_compare > length)
+            to_compare = length;
+
+        if (a != b && memcmp(a, b, to_compare)) {
+            int64_t i = 0;
+            while (a[i] == b[i])
+                ++i;
+            state->first_difference = data_offset + i;
+            return 1;
+        }
+
+        b += to_compare;
+        length -= to_compare;
+        data_offset += to_compare;
+        state->a_pos += to_compare;
+        if (state->a_pos == a_extent->length) {
+            state->a_index++;
+            state->a_pos = 0;
+        }
+    }
+
+    return 0;
+}
+
+/* Compare the contents of two streams, up to the length of the shorter one.
+ * Returns the offset of the first byte that differs, -1 if there's no
+ * difference, or -2 on error. */
+static int64_t
+diff_stream_contents(struct cfbf *cfbf_a, struct DirEntry *entry_a,
+        struct cfbf *cfbf_b, struct DirEntry *entry_b) {
+    struct diff_extent_list a_extents;
+    struct diff_compare_state state;
+
+    if (entry_a->stream_size == 0 || entry_b->stream_size == 0)
+        return -1;
+
+    memset(&a_extents, 0, sizeof(a_extents));
+    if (cfbf_follow_chain_extents(cfbf_a, entry_a->start_sector,
+                entry_a->stream_size,
+                cfbf_dir_stored_in_mini_stream(cfbf_a, entry_a),
+                collect_extent, &a_extents) < 0) {
+        free(a_extents.extents);
+        return -2;
+    }
+
+    memset(&state, 0, sizeof(state));
+    state.cfbf_a = cfbf_a;
+    state.a = &a_extents;
+    state.first_difference = -1;
+
+    if (cfbf_follow_chain_extents(cfbf_b, entry_b->start_sector,
+                entry_b->stream_size,
+                cfbf_dir_stored_in_mini_stream(cfbf_b, entry_b),
+                compare_extent, &state) < 0) {
+        free(a_extents.extents);
+        return -2;
+    }
+    free(a_extents.extents);
+
+    return state.first_difference;
+}
+
+static int
+compare_dir_paths(const void *x, const void *y) {
+    const struct cfbf_dir_path *a = *(const struct cfbf_dir_path **) x;
+    const struct cfbf_dir_path *b = *(const struct cfbf_dir_path **) y;
+    return strcmp(a->path, b->path);
+}
+
+static struct cfbf_dir_path **
+sorted_dir_paths(struct cfbf_dir_path *paths, int num_paths) {
+    struct cfbf_dir_path **sorted = malloc(num_paths * sizeof(struct cfbf_dir_path *));
+
+    if (sorted == NULL) {
+        error(0, errno, "cfbf_diff()");
+        return NULL;
+    }
+    for (int i = 0; i < num_paths; ++i)
+        sorted[i] = &paths[i];
+    qsort(sorted, num_paths, sizeof(struct cfbf_dir_path *), compare_dir_paths);
+
+    return sorted;
+}
+
+static const char *
+diff_type_string(const struct DirEntry *entry, char *buf, int buf_max) {
+    cfbf_object_type_to_string(entry->object_type, buf, buf_max);
+    return buf;
+}
+
+/* Write one line to out for every entry which is only in a ("removed"), only
+ * in b ("added"), or in both but different ("modified"). With verbosity > 0,
+ * modified streams also show both sizes and the offset of the first byte
+ * that differs.
+ *
+ * Returns 0 if there are no differences, 1 if there are, or -1 on error. */
+int
+cfbf_diff(struct cfbf *cfbf_a, struct cfbf *cfbf_b, FILE *out, int verbosity) {
+    struct cfbf_dir_path *paths_a = NULL, *paths_b = NULL;
+    struct cfbf_dir_path **sorted_a = NULL, **sorted_b = NULL;
+    int num_a = 0, num_b = 0;
+    int ia = 0, ib = 0;
+    int retval = 0;
+    char type_a[10], type_b[10];
+
+    if (cfbf_dir_list_paths(cfbf_a, &paths_a, &num_a) < 0)
+        goto fail;
+    if (cfbf_dir_list_paths(cfbf_b, &paths_b, &num_b) < 0)
+        goto fail;
+
+    sorted_a = sorted_dir_paths(paths_a, num_a);
+    sorted_b = sorted_dir_paths(paths_b, num_b);
+    if (sorted_a == NULL || sorted_b == NULL)
+        goto fail;
+
+    while (ia < num_a || ib < num_b) {
+        int cmp;
+
+        if (ia >= num_a)
+            cmp = 1;
+        else if (ib >= num_b)
+            cmp = -1;
+        else
+            cmp = strcmp(sorted_a[ia]->path, sorted_b[ib]->path);
+
+        if (cmp < 0) {
+            fprintf(out, "removed\t%s\t%s\n", diff_type_string(sorted_a[ia]->entry, type_a, sizeof(type_a)), sorted_a[ia]->path);
+            retval = 1;
+            ++ia;
+        }
+        else if (cmp > 0) {
+            fprintf(out, "added\t%s\t%s\n", diff_type_string(sorted_b[ib]->entry, type_b, sizeof(type_b)), sorted_b[ib]->path);
+            retval = 1;
+            ++ib;
+        }
+        else {
+            struct DirEntry *ea = sorted_a[ia]->entry;
+            struct DirEntry *eb = sorted_b[ib]->entry;
+            const char *path = sorted_a[ia]->path;
+
+            if (ea->object_type != eb->object_type) {
+                fprintf(out, "modified\t%s\t%s", diff_type_string(eb, type_b, sizeof(type_b)), path);
+                if (verbosity > 0)
+                    fprintf(out, "\twas %s", diff_type_string(ea, type_a, sizeof(type_a)));
+                fprintf(out, "\n");
+                retval = 1;
+            }
+            else if (ea->object_type == 2) {
+                int64_t first_difference;
+
+                if (ea->stream_size != eb->stream_size && verbosity <= 0) {
+                    /* No need to look at the contents unless we're going
+                     * to say where the first difference is */
+                    first_difference = 0;
+                }
+                else {
+                    first_difference = diff_stream_contents(cfbf_a, ea, cfbf_b, eb);
+                    if (first_difference == -2) {
+                        error(0, 0, "failed to compare %s", path);
+                        goto fail;
+                    }
+                    if (first_difference == -1 && ea->stream_size != eb->stream_size) {
+                        /* One is a prefix of the other */
+                        first_difference = ea->stream_size < eb->stream_size ? ea->stream_size : eb->stream_size;
+                    }
+                }
+
+                if (first_difference != -1) {
+                    fprintf(out, "modified\tstream\t%s", path);
+                    if (verbosity > 0) {
+                        fprintf(out, "\t%llu -> %llu bytes",
+                                (unsigned long long) ea->stream_size,
+                                (unsigned long long) eb->stream_size);
+                        if (first_difference >= 0)
+                            fprintf(out, ", first difference at byte %lld", (long long) first_difference);
+                    }
+                    fprintf(out, "\n");
+                    retval = 1;
+                }
+            }
+            ++ia;
+            ++ib;
+        }
+    }
+
+end:
+    free(sorted_a);
+    free(sorted_b);
+    cfbf_dir_free_paths(paths_a, num_a);
+    cfbf_dir_free_paths(paths_b, num_b);
+    return retval;
+
+fail:
+    retval = -1;
+    goto end;
+}
@@ -6,6 +6,7 @@
 #include <iconv.h>
 
 #include "cfbf.h"
+#include "cfbf_trace.h"
 
 static size_t
 strlen_utf16(uint16_t *s) {
@@ -42,20 +43,69 @@ strchr_utf16(const uint16_t *s, int c) {
     return NULL;
 }
 
+/* Directory entries are 128 bytes, so a sector holds a power of two of them.
+ * Return which power, so entry IDs can be split into sector and index with
+ * a shift and a mask. */
+static int
+cfbf_dir_entries_shift(struct cfbf *cfbf) {
+    return cfbf->sector_shift - 7;
+}
+
+/* A damaged directory can link to an entry from more than one place, or in
+ * a loop, which would have a search go round forever, or take exponential
+ * time by searching the same subtrees again and again. So searches and walks
+ * of the tree keep a bitmap of the entries they've seen, with a bit for each
+ * entry in the directory chain, and won't look at any entry twice.
+ *
+ * Even without loops, a tree which is really a long list would need a deep
+ * recursion, so we also give up on one deeper than this. Sibling trees are
+ * meant to be balanced, so this is far more than any real file needs. */
+#define MAX_DIR_TREE_RECURSION 10000
+
+static unsigned long
+dir_num_entries(int dir_chain_length, int entries_shift) {
+    return (unsigned long) dir_chain_length << entries_shift;
+}
+
+/* Mark entry_id as seen, and return 1 if it already was */
+static int
+dir_entry_seen(unsigned char *seen, unsigned long entry_id) {
+    unsigned char bit = 1 << (entry_id & 7);
+
+    if (seen[entry_id >> 3] & bit)
+        return 1;
+    seen[entry_id >> 3] |= bit;
+    return 0;
+}
+
 static struct DirEntry *
 cfbf_find_path_in_tree(struct cfbf *cfbf, void **dir_chain,
-        int dir_chain_length, int sector_size, int entries_per_sector,
-        unsigned long entry_id, uint16_t *sought_path_utf16) {
+        int dir_chain_length, int entries_shift,
+        unsigned long entry_id, uint16_t *sought_path_utf16,
+        unsigned char *seen, int recursion) {
     uint16_t *path_component_end;
     int path_component_length;
     int last_component = 0;
-    SECT sector = entry_id / entries_per_sector;
-    int entry_within_sector = entry_id % entries_per_sector;
+    SECT sector = entry_id >> entries_shift;
+    int entry_within_sector = entry_id & ((1UL << entries_shift) - 1);
     struct DirEntry *e;
 
     if (entry_id == CFBF_NOSTREAM)
         return NULL;
-    
+
+    if (sector >= dir_chain_length) {
+        error(0, 0, "cfbf_find_path_in_tree(): directory entry id %lu not in chain", entry_id);
+        return NULL;
+    }
+    if (dir_entry_seen(seen, entry_id)) {
+        error(0, 0, "cfbf_find_path_in_tree(): directory entry id %lu is linked to more than once", entry_id);
+        return NULL;
+    }
+    if (recursion > MAX_DIR_TREE_RECURSION) {
+        error(0, 0, "cfbf_find_path_in_tree(): directory tree is more than %d entries deep", MAX_DIR_TREE_RECURSION);
+        return NULL;
+    }
+
     e = ((struct DirEntry *) dir_chain[sector]) + entry_within_sector;
 
     path_component_end = strchr_utf16(sought_path_utf16, '/');
@@ -85,8 +135,8 @@ cfbf_find_path_in_tree(struct cfbf *cfbf, void **dir_chain,
             }
             else {
                 return cfbf_find_path_in_tree(cfbf, dir_chain, dir_chain_length,
-                        sector_size, entries_per_sector, e->child_id,
-                        path_component_end + 1);
+                        entries_shift, e->child_id,
+                        path_component_end + 1, seen, recursion + 1);
             }
         }
         else {
@@ -94,18 +144,28 @@ cfbf_find_path_in_tree(struct cfbf *cfbf, void **dir_chain,
             struct DirEntry *found;
 
             found = cfbf_find_path_in_tree(cfbf, dir_chain, dir_chain_length,
-                    sector_size, entries_per_sector, e->left_sibling_id,
-                    sought_path_utf16);
+                    entries_shift, e->left_sibling_id,
+                    sought_path_utf16, seen, recursion + 1);
             if (!found) {
                 found = cfbf_find_path_in_tree(cfbf, dir_chain,
-                        dir_chain_length, sector_size, entries_per_sector,
-                        e->right_sibling_id, sought_path_utf16);
+                        dir_chain_length, entries_shift,
+                        e->right_sibling_id, sought_path_utf16,
+                        seen, recursion + 1);
             }
             return found;
         }
     }
 }
 
+/* Return the list of pointers to the directory's sectors, which was found
+ * when the file was opened. It belongs to cfbf, so don't free it. */
+void **
+cfbf_dir_get_chain(struct cfbf *cfbf, int *num_sectors_r) {
+    if (num_sectors_r)
+        *num_sectors_r = cfbf->dir_chain_length;
+    return cfbf->dir_chain;
+}
+
 struct DirEntry *
 cfbf_dir_entry_find_path(struct cfbf *cfbf, char *sought_path_utf8) {
     void **dir_chain = NULL;
@@ -113,22 +173,22 @@ cfbf_dir_entry_find_path(struct cfbf *cfbf, char *sought_path_utf8) {
     struct DirEntry *entry;
     uint16_t *sought_path_utf16 = NULL;
     int sought_path_utf16_max;
+    unsigned char *seen;
     char *in_ptr, *out_ptr;
     size_t in_left, out_left;
     iconv_t cd;
+    struct cfbf_arena_mark mark;
+    uint64_t start = cfbf_stats_now();
 
-    dir_chain = cfbf_get_chain_ptrs(cfbf, cfbf->header->_sectDirStart, &num_dir_secs);
-
-    if (dir_chain == NULL) {
-        error(0, 0, "failed to read directory chain");
-        return NULL;
-    }
+    CFBF_TRACE1(dir_lookup_start, sought_path_utf8);
+    CFBF_STAT_ADD(CFBF_STAT_DIR_LOOKUPS, 1);
+    dir_chain = cfbf_dir_get_chain(cfbf, &num_dir_secs);
 
     /* Convert sought path to UTF-16 */
-    sought_path_utf16_max = strlen(sought_path_utf8) * 4;
-    sought_path_utf16 = malloc(sought_path_utf16_max);
+    mark = cfbf_arena_mark(&cfbf->arena);
+    sought_path_utf16_max = strlen(sought_path_utf8) * 4 + 2;
+    sought_path_utf16 = cfbf_arena_alloc(&cfbf->arena, sought_path_utf16_max);
     if (sought_path_utf16 == NULL) {
-        error(0, errno, "cfbf_dir_entry_find_path() out of memory");
         goto nomem;
     }
 
@@ -143,6 +203,7 @@ cfbf_dir_entry_find_path(struct cfbf *cfbf, char *sought_path_utf8) {
         goto nomem;
     }
 
+    CFBF_STAT_ADD(CFBF_STAT_ICONV_CALLS, 1);
     if (iconv(cd, &in_ptr, &in_left, &out_ptr, &out_left) == (size_t) -1) {
         iconv_close(cd);
         error(0, errno, "cfbf_dir_entry_find_path(): path charset conversion failed: %s", sought_path_utf8);
@@ -152,14 +213,19 @@ cfbf_dir_entry_find_path(struct cfbf *cfbf, char *sought_path_utf8) {
         *(uint16_t *) out_ptr = 0;
     }
 
+    seen = cfbf_arena_calloc(&cfbf->arena,
+            dir_num_entries(num_dir_secs, cfbf_dir_entries_shift(cfbf)) / 8 + 1, 1);
+    if (seen == NULL)
+        goto nomem;
+
     entry = cfbf_find_path_in_tree(cfbf, dir_chain, num_dir_secs,
-            cfbf_get_sector_size(cfbf),
-            cfbf_get_sector_size(cfbf) / sizeof(struct DirEntry), 0,
-            sought_path_utf16);
+            cfbf_dir_entries_shift(cfbf), 0,
+            sought_path_utf16, seen, 0);
 
 end:
-    free(dir_chain);
-    free(sought_path_utf16);
+    cfbf_arena_release(&cfbf->arena, mark);
+    CFBF_TRACE2(dir_lookup_done, sought_path_utf8, entry != NULL);
+    cfbf_stats_phase_end(CFBF_PHASE_DIR_LOOKUP, start);
 
     return entry;
 
@@ -170,12 +236,13 @@ nomem:
 
 static int
 cfbf_walk_dir_tree_from_chain(struct cfbf *cfbf, void **dir_chain,
-        int dir_chain_length, int sector_size, int entries_per_sector,
+        int dir_chain_length, int entries_shift,
         unsigned long entry_id, struct DirEntry *parent,
         int depth, int (*callback)(void *, struct cfbf *, struct DirEntry *,
-            struct DirEntry *, unsigned long, int), void *cookie) {
-    SECT sector = entry_id / entries_per_sector;
-    int entry_within_sector = entry_id % entries_per_sector;
+            struct DirEntry *, unsigned long, int), void *cookie,
+        unsigned char *seen, int recursion) {
+    SECT sector = entry_id >> entries_shift;
+    int entry_within_sector = entry_id & ((1UL << entries_shift) - 1);
     struct DirEntry *entry;
     int ret;
 
@@ -183,6 +250,14 @@ cfbf_walk_dir_tree_from_chain(struct cfbf *cfbf, void **dir_chain,
         error(0, 0, "cfbf_walk_dir_tree_from_chain(): directory entry id %lu not in chain", (unsigned long) entry_id);
         return -1;
     }
+    if (dir_entry_seen(seen, entry_id)) {
+        error(0, 0, "cfbf_walk_dir_tree_from_chain(): directory entry id %lu is linked to more than once", (unsigned long) entry_id);
+        return -1;
+    }
+    if (recursion > MAX_DIR_TREE_RECURSION) {
+        error(0, 0, "cfbf_walk_dir_tree_from_chain(): directory tree is more than %d entries deep", MAX_DIR_TREE_RECURSION);
+        return -1;
+    }
 
     entry = &((struct DirEntry *) dir_chain[sector])[entry_within_sector];
 
@@ -191,6 +266,7 @@ cfbf_walk_dir_tree_from_chain(struct cfbf *cfbf, void **dir_chain,
         return -1;
     }
 
+    CFBF_STAT_ADD(CFBF_STAT_CALLBACKS, 1);
     ret = callback(cookie, cfbf, entry, parent, entry_id, depth);
     if (ret == 0) {
         /* Give up but don't fail */
@@ -204,8 +280,8 @@ cfbf_walk_dir_tree_from_chain(struct cfbf *cfbf, void **dir_chain,
     /* Visit children */
     if (entry->child_id != CFBF_NOSTREAM) {
         ret = cfbf_walk_dir_tree_from_chain(cfbf, dir_chain, dir_chain_length,
-                sector_size, entries_per_sector, entry->child_id, entry,
-                depth + 1, callback, cookie);
+                entries_shift, entry->child_id, entry,
+                depth + 1, callback, cookie, seen, recursion + 1);
         if (ret <= 0)
             return ret;
     }
@@ -214,15 +290,15 @@ cfbf_walk_dir_tree_from_chain(struct cfbf *cfbf, void **dir_chain,
      * to make a tree rather than a doubly-linked list, so do it recursively */
     if (entry->left_sibling_id != CFBF_NOSTREAM) {
         ret = cfbf_walk_dir_tree_from_chain(cfbf, dir_chain, dir_chain_length,
-                sector_size, entries_per_sector, entry->left_sibling_id,
-                parent, depth, callback, cookie);
+                entries_shift, entry->left_sibling_id,
+                parent, depth, callback, cookie, seen, recursion + 1);
         if (ret <= 0)
             return ret;
     }
     if (entry->right_sibling_id != CFBF_NOSTREAM) {
         ret = cfbf_walk_dir_tree_from_chain(cfbf, dir_chain, dir_chain_length,
-                sector_size, entries_per_sector, entry->right_sibling_id,
-                parent, depth, callback, cookie);
+                entries_shift, entry->right_sibling_id,
+                parent, depth, callback, cookie, seen, recursion + 1);
         if (ret <= 0)
             return ret;
     }
@@ -243,20 +319,23 @@ cfbf_walk_dir_tree(struct cfbf *cfbf,
     int ret;
     int num_dir_secs;
     void **dir_chain;
+    unsigned char *seen;
+
+    dir_chain = cfbf_dir_get_chain(cfbf, &num_dir_secs);
 
-    dir_chain = cfbf_get_chain_ptrs(cfbf, cfbf->header->_sectDirStart, &num_dir_secs);
-    if (dir_chain == NULL) {
-        error(0, 0, "failed to read directory chain");
+    /* Not from the arena, as callbacks may allocate from it and keep what
+     * they get */
+    seen = calloc(dir_num_entries(num_dir_secs, cfbf_dir_entries_shift(cfbf)) / 8 + 1, 1);
+    if (seen == NULL) {
+        error(0, errno, "cfbf_walk_dir_tree()");
         return -1;
     }
 
     ret = cfbf_walk_dir_tree_from_chain(cfbf, dir_chain, num_dir_secs,
-            cfbf_get_sector_size(cfbf),
-            cfbf_get_sector_size(cfbf) / sizeof(struct DirEntry),
-            0, NULL, 0, callback, cookie);
-
-    free(dir_chain);
+            cfbf_dir_entries_shift(cfbf),
+            0, NULL, 0, callback, cookie, seen, 0);
 
+    free(seen);
     return ret;
 }
 
@@ -302,11 +381,201 @@ cfbf_dir_entry_get_sector_ptrs(struct cfbf *cfbf, struct DirEntry *entry, int *n
     if (cfbf_dir_stored_in_mini_stream(cfbf, entry)) {
         if (sector_size_r)
             *sector_size_r = cfbf_get_mini_fat_sector_size(cfbf);
-        return cfbf_get_chain_ptrs_from_mini_stream(cfbf, entry->start_sector, num_sectors_r);
+        return cfbf_get_chain_ptrs_sized(cfbf, entry->start_sector, num_sectors_r, 1, entry->stream_size);
     }
     else {
         if (sector_size_r)
             *sector_size_r = cfbf_get_sector_size(cfbf);
-        return cfbf_get_chain_ptrs(cfbf, entry->start_sector, num_sectors_r);
+        return cfbf_get_chain_ptrs_sized(cfbf, entry->start_sector, num_sectors_r, 0, entry->stream_size);
+    }
+}
+
+struct dir_paths_state {
+    struct cfbf_dir_path *paths;
+    int num_paths;
+    int paths_size;
+
+    /* Index in paths of the last entry seen at each depth. Children are
+     * visited before siblings, so the parent of an entry at depth d is
+     * always the last entry we saw at depth d - 1. */
+    int *depth_index;
+    int depth_index_size;
+
+    iconv_t cd;
+};
+
+static int
+add_dir_path(void *cookie, struct cfbf *cfbf, struct DirEntry *entry,
+        struct DirEntry *parent, unsigned long entry_id, int depth) {
+    struct dir_paths_state *state = (struct dir_paths_state *) cookie;
+    struct cfbf_dir_path *p;
+    char name[CFBF_NAME_UTF8_MAX];
+    char escaped_name[CFBF_NAME_UTF8_MAX * 3];
+    char *in_p, *out_p;
+    size_t in_left, out_left;
+    int name_length;
+
+    if (state->num_paths >= state->paths_size) {
+        int new_size = state->paths_size ? state->paths_size * 2 : 16;
+        struct cfbf_dir_path *new_paths = realloc(state->paths, new_size * sizeof(struct cfbf_dir_path));
+        if (new_paths == NULL)
+            goto nomem;
+        state->paths = new_paths;
+        state->paths_size = new_size;
+    }
+    if (depth >= state->depth_index_size) {
+        int new_size = depth + 16;
+        int *new_depth_index = realloc(state->depth_index, new_size * sizeof(int));
+        if (new_depth_index == NULL)
+            goto nomem;
+        state->depth_index = new_depth_index;
+        state->depth_index_size = new_size;
+    }
+
+    /* name_length includes the terminating null */
+    name_length = entry->name_length;
+    if (name_length > 64)
+        name_length = 64;
+    if (name_length >= 2)
+        name_length -= 2;
+
+    in_p = (char *) entry->name;
+    in_left = name_length;
+    out_p = name;
+    out_left = sizeof(name) - 1;
+    CFBF_STAT_ADD(CFBF_STAT_ICONV_CALLS, 1);
+    iconv(state->cd, NULL, NULL, NULL, NULL);
+    if (iconv(state->cd, &in_p, &in_left, &out_p, &out_left) == (size_t) -1) {
+        error(0, errno, "dir entry %lu: failed to convert name from UTF-16", entry_id);
+        return -1;
+    }
+    *out_p = '\0';
+
+    p = &state->paths[state->num_paths];
+    memset(p, 0, sizeof(*p));
+    p->entry = entry;
+    p->entry_id = entry_id;
+    p->depth = depth;
+    p->parent = depth > 0 ? state->depth_index[depth - 1] : -1;
+    p->name = strdup(name);
+    if (p->name == NULL)
+        goto nomem;
+
+    cfbf_escape_name(name, escaped_name, sizeof(escaped_name));
+
+    if (p->parent < 0) {
+        p->path = strdup(name);
+        p->escaped_path = strdup("");
+    }
+    else {
+        const struct cfbf_dir_path *parent_p = &state->paths[p->parent];
+
+        p->path = malloc(strlen(parent_p->path) + strlen(name) + 2);
+        if (p->path != NULL)
+            sprintf(p->path, "%s/%s", parent_p->path, name);
+
+        p->escaped_path = malloc(strlen(parent_p->escaped_path) + strlen(escaped_name) + 2);
+        if (p->escaped_path != NULL) {
+            if (parent_p->parent < 0)
+                strcpy(p->escaped_path, escaped_name);
+            else
+                sprintf(p->escaped_path, "%s/%s", parent_p->escaped_path, escaped_name);
+        }
+    }
+    if (p->path == NULL || p->escaped_path == NULL) {
+        free(p->name);
+        free(p->path);
+        free(p->escaped_path);
+        goto nomem;
+    }
+
+    state->depth_index[depth] = state->num_paths++;
+
+    return 1;
+
+nomem:
+    error(0, ENOMEM, "cfbf_dir_list_paths()");
+    return -1;
+}
+
+/* Make a list of every entry reachable from the root of the directory tree,
+ * in the order cfbf_walk_dir_tree() visits them, which means every entry
+ * comes after its parent. Each entry's name and full path are given in
+ * UTF-8; the path is in the form accepted by cfbf_dir_entry_find_path().
+ * escaped_path is the path relative to the root entry with each component
+ * escaped by cfbf_escape_name(), suitable for use as a relative filename.
+ *
+ * Returns 0 on success and sets *paths_r and *num_paths_r. The caller must
+ * free the list with cfbf_dir_free_paths(). Returns -1 on failure. */
+int
+cfbf_dir_list_paths(struct cfbf *cfbf, struct cfbf_dir_path **paths_r,
+        int *num_paths_r) {
+    struct dir_paths_state state;
+
+    memset(&state, 0, sizeof(state));
+
+    state.cd = iconv_open("UTF-8", "UTF-16LE");
+    if (state.cd == (iconv_t) -1) {
+        error(0, errno, "cfbf_dir_list_paths(): iconv_open failed");
+        return -1;
+    }
+
+    if (cfbf_walk_dir_tree(cfbf, add_dir_path, &state) < 0) {
+        iconv_close(state.cd);
+        free(state.depth_index);
+        cfbf_dir_free_paths(state.paths, state.num_paths);
+        return -1;
+    }
+
+    iconv_close(state.cd);
+    free(state.depth_index);
+
+    *paths_r = state.paths;
+    *num_paths_r = state.num_paths;
+
+    return 0;
+}
+
+void
+cfbf_dir_free_paths(struct cfbf_dir_path *paths, int num_paths) {
+    for (int i = 0; i < num_paths; ++i) {
+        free(paths[i].name);
+        free(paths[i].path);
+        free(paths[i].escaped_path);
+    }
+    free(paths);
+}
+
+/* Copy the UTF-8 entry name to dest so that it can safely be used as a single
+ * component of a filename. Slashes, control characters such as the \005 at
+ * the start of "\005SummaryInformation", and the % sign itself are written
+ * as %XX. "." and ".." are escaped in full, and an empty name becomes "%".
+ * dest_max must be at least 3 times the length of name plus one. */
+void
+cfbf_escape_name(const char *name, char *dest, size_t dest_max) {
+    size_t pos = 0;
+    int escape_all = (!strcmp(name, ".") || !strcmp(name, ".."));
+
+    if (dest_max == 0)
+        return;
+
+    if (*name == '\0') {
+        snprintf(dest, dest_max, "%%");
+        return;
+    }
+
+    for (const unsigned char *p = (const unsigned char *) name; *p; ++p) {
+        if (escape_all || *p < 0x20 || *p == 0x7f || *p == '/' || *p == '%') {
+            if (pos + 3 >= dest_max)
+                break;
+            snprintf(dest + pos, 4, "%%%02X", (unsigned int) *p);
+            pos += 3;
+        }
+        else {
+            if (pos + 1 >= dest_max)
+                break;
+            dest[pos++] = *p;
+        }
     }
+    dest[pos] = '\0';
 }
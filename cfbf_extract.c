@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <error.h>
+
+#include "cfbf.h"
+
+/* Unpack the whole storage tree of a CFB file into a directory. Storage
+ * objects become directories and stream objects become files. The root
+ * entry is the output directory itself.
+ *
+ * The directories are created first, in a single thread, in directory tree
+ * order, so every parent exists before its children. The streams are then
+ * written out by a pool of threads. Streams in the main FAT are copied
+ * extent by extent from the CFB file with copy_file_range(), so the data
+ * needn't pass through user space at all. Streams in the mini-stream are
+ * already in memory, and are written with a single writev() each. The
+ * streams are read in the order cfbf_run_scheduled() gives them out, which
+ * is the order their data comes in the file.
+ */
+
+struct extract_state {
+    struct cfbf *cfbf;
+    struct cfbf_dir_path *paths;
+    int num_paths;
+
+    /* Path on the filesystem of each entry in paths, escaped */
+    char **out_paths;
+
+    /* Indices into paths of the stream entries, which are the jobs we give
+     * to the thread pool */
+    int *streams;
+    int num_streams;
+};
+
+struct extract_stream_state {
+    struct cfbf *cfbf;
+    int fd;
+    const char *out_path;
+
+    /* Mini-stream extents waiting to be written */
+    struct iovec iov[64];
+    int iov_count;
+
+    /* Set if copy_file_range() doesn't work between these two files */
+    int no_copy_file_range;
+};
+
+static int
+write_all(int fd, const void *data, size_t length, const char *out_path) {
+    while (length > 0) {
+        ssize_t ret = write(fd, data, length);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            error(0, errno, "%s", out_path);
+            return -1;
+        }
+        data = (const char *) data + ret;
+        length -= ret;
+    }
+    return 0;
+}
+
+static int
+flush_iov(struct extract_stream_state *state) {
+    struct iovec *iov = state->iov;
+    int iov_count = state->iov_count;
+
+    while (iov_count > 0) {
+        ssize_t ret = writev(state->fd, iov, iov_count);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            error(0, errno, "%s", state->out_path);
+            return -1;
+        }
+
+        /* Skip over whatever got written */
+        while (iov_count > 0 && ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            ++iov;
+            --iov_count;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (char *) iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    state->iov_count = 0;
+
+    return 0;
+}
+
+static int
+extract_extent(void *cookie, const void *data, int64_t length,
+        int64_t data_offset, int64_t sector_offset) {
+    struct extract_stream_state *state = (struct extract_stream_state *) cookie;
+
+    if (sector_offset < 0) {
+        /* Extent in the mini-stream - batch it up */
+        if (state->iov_count >= sizeof(state->iov) / sizeof(state->iov[0])) {
+            if (flush_iov(state) < 0)
+                return -1;
+        }
+        state->iov[state->iov_count].iov_base = (void *) data;
+        state->iov[state->iov_count].iov_len = length;
+        state->iov_count++;
+        return 0;
+    }
+
+    /* Extent in the file - copy it directly from the CFB file */
+    while (length > 0 && !state->no_copy_file_range) {
+        loff_t off_in = sector_offset;
+        ssize_t ret = copy_file_range(state->cfbf->fd, &off_in, state->fd,
+                NULL, length, 0);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                    errno == EOPNOTSUPP || errno == EBADF) {
+                /* Fall back to write() for this and every later extent */
+                state->no_copy_file_range = 1;
+                break;
+            }
+            error(0, errno, "%s", state->out_path);
+            return -1;
+        }
+        else if (ret == 0) {
+            /* Shouldn't happen unless the CFB file has been truncated */
+            break;
+        }
+
+        data = (const char *) data + ret;
+        length -= ret;
+        sector_offset += ret;
+    }
+
+    if (length > 0)
+        return write_all(state->fd, data, length, state->out_path);
+
+    return 0;
+}
+
+static int
+extract_stream(void *cookie, int job_index) {
+    struct extract_state *state = (struct extract_state *) cookie;
+    int path_index = state->streams[job_index];
+    struct DirEntry *entry = state->paths[path_index].entry;
+    struct extract_stream_state stream_state;
+    int retval = 0;
+
+    memset(&stream_state, 0, sizeof(stream_state));
+    stream_state.cfbf = state->cfbf;
+    stream_state.out_path = state->out_paths[path_index];
+
+    stream_state.fd = open(stream_state.out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (stream_state.fd < 0) {
+        error(0, errno, "%s", stream_state.out_path);
+        return -1;
+    }
+
+    if (entry->stream_size > 0) {
+        if (cfbf_follow_chain_extents(state->cfbf, entry->start_sector,
+                    entry->stream_size,
+                    cfbf_dir_stored_in_mini_stream(state->cfbf, entry),
+                    extract_extent, &stream_state) < 0) {
+            error(0, 0, "failed to extract %s", state->paths[path_index].path);
+            retval = -1;
+        }
+        else if (flush_iov(&stream_state) < 0) {
+            retval = -1;
+        }
+    }
+
+    if (close(stream_state.fd) < 0) {
+        error(0, errno, "%s", stream_state.out_path);
+        retval = -1;
+    }
+
+    return retval;
+}
+
+int
+cfbf_extract_all(struct cfbf *cfbf, const char *dest_dir, FILE *out,
+        int num_threads, int64_t read_window, int verbosity) {
+    struct extract_state state;
+    struct DirEntry **entries = NULL;
+    int retval = 0;
+
+    memset(&state, 0, sizeof(state));
+    state.cfbf = cfbf;
+
+    if (cfbf_dir_list_paths(cfbf, &state.paths, &state.num_paths) < 0)
+        return -1;
+
+    state.out_paths = calloc(state.num_paths, sizeof(char *));
+    state.streams = calloc(state.num_paths, sizeof(int));
+    if (state.out_paths == NULL || state.streams == NULL) {
+        error(0, errno, "cfbf_extract_all()");
+        goto fail;
+    }
+
+    if (mkdir(dest_dir, 0777) < 0 && errno != EEXIST) {
+        error(0, errno, "%s", dest_dir);
+        goto fail;
+    }
+
+    /* Work out where each entry goes, and create the directories */
+    for (int i = 0; i < state.num_paths; ++i) {
+        struct cfbf_dir_path *p = &state.paths[i];
+
+        if (p->parent < 0) {
+            /* Root entry */
+            state.out_paths[i] = strdup(dest_dir);
+            if (state.out_paths[i] == NULL) {
+                error(0, errno, "cfbf_extract_all()");
+                goto fail;
+            }
+            continue;
+        }
+
+        if (state.out_paths[p->parent] == NULL) {
+            /* Parent was skipped, so skip its children too */
+            continue;
+        }
+
+        if (p->entry->object_type != 1 && p->entry->object_type != 2) {
+            error(0, 0, "%s: object type %d is not a storage or a stream, skipping", p->path, (int) p->entry->object_type);
+            retval = -1;
+            continue;
+        }
+
+        state.out_paths[i] = malloc(strlen(dest_dir) + strlen(p->escaped_path) + 2);
+        if (state.out_paths[i] == NULL) {
+            error(0, errno, "cfbf_extract_all()");
+            goto fail;
+        }
+        sprintf(state.out_paths[i], "%s/%s", dest_dir, p->escaped_path);
+
+        if (p->entry->object_type == 1) {
+            if (mkdir(state.out_paths[i], 0777) < 0 && errno != EEXIST) {
+                error(0, errno, "%s", state.out_paths[i]);
+                free(state.out_paths[i]);
+                state.out_paths[i] = NULL;
+                retval = -1;
+            }
+        }
+        else {
+            state.streams[state.num_streams++] = i;
+        }
+    }
+
+    entries = malloc((state.num_streams ? state.num_streams : 1) * sizeof(struct DirEntry *));
+    if (entries == NULL) {
+        error(0, errno, "cfbf_extract_all()");
+        goto fail;
+    }
+    for (int i = 0; i < state.num_streams; ++i)
+        entries[i] = state.paths[state.streams[i]].entry;
+
+    if (cfbf_run_scheduled(cfbf, entries, state.num_streams, read_window,
+                num_threads, extract_stream, &state) < 0)
+        retval = -1;
+
+    if (verbosity > 0) {
+        for (int i = 0; i < state.num_streams; ++i) {
+            int path_index = state.streams[i];
+            fprintf(out, "%s\t%llu\n", state.out_paths[path_index],
+                    (unsigned long long) state.paths[path_index].entry->stream_size);
+        }
+    }
+
+end:
+    if (state.out_paths) {
+        for (int i = 0; i < state.num_paths; ++i)
+            free(state.out_paths[i]);
+    }
+    free(state.out_paths);
+    free(state.streams);
+    free(entries);
+    cfbf_dir_free_paths(state.paths, state.num_paths);
+    return retval;
+
+fail:
+    retval = -1;
+    goto end;
+}
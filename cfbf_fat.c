@@ -1,15 +1,19 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
 #include <errno.h>
 #include <error.h>
 
 #include "cfbf.h"
+#include "cfbf_trace.h"
 
+/* The FAT's memory belongs to its file's arena, so there's nothing to free
+ * here; cfbf_close() frees it with everything else */
 void
 cfbf_fat_close(struct cfbf_fat *fat) {
-    free(fat->sector_entries);
-    free(fat->fat_sectors);
+    memset(fat, 0, sizeof(*fat));
 }
 
 SECT
@@ -17,11 +21,142 @@ cfbf_fat_get_sector_entry(struct cfbf_fat *fat, SECT sect) {
     if (sect >= fat->sector_entries_count) {
         return CFBF_FREESECT;
     }
+    else if (fat->sector_entries == NULL) {
+        /* The file is mapped in windows, so rather than keep a copy of the
+         * whole FAT, look the entry up in the FAT sector it's in */
+        int entries_shift = fat->cfbf->sector_shift - 2;
+        SECT fat_sector = fat->fat_sectors[sect >> entries_shift];
+        int64_t offset = (((int64_t) fat_sector + 1) << fat->cfbf->sector_shift) +
+            (sect & ((1U << entries_shift) - 1)) * sizeof(SECT);
+        SECT *entry = cfbf_get_fat_ptr_at_offset(fat->cfbf, offset);
+
+        return entry ? *entry : CFBF_FREESECT;
+    }
     else {
         return fat->sector_entries[sect];
     }
 }
 
+/* Chain-aware readahead.
+ *
+ * The kernel's own readahead assumes we read the file front to back, which
+ * for a fragmented chain means it reads the wrong pages and we fault on the
+ * right ones one at a time. So as we follow a chain in the main FAT, we keep
+ * a second cursor cfbf->readahead_sectors sectors further along the same
+ * chain, and tell the kernel with MADV_WILLNEED about each sector it passes.
+ * Runs of adjacent sectors are merged into one madvise() call.
+ *
+ * The mini-stream is in memory already, so chains in it need none of this.
+ */
+
+/* Flush a pending run when it gets this many sectors long, so the pages at
+ * the start of it aren't left waiting for the rest */
+#define READAHEAD_MAX_RUN 32
+
+void
+cfbf_readahead_flush(struct cfbf_readahead *ra) {
+    long page_size;
+    int64_t start;
+
+    if (ra->run_length == 0)
+        return;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    start = ra->run_start & ~((int64_t) page_size - 1);
+
+    /* Failure only costs us the readahead, so it isn't worth reporting */
+    cfbf_prefetch(ra->cfbf, start, ra->run_start + ra->run_length - start);
+    ra->run_length = 0;
+}
+
+static void
+readahead_sector(struct cfbf_readahead *ra, SECT sector) {
+    int sector_size = cfbf_get_sector_size(ra->cfbf);
+    int64_t offset = ((int64_t) sector + 1) * sector_size;
+
+    if (!CFBF_IS_SECTOR(sector) || offset + sector_size > ra->cfbf->file_size)
+        return;
+
+    if (ra->run_length > 0 && offset == ra->run_start + ra->run_length &&
+            ra->run_length < (int64_t) READAHEAD_MAX_RUN * sector_size) {
+        ra->run_length += sector_size;
+        return;
+    }
+
+    cfbf_readahead_flush(ra);
+    ra->run_start = offset;
+    ra->run_length = sector_size;
+}
+
+/* Start reading ahead along the chain beginning at first_sector. If
+ * use_mini_stream is set, or readahead is turned off, this and the other
+ * cfbf_readahead functions do nothing. */
+void
+cfbf_readahead_begin(struct cfbf_readahead *ra, struct cfbf *cfbf,
+        SECT first_sector, int use_mini_stream) {
+    memset(ra, 0, sizeof(*ra));
+    ra->cfbf = cfbf;
+    ra->ahead = CFBF_END_OF_CHAIN;
+
+    if (use_mini_stream || cfbf->readahead_sectors <= 0)
+        return;
+
+    ra->ahead = first_sector;
+    for (int i = 0; i < cfbf->readahead_sectors && CFBF_IS_SECTOR(ra->ahead); ++i) {
+        readahead_sector(ra, ra->ahead);
+        ra->ahead = cfbf_fat_get_sector_entry(&cfbf->fat, ra->ahead);
+    }
+    cfbf_readahead_flush(ra);
+}
+
+/* Call this each time the reader moves on one sector along the chain */
+void
+cfbf_readahead_advance(struct cfbf_readahead *ra) {
+    if (!CFBF_IS_SECTOR(ra->ahead)) {
+        cfbf_readahead_flush(ra);
+        return;
+    }
+
+    readahead_sector(ra, ra->ahead);
+    ra->ahead = cfbf_fat_get_sector_entry(&ra->cfbf->fat, ra->ahead);
+}
+
+/* Read ahead a list of sectors which aren't a chain, such as the FAT
+ * sectors listed in the header or a DIFAT sector */
+static void
+readahead_sector_list(struct cfbf *cfbf, const SECT *sectors, int count) {
+    struct cfbf_readahead ra;
+
+    if (cfbf->readahead_sectors <= 0)
+        return;
+
+    memset(&ra, 0, sizeof(ra));
+    ra.cfbf = cfbf;
+    for (int i = 0; i < count; ++i)
+        readahead_sector(&ra, sectors[i]);
+    cfbf_readahead_flush(&ra);
+}
+
+/* Record that the FAT's index'th sector is sector, and unless we're looking
+ * entries up in the file, copy it */
+static int
+fat_load_sector(struct cfbf_fat *fat, struct cfbf *cfbf, SECT sector,
+        unsigned long index) {
+    unsigned long sect_ents_per_sect = fat->sector_size / sizeof(SECT);
+
+    if (cfbf->window_size != 0) {
+        if (((int64_t) sector + 1) * fat->sector_size + fat->sector_size > cfbf->file_size) {
+            error(0, 0, "FAT sector %lu is past the end of the file", (unsigned long) sector);
+            return -1;
+        }
+    }
+    else if (cfbf_read_sector(cfbf, sector, fat->sector_entries + index * sect_ents_per_sect) < 0) {
+        return -1;
+    }
+    fat->fat_sectors[index] = sector;
+    return 0;
+}
+
 int
 cfbf_fat_open(struct cfbf_fat *fat, struct cfbf *cfbf, SECT *start_sectors,
         unsigned long start_sectors_len, SECT difat_first_cont_sector,
@@ -31,28 +166,36 @@ cfbf_fat_open(struct cfbf_fat *fat, struct cfbf *cfbf, SECT *start_sectors,
     unsigned long max_fat_sect;
     int retval = 0;
     SECT *difat_sect_data = NULL;
+    struct cfbf_arena_mark mark;
 
     memset(fat, 0, sizeof(*fat));
 
     sector_size = cfbf_get_sector_size(cfbf);
     sect_ents_per_sect = sector_size / sizeof(SECT);
 
-    fat->sector_entries = calloc(num_fat_sectors_expected, sector_size);
-    if (fat->sector_entries == NULL) {
-        error(0, errno, "failed to allocate space for FAT sector entries");
-        goto fail;
+    /* With windows, the FAT could be bigger than we're allowed to use, so
+     * we only remember where its sectors are */
+    if (cfbf->window_size == 0) {
+        fat->sector_entries = cfbf_arena_calloc(&cfbf->arena, num_fat_sectors_expected, sector_size);
+        if (fat->sector_entries == NULL) {
+            error(0, 0, "failed to allocate space for FAT sector entries");
+            return -1;
+        }
     }
 
-    fat->fat_sectors = calloc(num_fat_sectors_expected, sizeof(SECT *));
+    fat->fat_sectors = cfbf_arena_calloc(&cfbf->arena, num_fat_sectors_expected, sizeof(SECT));
     if (fat->fat_sectors == NULL) {
-        error(0, errno, "failed to allocate space for FAT pointers");
-        goto fail;
+        error(0, 0, "failed to allocate space for FAT sector list");
+        return -1;
     }
     fat->num_fat_sectors = num_fat_sectors_expected;
     fat->sector_size = sector_size;
+    fat->cfbf = cfbf;
     
     max_fat_sect = num_fat_sectors_expected * sect_ents_per_sect;
 
+    readahead_sector_list(cfbf, start_sectors, start_sectors_len);
+
     fat->sector_entries_count = 0;
     for (int i = 0; i < start_sectors_len; ++i) {
         if (i >= num_fat_sectors_expected) {
@@ -60,20 +203,25 @@ cfbf_fat_open(struct cfbf_fat *fat, struct cfbf *cfbf, SECT *start_sectors,
             goto fail;
         }
         //fprintf(stderr, "reading sector %lu\n", (unsigned long) start_sectors[i]);
-        if (cfbf_read_sector(cfbf, start_sectors[i], fat->sector_entries + i * sect_ents_per_sect) < 0) {
+        if (fat_load_sector(fat, cfbf, start_sectors[i], i) < 0)
             goto fail;
-        }
-        fat->fat_sectors[fat->sector_entries_count / sect_ents_per_sect] = cfbf_get_sector_ptr(cfbf, start_sectors[i]);
         fat->sector_entries_count += sect_ents_per_sect;
     }
 
     SECT difat_cont_sector = difat_first_cont_sector;
-    difat_sect_data = malloc(sector_size);
+
+    /* We only need each DIFAT sector while we read it */
+    mark = cfbf_arena_mark(&cfbf->arena);
+    difat_sect_data = cfbf_arena_alloc(&cfbf->arena, sector_size);
+    if (difat_sect_data == NULL)
+        goto fail;
 
     for (int i = 0; i < num_cont_sectors; ++i) {
         if (cfbf_read_sector(cfbf, difat_cont_sector, difat_sect_data) < 0)
             goto fail;
 
+        readahead_sector_list(cfbf, difat_sect_data, sect_ents_per_sect - 1);
+
         /* Each DIFAT sector contains 127 sector numbers (each of which
          * refer to a FAT sector) followed by a reference to the next
          * DIFAT sector. */
@@ -99,10 +247,8 @@ cfbf_fat_open(struct cfbf_fat *fat, struct cfbf *cfbf, SECT *start_sectors,
                         (unsigned long) fat->sector_entries_count + sect_ents_per_sect - 1);
                 goto fail;
             }
-            fat->fat_sectors[fat->sector_entries_count / sect_ents_per_sect] = cfbf_get_sector_ptr(cfbf, fat_sector);
-            if (cfbf_read_sector(cfbf, fat_sector, fat->sector_entries + fat->sector_entries_count) < 0) {
+            if (fat_load_sector(fat, cfbf, fat_sector, fat->sector_entries_count / sect_ents_per_sect) < 0)
                 goto fail;
-            }
             fat->sector_entries_count += sect_ents_per_sect;
         }
 
@@ -133,7 +279,8 @@ cfbf_fat_open(struct cfbf_fat *fat, struct cfbf *cfbf, SECT *start_sectors,
     }
 
 end:
-    free(difat_sect_data);
+    if (difat_sect_data != NULL)
+        cfbf_arena_release(&cfbf->arena, mark);
     return retval;
     
 fail:
@@ -157,11 +304,11 @@ cfbf_mini_fat_open(struct cfbf_fat *mini_fat, struct cfbf_fat *main_fat,
         return 0;
     }
 
-    mini_fat->sector_entries = calloc(num_sectors, main_sector_size);
+    mini_fat->sector_entries = cfbf_arena_calloc(&cfbf->arena, num_sectors, main_sector_size);
     mini_fat->sector_entries_count = 0;
 
     if (mini_fat->sector_entries == NULL) {
-        error(0, ENOMEM, "failed to allocate %lu sectors for mini-FAT", (unsigned long) num_sectors);
+        error(0, 0, "failed to allocate %lu sectors for mini-FAT", (unsigned long) num_sectors);
         goto fail;
     }
 
@@ -200,13 +347,51 @@ fail:
 }
 
 
+/* With windows, the pointers cfbf_get_chain_ptrs_aux() found may not all be
+ * mapped at once, so copy the sectors into the arena and point sects at the
+ * copies instead. The directory has already been copied, so point into
+ * that. */
+static void **
+chain_ptrs_from_copy(struct cfbf *cfbf, void **sects, int sects_count,
+        SECT first_sector) {
+    int sector_size = cfbf_get_sector_size(cfbf);
+    char *data;
+    SECT sector = first_sector;
+
+    if (first_sector == cfbf->header->_sectDirStart && cfbf->dir_copy != NULL &&
+            sects_count <= cfbf->dir_copy_sectors) {
+        for (int i = 0; i < sects_count; ++i)
+            sects[i] = cfbf->dir_copy + (size_t) i * sector_size;
+        return sects;
+    }
+
+    data = cfbf_arena_alloc(&cfbf->arena, (size_t) sects_count * sector_size);
+    if (data == NULL)
+        return NULL;
+
+    for (int i = 0; i < sects_count; ++i) {
+        sects[i] = data + (size_t) i * sector_size;
+        if (cfbf_read_sector(cfbf, sector, sects[i]) < 0)
+            return NULL;
+        sector = cfbf_fat_get_sector_entry(&cfbf->fat, sector);
+    }
+
+    return sects;
+}
+
+/* size_hint is how many bytes we expect the chain to hold, if known, or -1.
+ * It's only used to size the list we return, so if it's wrong we're just
+ * slower. */
 static void **
-cfbf_get_chain_ptrs_aux(struct cfbf *cfbf, SECT first_sector, int *num_sectors_r, int use_mini_stream) {
+cfbf_get_chain_ptrs_aux(struct cfbf *cfbf, SECT first_sector, int *num_sectors_r,
+        int use_mini_stream, int64_t size_hint) {
     void **sects = NULL;
     int sects_count = 0;
-    int sects_size = 4;
+    size_t sects_size = 4;
     SECT current_sector;
     struct cfbf_fat *fat;
+    struct cfbf_readahead ra;
+    uint64_t start = cfbf_stats_now();
 
     if (use_mini_stream) {
         fat = &cfbf->mini_fat;
@@ -215,53 +400,100 @@ cfbf_get_chain_ptrs_aux(struct cfbf *cfbf, SECT first_sector, int *num_sectors_r
         fat = &cfbf->fat;
     }
 
-    sects = malloc(sects_size * sizeof(void *));
+    /* A version 4 header tells us how long the directory chain is */
+    if (!use_mini_stream && first_sector == cfbf->header->_sectDirStart &&
+            cfbf->num_dir_sectors > 0)
+        size_hint = (int64_t) cfbf->num_dir_sectors * fat->sector_size;
+
+    /* Leave room for the NULL on the end. A chain can't be longer than the
+     * FAT, whatever the hint says. */
+    if (size_hint > 0 && size_hint / fat->sector_size < fat->sector_entries_count)
+        sects_size = size_hint / fat->sector_size + 2;
+
+    CFBF_TRACE4(chain_start, CFBF_TRACE_CHAIN_PTRS, first_sector,
+            use_mini_stream, size_hint);
+
+    sects = cfbf_arena_alloc(&cfbf->arena, sects_size * sizeof(void *));
     if (sects == NULL) {
-        goto nomem;
+        goto fail;
     }
 
+    /* The caller is about to read the sectors we return, so start them
+     * coming in while we build the list */
+    cfbf_readahead_begin(&ra, cfbf, first_sector, use_mini_stream);
+
     for (current_sector = first_sector; current_sector != CFBF_END_OF_CHAIN; current_sector = cfbf_fat_get_sector_entry(fat, current_sector)) {
         void *p;
 
+        cfbf_readahead_advance(&ra);
+
         if (use_mini_stream)
             p = cfbf_get_sector_ptr_in_mini_stream(cfbf, current_sector);
         else
             p = cfbf_get_sector_ptr(cfbf, current_sector);
+        CFBF_TRACE2(sector_fetch, current_sector, use_mini_stream);
 
         if (p == NULL) {
             goto fail;
         }
+        /* No sector can be in a chain twice */
+        if (sects_count >= fat->sector_entries_count) {
+            error(0, 0, "cfbf_get_chain_ptrs(): chain starting at sector %lu loops", (unsigned long) first_sector);
+            goto fail;
+        }
+        if (sects_count == INT_MAX - 1) {
+            error(0, 0, "cfbf_get_chain_ptrs(): chain starting at sector %lu is too long", (unsigned long) first_sector);
+            goto fail;
+        }
         sects[sects_count++] = p;
         if (sects_count >= sects_size) {
-            void **new_sects = realloc(sects, sects_size * 2 * sizeof(void *));
+            void **new_sects = cfbf_arena_grow(&cfbf->arena, sects,
+                    sects_size * sizeof(void *), sects_size * 2 * sizeof(void *));
             if (new_sects == NULL)
-                goto nomem;
+                goto fail;
             sects = new_sects;
             sects_size *= 2;
+            CFBF_STAT_ADD(CFBF_STAT_CHAIN_GROWS, 1);
         }
     }
+    cfbf_readahead_flush(&ra);
     sects[sects_count] = NULL;
     if (num_sectors_r)
         *num_sectors_r = sects_count;
 
-    return sects;
+    CFBF_STAT_ADD(CFBF_STAT_SECTORS, sects_count);
 
-nomem:
-    error(0, 0, "cfbf_get_chain_ptrs(): out of memory");
+    if (cfbf->window_size != 0 && !use_mini_stream)
+        sects = chain_ptrs_from_copy(cfbf, sects, sects_count, first_sector);
+
+    CFBF_TRACE5(chain_done, CFBF_TRACE_CHAIN_PTRS, first_sector,
+            use_mini_stream, sects_count, sects == NULL ? -1 : 0);
+    cfbf_stats_phase_end(CFBF_PHASE_CHAIN_PTRS, start);
+    return sects;
 
 fail:
-    free(sects);
+    CFBF_TRACE5(chain_done, CFBF_TRACE_CHAIN_PTRS, first_sector,
+            use_mini_stream, sects_count, -1);
     return NULL;
 }
 
 void **
 cfbf_get_chain_ptrs(struct cfbf *cfbf, SECT first_sector, int *num_sectors_r) {
-    return cfbf_get_chain_ptrs_aux(cfbf, first_sector, num_sectors_r, 0);
+    return cfbf_get_chain_ptrs_aux(cfbf, first_sector, num_sectors_r, 0, -1);
 }
 
 void **
 cfbf_get_chain_ptrs_from_mini_stream(struct cfbf *cfbf, SECT first_sector, int *num_sectors_r) {
-    return cfbf_get_chain_ptrs_aux(cfbf, first_sector, num_sectors_r, 1);
+    return cfbf_get_chain_ptrs_aux(cfbf, first_sector, num_sectors_r, 1, -1);
+}
+
+/* Like cfbf_get_chain_ptrs() or cfbf_get_chain_ptrs_from_mini_stream(), for
+ * a chain we expect to hold size bytes */
+void **
+cfbf_get_chain_ptrs_sized(struct cfbf *cfbf, SECT first_sector,
+        int *num_sectors_r, int use_mini_stream, int64_t size) {
+    return cfbf_get_chain_ptrs_aux(cfbf, first_sector, num_sectors_r,
+            use_mini_stream, size);
 }
 
 void *
@@ -270,23 +502,28 @@ cfbf_alloc_chain_contents_from_fat(struct cfbf *cfbf, SECT first_sector, size_t
     void *data;
     size_t data_pos = 0;
     int read_partial_sector = 0;
+    struct cfbf_readahead ra;
 
     if (size == 0) {
         return NULL;
     }
 
-    data = malloc(size);
+    data = cfbf_arena_alloc(&cfbf->arena, size);
     if (data == NULL) {
-        goto nomem;
+        return NULL;
     }
 
+    cfbf_readahead_begin(&ra, cfbf, first_sector, 0);
+
     for (SECT sec = first_sector; sec != CFBF_END_OF_CHAIN; sec = cfbf_fat_get_sector_entry(&cfbf->fat, sec)) {
         size_t to_copy;
         void *p;
 
+        cfbf_readahead_advance(&ra);
+
         if (read_partial_sector) {
             error(0, 0, "reached where we expected EOF to be, based on file size, but there are more sectors? sec %lu", (unsigned long) sec);
-            goto fail;
+            return NULL;
         }
 
         to_copy = size - data_pos;
@@ -296,7 +533,7 @@ cfbf_alloc_chain_contents_from_fat(struct cfbf *cfbf, SECT first_sector, size_t
         p = cfbf_get_sector_ptr(cfbf, sec);
         if (p == NULL) {
             error(0, 0, "failed to copy contents, sector %lu not valid", (unsigned long) sec);
-            goto fail;
+            return NULL;
         }
 
         memcpy((char *) data + data_pos, p, to_copy);
@@ -308,19 +545,57 @@ cfbf_alloc_chain_contents_from_fat(struct cfbf *cfbf, SECT first_sector, size_t
 
     if (data_pos != size) {
         error(0, 0, "expected %llu bytes, got %llu", (unsigned long long) size, (unsigned long long) data_pos);
-        goto fail;
+        return NULL;
     }
+    CFBF_STAT_ADD(CFBF_STAT_SECTORS, (size + sector_size - 1) / sector_size);
+    CFBF_STAT_ADD(CFBF_STAT_BYTES_COPIED, size);
 
     return data;
+}
 
-nomem:
-    error(0, ENOMEM, "cfbf_alloc_chain_contents_from_fat()");
 
-fail:
-    free(data);
-    return NULL;
+/* Geometry specialisation.
+ *
+ * Almost every file has 512-byte sectors (version 3) or 4096-byte sectors
+ * (version 4), and 64-byte mini-sectors. The loops which follow chains are
+ * written once below as always-inline functions taking the sector shift as
+ * a parameter, and each public function switches on the shift once and
+ * calls an instance of its loop in which the shift is a constant. The
+ * compiler can then turn every sector size, offset and length calculation
+ * into a constant shift or mask. Any other geometry gets the instance in
+ * which the shift is a variable.
+ */
+
+#define CFBF_INLINE static inline __attribute__((always_inline))
+
+/* Next sector in a chain. The common case, a FAT we have a copy of, is
+ * done here without a function call. */
+CFBF_INLINE SECT
+fat_next(const struct cfbf_fat *fat, SECT sect) {
+    if (fat->sector_entries != NULL && sect < fat->sector_entries_count)
+        return fat->sector_entries[sect];
+    return cfbf_fat_get_sector_entry((struct cfbf_fat *) fat, sect);
 }
 
+/* Pointer to a sector of 1 << shift bytes, in the mini-stream or the file.
+ * Windows and errors are left to the out-of-line functions. */
+CFBF_INLINE void *
+chain_sector_ptr(struct cfbf *cfbf, SECT sect, int use_mini_stream,
+        const int shift) {
+    CFBF_TRACE2(sector_fetch, sect, use_mini_stream);
+    if (use_mini_stream) {
+        uint64_t offset = (uint64_t) sect << shift;
+        if (offset >= cfbf->mini_stream_size)
+            return NULL;
+        return (char *) cfbf->mini_stream + offset;
+    }
+    else {
+        uint64_t offset = ((uint64_t) sect + 1) << shift;
+        if (cfbf->window_size != 0 || offset >= (uint64_t) cfbf->file_size)
+            return cfbf_get_sector_ptr(cfbf, sect);
+        return (char *) cfbf->file + offset;
+    }
+}
 
 /* Follow the chain in the FAT (or the mini-FAT, if use_mini_stream is set),
  * starting with first_sector. cfbf_follow_chain() will call callback() once
@@ -341,56 +616,64 @@ fail:
  * number to indicate that there's been a failure and that cfbf_follow_chain()
  * should fail immediately.
  */
-int
-cfbf_follow_chain(struct cfbf *cfbf, SECT first_sector, int64_t data_size,
+CFBF_INLINE int
+follow_chain_shift(struct cfbf *cfbf, SECT first_sector, int64_t data_size,
         int use_mini_stream,
         int (*callback)(void *cookie, const void *sector_data, int length,
-            FSINDEX sector_index, int64_t file_offset), void *cookie) {
+            FSINDEX sector_index, int64_t file_offset), void *cookie,
+        const int shift) {
+    const int64_t sector_size = (int64_t) 1 << shift;
     struct cfbf_fat *fat;
     SECT sector;
     int64_t file_offset = 0;
     FSINDEX sector_index = 0;
+    struct cfbf_readahead ra;
 
     if (use_mini_stream)
         fat = &cfbf->mini_fat;
     else
         fat = &cfbf->fat;
 
-    for (sector = first_sector; sector != CFBF_END_OF_CHAIN; sector = cfbf_fat_get_sector_entry(fat, sector)) {
+    CFBF_TRACE4(chain_start, CFBF_TRACE_CHAIN_FOLLOW, first_sector,
+            use_mini_stream, data_size);
+    cfbf_readahead_begin(&ra, cfbf, first_sector, use_mini_stream);
+
+    for (sector = first_sector; sector != CFBF_END_OF_CHAIN; sector = fat_next(fat, sector)) {
         void *ptr;
         int ret;
         int this_data_length;
 
-        if (data_size >= 0 && file_offset >= data_size) {
-            error(0, 0, "cfbf_follow_chain(): read %lld bytes but there are more sectors? sector %lu", (long long) file_offset, (unsigned long) sector);
+        cfbf_readahead_advance(&ra);
+
+        if (sector_index >= fat->sector_entries_count) {
+            error(0, 0, "cfbf_follow_chain(): chain starting at sector %lu loops", (unsigned long) first_sector);
             goto fail;
         }
 
-        if (use_mini_stream) {
-            ptr = cfbf_get_sector_ptr_in_mini_stream(cfbf, sector);
-        }
-        else {
-            ptr = cfbf_get_sector_ptr(cfbf, sector);
+        if (data_size >= 0 && file_offset >= data_size) {
+            error(0, 0, "cfbf_follow_chain(): read %lld bytes but there are more sectors? sector %lu", (long long) file_offset, (unsigned long) sector);
+            goto fail;
         }
 
+        ptr = chain_sector_ptr(cfbf, sector, use_mini_stream, shift);
         if (ptr == NULL) {
             error(0, 0, "cfbf_follow_chain(): failed to fetch pointer for sector %lu", (unsigned long) sector);
             goto fail;
         }
 
-        if (data_size < 0 || data_size - file_offset >= fat->sector_size)
-            this_data_length = fat->sector_size;
+        if (data_size < 0 || data_size - file_offset >= sector_size)
+            this_data_length = sector_size;
         else
             this_data_length = (int) (data_size - file_offset);
 
         ret = callback(cookie, ptr, this_data_length, sector_index, file_offset);
+        sector_index++;
         if (ret != 0) {
             error(0, 0, "cfbf_follow_chain(): callback returned failure");
             goto fail;
         }
 
         file_offset += this_data_length;
-        sector_index++;
     }
 
     if (data_size >= 0 && file_offset != data_size) {
@@ -398,8 +681,332 @@ cfbf_follow_chain(struct cfbf *cfbf, SECT first_sector, int64_t data_size,
         goto fail;
     }
 
+    CFBF_TRACE5(chain_done, CFBF_TRACE_CHAIN_FOLLOW, first_sector,
+            use_mini_stream, sector_index, 0);
+    CFBF_STAT_ADD(CFBF_STAT_SECTORS, sector_index);
+    CFBF_STAT_ADD(CFBF_STAT_CALLBACKS, sector_index);
     return 0;
 
 fail:
+    CFBF_TRACE5(chain_done, CFBF_TRACE_CHAIN_FOLLOW, first_sector,
+            use_mini_stream, sector_index, -1);
+    CFBF_STAT_ADD(CFBF_STAT_SECTORS, sector_index);
+    CFBF_STAT_ADD(CFBF_STAT_CALLBACKS, sector_index);
     return -1;
 }
+
+int
+cfbf_follow_chain(struct cfbf *cfbf, SECT first_sector, int64_t data_size,
+        int use_mini_stream,
+        int (*callback)(void *cookie, const void *sector_data, int length,
+            FSINDEX sector_index, int64_t file_offset), void *cookie) {
+    int shift = use_mini_stream ? cfbf->mini_sector_shift : cfbf->sector_shift;
+
+    switch (shift) {
+        case 6:
+            return follow_chain_shift(cfbf, first_sector, data_size,
+                    use_mini_stream, callback, cookie, 6);
+        case 9:
+            return follow_chain_shift(cfbf, first_sector, data_size,
+                    use_mini_stream, callback, cookie, 9);
+        case 12:
+            return follow_chain_shift(cfbf, first_sector, data_size,
+                    use_mini_stream, callback, cookie, 12);
+        default:
+            return follow_chain_shift(cfbf, first_sector, data_size,
+                    use_mini_stream, callback, cookie, shift);
+    }
+}
+
+/* Like cfbf_follow_chain(), but rather than calling callback() once per
+ * sector, call it once per extent - that is, once for each run of sectors
+ * which are consecutive in the chain and also adjacent to each other in the
+ * file (or in the mini-stream, if use_mini_stream is set). A contiguous
+ * stream is therefore passed to callback() in a single call.
+ *
+ * callback() is given a pointer to the extent's data, "length" which is the
+ * number of meaningful bytes in it, data_offset which is the offset of the
+ * extent from the start of the stream, and sector_offset, which is the
+ * offset of the extent from the start of the CFB file. sector_offset is -1
+ * for extents in the mini-stream, which is held in memory.
+ *
+ * data_size has the same meaning as for cfbf_follow_chain(). callback()
+ * must return 0 to carry on, a positive number to stop following the chain
+ * without failing, or a negative number to indicate failure, in which case
+ * cfbf_follow_chain_extents() fails immediately.
+ */
+CFBF_INLINE int
+follow_chain_extents_shift(struct cfbf *cfbf, SECT first_sector,
+        int64_t data_size, int use_mini_stream,
+        int (*callback)(void *cookie, const void *data, int64_t length,
+            int64_t data_offset, int64_t sector_offset), void *cookie,
+        const int shift) {
+    const int64_t sector_size = (int64_t) 1 << shift;
+    struct cfbf_fat *fat;
+    SECT sector;
+    int64_t data_offset = 0;
+    const char *extent_ptr = NULL;
+    SECT extent_first_sector = 0;
+    int64_t extent_data_offset = 0;
+    int64_t extent_length = 0;
+    int ret;
+    int retval = 0;
+    int64_t num_sectors = 0, num_callbacks = 0;
+    struct cfbf_readahead ra;
+
+    if (use_mini_stream)
+        fat = &cfbf->mini_fat;
+    else
+        fat = &cfbf->fat;
+
+    CFBF_TRACE4(chain_start, CFBF_TRACE_CHAIN_EXTENTS, first_sector,
+            use_mini_stream, data_size);
+    cfbf_readahead_begin(&ra, cfbf, first_sector, use_mini_stream);
+
+    for (sector = first_sector; sector != CFBF_END_OF_CHAIN; sector = fat_next(fat, sector)) {
+        const char *ptr;
+        int this_data_length;
+
+        cfbf_readahead_advance(&ra);
+
+        if (num_sectors >= fat->sector_entries_count) {
+            error(0, 0, "cfbf_follow_chain_extents(): chain starting at sector %lu loops", (unsigned long) first_sector);
+            goto fail;
+        }
+
+        if (data_size >= 0 && data_offset >= data_size) {
+            error(0, 0, "cfbf_follow_chain_extents(): read %lld bytes but there are more sectors? sector %lu", (long long) data_offset, (unsigned long) sector);
+            goto fail;
+        }
+
+        ptr = chain_sector_ptr(cfbf, sector, use_mini_stream, shift);
+        if (ptr == NULL) {
+            error(0, 0, "cfbf_follow_chain_extents(): failed to fetch pointer for sector %lu", (unsigned long) sector);
+            goto fail;
+        }
+
+        if (data_size < 0 || data_size - data_offset >= sector_size)
+            this_data_length = sector_size;
+        else
+            this_data_length = (int) (data_size - data_offset);
+
+        if (extent_length > 0 && (ptr != extent_ptr + extent_length ||
+                    (!use_mini_stream && !cfbf_same_window(cfbf,
+                        ((int64_t) extent_first_sector + 1) << shift,
+                        ((int64_t) sector + 1) << shift)))) {
+            /* This sector doesn't carry on from the previous one, or it's
+             * in a different window, so pass on the extent we've got so far
+             * and start a new one */
+            CFBF_TRACE3(extent, use_mini_stream ? -1 : ((int64_t) extent_first_sector + 1) << shift,
+                    extent_data_offset, extent_length);
+            ret = callback(cookie, extent_ptr, extent_length, extent_data_offset,
+                    use_mini_stream ? -1 : ((int64_t) extent_first_sector + 1) << shift);
+            num_callbacks++;
+            if (ret < 0) {
+                error(0, 0, "cfbf_follow_chain_extents(): callback returned failure");
+                goto fail;
+            }
+            else if (ret > 0) {
+                goto end;
+            }
+            extent_length = 0;
+        }
+
+        if (extent_length == 0) {
+            extent_ptr = ptr;
+            extent_first_sector = sector;
+            extent_data_offset = data_offset;
+        }
+        extent_length += this_data_length;
+        data_offset += this_data_length;
+        num_sectors++;
+    }
+
+    if (data_size >= 0 && data_offset != data_size) {
+        error(0, 0, "cfbf_follow_chain_extents(): came to end of sector chain but only read %lld bytes (expected %lld)", (long long) data_offset, (long long) data_size);
+        goto fail;
+    }
+
+    if (extent_length > 0) {
+        num_callbacks++;
+        CFBF_TRACE3(extent, use_mini_stream ? -1 : ((int64_t) extent_first_sector + 1) << shift,
+                extent_data_offset, extent_length);
+        if (callback(cookie, extent_ptr, extent_length, extent_data_offset,
+                    use_mini_stream ? -1 : ((int64_t) extent_first_sector + 1) << shift) < 0) {
+            error(0, 0, "cfbf_follow_chain_extents(): callback returned failure");
+            goto fail;
+        }
+    }
+
+end:
+    CFBF_TRACE5(chain_done, CFBF_TRACE_CHAIN_EXTENTS, first_sector,
+            use_mini_stream, num_sectors, retval);
+    CFBF_STAT_ADD(CFBF_STAT_SECTORS, num_sectors);
+    CFBF_STAT_ADD(CFBF_STAT_CALLBACKS, num_callbacks);
+    return retval;
+
+fail:
+    retval = -1;
+    goto end;
+}
+
+/* Check that a chain's extents from the index cover data_size bytes and
+ * lie within the file, or the mini-stream */
+static int
+index_extents_fit(struct cfbf *cfbf, const struct cfbf_index_extent *extents,
+        int num_extents, int64_t data_size, int use_mini_stream, int shift) {
+    uint64_t limit = use_mini_stream ? cfbf->mini_stream_size : cfbf->file_size;
+    uint64_t total_sectors = 0;
+
+    for (int i = 0; i < num_extents; ++i) {
+        uint64_t end = (uint64_t) extents[i].first_sector + extents[i].num_sectors;
+
+        if (extents[i].num_sectors == 0)
+            return 0;
+        if (!use_mini_stream)
+            end++;
+        /* The last sector need only be there as far as the data goes */
+        if (i == num_extents - 1) {
+            uint64_t last_length = data_size - ((total_sectors + extents[i].num_sectors - 1) << shift);
+            if (((end - 1) << shift) + last_length > limit)
+                return 0;
+        }
+        else if ((end << shift) > limit) {
+            return 0;
+        }
+        total_sectors += extents[i].num_sectors;
+    }
+
+    return total_sectors > 0 && ((total_sectors - 1) << shift) < (uint64_t) data_size &&
+        (total_sectors << shift) >= (uint64_t) data_size;
+}
+
+/* cfbf_follow_chain_extents() for a chain the file's index has the extents
+ * of, which saves looking up every sector in the FAT. Extents are still
+ * split at the edges of windows, and the next one is prefetched while the
+ * callback works on this one, as far as cfbf->readahead_sectors allows. */
+static int
+follow_index_extents(struct cfbf *cfbf, const struct cfbf_index_extent *extents,
+        int num_extents, SECT first_sector, int64_t data_size,
+        int use_mini_stream,
+        int (*callback)(void *cookie, const void *data, int64_t length,
+            int64_t data_offset, int64_t sector_offset), void *cookie) {
+    const int shift = use_mini_stream ? cfbf->mini_sector_shift : cfbf->sector_shift;
+    int64_t data_offset = 0;
+    int64_t num_sectors = 0, num_callbacks = 0;
+    int retval = 0;
+    int ret;
+
+    CFBF_TRACE4(chain_start, CFBF_TRACE_CHAIN_EXTENTS, first_sector,
+            use_mini_stream, data_size);
+
+    for (int i = 0; i < num_extents && data_offset < data_size; ++i) {
+        SECT sector = extents[i].first_sector;
+        SECT end_sector = sector + extents[i].num_sectors;
+
+        if (!use_mini_stream && cfbf->readahead_sectors > 0 && i + 1 < num_extents) {
+            uint32_t ahead = extents[i + 1].num_sectors;
+            if (ahead > cfbf->readahead_sectors)
+                ahead = cfbf->readahead_sectors;
+            cfbf_prefetch(cfbf, ((int64_t) extents[i + 1].first_sector + 1) << shift,
+                    (int64_t) ahead << shift);
+        }
+
+        while (sector < end_sector && data_offset < data_size) {
+            SECT piece_end = end_sector;
+            int64_t sector_offset = -1;
+            int64_t length;
+            const char *ptr;
+
+            if (use_mini_stream) {
+                ptr = (const char *) cfbf->mini_stream + ((int64_t) sector << shift);
+            }
+            else {
+                sector_offset = ((int64_t) sector + 1) << shift;
+                if (cfbf->window_size != 0) {
+                    /* Stop at the edge of the window this piece starts in */
+                    int64_t window_end = (sector_offset / (int64_t) cfbf->window_size + 1) *
+                        (int64_t) cfbf->window_size;
+                    int64_t window_end_sector = (window_end >> shift) - 1;
+                    if (window_end_sector < piece_end)
+                        piece_end = window_end_sector;
+                    ptr = cfbf_get_sector_ptr(cfbf, sector);
+                }
+                else {
+                    ptr = (const char *) cfbf->file + sector_offset;
+                }
+            }
+            if (ptr == NULL) {
+                error(0, 0, "cfbf_follow_chain_extents(): failed to fetch pointer for sector %lu", (unsigned long) sector);
+                goto fail;
+            }
+
+            length = (int64_t) (piece_end - sector) << shift;
+            if (length > data_size - data_offset)
+                length = data_size - data_offset;
+
+            CFBF_TRACE3(extent, sector_offset, data_offset, length);
+            ret = callback(cookie, ptr, length, data_offset, sector_offset);
+            num_callbacks++;
+            num_sectors += piece_end - sector;
+            if (ret < 0) {
+                error(0, 0, "cfbf_follow_chain_extents(): callback returned failure");
+                goto fail;
+            }
+            else if (ret > 0) {
+                goto end;
+            }
+
+            data_offset += length;
+            sector = piece_end;
+        }
+    }
+
+end:
+    CFBF_TRACE5(chain_done, CFBF_TRACE_CHAIN_EXTENTS, first_sector,
+            use_mini_stream, num_sectors, retval);
+    CFBF_STAT_ADD(CFBF_STAT_SECTORS, num_sectors);
+    CFBF_STAT_ADD(CFBF_STAT_CALLBACKS, num_callbacks);
+    return retval;
+
+fail:
+    retval = -1;
+    goto end;
+}
+
+int
+cfbf_follow_chain_extents(struct cfbf *cfbf, SECT first_sector,
+        int64_t data_size, int use_mini_stream,
+        int (*callback)(void *cookie, const void *data, int64_t length,
+            int64_t data_offset, int64_t sector_offset), void *cookie) {
+    int shift = use_mini_stream ? cfbf->mini_sector_shift : cfbf->sector_shift;
+
+    if (cfbf->index != NULL) {
+        const struct cfbf_index_extent *extents;
+        int num_extents;
+
+        /* Chains which don't check out are followed through the FAT, so
+         * they fail the same way they would without an index */
+        extents = cfbf_index_find_chain(cfbf, first_sector, use_mini_stream,
+                data_size, &num_extents);
+        if (extents != NULL && index_extents_fit(cfbf, extents, num_extents,
+                    data_size, use_mini_stream, shift))
+            return follow_index_extents(cfbf, extents, num_extents,
+                    first_sector, data_size, use_mini_stream, callback, cookie);
+    }
+
+    switch (shift) {
+        case 6:
+            return follow_chain_extents_shift(cfbf, first_sector, data_size,
+                    use_mini_stream, callback, cookie, 6);
+        case 9:
+            return follow_chain_extents_shift(cfbf, first_sector, data_size,
+                    use_mini_stream, callback, cookie, 9);
+        case 12:
+            return follow_chain_extents_shift(cfbf, first_sector, data_size,
+                    use_mini_stream, callback, cookie, 12);
+        default:
+            return follow_chain_extents_shift(cfbf, first_sector, data_size,
+                    use_mini_stream, callback, cookie, shift);
+    }
+}
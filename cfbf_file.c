@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -10,54 +11,232 @@
 #include <error.h>
 
 #include "cfbf.h"
+#include "cfbf_trace.h"
+
+/* Windows.
+ *
+ * Normally the whole file is mapped at cfbf->file. If that would take more
+ * memory than we've been allowed, we instead map it in windows of
+ * window_size bytes, aligned to window_size, keeping a few mapped at once
+ * and unmapping the least recently used when we need another.
+ *
+ * A pointer into a window stays valid until another window is mapped in
+ * its place. Window 0 is only used for looking up FAT entries, so that
+ * following a chain doesn't unmap the data we've just been given a pointer
+ * to, and there are always at least two other windows, so a caller can
+ * hold on to one extent while fetching the next. A window boundary always
+ * falls on a sector boundary, and cfbf_follow_chain_extents() doesn't let
+ * an extent cross one. Anything that needs to keep pointers for longer,
+ * such as the directory and the header, is copied.
+ *
+ * Windows are shared by everything using the struct cfbf, so only one
+ * thread may use it at a time.
+ */
+
+static void
+cfbf_unmap_windows(struct cfbf *cfbf) {
+    for (int i = 0; i < cfbf->num_windows; ++i) {
+        if (cfbf->windows[i].base != NULL)
+            munmap(cfbf->windows[i].base, cfbf->windows[i].length);
+    }
+    free(cfbf->windows);
+    cfbf->windows = NULL;
+    cfbf->num_windows = 0;
+}
+
+/* Return a pointer to the byte at offset in the file, mapping a window for
+ * it in one of windows first_window to last_window if need be */
+static void *
+cfbf_window_ptr(struct cfbf *cfbf, int64_t offset, int first_window,
+        int last_window) {
+    struct cfbf_window *w, *victim = NULL;
+    int64_t window_offset;
+
+    for (int i = first_window; i <= last_window; ++i) {
+        w = &cfbf->windows[i];
+        if (w->base != NULL && offset >= w->offset &&
+                offset < w->offset + (int64_t) w->length) {
+            w->last_used = ++cfbf->window_clock;
+            return w->base + (offset - w->offset);
+        }
+        if (victim == NULL || w->base == NULL ||
+                (victim->base != NULL && w->last_used < victim->last_used))
+            victim = w;
+    }
+
+    if (victim->base != NULL)
+        munmap(victim->base, victim->length);
+
+    window_offset = offset - offset % cfbf->window_size;
+    victim->offset = window_offset;
+    victim->length = cfbf->window_size;
+    if (window_offset + (int64_t) victim->length > cfbf->file_size)
+        victim->length = cfbf->file_size - window_offset;
+
+    victim->base = mmap(NULL, victim->length, PROT_READ, MAP_SHARED,
+            cfbf->fd, window_offset);
+    if (victim->base == MAP_FAILED) {
+        error(0, errno, "failed to map %zu bytes at offset %lld", victim->length, (long long) window_offset);
+        victim->base = NULL;
+        return NULL;
+    }
+    if (cfbf->advice != MADV_NORMAL)
+        madvise(victim->base, victim->length, cfbf->advice);
+
+    victim->last_used = ++cfbf->window_clock;
+    return victim->base + (offset - window_offset);
+}
+
+/* Return a pointer to the byte at offset in the file. If the file is being
+ * mapped a window at a time, see above for how long the pointer is good
+ * for. */
+void *
+cfbf_get_ptr_at_offset(struct cfbf *cfbf, int64_t offset) {
+    if (cfbf->window_size == 0)
+        return (char *) cfbf->file + offset;
+    return cfbf_window_ptr(cfbf, offset, 1, cfbf->num_windows - 1);
+}
+
+/* Like cfbf_get_ptr_at_offset(), but only for looking up FAT entries */
+void *
+cfbf_get_fat_ptr_at_offset(struct cfbf *cfbf, int64_t offset) {
+    if (cfbf->window_size == 0)
+        return (char *) cfbf->file + offset;
+    return cfbf_window_ptr(cfbf, offset, 0, 0);
+}
+
+/* Return true if the two offsets are in the same window, so that a run of
+ * bytes between them can be read through one pointer */
+int
+cfbf_same_window(struct cfbf *cfbf, int64_t offset_a, int64_t offset_b) {
+    if (cfbf->window_size == 0)
+        return 1;
+    return offset_a / (int64_t) cfbf->window_size == offset_b / (int64_t) cfbf->window_size;
+}
 
 void
 cfbf_close(struct cfbf *cfbf) {
+    uint64_t start = cfbf_stats_now();
+
+    CFBF_TRACE1(close, cfbf->file_size);
     cfbf_fat_close(&cfbf->fat);
     cfbf_fat_close(&cfbf->mini_fat);
-    free(cfbf->mini_stream);
-    munmap(cfbf->file, cfbf->file_size);
-    close(cfbf->fd);
-}
+    cfbf_index_close(cfbf);
+    cfbf_arena_free(&cfbf->arena);
+    cfbf_unmap_windows(cfbf);
+    if (cfbf->file != NULL && !cfbf->in_memory)
+        munmap(cfbf->file, cfbf->file_size);
+    if (cfbf->fd >= 0)
+        close(cfbf->fd);
 
-int
-cfbf_open(const char *filename, struct cfbf *cfbf) {
-    struct stat st;
-    struct DirEntry *root;
+    cfbf_stats_phase_end(CFBF_PHASE_CLOSE, start);
+}
 
-    memset(cfbf, 0, sizeof(*cfbf));
+/* Tell the kernel how we're about to access the file, as with madvise().
+ * This is only a hint, so failure is ignored. */
+void
+cfbf_advise(struct cfbf *cfbf, int advice) {
+    if (cfbf->in_memory)
+        return;
 
-    if (stat(filename, &st) < 0) {
-        error(0, errno, "%s", filename);
-        return -1;
+    cfbf->advice = advice;
+    if (cfbf->window_size == 0) {
+        madvise(cfbf->file, cfbf->file_size, advice);
     }
-
-    cfbf->fd = open(filename, O_RDONLY);
-    if (cfbf->fd < 0) {
-        error(0, errno, "%s", filename);
-        goto fail;
+    else {
+        for (int i = 0; i < cfbf->num_windows; ++i) {
+            if (cfbf->windows[i].base != NULL)
+                madvise(cfbf->windows[i].base, cfbf->windows[i].length, advice);
+        }
     }
+}
 
-    cfbf->file_size = st.st_size;
+/* Ask the kernel to start reading length bytes at offset, which we expect
+ * to want soon. Also only a hint. */
+void
+cfbf_prefetch(struct cfbf *cfbf, int64_t offset, int64_t length) {
+    long page_size;
+    int64_t start;
 
-    if (cfbf->file_size < sizeof(struct StructuredStorageHeader)) {
-        error(0, 0, "%s is too small (%lld bytes) to contain a StructuredStorageHeader (%d bytes)", filename, cfbf->file_size, (int) sizeof(struct StructuredStorageHeader));
-        goto fail;
+    if (cfbf->in_memory)
+        return;
+
+    if (cfbf->window_size != 0) {
+        /* The range may well not be mapped yet, so go through the page
+         * cache instead */
+        posix_fadvise(cfbf->fd, offset, length, POSIX_FADV_WILLNEED);
+        return;
     }
 
-    cfbf->file = mmap(NULL, cfbf->file_size, PROT_READ, MAP_SHARED, cfbf->fd, 0);
-    if (cfbf->file == NULL) {
-        error(0, errno, "failed to mmap %s", filename);
-        goto fail;
+    page_size = sysconf(_SC_PAGESIZE);
+    start = offset & ~((int64_t) page_size - 1);
+    madvise((char *) cfbf->file + start, offset + length - start, MADV_WILLNEED);
+}
+
+/* With windows, take a copy of the directory, so the pointers to directory
+ * entries which cfbf_dir_list_paths() and friends hand out stay valid */
+static int
+cfbf_copy_directory(struct cfbf *cfbf, const char *filename) {
+    int sector_size = cfbf_get_sector_size(cfbf);
+    int num_sectors = 0;
+    SECT sector;
+
+    for (sector = cfbf->header->_sectDirStart; CFBF_IS_SECTOR(sector);
+            sector = cfbf_fat_get_sector_entry(&cfbf->fat, sector)) {
+        if (++num_sectors > cfbf->fat.sector_entries_count || num_sectors == INT_MAX) {
+            error(0, 0, "%s: directory chain loops", filename);
+            return -1;
+        }
     }
 
-    cfbf->header = (struct StructuredStorageHeader *) cfbf->file;
+    cfbf->dir_copy = cfbf_arena_alloc(&cfbf->arena, (size_t) num_sectors * sector_size);
+    if (cfbf->dir_copy == NULL) {
+        error(0, 0, "%s: can't copy directory", filename);
+        return -1;
+    }
 
-    if (memcmp(cfbf->header->_abSig, "\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1", 8)) {
-        error(0, errno, "%s: signature bytes not as expected - this doesn't look like a CFB file", filename);
-        goto fail;
+    sector = cfbf->header->_sectDirStart;
+    for (int i = 0; i < num_sectors; ++i) {
+        if (cfbf_read_sector(cfbf, sector, cfbf->dir_copy + (size_t) i * sector_size) < 0)
+            return -1;
+        sector = cfbf_fat_get_sector_entry(&cfbf->fat, sector);
     }
+    cfbf->dir_copy_sectors = num_sectors;
+
+    return 0;
+}
+
+/* Decide whether to map the file in windows, given we may use max_memory
+ * bytes, and if so, how big and how many. Half the budget is for windows;
+ * the rest is left for the mini-stream, the directory and everything the
+ * actions allocate. */
+static void
+cfbf_plan_windows(struct cfbf *cfbf, long long max_memory) {
+    long long budget = max_memory / 2;
+    size_t window_size = CFBF_MAX_WINDOW_SIZE;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    if (max_memory <= 0 || cfbf->file_size <= budget)
+        return;
 
+    /* We need at least three windows: one for the FAT, and two for data */
+    while (window_size > page_size && (long long) window_size * 3 > budget)
+        window_size /= 2;
+    if (window_size < 4096)
+        window_size = 4096;
+
+    cfbf->window_size = window_size;
+    cfbf->num_windows = budget / window_size;
+    if (cfbf->num_windows < 3)
+        cfbf->num_windows = 3;
+    if (cfbf->num_windows > 64)
+        cfbf->num_windows = 64;
+}
+
+/* Load the FAT and mini-FAT from the file */
+static int
+cfbf_load_fats(struct cfbf *cfbf, const char *filename) {
+    uint64_t start;
     unsigned long num_start_sectors;
     unsigned long num_fat_sectors = (unsigned long) cfbf->header->_csectFat;
 
@@ -66,20 +245,104 @@ cfbf_open(const char *filename, struct cfbf *cfbf) {
     else
         num_start_sectors = num_fat_sectors;
 
+    /* Each FAT, DIFAT and mini-FAT sector is a sector of the file, so a
+     * header which claims more of them than the file has is damaged, and
+     * believing it would have us allocate room for them all */
+    unsigned long num_file_sectors = cfbf->file_size >> cfbf->sector_shift;
+
+    if (num_fat_sectors > num_file_sectors ||
+            cfbf->header->_csectDif > num_file_sectors ||
+            cfbf->header->_csectMiniFat > num_file_sectors) {
+        error(0, 0, "%s: header gives %lu FAT, %lu DIFAT and %lu mini-FAT sectors, but the file only has %lu sectors", filename, num_fat_sectors, (unsigned long) cfbf->header->_csectDif, (unsigned long) cfbf->header->_csectMiniFat, num_file_sectors);
+        return -1;
+    }
+
+    start = cfbf_stats_now();
+    CFBF_TRACE2(fat_load_start, num_fat_sectors,
+            (unsigned long) cfbf->header->_csectDif);
     if (cfbf_fat_open(&cfbf->fat, cfbf, cfbf->header->_sectFat,
                 num_start_sectors, cfbf->header->_sectDifStart,
                 (unsigned long) cfbf->header->_csectDif,
                 num_fat_sectors) < 0) {
+        CFBF_TRACE2(fat_load_done, 0, -1);
         error(0, 0, "%s: failed to load FAT", filename);
         memset(&cfbf->fat, 0, sizeof(cfbf->fat));
-        goto fail;
+        return -1;
     }
+    CFBF_TRACE2(fat_load_done, cfbf->fat.sector_entries_count, 0);
+    cfbf_stats_phase_end(CFBF_PHASE_OPEN_FAT, start);
+
+    start = cfbf_stats_now();
+    CFBF_TRACE2(minifat_load_start, cfbf->header->_sectMiniFatStart,
+            cfbf->header->_csectMiniFat);
 
     if (cfbf_mini_fat_open(&cfbf->mini_fat, &cfbf->fat, cfbf,
                 cfbf->header->_sectMiniFatStart, cfbf->header->_csectMiniFat) < 0) {
+        CFBF_TRACE2(minifat_load_done, 0, -1);
         error(0, 0, "%s: failed to load mini-FAT", filename);
         memset(&cfbf->mini_fat, 0, sizeof(cfbf->mini_fat));
-        goto fail;
+        return -1;
+    }
+    CFBF_TRACE2(minifat_load_done, cfbf->mini_fat.sector_entries_count, 0);
+    cfbf_stats_phase_end(CFBF_PHASE_OPEN_MINI_FAT, start);
+
+    return 0;
+}
+
+/* Having got the whole file at cfbf->file, or set up windows and copied the
+ * header to cfbf->header, check the header and load the FAT, mini-FAT and
+ * mini-stream. If opts asks for an index, the FATs and directory come from
+ * the file's index when it has an up-to-date one, and one is written when
+ * it hasn't. opts is NULL for a file in memory. */
+static int
+cfbf_parse(struct cfbf *cfbf, const char *filename,
+        const struct cfbf_open_options *opts) {
+    struct DirEntry *root;
+    SECT mini_stream_start;
+    uint64_t mini_stream_size;
+    uint64_t start;
+
+    if (cfbf->file_size < sizeof(struct StructuredStorageHeader)) {
+        error(0, 0, "%s is too small (%lld bytes) to contain a StructuredStorageHeader (%d bytes)", filename, cfbf->file_size, (int) sizeof(struct StructuredStorageHeader));
+        return -1;
+    }
+
+    if (cfbf->header == NULL)
+        cfbf->header = (struct StructuredStorageHeader *) cfbf->file;
+
+    if (memcmp(cfbf->header->_abSig, "\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1", 8)) {
+        error(0, errno, "%s: signature bytes not as expected - this doesn't look like a CFB file", filename);
+        return -1;
+    }
+
+    /* Version 3 files have 512-byte sectors and version 4 files 4096-byte
+     * ones. We can cope with other sizes, as long as a sector can hold a
+     * directory entry and isn't bigger than the smallest window. */
+    if (cfbf->header->_uSectorShift < 7 || cfbf->header->_uSectorShift > 12 ||
+            cfbf->header->_uMiniSectorShift < 1 ||
+            cfbf->header->_uMiniSectorShift > cfbf->header->_uSectorShift) {
+        error(0, 0, "%s: unsupported sector shift %u or mini-sector shift %u", filename, (unsigned int) cfbf->header->_uSectorShift, (unsigned int) cfbf->header->_uMiniSectorShift);
+        return -1;
+    }
+    cfbf->sector_shift = cfbf->header->_uSectorShift;
+    cfbf->sector_size = 1 << cfbf->sector_shift;
+    cfbf->mini_sector_shift = cfbf->header->_uMiniSectorShift;
+    cfbf->mini_sector_size = 1 << cfbf->mini_sector_shift;
+
+    /* _csectDir must be 0 in version 3 files */
+    if (cfbf->sector_shift >= 12)
+        cfbf->num_dir_sectors = cfbf->header->_csectDir;
+
+    if (opts != NULL && opts->use_index)
+        cfbf_index_open(cfbf, filename, opts->index_dir);
+
+    if (cfbf->index != NULL) {
+        start = cfbf_stats_now();
+        cfbf_index_load_fats(cfbf);
+        cfbf_stats_phase_end(CFBF_PHASE_OPEN_FAT, start);
+    }
+    else if (cfbf_load_fats(cfbf, filename) < 0) {
+        return -1;
     }
 
     /* Load mini-stream - the start sector and length of this is given by the
@@ -87,36 +350,213 @@ cfbf_open(const char *filename, struct cfbf *cfbf) {
     root = cfbf_get_sector_ptr(cfbf, cfbf->header->_sectDirStart);
     if (root == NULL) {
         error(0, 0, "%s: failed to look up root entry", filename);
-        goto fail;
+        return -1;
     }
 
     if (memcmp(root->name, "R\0o\0o\0t\0 \0E\0n\0t\0r\0y\0\0\0", 22)) {
         error(0, 0, "%s: first directory entry is not called RootEntry", filename);
-        goto fail;
+        return -1;
     }
 
-    cfbf->mini_stream = cfbf_alloc_chain_contents_from_fat(cfbf, root->start_sector, root->stream_size);
-    if (cfbf->mini_stream == NULL) {
+    /* With a window, root may be unmapped by loading the mini-stream, so
+     * take what we need from it first */
+    mini_stream_start = root->start_sector;
+    mini_stream_size = root->stream_size;
+    root = NULL;
+
+    /* A file with no small streams may have no mini-stream at all */
+    start = cfbf_stats_now();
+    if (mini_stream_size == 0) {
+        cfbf->mini_stream = NULL;
+    }
+    else if (mini_stream_size > (uint64_t) cfbf->file_size) {
+        error(0, 0, "%s: mini-stream is %llu bytes, bigger than the file", filename, (unsigned long long) mini_stream_size);
+        return -1;
+    }
+    else if ((cfbf->mini_stream = cfbf_alloc_chain_contents_from_fat(cfbf, mini_stream_start, mini_stream_size)) == NULL) {
         error(0, 0, "%s: failed to load mini-stream", filename);
+        return -1;
+    }
+    cfbf->mini_stream_size = mini_stream_size;
+    cfbf_stats_phase_end(CFBF_PHASE_OPEN_MINI_STREAM, start);
+
+    start = cfbf_stats_now();
+
+    if (cfbf->index != NULL) {
+        if (cfbf_index_load_directory(cfbf) < 0) {
+            error(0, 0, "%s: failed to load directory from index", filename);
+            return -1;
+        }
+        cfbf_stats_phase_end(CFBF_PHASE_OPEN_DIRECTORY, start);
+        return 0;
+    }
+
+    if (cfbf->window_size != 0 && cfbf_copy_directory(cfbf, filename) < 0)
+        return -1;
+
+    /* Most actions look things up in the directory, some several times, so
+     * find its sectors once here */
+    cfbf->dir_chain = cfbf_get_chain_ptrs(cfbf, cfbf->header->_sectDirStart,
+            &cfbf->dir_chain_length);
+    if (cfbf->dir_chain == NULL) {
+        error(0, 0, "%s: failed to read directory chain", filename);
+        return -1;
+    }
+    cfbf_stats_phase_end(CFBF_PHASE_OPEN_DIRECTORY, start);
+
+    /* Failing to write an index is reported, but the file is still open */
+    if (opts != NULL && opts->use_index)
+        cfbf_index_write(cfbf, filename, opts->index_dir);
+
+    return 0;
+}
+
+int
+cfbf_open(const char *filename, struct cfbf *cfbf) {
+    struct cfbf_open_options opts;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.readahead_sectors = CFBF_DEFAULT_READAHEAD_SECTORS;
+
+    return cfbf_open_with_options(filename, cfbf, &opts);
+}
+
+int
+cfbf_open_with_options(const char *filename, struct cfbf *cfbf,
+        const struct cfbf_open_options *opts) {
+    struct stat st;
+    int map_flags = MAP_SHARED;
+    uint64_t start = cfbf_stats_now();
+
+    CFBF_TRACE1(open_start, filename);
+
+    memset(cfbf, 0, sizeof(*cfbf));
+    cfbf_arena_init(&cfbf->arena);
+    cfbf->fd = -1;
+    cfbf->readahead_sectors = opts->readahead_sectors;
+
+    if (stat(filename, &st) < 0) {
+        error(0, errno, "%s", filename);
+        CFBF_TRACE3(open_done, filename, 0, -1);
+        return -1;
+    }
+
+    cfbf->fd = open(filename, O_RDONLY);
+    if (cfbf->fd < 0) {
+        error(0, errno, "%s", filename);
+        goto fail;
+    }
+
+    cfbf->file_size = st.st_size;
+    cfbf->file_mtime = st.st_mtim;
+
+    /* mmap() won't map an empty file, so catch that here */
+    if (cfbf->file_size < sizeof(struct StructuredStorageHeader)) {
+        error(0, 0, "%s is too small (%lld bytes) to contain a StructuredStorageHeader (%d bytes)", filename, cfbf->file_size, (int) sizeof(struct StructuredStorageHeader));
+        goto fail;
+    }
+
+    cfbf_plan_windows(cfbf, opts->max_memory);
+    if (cfbf->window_size != 0) {
+        ssize_t ret;
+
+        cfbf->windows = calloc(cfbf->num_windows, sizeof(struct cfbf_window));
+        if (cfbf->windows == NULL) {
+            error(0, errno, "%s", filename);
+            cfbf->num_windows = 0;
+            goto fail;
+        }
+
+        ret = pread(cfbf->fd, &cfbf->header_copy, sizeof(cfbf->header_copy), 0);
+        if (ret != sizeof(cfbf->header_copy)) {
+            error(0, ret < 0 ? errno : 0, "%s: failed to read header", filename);
+            goto fail;
+        }
+        cfbf->header = &cfbf->header_copy;
+
+        if (cfbf->readahead_sectors > 0)
+            cfbf->advice = MADV_RANDOM;
+
+        cfbf_stats_phase_end(CFBF_PHASE_OPEN_MAP, start);
+        if (cfbf_parse(cfbf, filename, opts) < 0)
+            goto fail;
+
+        CFBF_TRACE3(open_done, filename, cfbf->file_size, 0);
+        cfbf_stats_phase_end(CFBF_PHASE_OPEN, start);
+        return 0;
+    }
+
+    /* A small file is quicker to read in one go than to fault in a page
+     * at a time */
+    if (cfbf->file_size <= opts->populate_max_size)
+        map_flags |= MAP_POPULATE;
+
+    cfbf->file = mmap(NULL, cfbf->file_size, PROT_READ, map_flags, cfbf->fd, 0);
+    if (cfbf->file == MAP_FAILED) {
+        error(0, errno, "failed to mmap %s", filename);
+        cfbf->file = NULL;
         goto fail;
     }
-    cfbf->mini_stream_size = root->stream_size;
 
+    /* Reading the header, FAT and directory hops about the file, so
+     * unless we've been told to leave it to the kernel, don't let its
+     * readahead pull in pages around each one. cfbf_run_action() picks
+     * the advice for each action after this. */
+    if (cfbf->readahead_sectors > 0 && !(map_flags & MAP_POPULATE))
+        cfbf_advise(cfbf, MADV_RANDOM);
+
+    cfbf_stats_phase_end(CFBF_PHASE_OPEN_MAP, start);
+    if (cfbf_parse(cfbf, filename, opts) < 0)
+        goto fail;
+
+    CFBF_TRACE3(open_done, filename, cfbf->file_size, 0);
+    cfbf_stats_phase_end(CFBF_PHASE_OPEN, start);
     return 0;
 
 fail:
+    CFBF_TRACE3(open_done, filename, cfbf->file_size, -1);
     cfbf_close(cfbf);
     return -1;
 }
 
+/* Like cfbf_open(), but for a CFB file which is already in memory. The
+ * data must be followed by zeros up to CFBF_MEMORY_PADDED_SIZE(size)
+ * bytes. The caller must keep the data there, unchanged, until after
+ * cfbf_close(), and free it afterwards. name is used only in error
+ * messages. There is no file descriptor, so cfbf->fd is -1. */
+int
+cfbf_open_memory(const void *data, size_t size, const char *name,
+        struct cfbf *cfbf) {
+    uint64_t start = cfbf_stats_now();
+
+    CFBF_TRACE1(open_start, name);
+
+    memset(cfbf, 0, sizeof(*cfbf));
+    cfbf_arena_init(&cfbf->arena);
+    cfbf->fd = -1;
+    cfbf->in_memory = 1;
+    cfbf->file = (void *) data;
+    cfbf->file_size = size;
+
+    if (cfbf_parse(cfbf, name, NULL) < 0) {
+        CFBF_TRACE3(open_done, name, cfbf->file_size, -1);
+        cfbf_close(cfbf);
+        return -1;
+    }
+
+    CFBF_TRACE3(open_done, name, cfbf->file_size, 0);
+    cfbf_stats_phase_end(CFBF_PHASE_OPEN, start);
+    return 0;
+}
+
 int
 cfbf_get_sector_size(struct cfbf *cfbf) {
-    return 1 << cfbf->header->_uSectorShift;
+    return cfbf->sector_size;
 }
 
 int
 cfbf_get_mini_fat_sector_size(struct cfbf *cfbf) {
-    return 1 << cfbf->header->_uMiniSectorShift;
+    return cfbf->mini_sector_size;
 }
 
 int
@@ -127,27 +567,27 @@ cfbf_read_sector(struct cfbf *cfbf, SECT sect, void *dest) {
         return -1;
 
     memcpy(dest, src, sect_size);
+    CFBF_STAT_ADD(CFBF_STAT_BYTES_COPIED, sect_size);
 
     return 0;
 }
 
 void *
 cfbf_get_sector_ptr(struct cfbf *cfbf, SECT sect) {
-    int sect_size = cfbf_get_sector_size(cfbf);
-    unsigned long long offset = (sect + 1) * sect_size;
+    int sect_size = cfbf->sector_size;
+    uint64_t offset = ((uint64_t) sect + 1) << cfbf->sector_shift;
 
     if (offset >= cfbf->file_size) {
         error(0, 0, "can't get sector %lu - it's past the end of the file (file size %lld, sector size %d)", (unsigned long) sect, cfbf->file_size, sect_size);
         return NULL;
     }
 
-    return cfbf->file + offset;
+    return cfbf_get_ptr_at_offset(cfbf, offset);
 }
 
 void *
 cfbf_get_sector_ptr_in_mini_stream(struct cfbf *cfbf, SECT sector) {
-    int mini_sector_size = cfbf_get_mini_fat_sector_size(cfbf);
-    uint64_t offset = sector * mini_sector_size;
+    uint64_t offset = (uint64_t) sector << cfbf->mini_sector_shift;
     if (offset > cfbf->mini_stream_size) {
         return NULL;
     }
@@ -158,7 +598,7 @@ cfbf_get_sector_ptr_in_mini_stream(struct cfbf *cfbf, SECT sector) {
 int
 cfbf_is_sector_in_file(struct cfbf *cfbf, SECT sect) {
     int sect_size = cfbf_get_sector_size(cfbf);
-    if ((sect + 1) * sect_size + sect_size > cfbf->file_size)
+    if (((uint64_t) sect + 1) * sect_size + sect_size > cfbf->file_size)
         return 0;
     else
         return 1;
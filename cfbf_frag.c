@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+
+#include "cfbf.h"
+
+/* Fragmentation report.
+ *
+ * For every chain in the file - each stream, and the FAT, directory,
+ * mini-FAT and mini-stream - work out where its data lies in the file as a
+ * list of extents, and from that how much seeking a reader has to do to
+ * read it from start to finish. A stream in the mini-stream is followed
+ * through the mini-stream to the main sectors holding it, so its extents
+ * are also in terms of offsets in the file.
+ *
+ * The estimated cost of reading a chain from a cold cache is one seek per
+ * extent, plus the time to transfer its bytes at CFBF_FRAG_TRANSFER_RATE.
+ * It's crude, but it's good enough to rank files and streams by how much
+ * they'd gain from being repacked.
+ */
+
+/* Sequential read rate assumed for the cost estimate, in bytes per second */
+#define CFBF_FRAG_TRANSFER_RATE 100000000.0
+
+struct frag_chain {
+    char *name;
+    int64_t bytes;
+    long extents;
+    int64_t total_seek;
+    int64_t max_backward_seek;
+    double cost_ms;
+
+    /* Offset in the file of the byte after the last extent */
+    int64_t last_end;
+
+    /* Extent being built up, for chains we put together sector by sector */
+    int64_t cur_start;
+    int64_t cur_length;
+};
+
+struct frag_report {
+    struct frag_chain *chains;
+    int num_chains;
+    int max_chains;
+};
+
+static struct frag_chain *
+frag_new_chain(struct frag_report *report, const char *name) {
+    struct frag_chain *chain;
+
+    if (report->num_chains >= report->max_chains) {
+        int new_max = report->max_chains ? report->max_chains * 2 : 16;
+        struct frag_chain *new_chains = realloc(report->chains, new_max * sizeof(struct frag_chain));
+        if (new_chains == NULL) {
+            error(0, errno, "frag_new_chain()");
+            return NULL;
+        }
+        report->chains = new_chains;
+        report->max_chains = new_max;
+    }
+
+    chain = &report->chains[report->num_chains];
+    memset(chain, 0, sizeof(*chain));
+    chain->name = strdup(name);
+    if (chain->name == NULL) {
+        error(0, errno, "frag_new_chain()");
+        return NULL;
+    }
+    report->num_chains++;
+
+    return chain;
+}
+
+static void
+frag_add_extent(struct frag_chain *chain, int64_t offset, int64_t length) {
+    if (chain->extents > 0) {
+        int64_t seek = offset - chain->last_end;
+
+        if (seek < 0) {
+            seek = -seek;
+            if (seek > chain->max_backward_seek)
+                chain->max_backward_seek = seek;
+        }
+        chain->total_seek += seek;
+    }
+    chain->extents++;
+    chain->bytes += length;
+    chain->last_end = offset + length;
+}
+
+/* Add a piece of a chain to the current extent, or if it doesn't follow on
+ * from it, finish the current extent and start a new one. */
+static void
+frag_add_piece(struct frag_chain *chain, int64_t offset, int64_t length) {
+    if (chain->cur_length > 0 && offset == chain->cur_start + chain->cur_length) {
+        chain->cur_length += length;
+        return;
+    }
+    if (chain->cur_length > 0)
+        frag_add_extent(chain, chain->cur_start, chain->cur_length);
+    chain->cur_start = offset;
+    chain->cur_length = length;
+}
+
+static void
+frag_finish_pieces(struct frag_chain *chain) {
+    if (chain->cur_length > 0)
+        frag_add_extent(chain, chain->cur_start, chain->cur_length);
+    chain->cur_length = 0;
+}
+
+static int
+frag_chain_extent(void *cookie, const void *data, int64_t length,
+        int64_t data_offset, int64_t sector_offset) {
+    struct frag_chain *chain = (struct frag_chain *) cookie;
+
+    /* cfbf_follow_chain_extents() splits extents at window boundaries if
+     * the file is mapped in windows, so join them back up */
+    if (chain->extents > 0 && sector_offset == chain->last_end) {
+        chain->bytes += length;
+        chain->last_end += length;
+        return 0;
+    }
+    frag_add_extent(chain, sector_offset, length);
+    return 0;
+}
+
+/* Follow a chain of mini-sectors, translating each into its offset in the
+ * file by way of the main sectors holding the mini-stream. */
+struct mini_stream_offsets_state {
+    int64_t *offsets;
+    int count;
+    int sector_size;
+};
+
+/* Note where in the file each of the mini-stream's sectors is */
+static int
+frag_mini_stream_extent(void *cookie, const void *data, int64_t length,
+        int64_t data_offset, int64_t sector_offset) {
+    struct mini_stream_offsets_state *state = (struct mini_stream_offsets_state *) cookie;
+
+    for (int64_t pos = 0; pos < length; pos += state->sector_size)
+        state->offsets[state->count++] = sector_offset + pos;
+
+    return 0;
+}
+
+static int
+frag_mini_chain(struct cfbf *cfbf, struct frag_chain *chain, SECT first_sector,
+        int64_t size, const int64_t *mini_stream_offsets,
+        int num_mini_stream_sectors) {
+    int sector_size = cfbf_get_sector_size(cfbf);
+    int mini_sector_size = cfbf_get_mini_fat_sector_size(cfbf);
+    int64_t remaining = size;
+    int count = 0;
+
+    for (SECT sector = first_sector; sector != CFBF_END_OF_CHAIN && remaining > 0;
+            sector = cfbf_fat_get_sector_entry(&cfbf->mini_fat, sector)) {
+        int64_t mini_offset = (int64_t) sector * mini_sector_size;
+        int64_t index = mini_offset / sector_size;
+        int64_t length = remaining < mini_sector_size ? remaining : mini_sector_size;
+
+        if (!CFBF_IS_SECTOR(sector) || index >= num_mini_stream_sectors ||
+                ++count > cfbf->mini_fat.sector_entries_count) {
+            error(0, 0, "%s: bad mini-stream chain", chain->name);
+            return -1;
+        }
+
+        frag_add_piece(chain, mini_stream_offsets[index] + mini_offset % sector_size, length);
+        remaining -= length;
+    }
+    frag_finish_pieces(chain);
+
+    return 0;
+}
+
+static int
+compare_chains_by_cost(const void *a, const void *b) {
+    const struct frag_chain *ca = (const struct frag_chain *) a;
+    const struct frag_chain *cb = (const struct frag_chain *) b;
+
+    if (ca->cost_ms != cb->cost_ms)
+        return ca->cost_ms < cb->cost_ms ? 1 : -1;
+    if (ca->extents != cb->extents)
+        return ca->extents < cb->extents ? 1 : -1;
+    return strcmp(ca->name, cb->name);
+}
+
+int
+cfbf_frag_report(struct cfbf *cfbf, FILE *out, int top_n,
+        double seek_latency_ms) {
+    struct frag_report report;
+    struct cfbf_dir_path *paths = NULL;
+    int num_paths = 0;
+    struct mini_stream_offsets_state mini_state;
+    int num_mini_stream_sectors = 0;
+    int64_t *mini_stream_offsets = NULL;
+    int sector_size = cfbf_get_sector_size(cfbf);
+    struct StructuredStorageHeader *header = cfbf->header;
+    struct frag_chain *chain;
+    long total_extents = 0, total_chains_with_data = 0;
+    double total_cost_ms = 0, contiguous_cost_ms = 0;
+    int retval = 0;
+
+    memset(&report, 0, sizeof(report));
+
+    if (cfbf_dir_list_paths(cfbf, &paths, &num_paths) < 0)
+        return -1;
+
+    /* The FAT's sectors are listed in the header and the DIFAT rather than
+     * in a chain, so take them in the order they're listed */
+    chain = frag_new_chain(&report, "[FAT]");
+    if (chain == NULL)
+        goto fail;
+    for (unsigned long i = 0; i < cfbf->fat.num_fat_sectors; ++i)
+        frag_add_piece(chain, ((int64_t) cfbf->fat.fat_sectors[i] + 1) * sector_size, sector_size);
+    frag_finish_pieces(chain);
+
+    chain = frag_new_chain(&report, "[directory]");
+    if (chain == NULL ||
+            cfbf_follow_chain_extents(cfbf, header->_sectDirStart, -1, 0,
+                frag_chain_extent, chain) < 0)
+        goto fail;
+
+    if (header->_csectMiniFat > 0) {
+        chain = frag_new_chain(&report, "[mini-FAT]");
+        if (chain == NULL ||
+                cfbf_follow_chain_extents(cfbf, header->_sectMiniFatStart, -1, 0,
+                    frag_chain_extent, chain) < 0)
+            goto fail;
+    }
+
+    for (int i = 0; i < num_paths; ++i) {
+        struct DirEntry *e = paths[i].entry;
+        const char *name = paths[i].escaped_path;
+
+        if (e->object_type == 5) {
+            if (e->stream_size == 0)
+                continue;
+
+            /* The mini-stream itself, which we also need the sectors of
+             * to follow chains in it */
+            chain = frag_new_chain(&report, "[mini-stream]");
+            if (chain == NULL ||
+                    cfbf_follow_chain_extents(cfbf, e->start_sector, e->stream_size, 0,
+                        frag_chain_extent, chain) < 0)
+                goto fail;
+
+            free(mini_stream_offsets);
+            mini_stream_offsets = malloc((e->stream_size / sector_size + 1) * sizeof(int64_t));
+            if (mini_stream_offsets == NULL) {
+                error(0, errno, "cfbf_frag_report()");
+                goto fail;
+            }
+            mini_state.offsets = mini_stream_offsets;
+            mini_state.count = 0;
+            mini_state.sector_size = sector_size;
+            if (cfbf_follow_chain_extents(cfbf, e->start_sector, e->stream_size, 0,
+                        frag_mini_stream_extent, &mini_state) < 0)
+                goto fail;
+            num_mini_stream_sectors = mini_state.count;
+        }
+        else if (e->object_type == 2 && e->stream_size > 0) {
+            chain = frag_new_chain(&report, name);
+            if (chain == NULL)
+                goto fail;
+
+            if (!cfbf_dir_stored_in_mini_stream(cfbf, e)) {
+                if (cfbf_follow_chain_extents(cfbf, e->start_sector, e->stream_size, 0,
+                            frag_chain_extent, chain) < 0)
+                    goto fail;
+            }
+            else if (frag_mini_chain(cfbf, chain, e->start_sector, e->stream_size,
+                        mini_stream_offsets, num_mini_stream_sectors) < 0) {
+                goto fail;
+            }
+        }
+    }
+
+    for (int i = 0; i < report.num_chains; ++i) {
+        chain = &report.chains[i];
+        chain->cost_ms = chain->extents * seek_latency_ms +
+            chain->bytes * 1000.0 / CFBF_FRAG_TRANSFER_RATE;
+        total_extents += chain->extents;
+        total_cost_ms += chain->cost_ms;
+        if (chain->extents > 0) {
+            total_chains_with_data++;
+            contiguous_cost_ms += seek_latency_ms +
+                chain->bytes * 1000.0 / CFBF_FRAG_TRANSFER_RATE;
+        }
+    }
+
+    qsort(report.chains, report.num_chains, sizeof(struct frag_chain),
+            compare_chains_by_cost);
+
+    fprintf(out, "extents\tbytes\tmax_backward_seek\ttotal_seek\tcost_ms\tname\n");
+    for (int i = 0; i < report.num_chains && (top_n <= 0 || i < top_n); ++i) {
+        chain = &report.chains[i];
+        fprintf(out, "%ld\t%lld\t%lld\t%lld\t%.3f\t%s\n",
+                chain->extents, (long long) chain->bytes,
+                (long long) chain->max_backward_seek,
+                (long long) chain->total_seek, chain->cost_ms, chain->name);
+    }
+    fprintf(out, "# %ld chains, %ld extents, estimated cold read %.3f ms, %.3f ms if contiguous\n",
+            total_chains_with_data, total_extents, total_cost_ms, contiguous_cost_ms);
+
+end:
+    for (int i = 0; i < report.num_chains; ++i)
+        free(report.chains[i].name);
+    free(report.chains);
+    free(mini_stream_offsets);
+    cfbf_dir_free_paths(paths, num_paths);
+    return retval;
+
+fail:
+    retval = -1;
+    goto end;
+}
@@ -0,0 +1,416 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+
+#include "cfbf.h"
+
+/* Stream content hashing. Every stream is hashed in place, straight from the
+ * mapped sectors (or the in-memory mini-stream), with XXH64 and optionally
+ * SHA-256. Streams are independent of each other, so they are shared out
+ * between a pool of threads.
+ *
+ * Both hash functions are implemented here so that we don't depend on any
+ * library. XXH64 follows the reference xxHash specification, and SHA-256
+ * follows FIPS 180-4.
+ */
+
+/*** XXH64 ***/
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t
+rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+read64le(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t
+read32le(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t
+xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t
+xxh64_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+void
+cfbf_xxh64_init(struct cfbf_xxh64_state *state, uint64_t seed) {
+    memset(state, 0, sizeof(*state));
+    state->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = seed + XXH_PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - XXH_PRIME64_1;
+    state->seed = seed;
+}
+
+void
+cfbf_xxh64_update(struct cfbf_xxh64_state *state, const void *data, size_t length) {
+    const unsigned char *p = (const unsigned char *) data;
+    const unsigned char *end = p + length;
+
+    state->total_len += length;
+
+    if (state->buf_len + length < 32) {
+        memcpy(state->buf + state->buf_len, p, length);
+        state->buf_len += length;
+        return;
+    }
+
+    if (state->buf_len > 0) {
+        size_t fill = 32 - state->buf_len;
+        memcpy(state->buf + state->buf_len, p, fill);
+        for (int i = 0; i < 4; ++i)
+            state->v[i] = xxh64_round(state->v[i], read64le(state->buf + i * 8));
+        p += fill;
+        state->buf_len = 0;
+    }
+
+    if (end - p >= 32) {
+        uint64_t v1 = state->v[0], v2 = state->v[1], v3 = state->v[2], v4 = state->v[3];
+        const unsigned char *limit = end - 32;
+
+        do {
+            v1 = xxh64_round(v1, read64le(p));
+            v2 = xxh64_round(v2, read64le(p + 8));
+            v3 = xxh64_round(v3, read64le(p + 16));
+            v4 = xxh64_round(v4, read64le(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        state->v[0] = v1;
+        state->v[1] = v2;
+        state->v[2] = v3;
+        state->v[3] = v4;
+    }
+
+    if (p < end) {
+        memcpy(state->buf, p, end - p);
+        state->buf_len = end - p;
+    }
+}
+
+uint64_t
+cfbf_xxh64_digest(const struct cfbf_xxh64_state *state) {
+    const unsigned char *p = state->buf;
+    const unsigned char *end = p + state->buf_len;
+    uint64_t h;
+
+    if (state->total_len >= 32) {
+        h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) +
+            rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+        for (int i = 0; i < 4; ++i)
+            h = xxh64_merge_round(h, state->v[i]);
+    }
+    else {
+        h = state->seed + XXH_PRIME64_5;
+    }
+
+    h += state->total_len;
+
+    while (p + 8 <= end) {
+        h ^= xxh64_round(0, read64le(p));
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) read32le(p) * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
+        ++p;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/*** SHA-256 ***/
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t
+rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+static void
+sha256_block(uint32_t *h, const unsigned char *block) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, hh;
+
+    for (int i = 0; i < 16; ++i) {
+        w[i] = ((uint32_t) block[i * 4] << 24) | ((uint32_t) block[i * 4 + 1] << 16) |
+            ((uint32_t) block[i * 4 + 2] << 8) | (uint32_t) block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+    e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+
+    for (int i = 0; i < 64; ++i) {
+        uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = hh + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+
+        hh = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+void
+cfbf_sha256_init(struct cfbf_sha256_state *state) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memset(state, 0, sizeof(*state));
+    memcpy(state->h, initial, sizeof(initial));
+}
+
+void
+cfbf_sha256_update(struct cfbf_sha256_state *state, const void *data, size_t length) {
+    const unsigned char *p = (const unsigned char *) data;
+
+    state->total_len += length;
+
+    if (state->buf_len > 0) {
+        size_t fill = 64 - state->buf_len;
+        if (fill > length)
+            fill = length;
+        memcpy(state->buf + state->buf_len, p, fill);
+        state->buf_len += fill;
+        p += fill;
+        length -= fill;
+        if (state->buf_len < 64)
+            return;
+        sha256_block(state->h, state->buf);
+        state->buf_len = 0;
+    }
+
+    while (length >= 64) {
+        sha256_block(state->h, p);
+        p += 64;
+        length -= 64;
+    }
+
+    memcpy(state->buf, p, length);
+    state->buf_len = length;
+}
+
+void
+cfbf_sha256_final(struct cfbf_sha256_state *state, unsigned char *digest) {
+    uint64_t bit_len = state->total_len * 8;
+    unsigned char pad[72];
+    size_t pad_len;
+
+    /* 0x80, then zeroes up to 56 mod 64, then the length in bits */
+    pad_len = (state->buf_len < 56 ? 56 : 120) - state->buf_len;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (int i = 0; i < 8; ++i)
+        pad[pad_len + i] = (unsigned char) (bit_len >> (56 - i * 8));
+    cfbf_sha256_update(state, pad, pad_len + 8);
+
+    for (int i = 0; i < 8; ++i) {
+        digest[i * 4] = (unsigned char) (state->h[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char) (state->h[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char) (state->h[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char) state->h[i];
+    }
+}
+
+/*** Hashing every stream in a CFB file ***/
+
+struct stream_hash {
+    int path_index;
+    uint64_t xxh64;
+    unsigned char sha256[32];
+    int failed;
+};
+
+struct hash_streams_state {
+    struct cfbf *cfbf;
+    struct cfbf_dir_path *paths;
+    struct stream_hash *hashes;
+    int use_sha256;
+};
+
+struct hash_one_stream_state {
+    struct cfbf_xxh64_state xxh64;
+    struct cfbf_sha256_state sha256;
+    int use_sha256;
+};
+
+static int
+hash_extent(void *cookie, const void *data, int64_t length,
+        int64_t data_offset, int64_t sector_offset) {
+    struct hash_one_stream_state *state = (struct hash_one_stream_state *) cookie;
+
+    cfbf_xxh64_update(&state->xxh64, data, length);
+    if (state->use_sha256)
+        cfbf_sha256_update(&state->sha256, data, length);
+
+    return 0;
+}
+
+static int
+hash_stream(void *cookie, int job_index) {
+    struct hash_streams_state *state = (struct hash_streams_state *) cookie;
+    struct stream_hash *hash = &state->hashes[job_index];
+    struct DirEntry *entry = state->paths[hash->path_index].entry;
+    struct hash_one_stream_state stream_state;
+
+    cfbf_xxh64_init(&stream_state.xxh64, 0);
+    cfbf_sha256_init(&stream_state.sha256);
+    stream_state.use_sha256 = state->use_sha256;
+
+    if (entry->stream_size > 0) {
+        if (cfbf_follow_chain_extents(state->cfbf, entry->start_sector,
+                    entry->stream_size,
+                    cfbf_dir_stored_in_mini_stream(state->cfbf, entry),
+                    hash_extent, &stream_state) < 0) {
+            error(0, 0, "failed to read %s", state->paths[hash->path_index].path);
+            hash->failed = 1;
+            return -1;
+        }
+    }
+
+    hash->xxh64 = cfbf_xxh64_digest(&stream_state.xxh64);
+    if (state->use_sha256)
+        cfbf_sha256_final(&stream_state.sha256, hash->sha256);
+
+    return 0;
+}
+
+/* Write a CSV field, quoting it if it contains anything that would
+ * confuse a CSV reader */
+static void
+print_csv_field(FILE *out, const char *s) {
+    if (strpbrk(s, ",\"\r\n") == NULL) {
+        fputs(s, out);
+        return;
+    }
+    fputc('"', out);
+    for (; *s; ++s) {
+        if (*s == '"')
+            fputc('"', out);
+        fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+/* Hash every stream in the file and write one CSV record per stream to out:
+ * escaped path, size, XXH64 in hex and, if use_sha256 is set, SHA-256 in
+ * hex. Records are in directory tree order. */
+int
+cfbf_hash_streams(struct cfbf *cfbf, FILE *out, int num_threads,
+        int64_t read_window, int use_sha256) {
+    struct hash_streams_state state;
+    struct DirEntry **entries;
+    int num_paths, num_streams = 0;
+    int retval = 0;
+
+    memset(&state, 0, sizeof(state));
+    state.cfbf = cfbf;
+    state.use_sha256 = use_sha256;
+
+    if (cfbf_dir_list_paths(cfbf, &state.paths, &num_paths) < 0)
+        return -1;
+
+    state.hashes = calloc(num_paths, sizeof(struct stream_hash));
+    entries = calloc(num_paths, sizeof(struct DirEntry *));
+    if (state.hashes == NULL || entries == NULL) {
+        error(0, errno, "cfbf_hash_streams()");
+        free(state.hashes);
+        free(entries);
+        cfbf_dir_free_paths(state.paths, num_paths);
+        return -1;
+    }
+
+    for (int i = 0; i < num_paths; ++i) {
+        if (state.paths[i].entry->object_type == 2) {
+            entries[num_streams] = state.paths[i].entry;
+            state.hashes[num_streams++].path_index = i;
+        }
+    }
+
+    if (cfbf_run_scheduled(cfbf, entries, num_streams, read_window,
+                num_threads, hash_stream, &state) < 0)
+        retval = -1;
+
+    fprintf(out, "path,size,xxh64%s\n", use_sha256 ? ",sha256" : "");
+    for (int i = 0; i < num_streams; ++i) {
+        struct stream_hash *hash = &state.hashes[i];
+        struct cfbf_dir_path *p = &state.paths[hash->path_index];
+
+        if (hash->failed)
+            continue;
+
+        print_csv_field(out, p->escaped_path);
+        fprintf(out, ",%llu,%016llx", (unsigned long long) p->entry->stream_size,
+                (unsigned long long) hash->xxh64);
+        if (use_sha256) {
+            fputc(',', out);
+            for (int j = 0; j < 32; ++j)
+                fprintf(out, "%02x", hash->sha256[j]);
+        }
+        fputc('\n', out);
+    }
+
+    free(state.hashes);
+    free(entries);
+    cfbf_dir_free_paths(state.paths, num_paths);
+
+    return retval;
+}
@@ -0,0 +1,607 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <error.h>
+
+#include "cfbf.h"
+
+/* Sidecar indexes.
+ *
+ * Opening a very big file means reading its whole FAT, which is scattered
+ * through the file in sectors listed by the DIFAT, then the mini-FAT and
+ * the directory, and following a stream's chain means looking up every
+ * sector of it in the FAT. An index saves all of that for next time, in a
+ * file which is mapped as it is, so opening a file with an up-to-date index
+ * reads none of its FAT or directory sectors.
+ *
+ * The index for foo.pub is foo.pub.cfbfidx, or if an index directory is
+ * given, a file there named after a hash of foo.pub's full path. It holds,
+ * each 8-byte aligned and in the machine's own byte order:
+ *
+ *     struct index_header
+ *     the FAT                       fat_entries SECTs
+ *     the FAT's own sectors         num_fat_sectors SECTs
+ *     the mini-FAT                  mini_fat_entries SECTs
+ *     the directory                 dir_sectors sectors
+ *     every stream's chain          num_chains struct index_chain, sorted
+ *     the chains' extents           num_extents struct cfbf_index_extent
+ *
+ * An index is only used if the file's size, modification time and a hash
+ * of its header are what they were when the index was written, and a hash
+ * of the rest of the index is right. Otherwise it's ignored, the file is
+ * opened as usual, and a new index is written in its place.
+ */
+
+#define INDEX_MAGIC "CFBFIDX\0"
+#define INDEX_VERSION 1
+#define INDEX_BYTE_ORDER 0x01020304
+
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+
+    /* The file this is an index of, when it was written */
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t header_hash;
+
+    /* XXH64 of everything after this header */
+    uint64_t body_hash;
+
+    uint32_t sector_shift;
+    uint32_t mini_sector_shift;
+
+    uint64_t fat_entries;
+    uint64_t num_fat_sectors;
+    uint64_t mini_fat_entries;
+    uint64_t dir_sectors;
+    uint64_t num_chains;
+    uint64_t num_extents;
+
+    /* Where each of the above starts, from the start of the index */
+    uint64_t fat_offset;
+    uint64_t fat_sectors_offset;
+    uint64_t mini_fat_offset;
+    uint64_t dir_offset;
+    uint64_t chains_offset;
+    uint64_t extents_offset;
+};
+
+/* A stream's chain, and the runs of sectors it's made of. Sorted by
+ * use_mini_stream, first_sector and data_size. */
+struct index_chain {
+    SECT first_sector;
+    uint32_t use_mini_stream;
+    uint64_t data_size;
+    uint64_t first_extent;
+    uint64_t num_extents;
+};
+
+struct cfbf_index {
+    void *map;
+    size_t map_size;
+    const struct index_header *header;
+    const struct index_chain *chains;
+    const struct cfbf_index_extent *extents;
+};
+
+#define INDEX_ALIGN 8
+
+static uint64_t
+index_align(uint64_t offset) {
+    return (offset + INDEX_ALIGN - 1) & ~(uint64_t) (INDEX_ALIGN - 1);
+}
+
+/* Work out where the index for filename lives */
+static int
+index_path(const char *filename, const char *index_dir, char *dest,
+        size_t dest_max) {
+    int ret;
+
+    if (index_dir == NULL) {
+        ret = snprintf(dest, dest_max, "%s.cfbfidx", filename);
+    }
+    else {
+        char full_path[PATH_MAX];
+        struct cfbf_xxh64_state state;
+
+        if (realpath(filename, full_path) == NULL)
+            snprintf(full_path, sizeof(full_path), "%s", filename);
+        cfbf_xxh64_init(&state, 0);
+        cfbf_xxh64_update(&state, full_path, strlen(full_path));
+        ret = snprintf(dest, dest_max, "%s/%016llx.cfbfidx", index_dir,
+                (unsigned long long) cfbf_xxh64_digest(&state));
+    }
+
+    if (ret < 0 || ret >= dest_max) {
+        error(0, 0, "%s: index filename is too long", filename);
+        return -1;
+    }
+    return 0;
+}
+
+static uint64_t
+header_hash(struct cfbf *cfbf) {
+    struct cfbf_xxh64_state state;
+    cfbf_xxh64_init(&state, 0);
+    cfbf_xxh64_update(&state, cfbf->header, sizeof(struct StructuredStorageHeader));
+    return cfbf_xxh64_digest(&state);
+}
+
+/* Check that a table of count items of item_size bytes at offset lies
+ * within the index */
+static int
+index_table_fits(const struct cfbf_index *index, uint64_t offset,
+        uint64_t count, uint64_t item_size) {
+    if (offset % INDEX_ALIGN != 0 || offset > index->map_size)
+        return 0;
+    if (item_size != 0 && count > (index->map_size - offset) / item_size)
+        return 0;
+    return 1;
+}
+
+/* Is this index right for cfbf, and in one piece? */
+static int
+index_is_valid(struct cfbf *cfbf, const struct cfbf_index *index) {
+    const struct index_header *h = index->header;
+    struct cfbf_xxh64_state state;
+
+    if (index->map_size < sizeof(*h) || memcmp(h->magic, INDEX_MAGIC, 8) ||
+            h->version != INDEX_VERSION || h->byte_order != INDEX_BYTE_ORDER)
+        return 0;
+
+    /* Has the file changed since? */
+    if (h->file_size != cfbf->file_size ||
+            h->mtime_sec != cfbf->file_mtime.tv_sec ||
+            h->mtime_nsec != cfbf->file_mtime.tv_nsec ||
+            h->header_hash != header_hash(cfbf))
+        return 0;
+
+    if (h->sector_shift != cfbf->sector_shift ||
+            h->mini_sector_shift != cfbf->mini_sector_shift ||
+            h->num_fat_sectors != cfbf->header->_csectFat ||
+            h->fat_entries > h->num_fat_sectors * (cfbf->sector_size / sizeof(SECT)))
+        return 0;
+
+    if (!index_table_fits(index, h->fat_offset, h->fat_entries, sizeof(SECT)) ||
+            !index_table_fits(index, h->fat_sectors_offset, h->num_fat_sectors, sizeof(SECT)) ||
+            !index_table_fits(index, h->mini_fat_offset, h->mini_fat_entries, sizeof(SECT)) ||
+            !index_table_fits(index, h->dir_offset, h->dir_sectors, cfbf->sector_size) ||
+            !index_table_fits(index, h->chains_offset, h->num_chains, sizeof(struct index_chain)) ||
+            !index_table_fits(index, h->extents_offset, h->num_extents, sizeof(struct cfbf_index_extent)))
+        return 0;
+    if (h->dir_sectors == 0 || h->dir_sectors > INT_MAX)
+        return 0;
+
+    for (uint64_t i = 0; i < h->num_chains; ++i) {
+        const struct index_chain *chain = &index->chains[i];
+        if (chain->first_extent > h->num_extents ||
+                chain->num_extents > h->num_extents - chain->first_extent)
+            return 0;
+    }
+
+    cfbf_xxh64_init(&state, 0);
+    cfbf_xxh64_update(&state, (const char *) index->map + sizeof(*h),
+            index->map_size - sizeof(*h));
+    return cfbf_xxh64_digest(&state) == h->body_hash;
+}
+
+/* Map the index for filename, if there is one and it's up to date, and
+ * attach it to cfbf so cfbf_parse() loads the FATs and directory from it.
+ * cfbf_parse() must have checked the header already. Returns 0 if
+ * the index will be used, or -1 if not. No index, or one which is out of
+ * date, isn't an error, and isn't reported. */
+int
+cfbf_index_open(struct cfbf *cfbf, const char *filename, const char *index_dir) {
+    char path[PATH_MAX];
+    struct cfbf_index *index;
+    struct stat st;
+    int fd;
+
+    if (index_path(filename, index_dir, path, sizeof(path)) < 0)
+        return -1;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct index_header)) {
+        close(fd);
+        return -1;
+    }
+
+    index = cfbf_arena_calloc(&cfbf->arena, 1, sizeof(*index));
+    if (index == NULL) {
+        close(fd);
+        return -1;
+    }
+    index->map_size = st.st_size;
+    index->map = mmap(NULL, index->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (index->map == MAP_FAILED) {
+        error(0, errno, "%s", path);
+        return -1;
+    }
+
+    index->header = index->map;
+    index->chains = (const void *) ((const char *) index->map + index->header->chains_offset);
+    index->extents = (const void *) ((const char *) index->map + index->header->extents_offset);
+
+    if (!index_is_valid(cfbf, index)) {
+        munmap(index->map, index->map_size);
+        return -1;
+    }
+
+    cfbf->index = index;
+    return 0;
+}
+
+/* Point cfbf's FAT and mini-FAT at the copies in its index */
+void
+cfbf_index_load_fats(struct cfbf *cfbf) {
+    const struct cfbf_index *index = cfbf->index;
+    const struct index_header *h = index->header;
+    const char *base = index->map;
+
+    memset(&cfbf->fat, 0, sizeof(cfbf->fat));
+    cfbf->fat.sector_entries = (SECT *) (base + h->fat_offset);
+    cfbf->fat.sector_entries_count = h->fat_entries;
+    cfbf->fat.sector_size = cfbf->sector_size;
+    cfbf->fat.fat_sectors = (SECT *) (base + h->fat_sectors_offset);
+    cfbf->fat.num_fat_sectors = h->num_fat_sectors;
+    cfbf->fat.cfbf = cfbf;
+
+    memset(&cfbf->mini_fat, 0, sizeof(cfbf->mini_fat));
+    cfbf->mini_fat.sector_size = cfbf->mini_sector_size;
+    if (h->mini_fat_entries > 0) {
+        cfbf->mini_fat.sector_entries = (SECT *) (base + h->mini_fat_offset);
+        cfbf->mini_fat.sector_entries_count = h->mini_fat_entries;
+    }
+}
+
+/* Point cfbf's directory chain at the copy of the directory in its index */
+int
+cfbf_index_load_directory(struct cfbf *cfbf) {
+    const struct index_header *h = cfbf->index->header;
+    char *dir = (char *) cfbf->index->map + h->dir_offset;
+
+    cfbf->dir_chain = cfbf_arena_alloc(&cfbf->arena, h->dir_sectors * sizeof(void *));
+    if (cfbf->dir_chain == NULL)
+        return -1;
+    for (uint64_t i = 0; i < h->dir_sectors; ++i)
+        cfbf->dir_chain[i] = dir + (i << cfbf->sector_shift);
+    cfbf->dir_chain_length = h->dir_sectors;
+
+    /* With windows, this is where the directory is looked for too */
+    if (cfbf->window_size != 0) {
+        cfbf->dir_copy = dir;
+        cfbf->dir_copy_sectors = h->dir_sectors;
+    }
+
+    return 0;
+}
+
+static int
+compare_chain_key(SECT first_sector_a, int use_mini_stream_a, uint64_t data_size_a,
+        const struct index_chain *b) {
+    if (use_mini_stream_a != b->use_mini_stream)
+        return use_mini_stream_a < b->use_mini_stream ? -1 : 1;
+    if (first_sector_a != b->first_sector)
+        return first_sector_a < b->first_sector ? -1 : 1;
+    if (data_size_a != b->data_size)
+        return data_size_a < b->data_size ? -1 : 1;
+    return 0;
+}
+
+/* Find the extents of the chain with this first sector and size in the
+ * index, if cfbf has one and the chain is in it. Returns NULL if not. */
+const struct cfbf_index_extent *
+cfbf_index_find_chain(struct cfbf *cfbf, SECT first_sector,
+        int use_mini_stream, int64_t data_size, int *num_extents_r) {
+    const struct cfbf_index *index = cfbf->index;
+    uint64_t low = 0, high;
+
+    if (index == NULL || data_size <= 0)
+        return NULL;
+
+    high = index->header->num_chains;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        const struct index_chain *chain = &index->chains[mid];
+        int cmp = compare_chain_key(first_sector, use_mini_stream != 0,
+                data_size, chain);
+
+        if (cmp == 0) {
+            if (chain->num_extents > INT_MAX)
+                return NULL;
+            *num_extents_r = chain->num_extents;
+            return &index->extents[chain->first_extent];
+        }
+        else if (cmp < 0) {
+            high = mid;
+        }
+        else {
+            low = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+void
+cfbf_index_close(struct cfbf *cfbf) {
+    if (cfbf->index != NULL) {
+        munmap(cfbf->index->map, cfbf->index->map_size);
+        cfbf->index = NULL;
+    }
+}
+
+
+/* Writing an index */
+
+struct index_builder {
+    struct cfbf *cfbf;
+
+    struct index_chain *chains;
+    int num_chains, max_chains;
+
+    struct cfbf_index_extent *extents;
+    uint64_t num_extents, max_extents;
+
+    /* The chain being followed */
+    struct index_chain *chain;
+    int shift;
+};
+
+struct index_writer {
+    FILE *f;
+    uint64_t offset;
+    struct cfbf_xxh64_state hash;
+    int failed;
+};
+
+static void
+index_put(struct index_writer *w, const void *data, size_t length) {
+    if (w->failed || length == 0)
+        return;
+    if (fwrite(data, 1, length, w->f) != length) {
+        w->failed = 1;
+        return;
+    }
+    cfbf_xxh64_update(&w->hash, data, length);
+    w->offset += length;
+}
+
+static void
+index_put_padding(struct index_writer *w) {
+    static const char zeroes[INDEX_ALIGN];
+
+    index_put(w, zeroes, index_align(w->offset) - w->offset);
+}
+
+static int
+add_index_extent(void *cookie, const void *data, int64_t length,
+        int64_t data_offset, int64_t sector_offset) {
+    struct index_builder *b = (struct index_builder *) cookie;
+    struct cfbf_index_extent extent;
+
+    if (b->chain->use_mini_stream)
+        extent.first_sector = ((const char *) data - (const char *) b->cfbf->mini_stream) >> b->shift;
+    else
+        extent.first_sector = (sector_offset >> b->shift) - 1;
+    extent.num_sectors = (length + ((int64_t) 1 << b->shift) - 1) >> b->shift;
+
+    /* Windows split extents at their edges, but the index doesn't need to */
+    if (b->chain->num_extents > 0) {
+        struct cfbf_index_extent *last = &b->extents[b->num_extents - 1];
+        if (last->first_sector + last->num_sectors == extent.first_sector) {
+            last->num_sectors += extent.num_sectors;
+            return 0;
+        }
+    }
+
+    if (b->num_extents >= b->max_extents) {
+        uint64_t new_max = b->max_extents ? b->max_extents * 2 : 1024;
+        struct cfbf_index_extent *new_extents = realloc(b->extents, new_max * sizeof(*new_extents));
+        if (new_extents == NULL) {
+            error(0, errno, "add_index_extent()");
+            return -1;
+        }
+        b->extents = new_extents;
+        b->max_extents = new_max;
+    }
+    b->extents[b->num_extents++] = extent;
+    b->chain->num_extents++;
+
+    return 0;
+}
+
+static int
+add_index_chain(void *cookie, struct cfbf *cfbf, struct DirEntry *e,
+        struct DirEntry *parent, unsigned long entry_id, int depth) {
+    struct index_builder *b = (struct index_builder *) cookie;
+
+    if (e->object_type != 2 || e->stream_size == 0)
+        return 1;
+
+    if (b->num_chains >= b->max_chains) {
+        int new_max = b->max_chains ? b->max_chains * 2 : 256;
+        struct index_chain *new_chains = realloc(b->chains, new_max * sizeof(*new_chains));
+        if (new_chains == NULL) {
+            error(0, errno, "add_index_chain()");
+            return -1;
+        }
+        b->chains = new_chains;
+        b->max_chains = new_max;
+    }
+
+    b->chain = &b->chains[b->num_chains];
+    memset(b->chain, 0, sizeof(*b->chain));
+    b->chain->first_sector = e->start_sector;
+    b->chain->use_mini_stream = cfbf_dir_stored_in_mini_stream(cfbf, e);
+    b->chain->data_size = e->stream_size;
+    b->chain->first_extent = b->num_extents;
+    b->shift = b->chain->use_mini_stream ? cfbf->mini_sector_shift : cfbf->sector_shift;
+
+    /* A stream we can't follow is left out, and will be followed the slow
+     * way, and fail the same way, when it's read */
+    if (cfbf_follow_chain_extents(cfbf, e->start_sector, e->stream_size,
+                b->chain->use_mini_stream, add_index_extent, b) < 0) {
+        b->num_extents = b->chain->first_extent;
+        return 1;
+    }
+    b->num_chains++;
+
+    return 1;
+}
+
+static int
+compare_index_chains(const void *a, const void *b) {
+    const struct index_chain *chain = (const struct index_chain *) a;
+    return compare_chain_key(chain->first_sector, chain->use_mini_stream,
+            chain->data_size, (const struct index_chain *) b);
+}
+
+/* Write an index for cfbf, which has just been opened without one. The
+ * index is written to a temporary file and renamed into place, so a reader
+ * never sees half of one. Returns 0 on success or -1 on failure, which
+ * costs nothing but having to do without the index next time. */
+int
+cfbf_index_write(struct cfbf *cfbf, const char *filename, const char *index_dir) {
+    char path[PATH_MAX], temp_path[PATH_MAX + 16];
+    struct index_builder builder;
+    struct index_writer w;
+    struct index_header h;
+    int saved_readahead = cfbf->readahead_sectors;
+    int num_chains = 0;
+    int retval = 0;
+    int fd = -1;
+
+    memset(&builder, 0, sizeof(builder));
+    memset(&w, 0, sizeof(w));
+
+    if (index_path(filename, index_dir, path, sizeof(path)) < 0)
+        return -1;
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp.XXXXXX", path);
+
+    /* Find every stream's extents. We only want the sector numbers, so
+     * don't have the kernel read the data. */
+    builder.cfbf = cfbf;
+    cfbf->readahead_sectors = 0;
+    if (cfbf_walk_dir_tree(cfbf, add_index_chain, &builder) < 0)
+        retval = -1;
+    cfbf->readahead_sectors = saved_readahead;
+    if (retval < 0)
+        goto end;
+
+    /* Sort them for cfbf_index_find_chain(), dropping any chain two
+     * entries share */
+    qsort(builder.chains, builder.num_chains, sizeof(struct index_chain),
+            compare_index_chains);
+    for (int i = 0; i < builder.num_chains; ++i) {
+        if (num_chains == 0 || compare_index_chains(&builder.chains[i],
+                    &builder.chains[num_chains - 1]) != 0)
+            builder.chains[num_chains++] = builder.chains[i];
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.version = INDEX_VERSION;
+    h.byte_order = INDEX_BYTE_ORDER;
+    h.file_size = cfbf->file_size;
+    h.mtime_sec = cfbf->file_mtime.tv_sec;
+    h.mtime_nsec = cfbf->file_mtime.tv_nsec;
+    h.header_hash = header_hash(cfbf);
+    h.sector_shift = cfbf->sector_shift;
+    h.mini_sector_shift = cfbf->mini_sector_shift;
+    h.fat_entries = cfbf->fat.sector_entries_count;
+    h.num_fat_sectors = cfbf->fat.num_fat_sectors;
+    h.mini_fat_entries = cfbf->mini_fat.sector_entries_count;
+    h.dir_sectors = cfbf->dir_chain_length;
+    h.num_chains = num_chains;
+    h.num_extents = builder.num_extents;
+
+    h.fat_offset = index_align(sizeof(h));
+    h.fat_sectors_offset = index_align(h.fat_offset + h.fat_entries * sizeof(SECT));
+    h.mini_fat_offset = index_align(h.fat_sectors_offset + h.num_fat_sectors * sizeof(SECT));
+    h.dir_offset = index_align(h.mini_fat_offset + h.mini_fat_entries * sizeof(SECT));
+    h.chains_offset = index_align(h.dir_offset + (h.dir_sectors << cfbf->sector_shift));
+    h.extents_offset = index_align(h.chains_offset + h.num_chains * sizeof(struct index_chain));
+
+    /* Several threads of the server may be indexing the same file */
+    fd = mkostemp(temp_path, O_CLOEXEC);
+    if (fd < 0) {
+        error(0, errno, "%s: can't write index", path);
+        retval = -1;
+        goto end;
+    }
+    fchmod(fd, 0644);
+    if ((w.f = fdopen(fd, "w")) == NULL)
+        goto write_fail;
+    fd = -1;
+
+    /* The header goes in last, once we know the hash of the rest */
+    cfbf_xxh64_init(&w.hash, 0);
+    if (fseek(w.f, h.fat_offset, SEEK_SET) < 0)
+        goto write_fail;
+    w.offset = h.fat_offset;
+
+    if (cfbf->fat.sector_entries != NULL) {
+        index_put(&w, cfbf->fat.sector_entries, h.fat_entries * sizeof(SECT));
+    }
+    else {
+        /* With windows, the FAT is looked up in the file as needed */
+        for (uint64_t i = 0; i < h.fat_entries; ++i) {
+            SECT entry = cfbf_fat_get_sector_entry(&cfbf->fat, i);
+            index_put(&w, &entry, sizeof(entry));
+        }
+    }
+    index_put_padding(&w);
+    index_put(&w, cfbf->fat.fat_sectors, h.num_fat_sectors * sizeof(SECT));
+    index_put_padding(&w);
+    index_put(&w, cfbf->mini_fat.sector_entries, h.mini_fat_entries * sizeof(SECT));
+    index_put_padding(&w);
+    for (int i = 0; i < cfbf->dir_chain_length; ++i)
+        index_put(&w, cfbf->dir_chain[i], cfbf->sector_size);
+    index_put_padding(&w);
+    index_put(&w, builder.chains, h.num_chains * sizeof(struct index_chain));
+    index_put_padding(&w);
+    index_put(&w, builder.extents, h.num_extents * sizeof(struct cfbf_index_extent));
+
+    h.body_hash = cfbf_xxh64_digest(&w.hash);
+    if (w.failed || fseek(w.f, 0, SEEK_SET) < 0 ||
+            fwrite(&h, sizeof(h), 1, w.f) != 1)
+        goto write_fail;
+
+    if (fclose(w.f) == EOF) {
+        w.f = NULL;
+        goto write_fail;
+    }
+    w.f = NULL;
+
+    if (rename(temp_path, path) < 0)
+        goto write_fail;
+
+end:
+    if (w.f != NULL)
+        fclose(w.f);
+    if (fd >= 0)
+        close(fd);
+    free(builder.chains);
+    free(builder.extents);
+    return retval;
+
+write_fail:
+    error(0, errno, "%s: can't write index", path);
+    unlink(temp_path);
+    retval = -1;
+    goto end;
+}
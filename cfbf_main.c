@@ -1,227 +1,783 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/mman.h>
+#include <sys/stat.h>
 #include <getopt.h>
+#include <ftw.h>
 #include <errno.h>
 #include <error.h>
-#include <iconv.h>
+#include <limits.h>
 
 #include "cfbf.h"
 
-struct write_pub_text_state {
-    iconv_t iconv_desc;
+void
+print_help(FILE *out) {
+    fprintf(out, "Compound File Binary File format analyser\n");
+    fprintf(out, "Graeme Cole, 2019\n");
+    fprintf(out, "Usage: cfbfinfo [action [-o <file>]]... [options] file.pub\n");
+    fprintf(out, "       cfbfinfo --batch [action [-o <file>]]... [options] file|dir...\n");
+    fprintf(out, "       cfbfinfo --diff [-o <file>] [-v] old.pub new.pub\n");
+    fprintf(out, "       cfbfinfo --serve [--socket <path>] [options]\n");
+    fprintf(out, "       cfbfinfo --triage [-o <file>] [-j <n>] [-v] file|dir...\n");
+    fprintf(out, "Actions:\n");
+    fprintf(out, "    -h         Show this help\n");
+    fprintf(out, "    -H         Print information from the header\n");
+    fprintf(out, "    -l         List directory tree\n");
+    fprintf(out, "    -r <path>  Dump the object with this path to the output file\n");
+    fprintf(out, "               (e.g. -r \"Root Entry/Quill/QuillSub/CONTENTS\")\n");
+    fprintf(out, "    -t         Extract TEXT section from CONTENTS object, write to output file\n");
+    fprintf(out, "    -w         Walk FAT structure, highlight any problems\n");
+    fprintf(out, "    -x <dir>   Extract every stream into <dir>, recreating storages as\n");
+    fprintf(out, "               directories. Names are escaped as %%XX where necessary.\n");
+    fprintf(out, "    --segments List the segments in the CONTENTS object, one per line\n");
+    fprintf(out, "    --tar      Write every stream to the output file as a tar archive\n");
+    fprintf(out, "    --hash     Hash every stream, writing path,size,xxh64 records\n");
+    fprintf(out, "    --repack <file>\n");
+    fprintf(out, "               Write a defragmented copy of the file to <file>, with every\n");
+    fprintf(out, "               chain contiguous and free sectors dropped, then check it\n");
+    fprintf(out, "    --frag     Report how fragmented each stream and the FAT, directory,\n");
+    fprintf(out, "               mini-FAT and mini-stream are, most costly to read first\n");
+    fprintf(out, "    --diff     Compare two files, listing streams and storages which have\n");
+    fprintf(out, "               been added, removed or modified. With -v, also show the\n");
+    fprintf(out, "               sizes and first differing byte of modified streams. Exit\n");
+    fprintf(out, "               status is 0 if there are no differences, 1 if there are.\n");
+    fprintf(out, "    --batch    Carry out the actions on every file given, and every file in\n");
+    fprintf(out, "               any directory given. Small files are read with io_uring into\n");
+    fprintf(out, "               memory, many at once, rather than being mapped one by one.\n");
+    fprintf(out, "    --serve    Read requests, one JSON object per line, from stdin and write\n");
+    fprintf(out, "               the responses to stdout, keeping files open between them.\n");
+    fprintf(out, "               See cfbf_server.c for the format.\n");
+    fprintf(out, "    --watch <dir>\n");
+    fprintf(out, "               Carry out the actions on each file written to or moved into\n");
+    fprintf(out, "               <dir>, as it arrives, until interrupted\n");
+    fprintf(out, "    --triage   Read only the header of each file given, and of every file\n");
+    fprintf(out, "               in any directory given, and write one line for each: path,\n");
+    fprintf(out, "               class (cfb, damaged, not-cfb or error), version, sector\n");
+    fprintf(out, "               size, file size and any problems with the header\n");
+    fprintf(out, "Options:\n");
+    fprintf(out, "    -c <path>  [with -t, --segments] Path to use for CONTENTS object\n");
+    fprintf(out, "               (default is \"Root Entry/Quill/QuillSub/CONTENTS\")\n");
+    fprintf(out, "    -o <file>  Output file name for the preceding action, or for all actions\n");
+    fprintf(out, "               if it comes before any action (default is stderr for -w,\n");
+    fprintf(out, "               stdout otherwise)\n");
+    fprintf(out, "    -j <n>     [with -x, --hash, --serve, --watch, --triage] Number of threads to use\n");
+    fprintf(out, "               (default is one per CPU)\n");
+    fprintf(out, "    --queue-depth <n>\n");
+    fprintf(out, "               [with --batch] Number of files to read at once (default %d)\n", CFBF_DEFAULT_BATCH_QUEUE_DEPTH);
+    fprintf(out, "    --buffer-pool <MB>\n");
+    fprintf(out, "               [with --batch] Memory to read files into (default %d). Files\n", CFBF_DEFAULT_BATCH_BUFFER_POOL_SIZE / (1024 * 1024));
+    fprintf(out, "               bigger than this divided by the queue depth are mapped.\n");
+    fprintf(out, "    --no-io-uring\n");
+    fprintf(out, "               [with --batch] Read one file at a time with pread()\n");
+    fprintf(out, "    --manifest <file>\n");
+    fprintf(out, "               [with --batch] Record each file processed in <file>, and\n");
+    fprintf(out, "               skip those unchanged since it was last processed with the\n");
+    fprintf(out, "               same actions. Files recorded but now gone are reported.\n");
+    fprintf(out, "    --output-dir <dir>\n");
+    fprintf(out, "               [with --watch] Write each file's output to <dir>/<name>.out\n");
+    fprintf(out, "               rather than to the actions' outputs\n");
+    fprintf(out, "    --debounce <ms>\n");
+    fprintf(out, "               [with --watch] Wait until a file has gone <ms> milliseconds\n");
+    fprintf(out, "               without being written to before processing it (default %d)\n", CFBF_DEFAULT_WATCH_DEBOUNCE_MS);
+    fprintf(out, "    --socket <path>\n");
+    fprintf(out, "               [with --serve] Take requests from clients connecting to this\n");
+    fprintf(out, "               Unix socket, rather than from stdin\n");
+    fprintf(out, "    --cache-size <MB>\n");
+    fprintf(out, "               [with --serve] Memory to keep parsed files in (default %d)\n", CFBF_DEFAULT_SERVER_CACHE_SIZE / (1024 * 1024));
+    fprintf(out, "    --cache-files <n>\n");
+    fprintf(out, "               [with --serve] Most files to keep open (default %d)\n", CFBF_DEFAULT_SERVER_CACHE_FILES);
+    fprintf(out, "    -q         Be less verbose\n");
+    fprintf(out, "    --stats    When finished, write timings of each phase of opening the\n");
+    fprintf(out, "               file and of each action, counters and resource usage to\n");
+    fprintf(out, "               stderr as JSON. With --batch, these are totals for all\n");
+    fprintf(out, "               the files.\n");
+    fprintf(out, "    --sha256   [with --hash] Add a SHA-256 hash to each record\n");
+    fprintf(out, "    --read-window <MB>\n");
+    fprintf(out, "               [with -x, --hash] Read streams in the order their data\n");
+    fprintf(out, "               comes in the file, prefetching up to <MB> megabytes at a\n");
+    fprintf(out, "               time. 0 reads them in directory order (default 64)\n");
+    fprintf(out, "    --readahead <n>\n");
+    fprintf(out, "               Read <n> sectors ahead along each chain being followed\n");
+    fprintf(out, "               (default %d, 0 to leave readahead to the kernel)\n", CFBF_DEFAULT_READAHEAD_SECTORS);
+    fprintf(out, "    --populate <KB>\n");
+    fprintf(out, "               Read the whole file in at once when it's opened, if it is\n");
+    fprintf(out, "               no bigger than <KB> kilobytes (default 0)\n");
+    fprintf(out, "    --max-memory <MB>\n");
+    fprintf(out, "               Try to use no more than <MB> megabytes of memory, by\n");
+    fprintf(out, "               mapping big files a piece at a time (default 0, no limit)\n");
+    fprintf(out, "    --index    Keep an index of each file's FAT and directory in\n");
+    fprintf(out, "               <file>.cfbfidx, making it quicker to open next time\n");
+    fprintf(out, "    --index-dir <dir>\n");
+    fprintf(out, "               [implies --index] Keep the indexes in <dir> rather than\n");
+    fprintf(out, "               next to the files\n");
+    fprintf(out, "    --seek-latency <ms>\n");
+    fprintf(out, "               [with --frag] Seek time to assume when estimating the cost\n");
+    fprintf(out, "               of reading each chain (default 8)\n");
+    fprintf(out, "    --top <n>  [with --frag] Only list the <n> most costly chains\n");
+    fprintf(out, "               (default 20, 0 for all)\n");
+    fprintf(out, "    -u         [with -t] Don't convert text to UTF-8 for output, keep as UTF-16\n");
+    fprintf(out, "    -v         Be more verbose\n");
+    fprintf(out, "\n");
+    fprintf(out, "Use -t to extract text from a Microsoft Publisher file.\n");
+    fprintf(out, "Any number of actions may be given. The file is opened once and the\n");
+    fprintf(out, "actions are carried out in the order given, each writing to its own\n");
+    fprintf(out, "output file if one follows it with -o.\n");
+    fprintf(out, "If there are no action arguments, print information from the header and exit.\n");
+}
+
+enum {
+    OPT_SEGMENTS = 256,
+    OPT_TAR,
+    OPT_HASH,
+    OPT_SHA256,
+    OPT_DIFF,
+    OPT_REPACK,
+    OPT_FRAG,
+    OPT_SEEK_LATENCY,
+    OPT_TOP,
+    OPT_READ_WINDOW,
+    OPT_READAHEAD,
+    OPT_POPULATE,
+    OPT_MAX_MEMORY,
+    OPT_INDEX,
+    OPT_INDEX_DIR,
+    OPT_BATCH,
+    OPT_QUEUE_DEPTH,
+    OPT_BUFFER_POOL,
+    OPT_NO_IO_URING,
+    OPT_MANIFEST,
+    OPT_STATS,
+    OPT_SERVE,
+    OPT_SOCKET,
+    OPT_CACHE_SIZE,
+    OPT_CACHE_FILES,
+    OPT_WATCH,
+    OPT_OUTPUT_DIR,
+    OPT_DEBOUNCE,
+    OPT_TRIAGE
+};
+
+static const struct option long_options[] = {
+    { "segments", no_argument, NULL, OPT_SEGMENTS },
+    { "tar", no_argument, NULL, OPT_TAR },
+    { "hash", no_argument, NULL, OPT_HASH },
+    { "sha256", no_argument, NULL, OPT_SHA256 },
+    { "diff", no_argument, NULL, OPT_DIFF },
+    { "repack", required_argument, NULL, OPT_REPACK },
+    { "frag", no_argument, NULL, OPT_FRAG },
+    { "seek-latency", required_argument, NULL, OPT_SEEK_LATENCY },
+    { "top", required_argument, NULL, OPT_TOP },
+    { "read-window", required_argument, NULL, OPT_READ_WINDOW },
+    { "readahead", required_argument, NULL, OPT_READAHEAD },
+    { "populate", required_argument, NULL, OPT_POPULATE },
+    { "max-memory", required_argument, NULL, OPT_MAX_MEMORY },
+    { "index", no_argument, NULL, OPT_INDEX },
+    { "index-dir", required_argument, NULL, OPT_INDEX_DIR },
+    { "batch", no_argument, NULL, OPT_BATCH },
+    { "queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH },
+    { "buffer-pool", required_argument, NULL, OPT_BUFFER_POOL },
+    { "no-io-uring", no_argument, NULL, OPT_NO_IO_URING },
+    { "manifest", required_argument, NULL, OPT_MANIFEST },
+    { "stats", no_argument, NULL, OPT_STATS },
+    { "serve", no_argument, NULL, OPT_SERVE },
+    { "socket", required_argument, NULL, OPT_SOCKET },
+    { "cache-size", required_argument, NULL, OPT_CACHE_SIZE },
+    { "cache-files", required_argument, NULL, OPT_CACHE_FILES },
+    { "watch", required_argument, NULL, OPT_WATCH },
+    { "output-dir", required_argument, NULL, OPT_OUTPUT_DIR },
+    { "debounce", required_argument, NULL, OPT_DEBOUNCE },
+    { "triage", no_argument, NULL, OPT_TRIAGE },
+    { NULL, 0, NULL, 0 }
+};
+
+/* Output files opened for actions. Actions naming the same output file share
+ * one FILE, and write to it in the order the actions were given. */
+struct action_output {
+    const char *filename;
     FILE *out;
 };
 
-int
-print_dir_entry(void *cookie, struct cfbf *cfbf, struct DirEntry *e,
-        struct DirEntry *parent, unsigned long entry_id, int depth) {
-    char name[129];
-    char *in_p;
-    int name_length;
-    char *out_p;
-    size_t in_left, out_left, ret;
-    int indent = depth * 4;
-    int retval = 1;
-    char obj_type_str[10];
-    FILE *out = (FILE *) cookie;
-
-    iconv_t cd = iconv_open("UTF-8", "UTF-16");
-    if (cd == (iconv_t) -1) {
-        error(0, errno, "iconv_open");
-        goto fail;
-    }
+/* Parse the argument of a numeric option, rejecting anything that isn't
+ * a whole number which fits in an int. Each option checks its own range. */
+static int
+parse_int_option(const char *name, const char *arg) {
+    char *end;
+    long n;
+
+    errno = 0;
+    n = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0')
+        error(1, 0, "%s: \"%s\" is not a whole number", name, arg);
+    if (errno == ERANGE || n < INT_MIN || n > INT_MAX)
+        error(1, 0, "%s: %s is out of range", name, arg);
+    return (int) n;
+}
 
-    if (e->name_length > 64) {
-        error(0, 0, "warning: dir entry %lu: name_length is %hu which is > 64", entry_id, (unsigned short) e->name_length);
-        name_length = 64;
-    }
-    else {
-        name_length = (int) e->name_length;
-    }
+static double
+parse_double_option(const char *name, const char *arg) {
+    char *end;
+    double n;
+
+    errno = 0;
+    n = strtod(arg, &end);
+    if (end == arg || *end != '\0')
+        error(1, 0, "%s: \"%s\" is not a number", name, arg);
+    if (errno == ERANGE)
+        error(1, 0, "%s: %s is out of range", name, arg);
+    return n;
+}
 
-    in_p = (char *) e->name;
-    out_p = name;
-    in_left = name_length;
-    out_left = sizeof(name);
-    ret = iconv(cd, &in_p, &in_left, &out_p, &out_left);
-    if (ret == (size_t) -1) {
-        error(0, errno, "dir entry %lu: failed to convert filename from UTF-16", entry_id);
-        goto fail;
+static void
+add_action(struct cfbf_action **actions, int *num_actions,
+        enum cfbf_action_type type, const char *arg) {
+    struct cfbf_action *new_actions;
+
+    new_actions = realloc(*actions, (*num_actions + 1) * sizeof(struct cfbf_action));
+    if (new_actions == NULL)
+        error(1, errno, "add_action()");
+
+    *actions = new_actions;
+    memset(&new_actions[*num_actions], 0, sizeof(struct cfbf_action));
+    new_actions[*num_actions].type = type;
+    new_actions[*num_actions].arg = arg;
+    ++*num_actions;
+}
+
+/* Return the FILE to use for the named output file, opening it if no other
+ * action has opened it already. */
+static FILE *
+get_action_output(struct action_output *outputs, int *num_outputs,
+        const char *filename) {
+    for (int i = 0; i < *num_outputs; ++i) {
+        if (!strcmp(outputs[i].filename, filename))
+            return outputs[i].out;
     }
-    *out_p = '\0';
 
-    cfbf_object_type_to_string(e->object_type, obj_type_str, sizeof(obj_type_str));
+    outputs[*num_outputs].filename = filename;
+    outputs[*num_outputs].out = fopen(filename, "w");
+    if (outputs[*num_outputs].out == NULL)
+        error(1, errno, "%s", filename);
 
-    fprintf(out, "%-8s %10lu%s %10llu    ", obj_type_str,
-            (unsigned long) e->start_sector,
-            cfbf_dir_stored_in_mini_stream(cfbf, e) ? "m" : " ",
-            (unsigned long long) e->stream_size);
+    return outputs[(*num_outputs)++].out;
+}
 
-    fprintf(out, "%*s", indent, "");
-    fprintf(out, "%s\n", name);
+/* Carry out every action on an opened file. If file_index isn't negative,
+ * this is one of several files, and each output first gets a
+ * "==> filename <==" line, as head(1) writes when given several files.
+ * If result_hashes isn't NULL, the XXH64 of what each action writes is put
+ * in it, or 0 for --tar, which writes straight to the file descriptor.
+ * Returns 0 if all the actions succeeded, -1 otherwise. */
+static int
+run_actions(struct cfbf *cfbf, const char *filename,
+        const struct cfbf_action *actions, int num_actions, FILE **action_out,
+        const struct cfbf_action_options *opts, int file_index,
+        uint64_t *result_hashes) {
+    int retval = 0;
+
+    for (int i = 0; i < num_actions; ++i) {
+        struct cfbf_xxh64_state hash;
+        FILE *out = action_out[i];
+
+        if (file_index >= 0) {
+            int seen = 0;
+            for (int j = 0; j < i && !seen; ++j)
+                seen = (action_out[j] == action_out[i]);
+            if (!seen)
+                fprintf(action_out[i], "%s==> %s <==\n",
+                        file_index > 0 ? "\n" : "", filename);
+        }
 
-end:
-    iconv_close(cd);
+        if (result_hashes != NULL && actions[i].type != CFBF_ACTION_TAR) {
+            cfbf_xxh64_init(&hash, 0);
+            out = cfbf_manifest_hash_stream(action_out[i], &hash);
+            if (out == NULL) {
+                retval = -1;
+                continue;
+            }
+        }
 
-    return retval;
+        if (cfbf_run_action(cfbf, filename, &actions[i], out, opts) < 0)
+            retval = -1;
 
-fail:
-    retval = -1;
-    goto end;
-}
+        if (out != action_out[i]) {
+            fclose(out);
+            result_hashes[i] = cfbf_xxh64_digest(&hash);
+        }
+        else if (result_hashes != NULL) {
+            result_hashes[i] = 0;
+        }
 
-int
-write_publisher_text(void *cookie, const char *data, size_t data_length) {
-    struct write_pub_text_state *state = (struct write_pub_text_state *) cookie;
-    if (state->iconv_desc == (iconv_t) -1) {
-        /* We're not converting the character encoding, we're just writing
-         * it all straight out */
-        size_t ret = fwrite(data, 1, data_length, state->out);
-        if (ret != data_length) {
-            error(0, errno, "fwrite()");
-            return -1;
+        /* Output to a file is buffered, so count writing it out as part
+         * of the work too when we're timing things */
+        if (cfbf_stats.enabled) {
+            uint64_t start = cfbf_stats_now();
+            fflush(action_out[i]);
+            cfbf_stats_phase_end(CFBF_PHASE_OUTPUT_FLUSH, start);
         }
     }
-    else {
-        /* Convert text using iconv_desc before writing it out */
-        char *in_p = (char *) data;
-        char *out_p;
-        size_t in_left, out_left;
 
-        char buf[1024];
+    return retval;
+}
 
-        in_left = data_length;
+/* Files to process with --batch */
+struct batch_files {
+    char **filenames;
+    int num_files;
+    int max_files;
+};
 
-        while (in_left > 0) {
-            size_t ret;
-            out_left = sizeof(buf);
-            out_p = buf;
+static struct batch_files *nftw_batch_files;
+
+static void
+add_batch_file(struct batch_files *files, const char *filename) {
+    if (files->num_files >= files->max_files) {
+        int new_max = files->max_files ? files->max_files * 2 : 64;
+        char **new_filenames = realloc(files->filenames, new_max * sizeof(char *));
+        if (new_filenames == NULL)
+            error(1, errno, "add_batch_file()");
+        files->filenames = new_filenames;
+        files->max_files = new_max;
+    }
+    files->filenames[files->num_files] = strdup(filename);
+    if (files->filenames[files->num_files] == NULL)
+        error(1, errno, "add_batch_file()");
+    files->num_files++;
+}
 
-            ret = iconv(state->iconv_desc, &in_p, &in_left, &out_p, &out_left);
-            if (ret == (size_t) -1 && errno != E2BIG) {
-                error(0, errno, "write_publisher_text()");
-                return -1;
-            }
+static int
+add_batch_file_from_tree(const char *path, const struct stat *st,
+        int type, struct FTW *ftw) {
+    if (type == FTW_F)
+        add_batch_file(nftw_batch_files, path);
+    else if (type == FTW_DNR || type == FTW_NS)
+        error(0, 0, "%s: can't read", path);
+    return 0;
+}
+
+static int
+compare_strings(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
 
-            ret = fwrite(buf, 1, out_p - buf, state->out);
-            if (ret != out_p - buf) {
-                error(0, errno, "fwrite()");
-                return -1;
+/* Add a file to the list, or if it's a directory, every regular file under
+ * it, in order of name */
+static void
+add_batch_operand(struct batch_files *files, const char *operand) {
+    struct stat st;
+    int first = files->num_files;
+
+    if (stat(operand, &st) == 0 && S_ISDIR(st.st_mode)) {
+        nftw_batch_files = files;
+        if (nftw(operand, add_batch_file_from_tree, 64, FTW_PHYS) < 0)
+            error(0, errno, "%s", operand);
+        qsort(files->filenames + first, files->num_files - first,
+                sizeof(char *), compare_strings);
+    }
+    else {
+        add_batch_file(files, operand);
+    }
+}
+
+struct batch_run_state {
+    char **filenames;
+    const struct cfbf_action *actions;
+    int num_actions;
+    FILE **action_out;
+    const struct cfbf_action_options *opts;
+    const struct cfbf_open_options *open_opts;
+
+    /* With --manifest, where to record each file, and what stat() said
+     * about each before it was read */
+    struct cfbf_manifest *manifest;
+    struct stat *stats;
+    uint64_t *result_hashes;
+};
+
+/* Drop the files the manifest says haven't changed since they were last
+ * processed, and return what stat() said about each of the rest */
+static struct stat *
+skip_unchanged_files(struct batch_files *files, struct cfbf_manifest *manifest) {
+    struct stat *stats;
+    int num_files = 0;
+
+    stats = calloc(files->num_files ? files->num_files : 1, sizeof(struct stat));
+    if (stats == NULL)
+        error(1, errno, "skip_unchanged_files()");
+
+    for (int i = 0; i < files->num_files; ++i) {
+        if (stat(files->filenames[i], &stats[num_files]) == 0) {
+            if (cfbf_manifest_unchanged(manifest, files->filenames[i], &stats[num_files])) {
+                free(files->filenames[i]);
+                continue;
             }
         }
+        else {
+            /* A file we can't stat() is left for reading it to report, but
+             * without a st_mode, isn't recorded */
+            memset(&stats[num_files], 0, sizeof(struct stat));
+        }
+        files->filenames[num_files++] = files->filenames[i];
     }
+    files->num_files = num_files;
 
-    return 0;
+    return stats;
 }
 
-int
-write_sector_to_file(void *cookie, const void *sector_data, int length,
-        FSINDEX sector_index, int64_t file_offset) {
-    FILE *out = (FILE *) cookie;
-    size_t ret;
+static int
+batch_run_file(void *cookie, int file_index, const void *data, size_t size,
+        int err) {
+    struct batch_run_state *state = (struct batch_run_state *) cookie;
+    const char *filename = state->filenames[file_index];
+    struct cfbf cfbf;
+    uint64_t structure_hash;
+    int ret;
 
-    ret = fwrite(sector_data, 1, length, out);
-    if (ret != length) {
-        error(0, errno, "write_sector_to_file()");
-        return -1;
+    if (data == NULL && err == EFBIG) {
+        /* Too big for the buffers, so map it as usual */
+        if (cfbf_open_with_options(filename, &cfbf, state->open_opts) != 0)
+            goto fail;
+    }
+    else if (data == NULL) {
+        error(0, err, "%s", filename);
+        goto fail;
+    }
+    else if (cfbf_open_memory(data, size, filename, &cfbf) != 0) {
+        goto fail;
     }
 
-    return 0;
+    ret = run_actions(&cfbf, filename, state->actions, state->num_actions,
+            state->action_out, state->opts,
+            state->opts->verbosity >= 0 ? file_index : -1,
+            state->result_hashes);
+
+    if (state->manifest != NULL && state->stats[file_index].st_mode != 0) {
+        structure_hash = cfbf_manifest_structure_hash(&cfbf);
+        if (cfbf_manifest_add(state->manifest, filename,
+                    &state->stats[file_index], structure_hash,
+                    state->result_hashes, state->num_actions, ret < 0) < 0)
+            ret = -1;
+    }
+
+    cfbf_close(&cfbf);
+
+    return ret;
+
+fail:
+    /* Record the failure, so the file isn't taken for deleted next time,
+     * but is tried again */
+    if (state->manifest != NULL && state->stats[file_index].st_mode != 0)
+        cfbf_manifest_add(state->manifest, filename, &state->stats[file_index],
+                0, NULL, 0, 1);
+    return -1;
 }
 
-void
-print_help(FILE *out) {
-    fprintf(out, "Compound File Binary File format analyser\n");
-    fprintf(out, "Graeme Cole, 2019\n");
-    fprintf(out, "Usage: cfbfinfo [action] [options] file.pub\n");
-    fprintf(out, "Actions:\n");
-    fprintf(out, "    -h         Show this help\n");
-    fprintf(out, "    -l         List directory tree\n");
-    fprintf(out, "    -r <path>  Dump the object with this path to the output file\n");
-    fprintf(out, "               (e.g. -r \"Root Entry/Quill/QuillSub/CONTENTS\")\n");
-    fprintf(out, "    -t         Extract TEXT section from CONTENTS object, write to output file\n");
-    fprintf(out, "    -w         Walk FAT structure, highlight any problems\n");
-    fprintf(out, "Options:\n");
-    fprintf(out, "    -c <path>  [with -t] Path to use for CONTENTS object\n");
-    fprintf(out, "               (default is \"Root Entry/Quill/QuillSub/CONTENTS\")\n");
-    fprintf(out, "    -o <file>  Output file name (default is stderr for -w, stdout otherwise)\n");
-    fprintf(out, "    -q         Be less verbose\n");
-    fprintf(out, "    -u         [with -t] Don't convert text to UTF-8 for output, keep as UTF-16\n");
-    fprintf(out, "    -v         Be more verbose\n");
-    fprintf(out, "\n");
-    fprintf(out, "Use -t to extract text from a Microsoft Publisher file.\n");
-    fprintf(out, "If there are no action arguments, print information from the header and exit.\n");
+/* Compare two CFB files. Exit status is like that of diff(1): 0 if there
+ * are no differences, 1 if there are, and 2 if there was trouble. */
+static int
+diff_files(const char *filename_a, const char *filename_b,
+        const char *output_filename, int verbosity,
+        const struct cfbf_open_options *open_opts) {
+    struct cfbf cfbf_a, cfbf_b;
+    struct cfbf_open_options opts = *open_opts;
+    FILE *out;
+    int ret;
+
+    /* Both files are open at once, so each gets half the memory */
+    opts.max_memory /= 2;
+
+    if (cfbf_open_with_options(filename_a, &cfbf_a, &opts) != 0)
+        return 2;
+    if (cfbf_open_with_options(filename_b, &cfbf_b, &opts) != 0) {
+        cfbf_close(&cfbf_a);
+        return 2;
+    }
+
+    if (output_filename == NULL || !strcmp(output_filename, "-")) {
+        out = stdout;
+    }
+    else {
+        out = fopen(output_filename, "w");
+        if (out == NULL)
+            error(2, errno, "%s", output_filename);
+    }
+
+    ret = cfbf_diff(&cfbf_a, &cfbf_b, out, verbosity);
+
+    if (out != stdout && fclose(out) == EOF) {
+        error(0, errno, "%s", output_filename);
+        ret = -1;
+    }
+
+    cfbf_close(&cfbf_a);
+    cfbf_close(&cfbf_b);
+
+    return ret < 0 ? 2 : ret;
 }
 
 int main(int argc, char **argv) {
     int c;
+    int size;
     char *input_filename = NULL;
     struct cfbf cfbf;
-    int show_header = 0;
-    char *dump_object_path = NULL;
-    int print_dir_tree = 0;
-    char *output_filename = NULL;
-    FILE *out = NULL;
-    int walk = 0;
-    int extract_publisher_text = 0;
+    char *dump_object_path;
+    const char *default_output_filename = NULL;
+    struct cfbf_action *actions = NULL;
+    int num_actions = 0;
+    struct action_output *outputs = NULL;
+    int num_outputs = 0;
     int exit_status = 0;
-    int num_command_options = 0;
-    int verbosity = 0;
-    char *publisher_contents_path = "Root Entry/Quill/QuillSub/CONTENTS";
-    int convert_text_to_utf8 = 1;
-
-    while ((c = getopt(argc, argv, "hlr:twc:o:quv")) != -1) {
+    int diff_mode = 0;
+    int batch_mode = 0;
+    int serve_mode = 0;
+    int triage_mode = 0;
+    const char *manifest_filename = NULL;
+    struct cfbf_manifest *manifest = NULL;
+    struct stat *batch_stats = NULL;
+    struct cfbf_action_options opts;
+    struct cfbf_open_options open_opts;
+    struct cfbf_batch_options batch_opts;
+    struct cfbf_server_options server_opts;
+    const char *watch_dir = NULL;
+    struct cfbf_watch_options watch_opts;
+    struct batch_files batch_files;
+
+    memset(&batch_opts, 0, sizeof(batch_opts));
+    batch_opts.queue_depth = CFBF_DEFAULT_BATCH_QUEUE_DEPTH;
+    batch_opts.buffer_pool_size = CFBF_DEFAULT_BATCH_BUFFER_POOL_SIZE;
+    batch_opts.use_io_uring = 1;
+    memset(&batch_files, 0, sizeof(batch_files));
+
+    memset(&server_opts, 0, sizeof(server_opts));
+    server_opts.cache_size = CFBF_DEFAULT_SERVER_CACHE_SIZE;
+    server_opts.cache_files = CFBF_DEFAULT_SERVER_CACHE_FILES;
+
+    memset(&watch_opts, 0, sizeof(watch_opts));
+    watch_opts.debounce_ms = CFBF_DEFAULT_WATCH_DEBOUNCE_MS;
+
+    memset(&open_opts, 0, sizeof(open_opts));
+    open_opts.readahead_sectors = CFBF_DEFAULT_READAHEAD_SECTORS;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.publisher_contents_path = "Root Entry/Quill/QuillSub/CONTENTS";
+    opts.convert_text_to_utf8 = 1;
+    opts.num_threads = cfbf_default_num_threads();
+    opts.frag_top_n = 20;
+    opts.seek_latency_ms = 8;
+    opts.read_window = 64 * 1024 * 1024;
+
+    while ((c = getopt_long(argc, argv, "hHlr:twx:c:j:o:quv", long_options, NULL)) != -1) {
         switch (c) {
             case 'h':
                 print_help(stdout);
                 exit(0);
                 break;
 
+            case 'H':
+                add_action(&actions, &num_actions, CFBF_ACTION_HEADER, NULL);
+                break;
+
             case 'r':
-                ++num_command_options;
                 dump_object_path = optarg;
 
                 // Skip any leading slashes - we don't want them
                 while (*dump_object_path == '/') {
                     ++dump_object_path;
                 }
+                add_action(&actions, &num_actions, CFBF_ACTION_DUMP, dump_object_path);
                 break;
 
             case 'l':
-                print_dir_tree = 1;
-                ++num_command_options;
+                add_action(&actions, &num_actions, CFBF_ACTION_LIST, NULL);
                 break;
 
             case 'o':
-                output_filename = optarg;
+                /* -o applies to the action before it. If there isn't one,
+                 * it's the output file for every action without its own. */
+                if (num_actions == 0)
+                    default_output_filename = optarg;
+                else if (actions[num_actions - 1].output_filename != NULL)
+                    error(1, 0, "more than one -o given for the same action. Use -h for help.");
+                else
+                    actions[num_actions - 1].output_filename = optarg;
                 break;
 
             case 'q':
-                verbosity--;
+                opts.verbosity--;
                 break;
 
             case 'w':
-                walk = 1;
-                ++num_command_options;
+                add_action(&actions, &num_actions, CFBF_ACTION_WALK, NULL);
                 break;
 
             case 't':
-                extract_publisher_text = 1;
-                ++num_command_options;
+                add_action(&actions, &num_actions, CFBF_ACTION_TEXT, NULL);
                 break;
 
             case 'u':
-                convert_text_to_utf8 = 0;
+                opts.convert_text_to_utf8 = 0;
+                break;
+
+            case 'x':
+                add_action(&actions, &num_actions, CFBF_ACTION_EXTRACT, optarg);
+                break;
+
+            case 'j':
+                opts.num_threads = parse_int_option("-j", optarg);
+                if (opts.num_threads < 1)
+                    error(1, 0, "-j: number of threads must be at least 1");
                 break;
 
             case 'c':
-                publisher_contents_path = optarg;
+                opts.publisher_contents_path = optarg;
                 break;
 
             case 'v':
-                verbosity++;
+                opts.verbosity++;
+                break;
+
+            case OPT_SEGMENTS:
+                add_action(&actions, &num_actions, CFBF_ACTION_SEGMENTS, NULL);
+                break;
+
+            case OPT_TAR:
+                add_action(&actions, &num_actions, CFBF_ACTION_TAR, NULL);
+                break;
+
+            case OPT_HASH:
+                add_action(&actions, &num_actions, CFBF_ACTION_HASH, NULL);
+                break;
+
+            case OPT_SHA256:
+                opts.use_sha256 = 1;
+                break;
+
+            case OPT_DIFF:
+                diff_mode = 1;
+                break;
+
+            case OPT_REPACK:
+                add_action(&actions, &num_actions, CFBF_ACTION_REPACK, optarg);
+                break;
+
+            case OPT_FRAG:
+                add_action(&actions, &num_actions, CFBF_ACTION_FRAG, NULL);
+                break;
+
+            case OPT_SEEK_LATENCY:
+                opts.seek_latency_ms = parse_double_option("--seek-latency", optarg);
+                if (opts.seek_latency_ms < 0)
+                    error(1, 0, "--seek-latency: seek time can't be negative");
+                break;
+
+            case OPT_TOP:
+                opts.frag_top_n = parse_int_option("--top", optarg);
+                if (opts.frag_top_n < 0)
+                    error(1, 0, "--top: number of chains can't be negative");
+                break;
+
+            case OPT_READ_WINDOW:
+                size = parse_int_option("--read-window", optarg);
+                if (size < 0)
+                    error(1, 0, "--read-window: size can't be negative");
+                opts.read_window = (int64_t) size * 1024 * 1024;
+                break;
+
+            case OPT_READAHEAD:
+                open_opts.readahead_sectors = parse_int_option("--readahead", optarg);
+                if (open_opts.readahead_sectors < 0)
+                    error(1, 0, "--readahead: number of sectors can't be negative");
+                break;
+
+            case OPT_POPULATE:
+                size = parse_int_option("--populate", optarg);
+                if (size < 0)
+                    error(1, 0, "--populate: size can't be negative");
+                open_opts.populate_max_size = (long long) size * 1024;
+                break;
+
+            case OPT_MAX_MEMORY:
+                size = parse_int_option("--max-memory", optarg);
+                if (size < 0)
+                    error(1, 0, "--max-memory: size can't be negative");
+                open_opts.max_memory = (long long) size * 1024 * 1024;
+                break;
+
+            case OPT_INDEX:
+                open_opts.use_index = 1;
+                break;
+
+            case OPT_INDEX_DIR:
+                open_opts.use_index = 1;
+                open_opts.index_dir = optarg;
+                break;
+
+            case OPT_BATCH:
+                batch_mode = 1;
+                break;
+
+            case OPT_MANIFEST:
+                manifest_filename = optarg;
+                break;
+
+            case OPT_QUEUE_DEPTH:
+                batch_opts.queue_depth = parse_int_option("--queue-depth", optarg);
+                if (batch_opts.queue_depth < 1)
+                    error(1, 0, "--queue-depth: must be at least 1");
+                break;
+
+            case OPT_BUFFER_POOL:
+                size = parse_int_option("--buffer-pool", optarg);
+                if (size < 1)
+                    error(1, 0, "--buffer-pool: size must be at least 1");
+                batch_opts.buffer_pool_size = (size_t) size * 1024 * 1024;
+                break;
+
+            case OPT_NO_IO_URING:
+                batch_opts.use_io_uring = 0;
+                break;
+
+            case OPT_STATS:
+                cfbf_stats_enable();
+                break;
+
+            case OPT_SERVE:
+                serve_mode = 1;
+                break;
+
+            case OPT_SOCKET:
+                server_opts.socket_path = optarg;
+                break;
+
+            case OPT_CACHE_SIZE:
+                size = parse_int_option("--cache-size", optarg);
+                if (size < 0)
+                    error(1, 0, "--cache-size: size can't be negative");
+                server_opts.cache_size = (size_t) size * 1024 * 1024;
+                break;
+
+            case OPT_CACHE_FILES:
+                server_opts.cache_files = parse_int_option("--cache-files", optarg);
+                if (server_opts.cache_files < 0)
+                    error(1, 0, "--cache-files: number of files can't be negative");
+                break;
+
+            case OPT_WATCH:
+                watch_dir = optarg;
+                break;
+
+            case OPT_OUTPUT_DIR:
+                watch_opts.output_dir = optarg;
+                break;
+
+            case OPT_DEBOUNCE:
+                watch_opts.debounce_ms = parse_int_option("--debounce", optarg);
+                if (watch_opts.debounce_ms < 0)
+                    error(1, 0, "--debounce: time can't be negative");
+                break;
+
+            case OPT_TRIAGE:
+                triage_mode = 1;
                 break;
 
             default:
@@ -229,14 +785,63 @@ int main(int argc, char **argv) {
         }
     }
 
-    /* We can only do one action */
-    if (num_command_options > 1) {
-        error(1, 0, "Only one of -r, -l, -t and -w may be given. Use -h for help.");
+    if (diff_mode) {
+        if (num_actions > 0)
+            error(1, 0, "--diff can't be combined with other actions. Use -h for help.");
+        if (argc - optind != 2)
+            error(1, 0, "--diff needs exactly two files to compare. Use -h for help.");
+        exit_status = diff_files(argv[optind], argv[optind + 1],
+                default_output_filename, opts.verbosity, &open_opts);
+        cfbf_stats_print(stderr);
+        return exit_status;
+    }
+
+    if (triage_mode) {
+        FILE *out = stdout;
+        if (num_actions > 0 || diff_mode || batch_mode || serve_mode || watch_dir != NULL)
+            error(1, 0, "--triage can't be combined with other actions. Use -h for help.");
+        if (optind >= argc)
+            error(1, 0, "--triage needs at least one file or directory. Use -h for help.");
+        if (default_output_filename != NULL && strcmp(default_output_filename, "-")) {
+            out = fopen(default_output_filename, "w");
+            if (out == NULL)
+                error(1, errno, "%s", default_output_filename);
+        }
+        exit_status = cfbf_triage((const char * const *) argv + optind, argc - optind,
+                opts.num_threads, opts.verbosity, out) < 0 ? 1 : 0;
+        if (fclose(out) == EOF) {
+            error(0, errno, "%s", default_output_filename ? default_output_filename : "stdout");
+            exit_status = 1;
+        }
+        return exit_status;
+    }
+
+    if (serve_mode) {
+        if (num_actions > 0 || diff_mode || batch_mode || optind < argc)
+            error(1, 0, "--serve takes its actions and files from its requests. Use -h for help.");
+        server_opts.num_workers = opts.num_threads;
+        exit_status = cfbf_serve(&server_opts, &opts, &open_opts) < 0 ? 1 : 0;
+        cfbf_stats_print(stderr);
+        return exit_status;
+    }
+
+    if (watch_dir != NULL) {
+        if (diff_mode || batch_mode || optind < argc)
+            error(1, 0, "--watch takes its files from the directory it watches. Use -h for help.");
+        for (int i = 0; i < num_actions; ++i) {
+            if (actions[i].type == CFBF_ACTION_TAR || actions[i].type == CFBF_ACTION_REPACK ||
+                    actions[i].type == CFBF_ACTION_EXTRACT)
+                error(1, 0, "--tar, --repack and -x can't be combined with --watch. Use -h for help.");
+        }
+        watch_opts.num_workers = opts.num_threads;
+    }
+    else if (watch_opts.output_dir != NULL) {
+        error(1, 0, "--output-dir only works with --watch. Use -h for help.");
     }
 
     /* If no actions have been specified, print information from the header */
-    if (num_command_options == 0) {
-        show_header = 1;
+    if (num_actions == 0) {
+        add_action(&actions, &num_actions, CFBF_ACTION_HEADER, NULL);
     }
 
     /* If a filename has been given, that's the CFB file. Otherwise, that's
@@ -244,138 +849,126 @@ int main(int argc, char **argv) {
     if (optind < argc) {
         input_filename = argv[optind];
     }
-    else {
+    else if (watch_dir == NULL) {
         print_help(stderr);
         exit(1);
     }
 
-    /* Open the CFB file, which will fail if there's something seriously
-     * wrong with it, like it not being a CFB file */
-    if (cfbf_open(input_filename, &cfbf) != 0) {
-        exit(1);
-    }
+    if (manifest_filename != NULL && !batch_mode)
+        error(1, 0, "--manifest only works with --batch. Use -h for help.");
 
-    /* If an output file has been specified, open it */
-    if (output_filename == NULL || !strcmp(output_filename, "-")) {
-        if (walk)
-            out = stderr;
-        else
-            out = stdout;
-    }
-    else {
-        out = fopen(output_filename, "w");
-        if (out == NULL)
-            error(1, errno, "%s", output_filename);
-    }
+    if (batch_mode) {
+        /* These write to one place given on the command line, which every
+         * file would write over */
+        for (int i = 0; i < num_actions; ++i) {
+            if (actions[i].type == CFBF_ACTION_TAR || actions[i].type == CFBF_ACTION_REPACK ||
+                    actions[i].type == CFBF_ACTION_EXTRACT)
+                error(1, 0, "--tar, --repack and -x can't be combined with --batch. Use -h for help.");
+        }
 
-    /* Do whatever action we've been told to do */
-    struct StructuredStorageHeader *header = cfbf.header;
-    if (show_header) {
-        fprintf(out, "DllVersion, MinorVersion:     %hu, %hu\n", (unsigned short) header->_uDllVersion, (unsigned short) header->_uMinorVersion);
-        fprintf(out, "Byte-order mark:              %02X %02X\n", ((unsigned char *) header)[0x1c], ((unsigned char *) header)[0x1d]);
-        fprintf(out, "Main FAT sector size:         2^%hu (%d)\n", (unsigned short) header->_uSectorShift, cfbf_get_sector_size(&cfbf));
-        fprintf(out, "Mini-stream sector size:      2^%hu (%d)\n", (unsigned short) header->_uMiniSectorShift, cfbf_get_mini_fat_sector_size(&cfbf));
-        fprintf(out, "FAT chain sector count:       %lu\n", (unsigned long) header->_csectFat);
-        if (header->_uSectorShift >= 12)
-            fprintf(out, "Directory chain sector count: %lu\n", (unsigned long) header->_csectDir);
-        fprintf(out, "Directory chain first sector: %lu\n", (unsigned long) header->_sectDirStart);
-        fprintf(out, "Max file size in mini-stream: %lu\n", (unsigned long) header->_ulMiniSectorCutoff);
-        fprintf(out, "MiniFAT first sector, count:  %lu, %lu\n", (unsigned long) header->_sectMiniFatStart, (unsigned long) header->_csectMiniFat);
-        fprintf(out, "DIFAT first sector, count:    %lu, %lu\n", (unsigned long) header->_sectDifStart, (unsigned long) header->_csectDif);
-        fprintf(out, "\n");
-    }
-    else if (print_dir_tree) {
-        fprintf(out, "%-8s %10s  %10s    NAME\n", "TYPE", "START SEC", "SIZE");
+        for (int i = optind; i < argc; ++i)
+            add_batch_operand(&batch_files, argv[i]);
 
-        int ret = cfbf_walk_dir_tree(&cfbf, print_dir_entry, out);
-        if (ret < 0) {
-            exit_status = 1;
+        if (manifest_filename != NULL) {
+            manifest = cfbf_manifest_open(manifest_filename,
+                    cfbf_manifest_actions_hash(actions, num_actions, &opts));
+            if (manifest == NULL)
+                exit(1);
+            batch_stats = skip_unchanged_files(&batch_files, manifest);
         }
     }
-    else if (walk) {
-        if (cfbf_walk(&cfbf, out, verbosity))
-            exit_status = 1;
+    else if (watch_dir == NULL &&
+            cfbf_open_with_options(input_filename, &cfbf, &open_opts) != 0) {
+        /* Opening the CFB file fails if there's something seriously wrong
+         * with it, like it not being a CFB file */
+        exit(1);
     }
-    else if (dump_object_path) {
-        struct DirEntry *entry = cfbf_dir_entry_find_path(&cfbf, dump_object_path);
-        if (entry == NULL) {
-            error(0, 0, "object \"%s\" not found in %s", dump_object_path, input_filename);
-            exit_status = 1;
-        }
-        else if (entry->object_type == 5) {
-            error(0, 0, "you're not allowed to dump the root entry");
-            exit_status = 1;
-        }
-        else if (entry->object_type != 2) {
-            error(0, 0, "%s is not a stream object", dump_object_path);
-            exit_status = 1;
+
+    /* Open the output files before doing anything, so we don't find out
+     * we can't write the last one after doing all the work for the others */
+    outputs = calloc(num_actions, sizeof(struct action_output));
+    if (outputs == NULL)
+        error(1, errno, "main()");
+
+    FILE **action_out = calloc(num_actions, sizeof(FILE *));
+    if (action_out == NULL)
+        error(1, errno, "main()");
+
+    for (int i = 0; i < num_actions; ++i) {
+        const char *output_filename = actions[i].output_filename;
+
+        if (output_filename == NULL)
+            output_filename = default_output_filename;
+
+        if (output_filename == NULL || !strcmp(output_filename, "-")) {
+            if (actions[i].type == CFBF_ACTION_WALK)
+                action_out[i] = stderr;
+            else
+                action_out[i] = stdout;
         }
         else {
-            int ret;
-
-            ret = cfbf_follow_chain(&cfbf, entry->start_sector,
-                    entry->stream_size,
-                    entry->stream_size < header->_ulMiniSectorCutoff,
-                    write_sector_to_file, out);
-            if (ret) {
-                error(0, 0, "failed to read %s", dump_object_path);
-                exit_status = 1;
-            }
+            action_out[i] = get_action_output(outputs, &num_outputs, output_filename);
         }
     }
-    else if (extract_publisher_text) {
-        struct DirEntry *entry = cfbf_dir_entry_find_path(&cfbf, publisher_contents_path);
 
-        if (entry == NULL) {
-            error(0, 0, "Can't extract text: no entry named \"%s\" in directory", publisher_contents_path);
+    /* Do whatever actions we've been told to do, in order */
+    if (watch_dir != NULL) {
+        if (cfbf_watch(watch_dir, &watch_opts, actions, num_actions,
+                    action_out, &opts, &open_opts) < 0)
             exit_status = 1;
+    }
+    else if (batch_mode) {
+        struct batch_run_state state;
+
+        state.filenames = batch_files.filenames;
+        state.actions = actions;
+        state.num_actions = num_actions;
+        state.action_out = action_out;
+        state.opts = &opts;
+        state.open_opts = &open_opts;
+        state.manifest = manifest;
+        state.stats = batch_stats;
+        state.result_hashes = NULL;
+        if (manifest != NULL) {
+            state.result_hashes = calloc(num_actions, sizeof(uint64_t));
+            if (state.result_hashes == NULL)
+                error(1, errno, "main()");
         }
-        else {
-            void **contents_chain;
-            int sector_size, chain_length;
-
-            contents_chain = cfbf_dir_entry_get_sector_ptrs(&cfbf, entry, &chain_length, &sector_size);
-            if (contents_chain == NULL) {
-                exit_status = 1;
-            }
-            else {
-                struct write_pub_text_state state;
-
-                memset(&state, 0, sizeof(state));
-
-                if (convert_text_to_utf8) {
-                    state.iconv_desc = iconv_open("UTF-8", "UTF-16LE");
-                    if (state.iconv_desc == (iconv_t) -1) {
-                        error(1, errno, "failed to create iconv descriptor");
-                    }
-                }
-                else {
-                    state.iconv_desc = (iconv_t) -1;
-                }
-                state.out = out;
-
-                if (extract_text_from_contents_chain(contents_chain,
-                            chain_length, sector_size, entry->stream_size,
-                            verbosity, write_publisher_text, &state) < 0) {
-                    exit_status = 1;
-                }
 
+        if (cfbf_batch_read((const char * const *) batch_files.filenames,
+                    batch_files.num_files, &batch_opts, batch_run_file,
+                    &state) < 0)
+            exit_status = 1;
 
-                if (state.iconv_desc != (iconv_t) -1)
-                    iconv_close(state.iconv_desc);
-            }
-            free(contents_chain);
-        }
+        if (manifest != NULL &&
+                cfbf_manifest_close(manifest, (const char * const *) argv + optind,
+                    argc - optind, stderr, opts.verbosity) < 0)
+            exit_status = 1;
+        free(state.result_hashes);
+        free(batch_stats);
+    }
+    else {
+        if (run_actions(&cfbf, input_filename, actions, num_actions,
+                    action_out, &opts, -1, NULL) < 0)
+            exit_status = 1;
+        cfbf_close(&cfbf);
     }
 
-    if (out != NULL && out != stdout && out != stderr) {
-        if (fclose(out) == EOF) {
-            error(0, errno, "%s", output_filename);
+    for (int i = 0; i < num_outputs; ++i) {
+        if (fclose(outputs[i].out) == EOF) {
+            error(0, errno, "%s", outputs[i].filename);
             exit_status = 1;
         }
     }
 
-    cfbf_close(&cfbf);
+    cfbf_stats_print(stderr);
+
+    for (int i = 0; i < batch_files.num_files; ++i)
+        free(batch_files.filenames[i]);
+    free(batch_files.filenames);
+    free(action_out);
+    free(outputs);
+    free(actions);
 
     return exit_status;
 }
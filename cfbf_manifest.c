@@ -0,0 +1,710 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <error.h>
+
+#include "cfbf.h"
+
+/* Batch manifests.
+ *
+ * A nightly run over a big share does the same work on the same files as
+ * last night, except for the few which changed. With --manifest, --batch
+ * keeps a record of each file it processed: its path, device, inode, size
+ * and modification time, a hash of its header and directory, and a hash of
+ * what each action wrote for it. Next time, a file whose device, inode,
+ * size and modification time are all as recorded, and which was processed
+ * with the same actions and succeeded, is skipped without being opened.
+ * Files which were in the manifest but have gone are reported, as long as
+ * they were under one of the paths given this time.
+ *
+ * The manifest is a header followed by records, which are only ever
+ * appended, so a run which is killed loses at most the records it hadn't
+ * written yet. The last record for a path is the one which counts; a path
+ * whose file has gone gets a record saying so. Loading the manifest means
+ * mapping it and running through the records once to index them by path.
+ * When most of the records are out of date, it's rewritten with just the
+ * latest record for each file still there.
+ *
+ * Paths are recorded as given, so later runs must name the files the same
+ * way, relative to the same directory.
+ */
+
+#define MANIFEST_MAGIC "CFBFMAN\0"
+#define MANIFEST_VERSION 1
+#define MANIFEST_BYTE_ORDER 0x01020304
+
+/* Rewrite the manifest when at least this many records, and more than there
+ * are live ones, are out of date */
+#define MANIFEST_COMPACT_MIN_DEAD 4096
+
+struct manifest_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+};
+
+enum {
+    MANIFEST_RECORD_FILE,
+    MANIFEST_RECORD_DELETED
+};
+
+/* Each record is followed by num_results result hashes, then the path and
+ * enough NULs to end it on a multiple of 8 bytes */
+struct manifest_record {
+    /* XXH64 of the rest of the record, so that one which was only half
+     * written is spotted */
+    uint64_t check;
+    uint32_t record_size;
+    uint16_t path_length;
+    uint8_t type;
+    uint8_t num_results;
+
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+
+    /* Hash of the actions and options the file was processed with */
+    uint64_t actions_hash;
+
+    /* Hash of the file's header and directory */
+    uint64_t structure_hash;
+
+    uint32_t failed;
+    uint32_t reserved;
+};
+
+/* The most results a record can hold */
+#define MANIFEST_MAX_RESULTS 255
+
+/* Where the latest record for each path is, in a hash table keyed on the
+ * path's XXH64 */
+struct manifest_slot {
+    uint64_t path_hash;
+    uint64_t offset;
+    int seen;
+};
+
+struct cfbf_manifest {
+    char *filename;
+    int fd;
+    FILE *append;
+    uint64_t actions_hash;
+
+    void *map;
+    size_t map_size;
+
+    /* How much of the map holds records which check out */
+    size_t data_size;
+
+    struct manifest_slot *slots;
+    size_t num_slots, slots_used;
+
+    /* Records no longer current, and paths whose latest record is a file */
+    size_t num_dead, num_live;
+
+    /* For cfbf_manifest_close()'s report */
+    int num_unchanged, num_processed, num_results_changed, num_deleted;
+
+    /* Each record is put together here before it's written */
+    char *record_buf;
+    size_t record_buf_size;
+};
+
+static uint64_t
+hash_string(const char *s, size_t length) {
+    struct cfbf_xxh64_state state;
+
+    cfbf_xxh64_init(&state, 0);
+    cfbf_xxh64_update(&state, s, length);
+    return cfbf_xxh64_digest(&state);
+}
+
+static size_t
+record_size_for(size_t path_length, int num_results) {
+    return (sizeof(struct manifest_record) + num_results * sizeof(uint64_t) +
+            path_length + 1 + 7) & ~(size_t) 7;
+}
+
+static const uint64_t *
+record_results(const struct manifest_record *r) {
+    return (const uint64_t *) (r + 1);
+}
+
+static const char *
+record_path(const struct manifest_record *r) {
+    return (const char *) (record_results(r) + r->num_results);
+}
+
+static const struct manifest_record *
+record_at(const struct cfbf_manifest *m, uint64_t offset) {
+    return (const struct manifest_record *) ((const char *) m->map + offset);
+}
+
+static uint64_t
+record_check(const struct manifest_record *r) {
+    struct cfbf_xxh64_state state;
+
+    cfbf_xxh64_init(&state, 0);
+    cfbf_xxh64_update(&state, (const char *) r + sizeof(r->check),
+            r->record_size - sizeof(r->check));
+    return cfbf_xxh64_digest(&state);
+}
+
+/* Find the slot for path, or the empty slot where it would go */
+static struct manifest_slot *
+find_slot(const struct cfbf_manifest *m, const char *path, size_t path_length,
+        uint64_t path_hash) {
+    size_t mask = m->num_slots - 1;
+
+    for (size_t i = path_hash & mask; ; i = (i + 1) & mask) {
+        struct manifest_slot *slot = &m->slots[i];
+        const struct manifest_record *r;
+
+        if (slot->offset == 0)
+            return slot;
+        if (slot->path_hash != path_hash)
+            continue;
+        r = record_at(m, slot->offset);
+        if (r->path_length == path_length &&
+                !memcmp(record_path(r), path, path_length))
+            return slot;
+    }
+}
+
+static int
+grow_slots(struct cfbf_manifest *m) {
+    size_t old_num_slots = m->num_slots;
+    struct manifest_slot *old_slots = m->slots;
+
+    m->num_slots = old_num_slots ? old_num_slots * 2 : 1024;
+    m->slots = calloc(m->num_slots, sizeof(struct manifest_slot));
+    if (m->slots == NULL) {
+        error(0, errno, "%s", m->filename);
+        m->slots = old_slots;
+        m->num_slots = old_num_slots;
+        return -1;
+    }
+
+    for (size_t i = 0; i < old_num_slots; ++i) {
+        struct manifest_slot *slot = &old_slots[i];
+        if (slot->offset != 0) {
+            size_t mask = m->num_slots - 1;
+            size_t j = slot->path_hash & mask;
+            while (m->slots[j].offset != 0)
+                j = (j + 1) & mask;
+            m->slots[j] = *slot;
+        }
+    }
+    free(old_slots);
+
+    return 0;
+}
+
+/* Map the manifest and index its records. A record which doesn't check
+ * out, which can only be the last one, written by a run which was killed,
+ * is cut off, so that records appended after it can be found. */
+static int
+manifest_load(struct cfbf_manifest *m) {
+    struct stat st;
+    uint64_t offset;
+
+    if (fstat(m->fd, &st) < 0) {
+        error(0, errno, "%s", m->filename);
+        return -1;
+    }
+
+    if (st.st_size == 0) {
+        struct manifest_header h;
+
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, MANIFEST_MAGIC, 8);
+        h.version = MANIFEST_VERSION;
+        h.byte_order = MANIFEST_BYTE_ORDER;
+        if (write(m->fd, &h, sizeof(h)) != sizeof(h)) {
+            error(0, errno, "%s", m->filename);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (st.st_size < sizeof(struct manifest_header)) {
+        error(0, 0, "%s: not a cfbfinfo manifest", m->filename);
+        return -1;
+    }
+
+    m->map_size = st.st_size;
+    m->map = mmap(NULL, m->map_size, PROT_READ, MAP_SHARED, m->fd, 0);
+    if (m->map == MAP_FAILED) {
+        error(0, errno, "%s", m->filename);
+        m->map = NULL;
+        return -1;
+    }
+    madvise(m->map, m->map_size, MADV_SEQUENTIAL);
+
+    const struct manifest_header *h = m->map;
+    if (memcmp(h->magic, MANIFEST_MAGIC, 8) || h->version != MANIFEST_VERSION ||
+            h->byte_order != MANIFEST_BYTE_ORDER) {
+        error(0, 0, "%s: not a cfbfinfo manifest, or written by a different version or machine", m->filename);
+        return -1;
+    }
+
+    for (offset = sizeof(*h); offset < m->map_size; ) {
+        const struct manifest_record *r = record_at(m, offset);
+        struct manifest_slot *slot;
+        uint64_t path_hash;
+
+        if (m->map_size - offset < sizeof(*r) ||
+                r->record_size > m->map_size - offset ||
+                r->record_size != record_size_for(r->path_length, r->num_results) ||
+                r->check != record_check(r) ||
+                record_path(r)[r->path_length] != '\0') {
+            error(0, 0, "%s: dropping %llu bytes of damaged records at the end", m->filename, (unsigned long long) (m->map_size - offset));
+            if (ftruncate(m->fd, offset) < 0) {
+                error(0, errno, "%s", m->filename);
+                return -1;
+            }
+            break;
+        }
+
+        if (m->slots_used * 2 >= m->num_slots && grow_slots(m) < 0)
+            return -1;
+
+        path_hash = hash_string(record_path(r), r->path_length);
+        slot = find_slot(m, record_path(r), r->path_length, path_hash);
+        if (slot->offset == 0) {
+            m->slots_used++;
+        }
+        else {
+            m->num_dead++;
+            if (record_at(m, slot->offset)->type == MANIFEST_RECORD_FILE)
+                m->num_live--;
+        }
+        slot->path_hash = path_hash;
+        slot->offset = offset;
+        if (r->type == MANIFEST_RECORD_FILE)
+            m->num_live++;
+        else
+            m->num_dead++;
+
+        offset += r->record_size;
+    }
+    m->data_size = offset;
+
+    return 0;
+}
+
+static void
+manifest_unload(struct cfbf_manifest *m) {
+    if (m->map != NULL)
+        munmap(m->map, m->map_size);
+    m->map = NULL;
+    m->map_size = m->data_size = 0;
+    free(m->slots);
+    m->slots = NULL;
+    m->num_slots = m->slots_used = 0;
+    m->num_dead = m->num_live = 0;
+}
+
+/* Open the manifest at filename, creating it if it doesn't exist, for a run
+ * with the actions and options whose cfbf_manifest_actions_hash() is
+ * actions_hash. Only one run can have a manifest open at once. Returns NULL
+ * on failure. */
+struct cfbf_manifest *
+cfbf_manifest_open(const char *filename, uint64_t actions_hash) {
+    struct cfbf_manifest *m;
+
+    m = calloc(1, sizeof(*m));
+    if (m == NULL) {
+        error(0, errno, "cfbf_manifest_open()");
+        return NULL;
+    }
+    m->actions_hash = actions_hash;
+    m->filename = strdup(filename);
+    m->fd = open(filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (m->filename == NULL || m->fd < 0) {
+        error(0, errno, "%s", filename);
+        goto fail;
+    }
+
+    if (flock(m->fd, LOCK_EX | LOCK_NB) < 0) {
+        error(0, errno == EWOULDBLOCK ? 0 : errno,
+                "%s: manifest is in use by another run", filename);
+        goto fail;
+    }
+
+    if (manifest_load(m) < 0)
+        goto fail;
+
+    m->append = fdopen(m->fd, "a");
+    if (m->append == NULL) {
+        error(0, errno, "%s", filename);
+        goto fail;
+    }
+
+    return m;
+
+fail:
+    manifest_unload(m);
+    if (m->fd >= 0)
+        close(m->fd);
+    free(m->filename);
+    free(m);
+    return NULL;
+}
+
+/* Has the file at path, whose stat() gave st, been processed already with
+ * the same actions, without changing since? Either way, path counts as
+ * still being there for cfbf_manifest_close(). */
+int
+cfbf_manifest_unchanged(struct cfbf_manifest *m, const char *path,
+        const struct stat *st) {
+    size_t path_length = strlen(path);
+    struct manifest_slot *slot;
+    const struct manifest_record *r;
+
+    if (m->num_slots == 0)
+        return 0;
+
+    slot = find_slot(m, path, path_length, hash_string(path, path_length));
+    if (slot->offset == 0)
+        return 0;
+    slot->seen = 1;
+
+    r = record_at(m, slot->offset);
+    if (r->type != MANIFEST_RECORD_FILE || r->failed ||
+            r->actions_hash != m->actions_hash ||
+            r->dev != st->st_dev || r->ino != st->st_ino ||
+            r->size != st->st_size ||
+            r->mtime_sec != st->st_mtim.tv_sec ||
+            r->mtime_nsec != st->st_mtim.tv_nsec)
+        return 0;
+
+    m->num_unchanged++;
+    return 1;
+}
+
+static int
+manifest_append(struct cfbf_manifest *m, const char *path, int type,
+        const struct stat *st, uint64_t structure_hash,
+        const uint64_t *results, int num_results, int failed) {
+    size_t path_length = strlen(path);
+    struct manifest_record *r;
+    size_t size;
+
+    if (path_length > UINT16_MAX) {
+        error(0, 0, "%s: path is too long for the manifest", path);
+        return -1;
+    }
+    if (num_results > MANIFEST_MAX_RESULTS)
+        num_results = MANIFEST_MAX_RESULTS;
+
+    size = record_size_for(path_length, num_results);
+    if (size > m->record_buf_size) {
+        char *new_buf = realloc(m->record_buf, size);
+        if (new_buf == NULL) {
+            error(0, errno, "%s", m->filename);
+            return -1;
+        }
+        m->record_buf = new_buf;
+        m->record_buf_size = size;
+    }
+
+    memset(m->record_buf, 0, size);
+    r = (struct manifest_record *) m->record_buf;
+    r->record_size = size;
+    r->path_length = path_length;
+    r->type = type;
+    r->num_results = num_results;
+    if (st != NULL) {
+        r->dev = st->st_dev;
+        r->ino = st->st_ino;
+        r->size = st->st_size;
+        r->mtime_sec = st->st_mtim.tv_sec;
+        r->mtime_nsec = st->st_mtim.tv_nsec;
+    }
+    r->actions_hash = m->actions_hash;
+    r->structure_hash = structure_hash;
+    r->failed = failed;
+    if (num_results > 0)
+        memcpy((uint64_t *) (r + 1), results, num_results * sizeof(uint64_t));
+    memcpy((char *) record_path(r), path, path_length);
+    r->check = record_check(r);
+
+    if (fwrite(r, size, 1, m->append) != 1) {
+        error(0, errno, "%s", m->filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Record that the file at path, whose stat() before it was processed gave
+ * st, has been processed, giving the action results whose hashes are in
+ * results. structure_hash is its cfbf_manifest_structure_hash(), or 0 if
+ * it couldn't be opened. */
+int
+cfbf_manifest_add(struct cfbf_manifest *m, const char *path,
+        const struct stat *st, uint64_t structure_hash,
+        const uint64_t *results, int num_results, int failed) {
+    size_t path_length = strlen(path);
+
+    m->num_processed++;
+
+    /* Did it come out any different from last time? */
+    if (m->num_slots > 0) {
+        struct manifest_slot *slot = find_slot(m, path, path_length,
+                hash_string(path, path_length));
+        const struct manifest_record *r = slot->offset ? record_at(m, slot->offset) : NULL;
+
+        if (r == NULL || r->type != MANIFEST_RECORD_FILE || r->failed != failed ||
+                r->actions_hash != m->actions_hash ||
+                r->num_results != num_results ||
+                (num_results > 0 &&
+                 memcmp(record_results(r), results, num_results * sizeof(uint64_t))))
+            m->num_results_changed++;
+    }
+    else {
+        m->num_results_changed++;
+    }
+
+    return manifest_append(m, path, MANIFEST_RECORD_FILE, st, structure_hash,
+            results, num_results, failed);
+}
+
+/* Is path one of the operands, or under one of them? */
+static int
+path_in_scope(const char *path, const char * const *operands, int num_operands) {
+    for (int i = 0; i < num_operands; ++i) {
+        size_t length = strlen(operands[i]);
+
+        while (length > 1 && operands[i][length - 1] == '/')
+            length--;
+        if (!strncmp(path, operands[i], length) &&
+                (path[length] == '\0' || path[length] == '/' ||
+                 operands[i][length - 1] == '/'))
+            return 1;
+    }
+    return 0;
+}
+
+/* Write the manifest back out with only the latest record for each file */
+static int
+manifest_compact(struct cfbf_manifest *m) {
+    char temp_filename[strlen(m->filename) + 16];
+    struct manifest_header h;
+    FILE *f;
+    int fd;
+
+    snprintf(temp_filename, sizeof(temp_filename), "%s.tmp.XXXXXX", m->filename);
+    fd = mkostemp(temp_filename, O_CLOEXEC);
+    if (fd < 0) {
+        error(0, errno, "%s", temp_filename);
+        return -1;
+    }
+    fchmod(fd, 0644);
+    f = fdopen(fd, "w");
+    if (f == NULL) {
+        error(0, errno, "%s", temp_filename);
+        close(fd);
+        goto fail;
+    }
+
+    memcpy(&h, m->map, sizeof(h));
+    fwrite(&h, sizeof(h), 1, f);
+
+    /* In the order they were written, which is more or less the order of
+     * the files */
+    for (uint64_t offset = sizeof(h); offset < m->data_size; ) {
+        const struct manifest_record *r = record_at(m, offset);
+        struct manifest_slot *slot = find_slot(m, record_path(r),
+                r->path_length, hash_string(record_path(r), r->path_length));
+
+        if (slot->offset == offset && r->type == MANIFEST_RECORD_FILE)
+            fwrite(r, r->record_size, 1, f);
+        offset += r->record_size;
+    }
+
+    if (ferror(f) | (fclose(f) == EOF)) {
+        error(0, errno, "%s", temp_filename);
+        goto fail;
+    }
+
+    if (rename(temp_filename, m->filename) < 0) {
+        error(0, errno, "%s", m->filename);
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    unlink(temp_filename);
+    return -1;
+}
+
+/* Finish a run. Every file in the manifest under one of the operands which
+ * cfbf_manifest_unchanged() wasn't asked about has gone, so it's reported
+ * to report, and recorded as gone. Then, if verbosity is above 0, report
+ * how many files were skipped, processed and deleted, and close the
+ * manifest. Returns 0 on success, or -1 if the manifest couldn't be
+ * written. */
+int
+cfbf_manifest_close(struct cfbf_manifest *m, const char * const *operands,
+        int num_operands, FILE *report, int verbosity) {
+    int retval = 0;
+
+    for (size_t i = 0; i < m->num_slots; ++i) {
+        const struct manifest_record *r;
+
+        if (m->slots[i].offset == 0 || m->slots[i].seen)
+            continue;
+        r = record_at(m, m->slots[i].offset);
+        if (r->type != MANIFEST_RECORD_FILE ||
+                !path_in_scope(record_path(r), operands, num_operands))
+            continue;
+
+        if (verbosity >= 0)
+            fprintf(report, "%s: deleted\n", record_path(r));
+        m->num_deleted++;
+        if (manifest_append(m, record_path(r), MANIFEST_RECORD_DELETED,
+                    NULL, 0, NULL, 0, 0) < 0)
+            retval = -1;
+    }
+
+    if (fflush(m->append) == EOF) {
+        error(0, errno, "%s", m->filename);
+        retval = -1;
+    }
+
+    if (verbosity > 0)
+        fprintf(report, "%s: %d files unchanged, %d processed (%d with different results), %d deleted\n",
+                m->filename, m->num_unchanged, m->num_processed,
+                m->num_results_changed, m->num_deleted);
+
+    /* Look at the manifest as it is now, with this run's records, and
+     * rewrite it if it's mostly dead records. We still hold the lock, as
+     * the manifest isn't closed yet. */
+    if (retval == 0) {
+        manifest_unload(m);
+        if (manifest_load(m) < 0)
+            retval = -1;
+        else if (m->num_dead >= MANIFEST_COMPACT_MIN_DEAD &&
+                m->num_dead > m->num_live && manifest_compact(m) < 0)
+            retval = -1;
+    }
+
+    manifest_unload(m);
+    fclose(m->append);
+    free(m->record_buf);
+    free(m->filename);
+    free(m);
+
+    return retval;
+}
+
+/* Hash of the actions and the options which affect their output, so that
+ * changing either means every file is processed again */
+uint64_t
+cfbf_manifest_actions_hash(const struct cfbf_action *actions, int num_actions,
+        const struct cfbf_action_options *opts) {
+    struct cfbf_xxh64_state state;
+    int32_t values[5];
+
+    cfbf_xxh64_init(&state, 0);
+    for (int i = 0; i < num_actions; ++i) {
+        int32_t type = actions[i].type;
+
+        cfbf_xxh64_update(&state, &type, sizeof(type));
+        if (actions[i].arg != NULL)
+            cfbf_xxh64_update(&state, actions[i].arg, strlen(actions[i].arg) + 1);
+        else
+            cfbf_xxh64_update(&state, "", 1);
+    }
+
+    values[0] = opts->verbosity;
+    values[1] = opts->convert_text_to_utf8;
+    values[2] = opts->use_sha256;
+    values[3] = opts->frag_top_n;
+    values[4] = (int32_t) (opts->seek_latency_ms * 1000);
+    cfbf_xxh64_update(&state, values, sizeof(values));
+    if (opts->publisher_contents_path != NULL)
+        cfbf_xxh64_update(&state, opts->publisher_contents_path,
+                strlen(opts->publisher_contents_path));
+
+    return cfbf_xxh64_digest(&state);
+}
+
+/* Hash of a file's header and directory */
+uint64_t
+cfbf_manifest_structure_hash(struct cfbf *cfbf) {
+    struct cfbf_xxh64_state state;
+
+    cfbf_xxh64_init(&state, 0);
+    cfbf_xxh64_update(&state, cfbf->header, sizeof(struct StructuredStorageHeader));
+    for (int i = 0; i < cfbf->dir_chain_length; ++i)
+        cfbf_xxh64_update(&state, cfbf->dir_chain[i], cfbf->sector_size);
+
+    return cfbf_xxh64_digest(&state);
+}
+
+
+/* Hashing what an action writes */
+
+struct hash_stream {
+    FILE *out;
+    struct cfbf_xxh64_state *state;
+};
+
+static ssize_t
+hash_stream_write(void *cookie, const char *buf, size_t size) {
+    struct hash_stream *stream = (struct hash_stream *) cookie;
+
+    cfbf_xxh64_update(stream->state, buf, size);
+    if (fwrite(buf, 1, size, stream->out) != size)
+        return -1;
+    return size;
+}
+
+static int
+hash_stream_close(void *cookie) {
+    free(cookie);
+    return 0;
+}
+
+/* A stream which passes everything written to it on to out, and adds it to
+ * state as it goes. Close it before looking at the hash. */
+FILE *
+cfbf_manifest_hash_stream(FILE *out, struct cfbf_xxh64_state *state) {
+    cookie_io_functions_t functions;
+    struct hash_stream *stream;
+    FILE *f;
+
+    stream = malloc(sizeof(*stream));
+    if (stream == NULL) {
+        error(0, errno, "cfbf_manifest_hash_stream()");
+        return NULL;
+    }
+    stream->out = out;
+    stream->state = state;
+
+    memset(&functions, 0, sizeof(functions));
+    functions.write = hash_stream_write;
+    functions.close = hash_stream_close;
+
+    f = fopencookie(stream, "w", functions);
+    if (f == NULL) {
+        error(0, errno, "fopencookie()");
+        free(stream);
+        return NULL;
+    }
+
+    return f;
+}
@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cfbf.h"
+
+struct parallel_state {
+    int (*job)(void *cookie, int job_index);
+    void *cookie;
+    int num_jobs;
+
+    /* Index of the next job to be claimed by a worker */
+    int next_job;
+
+    /* Set if any job has failed */
+    int failed;
+};
+
+static void *
+parallel_worker(void *arg) {
+    struct parallel_state *state = (struct parallel_state *) arg;
+    int job_index;
+
+    while ((job_index = __atomic_fetch_add(&state->next_job, 1, __ATOMIC_RELAXED)) < state->num_jobs) {
+        if (state->job(state->cookie, job_index) < 0)
+            __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/* Return the number of worker threads to use if the user hasn't said. */
+int
+cfbf_default_num_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        return 1;
+    else if (n > 64)
+        return 64;
+    else
+        return (int) n;
+}
+
+/* Call job(cookie, i) for every i from 0 to num_jobs - 1, sharing the jobs
+ * out between up to num_threads threads. Jobs are started in order of
+ * job_index, but may finish in any order. job() must return 0 on success
+ * or a negative number on failure. A failed job doesn't stop the others.
+ *
+ * Returns 0 if every job succeeded, or -1 if any failed. */
+int
+cfbf_run_parallel(int num_threads, int num_jobs,
+        int (*job)(void *cookie, int job_index), void *cookie) {
+    struct parallel_state state;
+    pthread_t *threads;
+    int num_started = 0;
+
+    memset(&state, 0, sizeof(state));
+    state.job = job;
+    state.cookie = cookie;
+    state.num_jobs = num_jobs;
+
+    if (num_threads > num_jobs)
+        num_threads = num_jobs;
+
+    if (num_threads <= 1) {
+        parallel_worker(&state);
+        return state.failed ? -1 : 0;
+    }
+
+    threads = malloc(num_threads * sizeof(pthread_t));
+    if (threads == NULL) {
+        error(0, errno, "cfbf_run_parallel()");
+        return -1;
+    }
+
+    for (int i = 0; i < num_threads; ++i) {
+        int ret = pthread_create(&threads[i], NULL, parallel_worker, &state);
+        if (ret != 0) {
+            /* Carry on with the threads we've got. If we have none, this
+             * thread does all the work. */
+            error(0, ret, "cfbf_run_parallel(): pthread_create");
+            break;
+        }
+        ++num_started;
+    }
+
+    if (num_started == 0)
+        parallel_worker(&state);
+
+    for (int i = 0; i < num_started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+
+    return state.failed ? -1 : 0;
+}
@@ -5,6 +5,7 @@
 #include <error.h>
 
 #include "cfbf.h"
+#include "cfbf_trace.h"
 
 /* The CONTENTS stream of a Publisher file is a series of 512-byte sectors,
  * as required by the container format.
@@ -44,24 +45,19 @@ struct pub_contents_segment_list_header {
     uint32_t chain_next_offset;
 };
 
-struct pub_contents_segment_desc {
-    uint16_t tag;  // 0x18 if this is valid
-    char data_type[4];
-    uint16_t data_type_args[3]; // usually 0 1 0
-    char data_format[4];
-    uint32_t offset;  // offset from start of CONTENTS stream
-    uint32_t length; // length of segment in bytes
-};
-
 
-int
-chain_read(void **chain, int num_sectors, int sector_size, size_t stream_size,
-        void *dest, size_t offset, size_t size) {
+/* chain_read() for sectors of 1 << shift bytes. It's instantiated below
+ * with shift a constant for each usual sector size, so finding the sector
+ * and the offset within it is a shift and a mask rather than a division. */
+static inline __attribute__((always_inline)) int
+chain_read_shift(void **chain, int num_sectors, size_t stream_size,
+        void *dest, size_t offset, size_t size, const int shift) {
+    const size_t sector_size = (size_t) 1 << shift;
     size_t bytes_read = 0;
 
     while (bytes_read < size) {
-        FSINDEX sector_index = offset / sector_size;
-        int offset_in_sector = offset % sector_size;
+        FSINDEX sector_index = offset >> shift;
+        int offset_in_sector = offset & (sector_size - 1);
         size_t to_copy;
 
         if (sector_index >= num_sectors) {
@@ -90,15 +86,44 @@ chain_read(void **chain, int num_sectors, int sector_size, size_t stream_size,
     return 0;
 }
 
+/* Copy size bytes from offset in the stream whose sectors are given by
+ * chain, to dest. sector_size must be a power of two. */
 int
-extract_text_from_contents_chain(void **contents_chain, int num_sectors,
-        int sector_size, size_t stream_size, int verbosity,
-        int (*callback)(void *cookie, const char *text, size_t length),
-        void *cookie) {
+chain_read(void **chain, int num_sectors, int sector_size, size_t stream_size,
+        void *dest, size_t offset, size_t size) {
+    CFBF_STAT_ADD(CFBF_STAT_BYTES_COPIED, size);
+
+    switch (sector_size) {
+        case 64:
+            return chain_read_shift(chain, num_sectors, stream_size, dest, offset, size, 6);
+        case 512:
+            return chain_read_shift(chain, num_sectors, stream_size, dest, offset, size, 9);
+        case 4096:
+            return chain_read_shift(chain, num_sectors, stream_size, dest, offset, size, 12);
+        default:
+            return chain_read_shift(chain, num_sectors, stream_size, dest, offset, size,
+                    __builtin_ctz(sector_size));
+    }
+}
+
+/* Read every segment descriptor in the CONTENTS stream into index, following
+ * the chain of segment list headers from the start of the stream. This is the
+ * only place that walks the segment list chain - once the index is loaded,
+ * any segment can be found and read without rescanning the stream.
+ *
+ * Returns 0 on success, or -1 on failure in which case index is left empty.
+ * The caller must free the index with pub_contents_index_free().
+ */
+int
+pub_contents_index_load(struct pub_contents_index *index,
+        void **contents_chain, int num_sectors, int sector_size,
+        size_t stream_size, int verbosity) {
     struct pub_contents_header header;
-    struct pub_contents_segment_desc seg_desc;
     struct pub_contents_segment_list_header seg_list_header;
     size_t seg_list_header_offset;
+    int segments_size = 0;
+
+    memset(index, 0, sizeof(*index));
 
     if (stream_size < sizeof(struct pub_contents_header)) {
         error(0, 0, "CONTENTS stream size is %zd bytes, too short to contain a header", stream_size);
@@ -116,9 +141,10 @@ extract_text_from_contents_chain(void **contents_chain, int num_sectors,
         return -1;
     }
 
+    index->expected_segments = header.total_segments;
+    index->expected_segment_lists = header.num_segment_lists;
+
     seg_list_header_offset = sizeof(header);
-    int num_seg_list_headers = 0;
-    int num_segs = 0;
 
     do {
         /* Read the segment list header, which is at the top of a small
@@ -127,81 +153,190 @@ extract_text_from_contents_chain(void **contents_chain, int num_sectors,
         if (chain_read(contents_chain, num_sectors, sector_size, stream_size,
                     &seg_list_header, seg_list_header_offset, sizeof(seg_list_header)) < 0) {
             error(0, 0, "failed to read segment list header from contents stream at offset %zd", seg_list_header_offset);
-            return -1;
+            goto fail;
+        }
+        ++index->num_segment_lists;
+        CFBF_TRACE2(segment_list, seg_list_header_offset,
+                seg_list_header.num_segments);
+
+        /* There can't be more lists or descriptors than there's room for in
+         * the stream, so if there seem to be, the lists must link round in a
+         * loop */
+        if ((size_t) index->num_segment_lists > stream_size / sizeof(seg_list_header) ||
+                (size_t) index->num_segments + seg_list_header.num_segments >
+                stream_size / sizeof(struct pub_contents_segment_desc)) {
+            error(0, 0, "segment list at offset %zd: segment lists loop", seg_list_header_offset);
+            goto fail;
         }
-        ++num_seg_list_headers;
 
         if (seg_list_header.crap != 0x1f8) {
             error(0, 0, "segment list header at offset %zd: expected magic number 0x1f8, got 0x%hx", seg_list_header_offset, (unsigned short) seg_list_header.crap);
-            return -1;
+            goto fail;
         }
- 
-        for (int seg_index = 0; seg_index < seg_list_header.num_segments; ++seg_index) {
-            /* Read the segment descriptor, which tells us what kind of segment
-             * it is, where it is, and how long it is */
-            size_t sd_offset = seg_list_header_offset + sizeof(seg_list_header) + seg_index * sizeof(seg_desc);
-            if (chain_read(contents_chain, num_sectors, sector_size,
-                        stream_size, &seg_desc,
-                        sd_offset, sizeof(seg_desc)) < 0) {
-                error(0, 0, "failed to read segment descriptor from contents stream at offset %zd", sd_offset);
-                return -1;
-            }
 
-            if (seg_desc.tag == 0x18) {
-                ++num_segs;
-                if (!strncmp(seg_desc.data_type, "TEXT", 4) &&
-                        !strncmp(seg_desc.data_format, "TEXT", 4)) {
-                    uint32_t offset = seg_desc.offset;
-                    char buf[1024];
-
-                    if (verbosity > 0) {
-                        fprintf(stderr, "Reading TEXT/TEXT segment, offset %lu, length %lu... ",
-                                (unsigned long) seg_desc.offset,
-                                (unsigned long) seg_desc.length);
-                    }
-
-                    while (offset < seg_desc.offset + seg_desc.length) {
-                        size_t to_read = seg_desc.offset + seg_desc.length - offset;
-                        if (to_read > sizeof(buf))
-                            to_read = sizeof(buf);
-                        if (chain_read(contents_chain, num_sectors, sector_size,
-                                    stream_size, buf, offset, to_read) < 0) {
-                            error(0, 0, "failed to read chunk of text from contents stream at offset %zd", (size_t) offset);
-                            return -1;
-                        }
-
-                        if (callback(cookie, buf, to_read) < 0) {
-                            error(0, 0, "error signalled by callback");
-                            return -1;
-                        }
-
-                        offset += to_read;
-                    }
-
-                    if (verbosity > 0)
-                        fprintf(stderr, "done.\n");
-                }
-                else {
-                    if (verbosity > 1) {
-                        fprintf(stderr, "Skipping %.4s/%.4s segment, args %hu %hu %hu, offset %lu, length %lu\n",
-                                seg_desc.data_type, seg_desc.data_format,
-                                (unsigned short) seg_desc.data_type_args[0],
-                                (unsigned short) seg_desc.data_type_args[1],
-                                (unsigned short) seg_desc.data_type_args[2],
-                                (unsigned long) seg_desc.offset,
-                                (unsigned long) seg_desc.length);
-                    }
-                }
+        if (index->num_segments + seg_list_header.num_segments > segments_size) {
+            struct pub_contents_segment_desc *new_segments;
+            int new_size = segments_size ? segments_size : 16;
+
+            while (new_size < index->num_segments + seg_list_header.num_segments)
+                new_size *= 2;
+            new_segments = realloc(index->segments, new_size * sizeof(*new_segments));
+            if (new_segments == NULL) {
+                error(0, errno, "pub_contents_index_load()");
+                goto fail;
             }
+            index->segments = new_segments;
+            segments_size = new_size;
+        }
+
+        /* Read the segment descriptors, which tell us what kind of segment
+         * each one is, where it is, and how long it is. They immediately
+         * follow the segment list header, so read them all at once. */
+        size_t sd_offset = seg_list_header_offset + sizeof(seg_list_header);
+        if (chain_read(contents_chain, num_sectors, sector_size,
+                    stream_size, index->segments + index->num_segments,
+                    sd_offset, seg_list_header.num_segments * sizeof(struct pub_contents_segment_desc)) < 0) {
+            error(0, 0, "failed to read segment descriptors from contents stream at offset %zd", sd_offset);
+            goto fail;
         }
+        index->num_segments += seg_list_header.num_segments;
 
         seg_list_header_offset = seg_list_header.chain_next_offset;
     } while (seg_list_header_offset != 0xffffffff);
 
     if (verbosity > 1) {
-        fprintf(stderr, "expected: %u segment descriptors in %u descriptor blocks\n", (unsigned int) header.total_segments, (unsigned int) header.num_segment_lists);
-        fprintf(stderr, "observed: %d segment descriptors in %d descriptor blocks\n", num_segs, num_seg_list_headers);
+        int num_valid = 0;
+        for (int i = 0; i < index->num_segments; ++i) {
+            if (index->segments[i].tag == PUB_CONTENTS_SEGMENT_TAG)
+                ++num_valid;
+        }
+        fprintf(stderr, "expected: %u segment descriptors in %u descriptor blocks\n", (unsigned int) index->expected_segments, (unsigned int) index->expected_segment_lists);
+        fprintf(stderr, "observed: %d segment descriptors in %d descriptor blocks\n", num_valid, index->num_segment_lists);
+    }
+
+    return 0;
+
+fail:
+    pub_contents_index_free(index);
+    return -1;
+}
+
+void
+pub_contents_index_free(struct pub_contents_index *index) {
+    free(index->segments);
+    memset(index, 0, sizeof(*index));
+}
+
+/* Return the position in the index of the first valid segment at or after
+ * position "from" whose data type and data format match the given four-byte
+ * strings. Either may be NULL to match anything. Returns -1 if there is no
+ * such segment. */
+int
+pub_contents_index_find(const struct pub_contents_index *index,
+        const char *data_type, const char *data_format, int from) {
+    for (int i = from < 0 ? 0 : from; i < index->num_segments; ++i) {
+        const struct pub_contents_segment_desc *seg = &index->segments[i];
+
+        if (seg->tag != PUB_CONTENTS_SEGMENT_TAG)
+            continue;
+        if (data_type && strncmp(seg->data_type, data_type, 4))
+            continue;
+        if (data_format && strncmp(seg->data_format, data_format, 4))
+            continue;
+        return i;
+    }
+    return -1;
+}
+
+/* Pass the contents of a segment to callback, in chunks of no more than
+ * 1024 bytes. */
+int
+pub_contents_segment_read(void **contents_chain, int num_sectors,
+        int sector_size, size_t stream_size,
+        const struct pub_contents_segment_desc *seg,
+        int (*callback)(void *cookie, const char *data, size_t length),
+        void *cookie) {
+    uint32_t offset = seg->offset;
+    char buf[1024];
+
+    CFBF_TRACE2(segment_read_start, seg->offset, seg->length);
+
+    while (offset < seg->offset + seg->length) {
+        size_t to_read = seg->offset + seg->length - offset;
+        if (to_read > sizeof(buf))
+            to_read = sizeof(buf);
+        if (chain_read(contents_chain, num_sectors, sector_size,
+                    stream_size, buf, offset, to_read) < 0) {
+            error(0, 0, "failed to read chunk of segment from contents stream at offset %zd", (size_t) offset);
+            CFBF_TRACE3(segment_read_done, seg->offset, seg->length, -1);
+            return -1;
+        }
+
+        CFBF_STAT_ADD(CFBF_STAT_CALLBACKS, 1);
+        if (callback(cookie, buf, to_read) < 0) {
+            error(0, 0, "error signalled by callback");
+            CFBF_TRACE3(segment_read_done, seg->offset, seg->length, -1);
+            return -1;
+        }
+
+        offset += to_read;
     }
 
+    CFBF_TRACE3(segment_read_done, seg->offset, seg->length, 0);
     return 0;
 }
+
+int
+extract_text_from_contents_chain(void **contents_chain, int num_sectors,
+        int sector_size, size_t stream_size, int verbosity,
+        int (*callback)(void *cookie, const char *text, size_t length),
+        void *cookie) {
+    struct pub_contents_index index;
+    int retval = 0;
+
+    if (pub_contents_index_load(&index, contents_chain, num_sectors,
+                sector_size, stream_size, verbosity) < 0) {
+        return -1;
+    }
+
+    for (int seg_index = 0; seg_index < index.num_segments; ++seg_index) {
+        const struct pub_contents_segment_desc *seg_desc = &index.segments[seg_index];
+
+        if (seg_desc->tag != PUB_CONTENTS_SEGMENT_TAG)
+            continue;
+
+        if (!strncmp(seg_desc->data_type, "TEXT", 4) &&
+                !strncmp(seg_desc->data_format, "TEXT", 4)) {
+            if (verbosity > 0) {
+                fprintf(stderr, "Reading TEXT/TEXT segment, offset %lu, length %lu... ",
+                        (unsigned long) seg_desc->offset,
+                        (unsigned long) seg_desc->length);
+            }
+
+            if (pub_contents_segment_read(contents_chain, num_sectors,
+                        sector_size, stream_size, seg_desc,
+                        callback, cookie) < 0) {
+                retval = -1;
+                break;
+            }
+
+            if (verbosity > 0)
+                fprintf(stderr, "done.\n");
+        }
+        else {
+            if (verbosity > 1) {
+                fprintf(stderr, "Skipping %.4s/%.4s segment, args %hu %hu %hu, offset %lu, length %lu\n",
+                        seg_desc->data_type, seg_desc->data_format,
+                        (unsigned short) seg_desc->data_type_args[0],
+                        (unsigned short) seg_desc->data_type_args[1],
+                        (unsigned short) seg_desc->data_type_args[2],
+                        (unsigned long) seg_desc->offset,
+                        (unsigned long) seg_desc->length);
+            }
+        }
+    }
+
+    pub_contents_index_free(&index);
+
+    return retval;
+}
@@ -0,0 +1,299 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+
+#include "cfbf.h"
+
+/* Write a defragmented copy of a CFB file.
+ *
+ * Every chain in the new file is a single contiguous run of sectors, and the
+ * runs are in the order a reader needs them:
+ *     header, FAT, DIFAT, directory, mini-FAT, mini-stream,
+ *     then each stream in the main FAT, in directory tree order.
+ * Streams in the mini-stream are likewise laid out contiguously in the
+ * mini-stream, in directory tree order. Free sectors are dropped.
+ *
+ * Directory entry IDs don't change, so the directory is copied as it is,
+ * apart from the start sectors of streams and the root entry's mini-stream
+ * size. Entries that can't be reached from the root are garbage and are
+ * cleared, so the new file doesn't refer to data we haven't copied.
+ *
+ * The new file is checked afterwards by opening it and running cfbf_walk()
+ * over it, and by comparing every stream with the original.
+ */
+
+struct repack_copy_state {
+    struct cfbf_writer *w;
+    struct cfbf_writer_chain *chain;
+};
+
+struct repack_mini_state {
+    char *dest;
+};
+
+static int
+repack_copy_extent(void *cookie, const void *data, int64_t length,
+        int64_t data_offset, int64_t sector_offset) {
+    struct repack_copy_state *state = (struct repack_copy_state *) cookie;
+    return cfbf_writer_chain_write(state->w, state->chain, data, length);
+}
+
+static int
+repack_copy_mini_extent(void *cookie, const void *data, int64_t length,
+        int64_t data_offset, int64_t sector_offset) {
+    struct repack_mini_state *state = (struct repack_mini_state *) cookie;
+    memcpy(state->dest + data_offset, data, length);
+    CFBF_STAT_ADD(CFBF_STAT_BYTES_COPIED, length);
+    return 0;
+}
+
+static int
+repack_verify(struct cfbf *src, const char *filename, int verbosity) {
+    struct cfbf cfbf;
+    struct cfbf_open_options opts;
+    int retval = 0;
+
+    /* If the original is mapped in windows to save memory, do the same
+     * with the copy */
+    memset(&opts, 0, sizeof(opts));
+    opts.readahead_sectors = src->readahead_sectors;
+    opts.max_memory = (long long) src->window_size * src->num_windows * 2;
+
+    if (cfbf_open_with_options(filename, &cfbf, &opts) < 0) {
+        error(0, 0, "%s: can't open repacked file", filename);
+        return -1;
+    }
+
+    /* cfbf_walk() complains to stderr about anything wrong, and only
+     * describes what it's doing if verbosity is at least 0 */
+    if (cfbf_walk(&cfbf, stderr, verbosity - 1) != 0) {
+        error(0, 0, "%s: repacked file failed the FAT walk", filename);
+        retval = -1;
+    }
+    else if (cfbf_diff(src, &cfbf, stderr, 1) != 0) {
+        error(0, 0, "%s: repacked file's contents differ from the original", filename);
+        retval = -1;
+    }
+
+    cfbf_close(&cfbf);
+
+    return retval;
+}
+
+int
+cfbf_repack(struct cfbf *cfbf, const char *dest_filename, FILE *out,
+        int verbosity) {
+    struct cfbf_dir_path *paths = NULL;
+    int num_paths = 0;
+    void **dir_chain = NULL;
+    int num_dir_secs;
+    int sector_size = cfbf_get_sector_size(cfbf);
+    int mini_sector_size = cfbf_get_mini_fat_sector_size(cfbf);
+    int sector_shift = cfbf->header->_uSectorShift;
+    struct DirEntry *dir = NULL;
+    unsigned long num_dir_entries;
+    char *reachable = NULL;
+    char *mini_stream = NULL;
+    uint64_t mini_stream_size = 0;
+    SECT *mini_fat = NULL;
+    SECT mini_fat_entries = 0, mini_fat_size;
+    SECT num_data_sectors, num_mini_fat_sectors, num_mini_stream_sectors;
+    SECT next_sector;
+    SECT dir_start, mini_fat_start, mini_stream_start;
+    struct cfbf_writer w;
+    int writer_open = 0;
+    int num_cleared = 0;
+    int retval = 0;
+    struct cfbf_arena_mark mark;
+
+    memset(&w, 0, sizeof(w));
+
+    if (cfbf_dir_list_paths(cfbf, &paths, &num_paths) < 0)
+        return -1;
+
+    /* Take a copy of the whole directory, which we'll modify and write out */
+    mark = cfbf_arena_mark(&cfbf->arena);
+    dir_chain = cfbf_dir_get_chain(cfbf, &num_dir_secs);
+
+    dir = cfbf_arena_alloc(&cfbf->arena, (size_t) num_dir_secs * sector_size);
+    reachable = cfbf_arena_calloc(&cfbf->arena, (size_t) num_dir_secs * sector_size / sizeof(struct DirEntry), 1);
+    if (dir == NULL || reachable == NULL)
+        goto fail;
+    for (int i = 0; i < num_dir_secs; ++i)
+        memcpy((char *) dir + (size_t) i * sector_size, dir_chain[i], sector_size);
+    num_dir_entries = (unsigned long) num_dir_secs * sector_size / sizeof(struct DirEntry);
+
+    for (int i = 0; i < num_paths; ++i)
+        reachable[paths[i].entry_id] = 1;
+    for (unsigned long i = 0; i < num_dir_entries; ++i) {
+        if (!reachable[i] && dir[i].object_type != 0) {
+            memset(&dir[i], 0, sizeof(struct DirEntry));
+            dir[i].left_sibling_id = CFBF_NOSTREAM;
+            dir[i].right_sibling_id = CFBF_NOSTREAM;
+            dir[i].child_id = CFBF_NOSTREAM;
+            ++num_cleared;
+        }
+    }
+
+    /* Build the new mini-stream and mini-FAT, with each stream's mini
+     * sectors contiguous */
+    for (int i = 0; i < num_paths; ++i) {
+        struct DirEntry *e = paths[i].entry;
+        if (cfbf_dir_stored_in_mini_stream(cfbf, e))
+            mini_stream_size += (e->stream_size + mini_sector_size - 1) / mini_sector_size * mini_sector_size;
+    }
+
+    mini_fat_entries = mini_stream_size / mini_sector_size;
+    mini_fat_size = (mini_fat_entries * sizeof(SECT) + sector_size - 1) / sector_size * sector_size / sizeof(SECT);
+    if (mini_stream_size > 0) {
+        mini_stream = cfbf_arena_calloc(&cfbf->arena, mini_stream_size, 1);
+        mini_fat = cfbf_arena_alloc(&cfbf->arena, mini_fat_size * sizeof(SECT));
+        if (mini_stream == NULL || mini_fat == NULL)
+            goto fail;
+        for (SECT i = 0; i < mini_fat_size; ++i)
+            mini_fat[i] = CFBF_FREESECT;
+    }
+
+    SECT next_mini_sector = 0;
+    for (int i = 0; i < num_paths; ++i) {
+        struct DirEntry *e = paths[i].entry;
+        struct repack_mini_state mini_state;
+        SECT n;
+
+        if (!cfbf_dir_stored_in_mini_stream(cfbf, e))
+            continue;
+
+        mini_state.dest = mini_stream + (size_t) next_mini_sector * mini_sector_size;
+        if (cfbf_follow_chain_extents(cfbf, e->start_sector, e->stream_size, 1,
+                    repack_copy_mini_extent, &mini_state) < 0) {
+            error(0, 0, "failed to read %s", paths[i].path);
+            goto fail;
+        }
+
+        n = (e->stream_size + mini_sector_size - 1) / mini_sector_size;
+        for (SECT j = 0; j < n; ++j)
+            mini_fat[next_mini_sector + j] = (j + 1 < n) ? next_mini_sector + j + 1 : CFBF_END_OF_CHAIN;
+        dir[paths[i].entry_id].start_sector = next_mini_sector;
+        next_mini_sector += n;
+    }
+
+    /* Work out where everything goes. The writer puts chains in the order
+     * we write them, so we can decide all the start sectors now. */
+    num_mini_fat_sectors = mini_fat_size * sizeof(SECT) / sector_size;
+    num_mini_stream_sectors = (mini_stream_size + sector_size - 1) / sector_size;
+    num_data_sectors = num_dir_secs + num_mini_fat_sectors + num_mini_stream_sectors;
+    for (int i = 0; i < num_paths; ++i) {
+        struct DirEntry *e = paths[i].entry;
+
+        /* A damaged size would have us write out gigabytes of nothing
+         * before we found the chain was too short */
+        if (e->object_type == 2 && e->stream_size > (uint64_t) cfbf->file_size) {
+            error(0, 0, "%s: stream is %llu bytes, bigger than the file",
+                    paths[i].path, (unsigned long long) e->stream_size);
+            goto fail;
+        }
+        if (e->object_type == 2 && e->stream_size > 0 && !cfbf_dir_stored_in_mini_stream(cfbf, e))
+            num_data_sectors += (e->stream_size + sector_size - 1) / sector_size;
+    }
+
+    if (cfbf_writer_open(&w, dest_filename, sector_shift, num_data_sectors) < 0)
+        goto fail;
+    writer_open = 1;
+
+    next_sector = cfbf_writer_next_sector(&w);
+    dir_start = next_sector;
+    next_sector += num_dir_secs;
+    mini_fat_start = num_mini_fat_sectors ? next_sector : CFBF_END_OF_CHAIN;
+    next_sector += num_mini_fat_sectors;
+    mini_stream_start = num_mini_stream_sectors ? next_sector : CFBF_END_OF_CHAIN;
+    next_sector += num_mini_stream_sectors;
+
+    for (int i = 0; i < num_paths; ++i) {
+        struct DirEntry *e = paths[i].entry;
+        struct DirEntry *new_e = &dir[paths[i].entry_id];
+
+        if (e->object_type == 5) {
+            new_e->start_sector = mini_stream_start;
+            new_e->stream_size = mini_stream_size;
+        }
+        else if (e->object_type == 2 && e->stream_size == 0) {
+            new_e->start_sector = CFBF_END_OF_CHAIN;
+        }
+        else if (e->object_type == 2 && !cfbf_dir_stored_in_mini_stream(cfbf, e)) {
+            new_e->start_sector = next_sector;
+            next_sector += (e->stream_size + sector_size - 1) / sector_size;
+        }
+    }
+
+    /* Now write it all out, in that order */
+    if (cfbf_writer_write_chain(&w, dir, (size_t) num_dir_secs * sector_size) != dir_start)
+        goto write_fail;
+    if (num_mini_fat_sectors > 0 &&
+            cfbf_writer_write_chain(&w, mini_fat, mini_fat_size * sizeof(SECT)) != mini_fat_start)
+        goto write_fail;
+    if (num_mini_stream_sectors > 0 &&
+            cfbf_writer_write_chain(&w, mini_stream, mini_stream_size) != mini_stream_start)
+        goto write_fail;
+
+    for (int i = 0; i < num_paths; ++i) {
+        struct DirEntry *e = paths[i].entry;
+        struct cfbf_writer_chain chain;
+        struct repack_copy_state copy_state;
+
+        if (e->object_type != 2 || e->stream_size == 0 || cfbf_dir_stored_in_mini_stream(cfbf, e))
+            continue;
+
+        cfbf_writer_chain_begin(&chain);
+        copy_state.w = &w;
+        copy_state.chain = &chain;
+        if (cfbf_follow_chain_extents(cfbf, e->start_sector, e->stream_size, 0,
+                    repack_copy_extent, &copy_state) < 0) {
+            error(0, 0, "failed to read %s", paths[i].path);
+            cfbf_writer_chain_end(&w, &chain);
+            goto fail;
+        }
+        if (cfbf_writer_chain_end(&w, &chain) != dir[paths[i].entry_id].start_sector)
+            goto write_fail;
+    }
+
+    /* The header is the same as the original apart from where things are */
+    struct StructuredStorageHeader header;
+    memcpy(&header, cfbf->header, sizeof(header));
+    header._sectDirStart = dir_start;
+    header._csectDir = num_dir_secs;
+    header._sectMiniFatStart = mini_fat_start;
+    header._csectMiniFat = num_mini_fat_sectors;
+
+    writer_open = 0;
+    if (cfbf_writer_finish(&w, &header) < 0)
+        goto fail;
+
+    if (repack_verify(cfbf, dest_filename, verbosity) < 0)
+        goto fail;
+
+    if (verbosity > 0) {
+        fprintf(out, "%s: %lu sectors (%lu data), was %lld",
+                dest_filename, (unsigned long) (w.num_sectors),
+                (unsigned long) num_data_sectors,
+                (long long) (cfbf->file_size / sector_size - 1));
+        if (num_cleared > 0)
+            fprintf(out, ", %d unreachable directory entries cleared", num_cleared);
+        fprintf(out, "\n");
+    }
+
+end:
+    if (writer_open)
+        cfbf_writer_abort(&w);
+    cfbf_arena_release(&cfbf->arena, mark);
+    cfbf_dir_free_paths(paths, num_paths);
+    return retval;
+
+write_fail:
+    error(0, 0, "%s: failed to write repacked file", dest_filename);
+
+fail:
+    retval = -1;
+    goto end;
+}
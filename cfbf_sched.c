@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <error.h>
+
+#include "cfbf.h"
+
+/* Read scheduling for actions which read many streams.
+ *
+ * Left to themselves, such actions read streams in directory order and each
+ * stream in chain order, which on a cold cache is random I/O all over the
+ * file. Instead, we find out where every stream's extents are before reading
+ * any of them, then:
+ *
+ *   - put the streams in order of where their data starts in the file, so
+ *     we sweep through the file once rather than back and forth,
+ *   - split that list into batches whose data adds up to no more than the
+ *     read window,
+ *   - for each batch, sort the extents of all its streams by offset, merge
+ *     them, and ask the kernel to read them in with MADV_WILLNEED in one
+ *     ascending sweep, then hand the batch's streams to the thread pool.
+ *
+ * Each job still reads its stream in logical order from the mapping; by the
+ * time it gets there, the pages should already be on their way in. Streams
+ * in the mini-stream are already in memory and need no prefetching. The
+ * window bounds how much we ask the kernel to read ahead at once.
+ */
+
+struct sched_extent {
+    int64_t offset;
+    int64_t length;
+};
+
+struct sched_job {
+    int job_index;
+
+    /* Where the job's first extent starts in the file, or -1 if it has no
+     * extents in the main FAT */
+    int64_t first_offset;
+
+    /* Bytes of the job's data in the main FAT, and which of the extents
+     * list are its, in chain order */
+    int64_t bytes;
+    int first_extent;
+    int num_extents;
+};
+
+struct sched_state {
+    struct sched_extent *extents;
+    int num_extents;
+    int max_extents;
+};
+
+struct sched_batch_state {
+    struct sched_job *jobs;
+    int (*job)(void *cookie, int job_index);
+    void *cookie;
+};
+
+static int
+sched_add_extent(void *cookie, const void *data, int64_t length,
+        int64_t data_offset, int64_t sector_offset) {
+    struct sched_state *state = (struct sched_state *) cookie;
+
+    if (state->num_extents >= state->max_extents) {
+        int new_max = state->max_extents ? state->max_extents * 2 : 256;
+        struct sched_extent *new_extents = realloc(state->extents, new_max * sizeof(struct sched_extent));
+        if (new_extents == NULL) {
+            error(0, errno, "sched_add_extent()");
+            return -1;
+        }
+        state->extents = new_extents;
+        state->max_extents = new_max;
+    }
+
+    state->extents[state->num_extents].offset = sector_offset;
+    state->extents[state->num_extents].length = length;
+    state->num_extents++;
+
+    return 0;
+}
+
+static int
+compare_jobs_by_offset(const void *a, const void *b) {
+    const struct sched_job *ja = (const struct sched_job *) a;
+    const struct sched_job *jb = (const struct sched_job *) b;
+
+    if (ja->first_offset != jb->first_offset)
+        return ja->first_offset < jb->first_offset ? -1 : 1;
+    return ja->job_index - jb->job_index;
+}
+
+static int
+compare_extents_by_offset(const void *a, const void *b) {
+    const struct sched_extent *ea = (const struct sched_extent *) a;
+    const struct sched_extent *eb = (const struct sched_extent *) b;
+
+    if (ea->offset != eb->offset)
+        return ea->offset < eb->offset ? -1 : 1;
+    return 0;
+}
+
+/* Sort extents by offset and ask the kernel to read them in, merging any
+ * which touch the same pages */
+static void
+sched_prefetch(struct cfbf *cfbf, struct sched_extent *extents,
+        int num_extents) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    int64_t run_start = -1, run_end = -1;
+
+    qsort(extents, num_extents, sizeof(struct sched_extent),
+            compare_extents_by_offset);
+
+    for (int i = 0; i <= num_extents; ++i) {
+        int64_t start = 0, end = 0;
+
+        if (i < num_extents) {
+            start = extents[i].offset & ~((int64_t) page_size - 1);
+            end = extents[i].offset + extents[i].length;
+            if (run_start >= 0 && start <= run_end) {
+                if (end > run_end)
+                    run_end = end;
+                continue;
+            }
+        }
+
+        /* Failure only means we don't get the readahead, so ignore it */
+        if (run_start >= 0)
+            cfbf_prefetch(cfbf, run_start, run_end - run_start);
+
+        run_start = start;
+        run_end = end;
+    }
+}
+
+static int
+sched_run_job(void *cookie, int batch_index) {
+    struct sched_batch_state *state = (struct sched_batch_state *) cookie;
+
+    return state->job(state->cookie, state->jobs[batch_index].job_index);
+}
+
+/* Like cfbf_run_parallel(), but for jobs which each read one stream.
+ * entries[i] is the stream job i reads. The jobs are run in batches, in
+ * order of where their data is in the file, and each batch's data is
+ * prefetched with one sweep through the file before its jobs run. window is
+ * the most data to prefetch for one batch, in bytes; if it is 0, the jobs
+ * are just passed to cfbf_run_parallel() as they are.
+ *
+ * Returns 0 if every job succeeded, or -1 if any failed. */
+int
+cfbf_run_scheduled(struct cfbf *cfbf, struct DirEntry **entries, int num_jobs,
+        int64_t window, int num_threads,
+        int (*job)(void *cookie, int job_index), void *cookie) {
+    struct sched_state state;
+    struct sched_job *jobs = NULL;
+    struct sched_extent *batch_extents = NULL;
+    struct sched_batch_state batch_state;
+    int retval = 0;
+
+    if (window <= 0 || num_jobs <= 1)
+        return cfbf_run_parallel(num_threads, num_jobs, job, cookie);
+
+    memset(&state, 0, sizeof(state));
+
+    jobs = calloc(num_jobs, sizeof(struct sched_job));
+    if (jobs == NULL) {
+        error(0, errno, "cfbf_run_scheduled()");
+        return -1;
+    }
+
+    /* Find every job's extents in the main FAT */
+    for (int i = 0; i < num_jobs; ++i) {
+        struct DirEntry *entry = entries[i];
+
+        jobs[i].job_index = i;
+        jobs[i].first_offset = -1;
+        jobs[i].first_extent = state.num_extents;
+
+        if (entry->stream_size > 0 && !cfbf_dir_stored_in_mini_stream(cfbf, entry)) {
+            /* If the chain is broken, the job itself will find out and
+             * say so; all we lose is the prefetch */
+            if (cfbf_follow_chain_extents(cfbf, entry->start_sector,
+                        entry->stream_size, 0, sched_add_extent, &state) < 0)
+                state.num_extents = jobs[i].first_extent;
+        }
+
+        jobs[i].num_extents = state.num_extents - jobs[i].first_extent;
+        if (jobs[i].num_extents > 0)
+            jobs[i].first_offset = state.extents[jobs[i].first_extent].offset;
+        for (int j = 0; j < jobs[i].num_extents; ++j)
+            jobs[i].bytes += state.extents[jobs[i].first_extent + j].length;
+    }
+
+    qsort(jobs, num_jobs, sizeof(struct sched_job), compare_jobs_by_offset);
+
+    batch_extents = malloc((state.num_extents ? state.num_extents : 1) * sizeof(struct sched_extent));
+    if (batch_extents == NULL) {
+        error(0, errno, "cfbf_run_scheduled()");
+        retval = -1;
+        goto end;
+    }
+
+    batch_state.job = job;
+    batch_state.cookie = cookie;
+
+    for (int batch_start = 0; batch_start < num_jobs; ) {
+        int batch_end = batch_start;
+        int64_t batch_bytes = 0;
+        int num_batch_extents = 0;
+
+        /* Take jobs until the next would take us over the window. A job
+         * bigger than the window gets a batch to itself, and only the
+         * first window's worth of it is prefetched. */
+        do {
+            struct sched_job *j = &jobs[batch_end];
+
+            for (int e = 0; e < j->num_extents && batch_bytes < window; ++e) {
+                struct sched_extent *extent = &state.extents[j->first_extent + e];
+                batch_extents[num_batch_extents] = *extent;
+                if (extent->length > window - batch_bytes)
+                    batch_extents[num_batch_extents].length = window - batch_bytes;
+                batch_bytes += batch_extents[num_batch_extents].length;
+                num_batch_extents++;
+            }
+            batch_end++;
+        } while (batch_end < num_jobs && batch_bytes + jobs[batch_end].bytes <= window);
+
+        sched_prefetch(cfbf, batch_extents, num_batch_extents);
+
+        batch_state.jobs = jobs + batch_start;
+        if (cfbf_run_parallel(num_threads, batch_end - batch_start,
+                    sched_run_job, &batch_state) < 0)
+            retval = -1;
+
+        batch_start = batch_end;
+    }
+
+end:
+    free(batch_extents);
+    free(state.extents);
+    free(jobs);
+    return retval;
+}
@@ -0,0 +1,1418 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <error.h>
+
+#include "cfbf.h"
+
+/* Server mode.
+ *
+ * cfbf_serve() reads requests, one JSON object per line, from stdin or from
+ * clients connected to a Unix socket, and writes the responses back the same
+ * way. A request names a file and an action:
+ *
+ *     {"id": 7, "file": "docs/a.pub", "action": "text"}
+ *     {"id": 8, "file": "docs/a.pub", "action": "dump", "path": "Root Entry/Quill/QuillSub/CONTENTS"}
+ *
+ * The action's output is streamed back as it's written, as any number of
+ * lines each carrying a piece of it, then one line giving the outcome:
+ *
+ *     {"id": 7, "data": "Some text\n"}
+ *     {"id": 7, "status": "ok", "cached": true}
+ *
+ * "data" is UTF-8 text. The output of "dump" may be anything, so it's sent
+ * as "base64" instead, each line's piece encoded on its own. The id, which
+ * may be any number or string, is copied from the request to every line of
+ * its response, because the responses to one client's requests may be
+ * interleaved.
+ *
+ * Files are kept open between requests, in a cache with a limit on the
+ * memory their parsed structures take up and on the number of files; the
+ * least recently used are closed first. Each cached file is keyed on its
+ * device, inode, modification time and size, so if it's changed since it
+ * was opened, it's opened again. The file's directory, as a list of paths
+ * sorted for bsearch(), is cached with it the first time a stream is
+ * dumped.
+ *
+ * Requests are carried out by a pool of worker threads, so several can be
+ * in progress at once, but only one at a time can use each cached file.
+ */
+
+#define SERVER_HASH_BUCKETS 4096
+
+/* Longest request line we accept */
+#define SERVER_MAX_REQUEST_LENGTH (64 * 1024)
+
+/* Size of the buffer for each response's output, which is the most sent on
+ * one line */
+#define SERVER_CHUNK_SIZE (32 * 1024)
+
+struct cache_entry {
+    char *filename;
+
+    /* What the file was when we opened it */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+
+    struct cfbf cfbf;
+
+    /* Every object in the directory, and pointers to them sorted by path,
+     * or NULL if nothing has needed them yet */
+    struct cfbf_dir_path *paths;
+    struct cfbf_dir_path **sorted_paths;
+    int num_paths;
+    size_t paths_bytes;
+
+    /* Memory this entry counts for against the cache size */
+    size_t bytes;
+
+    /* Number of workers using the file or waiting to. It isn't closed
+     * while this is more than 0. */
+    int refs;
+
+    /* Set when the entry has been taken out of the cache, because the file
+     * has changed or to make room. The last worker to finish with it
+     * closes it. */
+    int removed;
+
+    /* Held by the worker using cfbf */
+    pthread_mutex_t lock;
+
+    struct cache_entry *hash_next;
+
+    /* Least recently used list, most recent first */
+    struct cache_entry *lru_prev, *lru_next;
+};
+
+struct server_conn {
+    int in_fd, out_fd;
+
+    /* Held while writing a line, so lines from different workers don't
+     * get mixed up */
+    pthread_mutex_t write_lock;
+
+    /* Set if writing to the client has failed, so we stop trying */
+    int failed;
+
+    /* One for the thread reading requests, and one for each request in
+     * progress. The connection is closed when it drops to 0. */
+    int refs;
+};
+
+struct server_request {
+    struct server_conn *conn;
+
+    /* The request's id as it was written in the request, or "null" */
+    char *id;
+
+    char *file;
+    char *action;
+    char *path;
+    int verbosity;
+
+    struct server_request *next;
+};
+
+struct server {
+    const struct cfbf_server_options *opts;
+    const struct cfbf_open_options *open_opts;
+    struct cfbf_action_options action_opts;
+
+    /* Protects everything below, and the refs of each connection */
+    pthread_mutex_t lock;
+
+    /* Requests waiting for a worker */
+    pthread_cond_t queue_cond;
+    struct server_request *queue_head, *queue_tail;
+    int shutting_down;
+
+    struct cache_entry *buckets[SERVER_HASH_BUCKETS];
+    struct cache_entry *lru_head, *lru_tail;
+    int num_cached;
+    size_t cached_bytes;
+
+    /* For the "cache" action */
+    unsigned long hits, misses, invalidations, evictions;
+};
+
+/* A line of JSON being built up */
+struct line_buffer {
+    char *data;
+    size_t length;
+    size_t size;
+    int failed;
+};
+
+static int
+line_reserve(struct line_buffer *line, size_t more) {
+    if (line->failed)
+        return -1;
+
+    if (line->length + more + 1 > line->size) {
+        size_t new_size = line->size ? line->size : 256;
+        char *new_data;
+
+        while (line->length + more + 1 > new_size)
+            new_size *= 2;
+        new_data = realloc(line->data, new_size);
+        if (new_data == NULL) {
+            error(0, errno, "line_reserve()");
+            line->failed = 1;
+            return -1;
+        }
+        line->data = new_data;
+        line->size = new_size;
+    }
+
+    return 0;
+}
+
+static void
+line_append(struct line_buffer *line, const char *s) {
+    size_t length = strlen(s);
+
+    if (line_reserve(line, length) < 0)
+        return;
+    memcpy(line->data + line->length, s, length + 1);
+    line->length += length;
+}
+
+/* Length of the UTF-8 character at p, 0 if the character is cut off by the
+ * end of the data, or -1 if it isn't valid UTF-8 */
+static int
+utf8_char_length(const unsigned char *p, size_t left) {
+    uint32_t c;
+    int length;
+
+    if (p[0] < 0x80)
+        return 1;
+    else if ((p[0] & 0xe0) == 0xc0)
+        length = 2, c = p[0] & 0x1f;
+    else if ((p[0] & 0xf0) == 0xe0)
+        length = 3, c = p[0] & 0x0f;
+    else if ((p[0] & 0xf8) == 0xf0)
+        length = 4, c = p[0] & 0x07;
+    else
+        return -1;
+
+    for (int i = 1; i < length; ++i) {
+        if (i >= left)
+            return 0;
+        if ((p[i] & 0xc0) != 0x80)
+            return -1;
+        c = (c << 6) | (p[i] & 0x3f);
+    }
+
+    /* Overlong forms, surrogates and anything past U+10FFFF */
+    if ((length == 2 && c < 0x80) || (length == 3 && c < 0x800) ||
+            (length == 4 && (c < 0x10000 || c > 0x10ffff)) ||
+            (c >= 0xd800 && c <= 0xdfff))
+        return -1;
+
+    return length;
+}
+
+/* Append data to the line as the inside of a JSON string. Anything which
+ * isn't valid UTF-8 becomes U+FFFD. If final isn't set, an incomplete
+ * character at the end is left for next time. Returns the number of bytes
+ * of data used. */
+static size_t
+line_append_json_text(struct line_buffer *line, const char *data,
+        size_t length, int final) {
+    const unsigned char *p = (const unsigned char *) data;
+    size_t pos = 0;
+
+    /* Nothing is longer than six characters once escaped */
+    if (line_reserve(line, length * 6) < 0)
+        return length;
+
+    while (pos < length) {
+        char *dest = line->data + line->length;
+        int n = utf8_char_length(p + pos, length - pos);
+
+        if (n == 0 && !final)
+            break;
+
+        if (n <= 0) {
+            memcpy(dest, "\\ufffd", 6);
+            line->length += 6;
+            n = 1;
+        }
+        else if (p[pos] == '"' || p[pos] == '\\') {
+            dest[0] = '\\';
+            dest[1] = p[pos];
+            line->length += 2;
+        }
+        else if (p[pos] == '\n') {
+            memcpy(dest, "\\n", 2);
+            line->length += 2;
+        }
+        else if (p[pos] == '\t') {
+            memcpy(dest, "\\t", 2);
+            line->length += 2;
+        }
+        else if (p[pos] < 0x20) {
+            snprintf(dest, 7, "\\u%04x", (unsigned int) p[pos]);
+            line->length += 6;
+        }
+        else {
+            memcpy(dest, p + pos, n);
+            line->length += n;
+        }
+        pos += n;
+    }
+    line->data[line->length] = '\0';
+
+    return pos;
+}
+
+static void
+line_append_base64(struct line_buffer *line, const char *data, size_t length) {
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *p = (const unsigned char *) data;
+    char *dest;
+
+    if (line_reserve(line, (length + 2) / 3 * 4) < 0)
+        return;
+    dest = line->data + line->length;
+
+    for (size_t i = 0; i < length; i += 3) {
+        uint32_t v = p[i] << 16;
+
+        if (i + 1 < length)
+            v |= p[i + 1] << 8;
+        if (i + 2 < length)
+            v |= p[i + 2];
+        *dest++ = digits[(v >> 18) & 0x3f];
+        *dest++ = digits[(v >> 12) & 0x3f];
+        *dest++ = i + 1 < length ? digits[(v >> 6) & 0x3f] : '=';
+        *dest++ = i + 2 < length ? digits[v & 0x3f] : '=';
+    }
+    *dest = '\0';
+    line->length = dest - line->data;
+}
+
+/* Start a response line: {"id": <id>, */
+static void
+line_begin_response(struct line_buffer *line, const char *id) {
+    line->length = 0;
+    line->failed = 0;
+    line_append(line, "{\"id\": ");
+    line_append(line, id);
+    line_append(line, ", ");
+}
+
+/* Write a line to the client. Returns 0 on success or -1 on failure. */
+static int
+conn_write_line(struct server_conn *conn, struct line_buffer *line) {
+    size_t done = 0;
+    int retval = 0;
+
+    line_append(line, "}\n");
+    if (line->failed)
+        return -1;
+
+    pthread_mutex_lock(&conn->write_lock);
+    while (!conn->failed && done < line->length) {
+        ssize_t ret = write(conn->out_fd, line->data + done, line->length - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            /* The client has gone, most likely, so don't go on about it
+             * every time */
+            if (errno != EPIPE && errno != ECONNRESET)
+                error(0, errno, "writing response");
+            conn->failed = 1;
+            break;
+        }
+        done += ret;
+    }
+    retval = conn->failed ? -1 : 0;
+    pthread_mutex_unlock(&conn->write_lock);
+
+    return retval;
+}
+
+static void
+send_status(struct server_conn *conn, const char *id, const char *error_message,
+        int cached) {
+    struct line_buffer line;
+
+    memset(&line, 0, sizeof(line));
+    line_begin_response(&line, id);
+    if (error_message == NULL) {
+        line_append(&line, "\"status\": \"ok\", \"cached\": ");
+        line_append(&line, cached ? "true" : "false");
+    }
+    else {
+        line_append(&line, "\"status\": \"error\", \"error\": \"");
+        line_append_json_text(&line, error_message, strlen(error_message), 1);
+        line_append(&line, "\"");
+    }
+    conn_write_line(conn, &line);
+    free(line.data);
+}
+
+/* Where an action's output goes. Each time the FILE's buffer is written out,
+ * it's sent to the client as one line. */
+struct response_stream {
+    struct server_conn *conn;
+    const char *id;
+    int binary;
+
+    /* The last write's incomplete UTF-8 character, to go with the next */
+    char carry[4];
+    int carry_length;
+
+    struct line_buffer line;
+};
+
+static ssize_t
+response_stream_write(void *cookie, const char *data, size_t length) {
+    struct response_stream *stream = (struct response_stream *) cookie;
+    struct line_buffer *line = &stream->line;
+
+    line_begin_response(line, stream->id);
+    if (stream->binary) {
+        line_append(line, "\"base64\": \"");
+        line_append_base64(line, data, length);
+    }
+    else {
+        size_t used = 0;
+
+        line_append(line, "\"data\": \"");
+        if (stream->carry_length > 0) {
+            char joined[sizeof(stream->carry) * 2];
+            int n = stream->carry_length;
+
+            /* Finish off the character left from last time */
+            memcpy(joined, stream->carry, stream->carry_length);
+            while (used < length && n < sizeof(joined)) {
+                joined[n++] = data[used++];
+                if (utf8_char_length((unsigned char *) joined, n) != 0)
+                    break;
+            }
+            line_append_json_text(line, joined, n, 1);
+            stream->carry_length = 0;
+        }
+        used += line_append_json_text(line, data + used, length - used, 0);
+
+        stream->carry_length = length - used;
+        memcpy(stream->carry, data + used, stream->carry_length);
+    }
+    line_append(line, "\"");
+
+    if (conn_write_line(stream->conn, line) < 0)
+        return -1;
+    return length;
+}
+
+static int
+response_stream_close(void *cookie) {
+    struct response_stream *stream = (struct response_stream *) cookie;
+    int retval = 0;
+
+    /* Anything left over can't be a whole character */
+    if (stream->carry_length > 0) {
+        line_begin_response(&stream->line, stream->id);
+        line_append(&stream->line, "\"data\": \"");
+        line_append_json_text(&stream->line, stream->carry, stream->carry_length, 1);
+        line_append(&stream->line, "\"");
+        retval = conn_write_line(stream->conn, &stream->line);
+    }
+
+    free(stream->line.data);
+    return retval;
+}
+
+static FILE *
+response_stream_open(struct response_stream *stream, struct server_conn *conn,
+        const char *id, int binary) {
+    cookie_io_functions_t functions;
+    FILE *f;
+
+    memset(stream, 0, sizeof(*stream));
+    stream->conn = conn;
+    stream->id = id;
+    stream->binary = binary;
+
+    memset(&functions, 0, sizeof(functions));
+    functions.write = response_stream_write;
+    functions.close = response_stream_close;
+
+    f = fopencookie(stream, "w", functions);
+    if (f == NULL) {
+        error(0, errno, "fopencookie()");
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, SERVER_CHUNK_SIZE);
+
+    return f;
+}
+
+
+/* The cache of open files */
+
+static unsigned int
+cache_hash(const char *filename) {
+    uint32_t h = 2166136261u;
+
+    for (const unsigned char *p = (const unsigned char *) filename; *p; ++p)
+        h = (h ^ *p) * 16777619u;
+
+    return h % SERVER_HASH_BUCKETS;
+}
+
+static int
+cache_entry_matches(const struct cache_entry *entry, const struct stat *st) {
+    return entry->dev == st->st_dev && entry->ino == st->st_ino &&
+        entry->size == st->st_size &&
+        entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+        entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static size_t
+cache_entry_bytes(const struct cache_entry *entry) {
+    return sizeof(*entry) + strlen(entry->filename) +
+        entry->cfbf.arena.bytes_allocated + entry->paths_bytes;
+}
+
+static void
+cache_entry_free(struct cache_entry *entry) {
+    cfbf_close(&entry->cfbf);
+    if (entry->paths != NULL)
+        cfbf_dir_free_paths(entry->paths, entry->num_paths);
+    free(entry->sorted_paths);
+    pthread_mutex_destroy(&entry->lock);
+    free(entry->filename);
+    free(entry);
+}
+
+static void
+lru_unlink(struct server *server, struct cache_entry *entry) {
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        server->lru_head = entry->lru_next;
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        server->lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void
+lru_push_front(struct server *server, struct cache_entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = server->lru_head;
+    if (server->lru_head != NULL)
+        server->lru_head->lru_prev = entry;
+    else
+        server->lru_tail = entry;
+    server->lru_head = entry;
+}
+
+static struct cache_entry *
+cache_find(struct server *server, const char *filename) {
+    struct cache_entry *entry = server->buckets[cache_hash(filename)];
+
+    while (entry != NULL && strcmp(entry->filename, filename))
+        entry = entry->hash_next;
+
+    return entry;
+}
+
+/* Take an entry out of the cache, and close it unless a worker is using it.
+ * Called with server->lock held. */
+static void
+cache_remove(struct server *server, struct cache_entry *entry) {
+    struct cache_entry **pp = &server->buckets[cache_hash(entry->filename)];
+
+    while (*pp != entry)
+        pp = &(*pp)->hash_next;
+    *pp = entry->hash_next;
+    lru_unlink(server, entry);
+
+    server->num_cached--;
+    server->cached_bytes -= entry->bytes;
+    entry->removed = 1;
+
+    if (entry->refs == 0)
+        cache_entry_free(entry);
+}
+
+/* Close the least recently used files not in use until the cache is within
+ * its limits. Called with server->lock held. */
+static void
+cache_evict(struct server *server) {
+    struct cache_entry *entry = server->lru_tail;
+
+    while (entry != NULL && (server->cached_bytes > server->opts->cache_size ||
+                server->num_cached > server->opts->cache_files)) {
+        struct cache_entry *prev = entry->lru_prev;
+
+        if (entry->refs == 0) {
+            cache_remove(server, entry);
+            server->evictions++;
+        }
+        entry = prev;
+    }
+}
+
+/* Return the cache entry for the open file, opening it if it isn't in the
+ * cache or has changed since it was opened. Sets *cached_r to whether it
+ * was already open. Returns NULL, with a message in err, on failure. */
+static struct cache_entry *
+cache_get(struct server *server, const char *filename, int *cached_r,
+        char *err, size_t err_max) {
+    struct cache_entry *entry;
+    struct stat st;
+
+    if (stat(filename, &st) < 0) {
+        snprintf(err, err_max, "%s: %s", filename, strerror(errno));
+        return NULL;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        snprintf(err, err_max, "%s: not a regular file", filename);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&server->lock);
+    entry = cache_find(server, filename);
+    if (entry != NULL && cache_entry_matches(entry, &st)) {
+        server->hits++;
+        entry->refs++;
+        lru_unlink(server, entry);
+        lru_push_front(server, entry);
+        pthread_mutex_unlock(&server->lock);
+        *cached_r = 1;
+        return entry;
+    }
+    if (entry != NULL) {
+        server->invalidations++;
+        cache_remove(server, entry);
+    }
+    server->misses++;
+    pthread_mutex_unlock(&server->lock);
+
+    *cached_r = 0;
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL || (entry->filename = strdup(filename)) == NULL) {
+        free(entry);
+        snprintf(err, err_max, "%s", strerror(ENOMEM));
+        return NULL;
+    }
+
+    if (cfbf_open_with_options(filename, &entry->cfbf, server->open_opts) != 0) {
+        snprintf(err, err_max, "%s: can't open as a CFB file", filename);
+        free(entry->filename);
+        free(entry);
+        return NULL;
+    }
+
+    /* Key it on the file we actually opened, in case it changed between
+     * stat() and open() */
+    if (entry->cfbf.fd >= 0)
+        fstat(entry->cfbf.fd, &st);
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->mtime = st.st_mtim;
+    entry->size = st.st_size;
+    entry->refs = 1;
+    entry->bytes = cache_entry_bytes(entry);
+    pthread_mutex_init(&entry->lock, NULL);
+
+    pthread_mutex_lock(&server->lock);
+
+    /* Another worker may have opened it while we did */
+    struct cache_entry *other = cache_find(server, filename);
+    if (other != NULL)
+        cache_remove(server, other);
+
+    unsigned int bucket = cache_hash(filename);
+    entry->hash_next = server->buckets[bucket];
+    server->buckets[bucket] = entry;
+    lru_push_front(server, entry);
+    server->num_cached++;
+    server->cached_bytes += entry->bytes;
+    cache_evict(server);
+
+    pthread_mutex_unlock(&server->lock);
+
+    return entry;
+}
+
+/* Finish with an entry from cache_get(). It may have grown while it was
+ * being used, so bytes is what it measures now, taken while entry->lock was
+ * still held. */
+static void
+cache_put(struct server *server, struct cache_entry *entry, size_t bytes) {
+    pthread_mutex_lock(&server->lock);
+    entry->refs--;
+    if (entry->removed) {
+        if (entry->refs == 0)
+            cache_entry_free(entry);
+    }
+    else {
+        server->cached_bytes += bytes - entry->bytes;
+        entry->bytes = bytes;
+        cache_evict(server);
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+static int
+compare_dir_paths(const void *a, const void *b) {
+    return strcmp((*(struct cfbf_dir_path * const *) a)->path,
+            (*(struct cfbf_dir_path * const *) b)->path);
+}
+
+/* Find the object with this path, listing the directory the first time.
+ * Called with entry->lock held. */
+static struct DirEntry *
+cache_entry_find_path(struct cache_entry *entry, const char *path) {
+    struct cfbf_dir_path key, *key_p = &key, **found;
+
+    if (entry->paths == NULL) {
+        if (cfbf_dir_list_paths(&entry->cfbf, &entry->paths, &entry->num_paths) < 0) {
+            entry->paths = NULL;
+            return NULL;
+        }
+        entry->sorted_paths = malloc(entry->num_paths * sizeof(struct cfbf_dir_path *));
+        if (entry->sorted_paths == NULL) {
+            error(0, errno, "cache_entry_find_path()");
+            cfbf_dir_free_paths(entry->paths, entry->num_paths);
+            entry->paths = NULL;
+            return NULL;
+        }
+
+        entry->paths_bytes = entry->num_paths * (sizeof(struct cfbf_dir_path) +
+                sizeof(struct cfbf_dir_path *));
+        for (int i = 0; i < entry->num_paths; ++i) {
+            entry->sorted_paths[i] = &entry->paths[i];
+            entry->paths_bytes += strlen(entry->paths[i].name) +
+                strlen(entry->paths[i].path) +
+                strlen(entry->paths[i].escaped_path) + 3;
+        }
+        qsort(entry->sorted_paths, entry->num_paths,
+                sizeof(struct cfbf_dir_path *), compare_dir_paths);
+    }
+
+    while (*path == '/')
+        ++path;
+    key.path = (char *) path;
+    found = bsearch(&key_p, entry->sorted_paths, entry->num_paths,
+            sizeof(struct cfbf_dir_path *), compare_dir_paths);
+
+    return found ? (*found)->entry : NULL;
+}
+
+
+/* Requests */
+
+static const struct {
+    const char *name;
+    enum cfbf_action_type type;
+} server_actions[] = {
+    { "header", CFBF_ACTION_HEADER },
+    { "list", CFBF_ACTION_LIST },
+    { "walk", CFBF_ACTION_WALK },
+    { "dump", CFBF_ACTION_DUMP },
+    { "text", CFBF_ACTION_TEXT },
+    { "segments", CFBF_ACTION_SEGMENTS },
+    { "hash", CFBF_ACTION_HASH },
+    { "frag", CFBF_ACTION_FRAG },
+};
+
+#define NUM_SERVER_ACTIONS (sizeof(server_actions) / sizeof(server_actions[0]))
+
+static void
+send_cache_stats(struct server *server, struct server_request *req) {
+    struct line_buffer line;
+    char buf[256];
+
+    pthread_mutex_lock(&server->lock);
+    snprintf(buf, sizeof(buf), "\"status\": \"ok\", \"files\": %d, "
+            "\"bytes\": %zu, \"hits\": %lu, \"misses\": %lu, "
+            "\"invalidations\": %lu, \"evictions\": %lu",
+            server->num_cached, server->cached_bytes, server->hits,
+            server->misses, server->invalidations, server->evictions);
+    pthread_mutex_unlock(&server->lock);
+
+    memset(&line, 0, sizeof(line));
+    line_begin_response(&line, req->id);
+    line_append(&line, buf);
+    conn_write_line(req->conn, &line);
+    free(line.data);
+}
+
+static void
+serve_request(struct server *server, struct server_request *req) {
+    struct cfbf_action_options opts = server->action_opts;
+    struct cfbf_action action;
+    struct cache_entry *entry;
+    struct response_stream stream;
+    char err[512];
+    const char *err_message = NULL;
+    int action_index;
+    int cached;
+    size_t bytes;
+    FILE *out;
+    int ret;
+
+    if (req->action != NULL && !strcmp(req->action, "cache")) {
+        send_cache_stats(server, req);
+        return;
+    }
+
+    for (action_index = 0; action_index < NUM_SERVER_ACTIONS; ++action_index) {
+        if (req->action != NULL && !strcmp(req->action, server_actions[action_index].name))
+            break;
+    }
+    if (action_index == NUM_SERVER_ACTIONS) {
+        send_status(req->conn, req->id, req->action ? "unknown action" : "no action given", 0);
+        return;
+    }
+    if (req->file == NULL) {
+        send_status(req->conn, req->id, "no file given", 0);
+        return;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.type = server_actions[action_index].type;
+    action.arg = req->path;
+    if (action.type == CFBF_ACTION_DUMP && req->path == NULL) {
+        send_status(req->conn, req->id, "no path given to dump", 0);
+        return;
+    }
+
+    entry = cache_get(server, req->file, &cached, err, sizeof(err));
+    if (entry == NULL) {
+        send_status(req->conn, req->id, err, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&entry->lock);
+
+    out = response_stream_open(&stream, req->conn, req->id,
+            action.type == CFBF_ACTION_DUMP);
+    if (out == NULL) {
+        err_message = "out of memory";
+    }
+    else {
+        if (action.type == CFBF_ACTION_DUMP) {
+            struct DirEntry *e = cache_entry_find_path(entry, req->path);
+
+            if (e == NULL) {
+                snprintf(err, sizeof(err), "object \"%s\" not found", req->path);
+                err_message = err;
+                ret = 0;
+            }
+            else {
+                ret = cfbf_dump_entry(&entry->cfbf, e, req->path, out);
+            }
+        }
+        else {
+            opts.verbosity = req->verbosity;
+            ret = cfbf_run_action(&entry->cfbf, req->file, &action, out, &opts);
+        }
+
+        if (fclose(out) == EOF && err_message == NULL)
+            err_message = "failed to send output";
+        if (ret < 0 && err_message == NULL)
+            err_message = "action failed";
+    }
+
+    bytes = cache_entry_bytes(entry);
+    pthread_mutex_unlock(&entry->lock);
+    cache_put(server, entry, bytes);
+
+    send_status(req->conn, req->id, err_message, cached);
+}
+
+
+/* Parsing requests. A request is a JSON object whose values are strings,
+ * numbers, true, false or null. */
+
+static void
+skip_space(const char **p) {
+    while (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n')
+        ++*p;
+}
+
+static int
+hex_value(const char *p) {
+    int v = 0;
+
+    for (int i = 0; i < 4; ++i) {
+        v <<= 4;
+        if (p[i] >= '0' && p[i] <= '9')
+            v |= p[i] - '0';
+        else if (p[i] >= 'a' && p[i] <= 'f')
+            v |= p[i] - 'a' + 10;
+        else if (p[i] >= 'A' && p[i] <= 'F')
+            v |= p[i] - 'A' + 10;
+        else
+            return -1;
+    }
+
+    return v;
+}
+
+/* Parse the JSON string at *p, leaving *p after it. If value_r isn't NULL,
+ * set it to the string decoded into UTF-8, which must be freed. */
+static int
+parse_json_string(const char **p, char **value_r) {
+    const char *s = *p + 1;
+    char *value, *dest;
+
+    /* Decoding never makes a string longer */
+    value = malloc(strlen(s) + 1);
+    if (value == NULL)
+        return -1;
+    dest = value;
+
+    while (*s != '"') {
+        if ((unsigned char) *s < 0x20) {
+            goto fail;
+        }
+        else if (*s != '\\') {
+            *dest++ = *s++;
+        }
+        else {
+            int c, c2;
+
+            ++s;
+            switch (*s) {
+                case '"': case '\\': case '/':
+                    *dest++ = *s++;
+                    continue;
+                case 'b': *dest++ = '\b'; ++s; continue;
+                case 'f': *dest++ = '\f'; ++s; continue;
+                case 'n': *dest++ = '\n'; ++s; continue;
+                case 'r': *dest++ = '\r'; ++s; continue;
+                case 't': *dest++ = '\t'; ++s; continue;
+                case 'u': break;
+                default: goto fail;
+            }
+
+            c = hex_value(s + 1);
+            s += 5;
+            if (c >= 0xd800 && c <= 0xdbff && s[0] == '\\' && s[1] == 'u' &&
+                    (c2 = hex_value(s + 2)) >= 0xdc00 && c2 <= 0xdfff) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+                s += 6;
+            }
+            else if (c <= 0 || (c >= 0xd800 && c <= 0xdfff)) {
+                /* Bad escape, lone surrogate, or a null we can't put in a
+                 * C string */
+                goto fail;
+            }
+
+            if (c < 0x80) {
+                *dest++ = c;
+            }
+            else if (c < 0x800) {
+                *dest++ = 0xc0 | (c >> 6);
+                *dest++ = 0x80 | (c & 0x3f);
+            }
+            else if (c < 0x10000) {
+                *dest++ = 0xe0 | (c >> 12);
+                *dest++ = 0x80 | ((c >> 6) & 0x3f);
+                *dest++ = 0x80 | (c & 0x3f);
+            }
+            else {
+                *dest++ = 0xf0 | (c >> 18);
+                *dest++ = 0x80 | ((c >> 12) & 0x3f);
+                *dest++ = 0x80 | ((c >> 6) & 0x3f);
+                *dest++ = 0x80 | (c & 0x3f);
+            }
+        }
+    }
+    *dest = '\0';
+    *p = s + 1;
+
+    if (value_r != NULL)
+        *value_r = value;
+    else
+        free(value);
+    return 0;
+
+fail:
+    free(value);
+    return -1;
+}
+
+/* Skip over a number, true, false or null */
+static int
+parse_json_scalar(const char **p) {
+    const char *s = *p;
+
+    if (!strncmp(s, "true", 4) || !strncmp(s, "null", 4)) {
+        s += 4;
+    }
+    else if (!strncmp(s, "false", 5)) {
+        s += 5;
+    }
+    else {
+        const char *digits;
+
+        if (*s == '-')
+            ++s;
+        digits = s;
+        while (*s >= '0' && *s <= '9')
+            ++s;
+        if (s == digits)
+            return -1;
+        if (*s == '.') {
+            digits = ++s;
+            while (*s >= '0' && *s <= '9')
+                ++s;
+            if (s == digits)
+                return -1;
+        }
+        if (*s == 'e' || *s == 'E') {
+            ++s;
+            if (*s == '+' || *s == '-')
+                ++s;
+            digits = s;
+            while (*s >= '0' && *s <= '9')
+                ++s;
+            if (s == digits)
+                return -1;
+        }
+    }
+
+    *p = s;
+    return 0;
+}
+
+static void
+request_free(struct server_request *req) {
+    free(req->id);
+    free(req->file);
+    free(req->action);
+    free(req->path);
+    free(req);
+}
+
+/* Parse a request line into req. Returns 0 on success, or -1 with a
+ * message in *err_r. */
+static int
+parse_request(const char *line, struct server_request *req, const char **err_r) {
+    const char *p = line;
+
+    skip_space(&p);
+    if (*p != '{') {
+        *err_r = "request isn't a JSON object";
+        return -1;
+    }
+    ++p;
+    skip_space(&p);
+
+    while (*p != '}') {
+        char *key, **value_r = NULL;
+        const char *value_start;
+
+        if (*p != '"' || parse_json_string(&p, &key) < 0)
+            goto bad_json;
+        skip_space(&p);
+        if (*p != ':') {
+            free(key);
+            goto bad_json;
+        }
+        ++p;
+        skip_space(&p);
+
+        if (!strcmp(key, "file"))
+            value_r = &req->file;
+        else if (!strcmp(key, "action"))
+            value_r = &req->action;
+        else if (!strcmp(key, "path"))
+            value_r = &req->path;
+
+        value_start = p;
+        if (*p == '"') {
+            if (value_r != NULL)
+                free(*value_r);
+            if (parse_json_string(&p, value_r) < 0) {
+                free(key);
+                goto bad_json;
+            }
+        }
+        else if (*p == '{' || *p == '[') {
+            free(key);
+            *err_r = "request values can't be objects or arrays";
+            return -1;
+        }
+        else if (parse_json_scalar(&p) < 0) {
+            free(key);
+            goto bad_json;
+        }
+
+        if (!strcmp(key, "id")) {
+            free(req->id);
+            req->id = strndup(value_start, p - value_start);
+        }
+        else if (!strcmp(key, "verbose")) {
+            req->verbosity = atoi(value_start);
+        }
+        free(key);
+
+        skip_space(&p);
+        if (*p == ',') {
+            ++p;
+            skip_space(&p);
+            if (*p != '"')
+                goto bad_json;
+        }
+        else if (*p != '}') {
+            goto bad_json;
+        }
+    }
+    ++p;
+    skip_space(&p);
+    if (*p != '\0')
+        goto bad_json;
+
+    return 0;
+
+bad_json:
+    *err_r = "request isn't valid JSON";
+    return -1;
+}
+
+
+/* Connections and workers */
+
+static struct server_conn *
+conn_new(int in_fd, int out_fd) {
+    struct server_conn *conn = calloc(1, sizeof(*conn));
+
+    if (conn == NULL) {
+        error(0, errno, "conn_new()");
+        return NULL;
+    }
+    conn->in_fd = in_fd;
+    conn->out_fd = out_fd;
+    conn->refs = 1;
+    pthread_mutex_init(&conn->write_lock, NULL);
+
+    return conn;
+}
+
+static void
+conn_release(struct server *server, struct server_conn *conn) {
+    int refs;
+
+    pthread_mutex_lock(&server->lock);
+    refs = --conn->refs;
+    pthread_mutex_unlock(&server->lock);
+
+    if (refs > 0)
+        return;
+
+    if (conn->in_fd != STDIN_FILENO)
+        close(conn->in_fd);
+    if (conn->out_fd != conn->in_fd && conn->out_fd != STDOUT_FILENO)
+        close(conn->out_fd);
+    pthread_mutex_destroy(&conn->write_lock);
+    free(conn);
+}
+
+/* Parse a request line and queue it for a worker, or if it's no good, say
+ * so straight away */
+static void
+queue_request_line(struct server *server, struct server_conn *conn,
+        const char *line) {
+    struct server_request *req;
+    const char *err = NULL;
+
+    line += strspn(line, " \t\r");
+    if (*line == '\0')
+        return;
+
+    req = calloc(1, sizeof(*req));
+    if (req == NULL) {
+        send_status(conn, "null", "out of memory", 0);
+        return;
+    }
+    req->verbosity = server->action_opts.verbosity;
+
+    if (parse_request(line, req, &err) < 0 || (req->id == NULL &&
+                (req->id = strdup("null")) == NULL)) {
+        send_status(conn, req->id ? req->id : "null", err ? err : "out of memory", 0);
+        request_free(req);
+        return;
+    }
+
+    req->conn = conn;
+    pthread_mutex_lock(&server->lock);
+    conn->refs++;
+    if (server->queue_tail != NULL)
+        server->queue_tail->next = req;
+    else
+        server->queue_head = req;
+    server->queue_tail = req;
+    pthread_cond_signal(&server->queue_cond);
+    pthread_mutex_unlock(&server->lock);
+}
+
+/* Read requests from the connection until the client closes it */
+static void
+read_requests(struct server *server, struct server_conn *conn) {
+    char *buf = malloc(SERVER_MAX_REQUEST_LENGTH + 1);
+    size_t used = 0;
+    int discarding = 0;
+
+    if (buf == NULL) {
+        error(0, errno, "read_requests()");
+        return;
+    }
+
+    for (;;) {
+        size_t start = 0;
+        char *newline;
+        ssize_t got = read(conn->in_fd, buf + used, SERVER_MAX_REQUEST_LENGTH - used);
+
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0 && errno != ECONNRESET)
+            error(0, errno, "reading requests");
+        if (got <= 0)
+            break;
+        used += got;
+
+        while ((newline = memchr(buf + start, '\n', used - start)) != NULL) {
+            *newline = '\0';
+            if (!discarding)
+                queue_request_line(server, conn, buf + start);
+            discarding = 0;
+            start = newline - buf + 1;
+        }
+        memmove(buf, buf + start, used - start);
+        used -= start;
+
+        if (used == SERVER_MAX_REQUEST_LENGTH) {
+            if (!discarding)
+                send_status(conn, "null", "request too long", 0);
+            discarding = 1;
+            used = 0;
+        }
+    }
+
+    /* The last request needn't end with a newline */
+    if (used > 0 && !discarding) {
+        buf[used] = '\0';
+        queue_request_line(server, conn, buf);
+    }
+
+    free(buf);
+}
+
+static void *
+server_worker(void *arg) {
+    struct server *server = (struct server *) arg;
+
+    for (;;) {
+        struct server_request *req;
+
+        pthread_mutex_lock(&server->lock);
+        while (server->queue_head == NULL && !server->shutting_down)
+            pthread_cond_wait(&server->queue_cond, &server->lock);
+        req = server->queue_head;
+        if (req != NULL) {
+            server->queue_head = req->next;
+            if (server->queue_head == NULL)
+                server->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        if (req == NULL)
+            break;
+
+        serve_request(server, req);
+        conn_release(server, req->conn);
+        request_free(req);
+    }
+
+    return NULL;
+}
+
+struct conn_thread_args {
+    struct server *server;
+    struct server_conn *conn;
+};
+
+static void *
+conn_thread(void *arg) {
+    struct conn_thread_args *args = (struct conn_thread_args *) arg;
+
+    read_requests(args->server, args->conn);
+    conn_release(args->server, args->conn);
+    free(args);
+
+    return NULL;
+}
+
+/* Accept clients on the Unix socket, each getting a thread to read its
+ * requests. Only returns on failure. */
+static int
+serve_socket(struct server *server, const char *socket_path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    int listen_fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        error(0, 0, "%s: socket path is too long", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    /* Clear away the socket left by an earlier run, but nothing else */
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(socket_path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        error(0, errno, "socket()");
+        return -1;
+    }
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            listen(listen_fd, SOMAXCONN) < 0) {
+        error(0, errno, "%s", socket_path);
+        close(listen_fd);
+        return -1;
+    }
+
+    for (;;) {
+        struct conn_thread_args *args;
+        pthread_t thread;
+        int fd, ret;
+
+        fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            error(0, errno, "accept()");
+            break;
+        }
+
+        args = malloc(sizeof(*args));
+        if (args == NULL || (args->conn = conn_new(fd, fd)) == NULL) {
+            free(args);
+            close(fd);
+            continue;
+        }
+        args->server = server;
+
+        ret = pthread_create(&thread, NULL, conn_thread, args);
+        if (ret != 0) {
+            error(0, ret, "pthread_create");
+            conn_release(server, args->conn);
+            free(args);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(listen_fd);
+    return -1;
+}
+
+/* Serve requests until stdin reaches end of file, or for ever if listening
+ * on a socket. Returns 0 when stdin is finished with, or -1 on failure. */
+int
+cfbf_serve(const struct cfbf_server_options *opts,
+        const struct cfbf_action_options *action_opts,
+        const struct cfbf_open_options *open_opts) {
+    struct server *server;
+    pthread_t *workers;
+    int num_workers = 0;
+    int retval = 0;
+
+    server = calloc(1, sizeof(*server));
+    workers = calloc(opts->num_workers, sizeof(pthread_t));
+    if (server == NULL || workers == NULL) {
+        error(0, errno, "cfbf_serve()");
+        free(server);
+        free(workers);
+        return -1;
+    }
+
+    server->opts = opts;
+    server->open_opts = open_opts;
+    server->action_opts = *action_opts;
+
+    /* The parallelism is between requests, not within them */
+    server->action_opts.num_threads = 1;
+
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->queue_cond, NULL);
+
+    /* A client going away shouldn't take the server with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < opts->num_workers; ++i) {
+        int ret = pthread_create(&workers[i], NULL, server_worker, server);
+        if (ret != 0) {
+            error(0, ret, "cfbf_serve(): pthread_create");
+            break;
+        }
+        ++num_workers;
+    }
+    if (num_workers == 0) {
+        retval = -1;
+        goto end;
+    }
+
+    if (opts->socket_path != NULL) {
+        retval = serve_socket(server, opts->socket_path);
+    }
+    else {
+        struct server_conn *conn = conn_new(STDIN_FILENO, STDOUT_FILENO);
+
+        if (conn == NULL) {
+            retval = -1;
+        }
+        else {
+            read_requests(server, conn);
+            conn_release(server, conn);
+        }
+    }
+
+end:
+    /* Let the workers finish what's queued, then close everything */
+    pthread_mutex_lock(&server->lock);
+    server->shutting_down = 1;
+    pthread_cond_broadcast(&server->queue_cond);
+    pthread_mutex_unlock(&server->lock);
+
+    for (int i = 0; i < num_workers; ++i)
+        pthread_join(workers[i], NULL);
+
+    while (server->lru_head != NULL)
+        cache_remove(server, server->lru_head);
+
+    pthread_cond_destroy(&server->queue_cond);
+    pthread_mutex_destroy(&server->lock);
+    free(workers);
+    free(server);
+
+    return retval;
+}
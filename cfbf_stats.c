@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "cfbf.h"
+
+/* Statistics for --stats.
+ *
+ * Phases are timed by taking cfbf_stats_now() at the start and passing it
+ * to cfbf_stats_phase_end() at the end, and counters are bumped with
+ * CFBF_STAT_ADD(). Until cfbf_stats_enable() is called, cfbf_stats_now()
+ * doesn't read the clock and neither of the others does anything, so the
+ * cost when --stats isn't given is a test of cfbf_stats.enabled.
+ *
+ * Phases can nest: the time in CFBF_PHASE_OPEN includes all the
+ * CFBF_PHASE_OPEN_* phases, and an action's time includes any chain
+ * following, directory lookups and iconv calls it does.
+ */
+
+struct cfbf_stats cfbf_stats;
+
+static const char *phase_names[CFBF_NUM_PHASES] = {
+    [CFBF_PHASE_OPEN] = "open",
+    [CFBF_PHASE_OPEN_MAP] = "open.map",
+    [CFBF_PHASE_OPEN_FAT] = "open.fat",
+    [CFBF_PHASE_OPEN_MINI_FAT] = "open.mini_fat",
+    [CFBF_PHASE_OPEN_MINI_STREAM] = "open.mini_stream",
+    [CFBF_PHASE_OPEN_DIRECTORY] = "open.directory",
+    [CFBF_PHASE_CLOSE] = "close",
+    [CFBF_PHASE_CHAIN_PTRS] = "chain_ptrs",
+    [CFBF_PHASE_DIR_LOOKUP] = "dir_lookup",
+    [CFBF_PHASE_ICONV] = "iconv",
+    [CFBF_PHASE_OUTPUT_FLUSH] = "output_flush",
+    [CFBF_PHASE_ACTION + CFBF_ACTION_HEADER] = "action.header",
+    [CFBF_PHASE_ACTION + CFBF_ACTION_LIST] = "action.list",
+    [CFBF_PHASE_ACTION + CFBF_ACTION_WALK] = "action.walk",
+    [CFBF_PHASE_ACTION + CFBF_ACTION_DUMP] = "action.dump",
+    [CFBF_PHASE_ACTION + CFBF_ACTION_TEXT] = "action.text",
+    [CFBF_PHASE_ACTION + CFBF_ACTION_SEGMENTS] = "action.segments",
+    [CFBF_PHASE_ACTION + CFBF_ACTION_EXTRACT] = "action.extract",
+    [CFBF_PHASE_ACTION + CFBF_ACTION_TAR] = "action.tar",
+    [CFBF_PHASE_ACTION + CFBF_ACTION_HASH] = "action.hash",
+    [CFBF_PHASE_ACTION + CFBF_ACTION_REPACK] = "action.repack",
+    [CFBF_PHASE_ACTION + CFBF_ACTION_FRAG] = "action.frag",
+};
+
+static const char *counter_names[CFBF_NUM_COUNTERS] = {
+    [CFBF_STAT_SECTORS] = "sectors_touched",
+    [CFBF_STAT_BYTES_COPIED] = "bytes_copied",
+    [CFBF_STAT_CALLBACKS] = "callbacks",
+    [CFBF_STAT_ICONV_CALLS] = "iconv_calls",
+    [CFBF_STAT_CHAIN_GROWS] = "chain_ptr_reallocs",
+    [CFBF_STAT_DIR_LOOKUPS] = "dir_lookups",
+};
+
+static uint64_t
+monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+cfbf_stats_enable(void) {
+    memset(&cfbf_stats, 0, sizeof(cfbf_stats));
+    cfbf_stats.start_ns = monotonic_ns();
+    cfbf_stats.enabled = 1;
+}
+
+/* Return the time to pass to cfbf_stats_phase_end(), or 0 if we're not
+ * keeping statistics */
+uint64_t
+cfbf_stats_now(void) {
+    if (!cfbf_stats.enabled)
+        return 0;
+    return monotonic_ns();
+}
+
+void
+cfbf_stats_phase_end(enum cfbf_stats_phase phase, uint64_t start_ns) {
+    struct cfbf_stats_phase_total *p = &cfbf_stats.phases[phase];
+    uint64_t elapsed, max;
+
+    if (!cfbf_stats.enabled)
+        return;
+
+    elapsed = monotonic_ns() - start_ns;
+    __atomic_fetch_add(&p->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->total_ns, elapsed, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&p->max_ns, __ATOMIC_RELAXED);
+    while (elapsed > max &&
+            !__atomic_compare_exchange_n(&p->max_ns, &max, elapsed, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* Called as each arena is freed, with the most it held */
+void
+cfbf_stats_arena_peak(uint64_t bytes) {
+    uint64_t max;
+
+    if (!cfbf_stats.enabled)
+        return;
+
+    max = __atomic_load_n(&cfbf_stats.arena_peak_bytes, __ATOMIC_RELAXED);
+    while (bytes > max &&
+            !__atomic_compare_exchange_n(&cfbf_stats.arena_peak_bytes, &max,
+                bytes, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void
+print_ms(FILE *out, uint64_t ns) {
+    fprintf(out, "%llu.%06llu", (unsigned long long) (ns / 1000000),
+            (unsigned long long) (ns % 1000000));
+}
+
+static void
+print_timeval_ms(FILE *out, const struct timeval *tv) {
+    print_ms(out, (uint64_t) tv->tv_sec * 1000000000 + (uint64_t) tv->tv_usec * 1000);
+}
+
+/* Write everything recorded so far to out as one JSON object. Phases which
+ * never happened are left out. Times are in milliseconds. */
+void
+cfbf_stats_print(FILE *out) {
+    struct rusage ru;
+    int first = 1;
+
+    if (!cfbf_stats.enabled)
+        return;
+
+    fprintf(out, "{\"files\": %llu, \"wall_ms\": ",
+            (unsigned long long) cfbf_stats.phases[CFBF_PHASE_OPEN].count);
+    print_ms(out, monotonic_ns() - cfbf_stats.start_ns);
+
+    fprintf(out, ", \"phases\": {");
+    for (int i = 0; i < CFBF_NUM_PHASES; ++i) {
+        const struct cfbf_stats_phase_total *p = &cfbf_stats.phases[i];
+
+        if (p->count == 0)
+            continue;
+        fprintf(out, "%s\"%s\": {\"count\": %llu, \"total_ms\": ",
+                first ? "" : ", ", phase_names[i],
+                (unsigned long long) p->count);
+        print_ms(out, p->total_ns);
+        fprintf(out, ", \"max_ms\": ");
+        print_ms(out, p->max_ns);
+        fprintf(out, "}");
+        first = 0;
+    }
+
+    fprintf(out, "}, \"counters\": {");
+    for (int i = 0; i < CFBF_NUM_COUNTERS; ++i) {
+        fprintf(out, "%s\"%s\": %llu", i ? ", " : "", counter_names[i],
+                (unsigned long long) cfbf_stats.counters[i]);
+    }
+    fprintf(out, "}, \"arena_peak_bytes\": %llu",
+            (unsigned long long) cfbf_stats.arena_peak_bytes);
+
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        fprintf(out, ", \"rusage\": {\"max_rss_kb\": %ld, \"minor_faults\": %ld, \"major_faults\": %ld, \"user_ms\": ",
+                ru.ru_maxrss, ru.ru_minflt, ru.ru_majflt);
+        print_timeval_ms(out, &ru.ru_utime);
+        fprintf(out, ", \"sys_ms\": ");
+        print_timeval_ms(out, &ru.ru_stime);
+        fprintf(out, "}");
+    }
+
+    fprintf(out, "}\n");
+}
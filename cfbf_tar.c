@@ -0,0 +1,387 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <error.h>
+
+#include "cfbf.h"
+
+/* Write the storage tree of a CFB file to a file descriptor as a POSIX tar
+ * archive. Storages become directories and streams become regular files,
+ * named by their escaped paths relative to the root entry. Names which don't
+ * fit in a ustar header get a pax extended header, as do streams too big for
+ * the ustar size field.
+ *
+ * Everything goes through one large output buffer: headers are built in
+ * place in the buffer, and stream contents are copied into it straight from
+ * the sectors of the mapped file, one extent at a time. The buffer is
+ * written out with write() whenever it fills up.
+ */
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_RECORD_SIZE (TAR_BLOCK_SIZE * 20)
+#define TAR_BUFFER_SIZE (TAR_RECORD_SIZE * 400)
+
+/* Largest file size which fits in the 11 octal digits of a ustar header */
+#define TAR_USTAR_MAX_SIZE 077777777777ULL
+
+/* Seconds between 1601-01-01 (the FILETIME epoch) and 1970-01-01 */
+#define FILETIME_UNIX_EPOCH_SECONDS 11644473600ULL
+
+struct ustar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+struct tar_state {
+    int fd;
+    char *buf;
+    size_t buf_used;
+
+    /* Total bytes written to fd */
+    unsigned long long bytes_out;
+};
+
+static int
+tar_flush(struct tar_state *state) {
+    char *p = state->buf;
+    size_t left = state->buf_used;
+
+    while (left > 0) {
+        ssize_t ret = write(state->fd, p, left);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            error(0, errno, "tar output");
+            return -1;
+        }
+        p += ret;
+        left -= ret;
+    }
+    state->bytes_out += state->buf_used;
+    state->buf_used = 0;
+
+    return 0;
+}
+
+/* Return a pointer to the next length bytes of the output buffer, flushing it
+ * first if necessary. length must be no more than TAR_BUFFER_SIZE. */
+static char *
+tar_reserve(struct tar_state *state, size_t length) {
+    char *p;
+
+    if (state->buf_used + length > TAR_BUFFER_SIZE) {
+        if (tar_flush(state) < 0)
+            return NULL;
+    }
+    p = state->buf + state->buf_used;
+    state->buf_used += length;
+
+    return p;
+}
+
+/* Pad the output with zeroes up to the next multiple of block_size */
+static int
+tar_pad(struct tar_state *state, size_t block_size) {
+    size_t pos = (state->bytes_out + state->buf_used) % block_size;
+
+    if (pos != 0) {
+        size_t pad = block_size - pos;
+        char *p = tar_reserve(state, pad);
+        if (p == NULL)
+            return -1;
+        memset(p, 0, pad);
+    }
+    return 0;
+}
+
+static int
+tar_copy_extent(void *cookie, const void *data, int64_t length,
+        int64_t data_offset, int64_t sector_offset) {
+    struct tar_state *state = (struct tar_state *) cookie;
+
+    while (length > 0) {
+        size_t to_copy = TAR_BUFFER_SIZE - state->buf_used;
+
+        if (to_copy == 0) {
+            if (tar_flush(state) < 0)
+                return -1;
+            continue;
+        }
+        if (to_copy > length)
+            to_copy = length;
+
+        memcpy(state->buf + state->buf_used, data, to_copy);
+        CFBF_STAT_ADD(CFBF_STAT_BYTES_COPIED, to_copy);
+        state->buf_used += to_copy;
+        data = (const char *) data + to_copy;
+        length -= to_copy;
+    }
+
+    return 0;
+}
+
+/* Write value into a header field as dest_size - 1 zero-padded octal digits
+ * and a NUL. Callers keep values in range, but if one isn't, its top digits
+ * are dropped. */
+static void
+tar_octal(char *dest, size_t dest_size, unsigned long long value) {
+    dest[dest_size - 1] = '\0';
+    for (size_t i = dest_size - 1; i > 0; --i) {
+        dest[i - 1] = '0' + (value & 7);
+        value >>= 3;
+    }
+}
+
+static int
+tar_write_header(struct tar_state *state, const char *name, char typeflag,
+        unsigned long long size, unsigned long long mtime) {
+    struct ustar_header *h;
+    unsigned int checksum = 0;
+
+    h = (struct ustar_header *) tar_reserve(state, TAR_BLOCK_SIZE);
+    if (h == NULL)
+        return -1;
+    memset(h, 0, TAR_BLOCK_SIZE);
+
+    /* The caller has already made sure the name fits, splitting it between
+     * prefix and name if need be */
+    if (strlen(name) <= sizeof(h->name)) {
+        memcpy(h->name, name, strlen(name));
+    }
+    else {
+        const char *slash = strchr(name + strlen(name) - sizeof(h->name) - 1, '/');
+        memcpy(h->prefix, name, slash - name);
+        memcpy(h->name, slash + 1, strlen(slash + 1));
+    }
+
+    tar_octal(h->mode, sizeof(h->mode), typeflag == '5' ? 0755 : 0644);
+    tar_octal(h->uid, sizeof(h->uid), 0);
+    tar_octal(h->gid, sizeof(h->gid), 0);
+    tar_octal(h->size, sizeof(h->size), size > TAR_USTAR_MAX_SIZE ? 0 : size);
+    tar_octal(h->mtime, sizeof(h->mtime), mtime);
+    h->typeflag = typeflag;
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    for (int i = 0; i < TAR_BLOCK_SIZE; ++i)
+        checksum += ((unsigned char *) h)[i];
+    snprintf(h->chksum, sizeof(h->chksum), "%06o", checksum);
+
+    return 0;
+}
+
+/* Append a pax record "<length> <keyword>=<value>\n" to records, where
+ * length is the length of the whole record including itself. */
+static size_t
+pax_record(char *records, size_t pos, const char *keyword, const char *value) {
+    size_t payload = strlen(keyword) + strlen(value) + 3;
+    size_t length = payload + 1;
+
+    /* The length includes its own digits */
+    while (snprintf(NULL, 0, "%zu", length) + payload != length)
+        ++length;
+
+    sprintf(records + pos, "%zu %s=%s\n", length, keyword, value);
+    return pos + length;
+}
+
+/* Does the name fit in a ustar header, possibly split into prefix and
+ * name at a slash? */
+static int
+ustar_name_fits(const char *name) {
+    size_t len = strlen(name);
+    const char *slash;
+
+    if (len <= 100)
+        return 1;
+    if (len > 100 + 1 + 155)
+        return 0;
+
+    /* Find the first slash which leaves no more than 100 bytes after it */
+    slash = strchr(name + len - 101, '/');
+    return slash != NULL && slash - name <= 155 && slash[1] != '\0';
+}
+
+static int
+tar_write_entry(struct tar_state *state, const char *name, char typeflag,
+        unsigned long long size, unsigned long long mtime) {
+    int need_path = !ustar_name_fits(name);
+    int need_size = (size > TAR_USTAR_MAX_SIZE);
+
+    if (need_path || need_size) {
+        char *records;
+        size_t records_len = 0;
+        char size_str[24];
+        char *p;
+
+        records = malloc(strlen(name) + 64);
+        if (records == NULL) {
+            error(0, errno, "tar_write_entry()");
+            return -1;
+        }
+        if (need_path)
+            records_len = pax_record(records, records_len, "path", name);
+        if (need_size) {
+            snprintf(size_str, sizeof(size_str), "%llu", size);
+            records_len = pax_record(records, records_len, "size", size_str);
+        }
+
+        if (tar_write_header(state, "././@PaxHeader", 'x', records_len, mtime) < 0) {
+            free(records);
+            return -1;
+        }
+        p = tar_reserve(state, records_len);
+        if (p == NULL) {
+            free(records);
+            return -1;
+        }
+        memcpy(p, records, records_len);
+        free(records);
+        if (tar_pad(state, TAR_BLOCK_SIZE) < 0)
+            return -1;
+
+        if (need_path) {
+            /* The real name is in the pax header, so the ustar header gets
+             * a truncated one for the benefit of readers that don't
+             * understand pax */
+            char short_name[101];
+            snprintf(short_name, sizeof(short_name), "%s", name);
+            return tar_write_header(state, short_name, typeflag, size, mtime);
+        }
+    }
+
+    return tar_write_header(state, name, typeflag, size, mtime);
+}
+
+static unsigned long long
+filetime_to_unix(const FILETIME *ft) {
+    unsigned long long t = ((unsigned long long) ft->high << 32) | ft->low;
+
+    t /= 10000000;
+    if (t < FILETIME_UNIX_EPOCH_SECONDS)
+        return 0;
+    return t - FILETIME_UNIX_EPOCH_SECONDS;
+}
+
+int
+cfbf_write_tar(struct cfbf *cfbf, int fd, int verbosity) {
+    struct tar_state state;
+    struct cfbf_dir_path *paths;
+    int num_paths;
+    char *skipped = NULL;
+    int retval = 0;
+
+    memset(&state, 0, sizeof(state));
+    state.fd = fd;
+
+    if (cfbf_dir_list_paths(cfbf, &paths, &num_paths) < 0)
+        return -1;
+
+    state.buf = malloc(TAR_BUFFER_SIZE);
+    skipped = calloc(num_paths, 1);
+    if (state.buf == NULL || skipped == NULL) {
+        error(0, errno, "cfbf_write_tar()");
+        goto fail;
+    }
+
+    for (int i = 0; i < num_paths; ++i) {
+        struct cfbf_dir_path *p = &paths[i];
+        struct DirEntry *e = p->entry;
+        unsigned long long mtime;
+        char *name;
+
+        /* The root entry is the top of the archive, so it has no entry of
+         * its own */
+        if (p->parent < 0)
+            continue;
+
+        if (skipped[p->parent]) {
+            skipped[i] = 1;
+            continue;
+        }
+
+        if (e->object_type != 1 && e->object_type != 2) {
+            error(0, 0, "%s: object type %d is not a storage or a stream, skipping", p->path, (int) e->object_type);
+            skipped[i] = 1;
+            retval = -1;
+            continue;
+        }
+
+        mtime = filetime_to_unix(&e->modified_time);
+        if (mtime == 0)
+            mtime = filetime_to_unix(&e->creation_time);
+
+        if (e->object_type == 1) {
+            name = malloc(strlen(p->escaped_path) + 2);
+            if (name == NULL) {
+                error(0, errno, "cfbf_write_tar()");
+                goto fail;
+            }
+            sprintf(name, "%s/", p->escaped_path);
+            if (tar_write_entry(&state, name, '5', 0, mtime) < 0) {
+                free(name);
+                goto fail;
+            }
+            free(name);
+        }
+        else {
+            if (tar_write_entry(&state, p->escaped_path, '0', e->stream_size, mtime) < 0)
+                goto fail;
+
+            if (e->stream_size > 0) {
+                if (cfbf_follow_chain_extents(cfbf, e->start_sector,
+                            e->stream_size,
+                            cfbf_dir_stored_in_mini_stream(cfbf, e),
+                            tar_copy_extent, &state) < 0) {
+                    /* We've already promised stream_size bytes in the
+                     * header, so there's no way to carry on */
+                    error(0, 0, "failed to read %s", p->path);
+                    goto fail;
+                }
+            }
+            if (tar_pad(&state, TAR_BLOCK_SIZE) < 0)
+                goto fail;
+
+            if (verbosity > 0)
+                fprintf(stderr, "%s\n", p->escaped_path);
+        }
+    }
+
+    /* End of archive: two zero blocks, then pad to a whole record */
+    char *end = tar_reserve(&state, TAR_BLOCK_SIZE * 2);
+    if (end == NULL)
+        goto fail;
+    memset(end, 0, TAR_BLOCK_SIZE * 2);
+    if (tar_pad(&state, TAR_RECORD_SIZE) < 0)
+        goto fail;
+    if (tar_flush(&state) < 0)
+        goto fail;
+
+end:
+    free(skipped);
+    free(state.buf);
+    cfbf_dir_free_paths(paths, num_paths);
+    return retval;
+
+fail:
+    retval = -1;
+    goto end;
+}
@@ -0,0 +1,66 @@
+#ifndef _CFBF_TRACE_H
+#define _CFBF_TRACE_H
+
+/* USDT (user-level statically defined tracing) probes.
+ *
+ * Built with -DCFBF_USDT ("make USDT=1"), which needs <sys/sdt.h> from
+ * SystemTap (systemtap-sdt-dev or systemtap-sdt-devel), each CFBF_TRACE()
+ * below becomes a probe that bpftrace or perf can attach to in a running
+ * cfbfinfo. An unattached probe is a single nop. Without CFBF_USDT they
+ * compile to nothing, and their arguments aren't evaluated.
+ *
+ * The provider is "cfbfinfo". The probes and their arguments are:
+ *
+ * open_start         filename
+ * open_done          filename, file size, 0 or -1
+ * close              file size
+ * fat_load_start     number of FAT sectors, number of DIFAT sectors
+ * fat_load_done      number of FAT entries, 0 or -1
+ * minifat_load_start first mini-FAT sector, number of mini-FAT sectors
+ * minifat_load_done  number of mini-FAT entries, 0 or -1
+ * chain_start        kind, first sector, 1 if in the mini-stream, size
+ *                    in bytes or -1 if unknown
+ * chain_done         kind, first sector, 1 if in the mini-stream, number
+ *                    of sectors, 0 or -1
+ * sector_fetch       sector, 1 if in the mini-stream
+ * extent             offset in file (-1 in the mini-stream), offset in
+ *                    stream, length
+ * dir_lookup_start   path
+ * dir_lookup_done    path, 1 if found
+ * segment_list       offset in CONTENTS, number of segment descriptors
+ * segment_read_start offset in CONTENTS, length
+ * segment_read_done  offset in CONTENTS, length, 0 or -1
+ * walk_conflict      sector, name of the use it was already put to
+ *
+ * The kind of chain is CFBF_TRACE_CHAIN_FOLLOW for cfbf_follow_chain(),
+ * CFBF_TRACE_CHAIN_EXTENTS for cfbf_follow_chain_extents() and
+ * CFBF_TRACE_CHAIN_PTRS for cfbf_get_chain_ptrs() and friends.
+ *
+ * See the scripts in trace/ for examples.
+ */
+
+#define CFBF_TRACE_CHAIN_FOLLOW 0
+#define CFBF_TRACE_CHAIN_EXTENTS 1
+#define CFBF_TRACE_CHAIN_PTRS 2
+
+#ifdef CFBF_USDT
+
+#include <sys/sdt.h>
+
+#define CFBF_TRACE1(name, a) DTRACE_PROBE1(cfbfinfo, name, a)
+#define CFBF_TRACE2(name, a, b) DTRACE_PROBE2(cfbfinfo, name, a, b)
+#define CFBF_TRACE3(name, a, b, c) DTRACE_PROBE3(cfbfinfo, name, a, b, c)
+#define CFBF_TRACE4(name, a, b, c, d) DTRACE_PROBE4(cfbfinfo, name, a, b, c, d)
+#define CFBF_TRACE5(name, a, b, c, d, e) DTRACE_PROBE5(cfbfinfo, name, a, b, c, d, e)
+
+#else
+
+#define CFBF_TRACE1(name, a) do { } while (0)
+#define CFBF_TRACE2(name, a, b) do { } while (0)
+#define CFBF_TRACE3(name, a, b, c) do { } while (0)
+#define CFBF_TRACE4(name, a, b, c, d) do { } while (0)
+#define CFBF_TRACE5(name, a, b, c, d, e) do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "cfbf.h"
+
+/* Header-only triage of many files: for each file, say whether it's a CFB
+ * file at all, which version and sector size it uses, and whether its
+ * header is consistent with itself and with the size of the file.
+ *
+ * Nothing but the header is read. Each file costs an openat(), an fstat(),
+ * one pread() of 512 bytes and a close(), so going through a directory
+ * tree takes little longer than listing it. Rather than nftw(), which
+ * stat()s every file by its full path, we read each directory with
+ * readdir(), which usually gives us each entry's type for nothing, and open
+ * its files relative to it. The files in a directory are triaged by up to
+ * num_threads threads at once, which matters mostly on network shares, and
+ * the results printed in order of name before going on to its
+ * subdirectories.
+ *
+ * Each file gets one line, tab-separated:
+ *
+ *     path  class  version  sector-size  file-size  problems
+ *
+ * class is "cfb" if cfbfinfo ought to be able to open the file, "damaged"
+ * if it has the CFB signature but the header says things that can't be
+ * right for this file, "not-cfb" if it hasn't the signature, or "error" if
+ * it couldn't be read, in which case problems is the reason. problems is a
+ * comma-separated list of the names below, or "-" if there are none. A
+ * "cfb" file may still have problems, where the header doesn't follow the
+ * specification but cfbfinfo doesn't mind.
+ */
+
+enum triage_class {
+    TRIAGE_CFB,
+    TRIAGE_DAMAGED,
+    TRIAGE_NOT_CFB,
+    TRIAGE_ERROR,
+    TRIAGE_NUM_CLASSES
+};
+
+static const char * const triage_class_names[] = {
+    "cfb", "damaged", "not-cfb", "error"
+};
+
+enum triage_problem {
+    /* Problems which stop cfbfinfo opening the file */
+    TRIAGE_TRUNCATED,
+    TRIAGE_SECTOR_SHIFT,
+    TRIAGE_NO_FAT,
+    TRIAGE_FAT_COUNT,
+    TRIAGE_DIFAT_COUNT,
+    TRIAGE_MINIFAT_COUNT,
+    TRIAGE_DIFAT_SHORT,
+    TRIAGE_FAT_START,
+    TRIAGE_DIFAT_START,
+    TRIAGE_MINIFAT_START,
+    TRIAGE_DIR_START,
+
+    /* Departures from the specification which don't */
+    TRIAGE_VERSION,
+    TRIAGE_VERSION_SHIFT,
+    TRIAGE_MINOR_VERSION,
+    TRIAGE_BYTE_ORDER,
+    TRIAGE_MINI_SHIFT,
+    TRIAGE_MINI_CUTOFF,
+    TRIAGE_CLSID,
+    TRIAGE_RESERVED,
+    TRIAGE_TRANSACTION,
+    TRIAGE_DIR_COUNT,
+    TRIAGE_DIFAT_EXTRA,
+    TRIAGE_FAT_ARRAY,
+    TRIAGE_FAT_TOO_SMALL,
+    TRIAGE_PARTIAL_SECTOR,
+
+    TRIAGE_NUM_PROBLEMS
+};
+
+#define TRIAGE_FATAL_PROBLEMS ((1U << (TRIAGE_DIR_START + 1)) - 1)
+
+static const char * const triage_problem_names[] = {
+    "truncated",
+    "sector-shift",
+    "no-fat",
+    "fat-count",
+    "difat-count",
+    "minifat-count",
+    "difat-short",
+    "fat-start",
+    "difat-start",
+    "minifat-start",
+    "dir-start",
+    "version",
+    "version-shift",
+    "minor-version",
+    "byte-order",
+    "mini-shift",
+    "mini-cutoff",
+    "clsid",
+    "reserved",
+    "transaction",
+    "dir-count",
+    "difat-extra",
+    "fat-array",
+    "fat-too-small",
+    "partial-sector"
+};
+
+struct triage_result {
+    enum triage_class class;
+
+    /* errno, for TRIAGE_ERROR */
+    int err;
+
+    int64_t file_size;
+
+    /* From the header, if there was a whole one. sector_shift is 0 if the
+     * header's was out of range. */
+    int have_header;
+    unsigned int major_version;
+    unsigned int sector_shift;
+
+    /* Bit mask of enum triage_problem */
+    unsigned int problems;
+};
+
+struct triage_state {
+    FILE *out;
+    int num_threads;
+
+    long class_counts[TRIAGE_NUM_CLASSES];
+    long version_counts[2];
+};
+
+/* The files in one directory, being triaged */
+struct triage_dir_state {
+    int dir_fd;
+    char **names;
+    struct triage_result *results;
+};
+
+/* Check a header against itself and against the size of the file it
+ * came from */
+static void
+triage_header(const struct StructuredStorageHeader *header, size_t header_len,
+        struct triage_result *result) {
+    static const BYTE zero_clsid[16];
+    unsigned int shift = header->_uSectorShift;
+    unsigned int problems = 0;
+    unsigned long num_file_sectors, entries_per_sector;
+    unsigned long num_fat_sectors, num_difat_needed;
+
+    if (header_len < 8 ||
+            memcmp(header->_abSig, "\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1", 8)) {
+        result->class = TRIAGE_NOT_CFB;
+        return;
+    }
+    if (header_len < sizeof(*header)) {
+        result->class = TRIAGE_DAMAGED;
+        result->problems = 1U << TRIAGE_TRUNCATED;
+        return;
+    }
+
+    result->have_header = 1;
+    result->major_version = header->_uDllVersion;
+
+    if (header->_uDllVersion != 3 && header->_uDllVersion != 4)
+        problems |= 1U << TRIAGE_VERSION;
+    else if (shift != (header->_uDllVersion == 3 ? 9 : 12))
+        problems |= 1U << TRIAGE_VERSION_SHIFT;
+    if (header->_uMinorVersion != 0x3E)
+        problems |= 1U << TRIAGE_MINOR_VERSION;
+    if (header->_uByteOrder != 0xFFFE)
+        problems |= 1U << TRIAGE_BYTE_ORDER;
+    if (header->_uMiniSectorShift != 6)
+        problems |= 1U << TRIAGE_MINI_SHIFT;
+    if (header->_ulMiniSectorCutoff != 4096)
+        problems |= 1U << TRIAGE_MINI_CUTOFF;
+    if (memcmp(header->_clsid, zero_clsid, sizeof(zero_clsid)))
+        problems |= 1U << TRIAGE_CLSID;
+    if (header->_usReserved != 0 || header->_ulReserved1 != 0)
+        problems |= 1U << TRIAGE_RESERVED;
+    if (header->_signature != 0)
+        problems |= 1U << TRIAGE_TRANSACTION;
+
+    /* The same limits as cfbf_parse(). Without a sector size, there's
+     * nothing more we can check. */
+    if (shift < 7 || shift > 12 || header->_uMiniSectorShift < 1 ||
+            header->_uMiniSectorShift > shift) {
+        result->class = TRIAGE_DAMAGED;
+        result->problems = problems | 1U << TRIAGE_SECTOR_SHIFT;
+        return;
+    }
+
+    result->sector_shift = shift;
+
+    /* The header takes up sector -1, and a partial last sector still
+     * counts */
+    num_file_sectors = result->file_size > 0 ? (result->file_size - 1) >> shift : 0;
+    entries_per_sector = (1UL << shift) / sizeof(SECT);
+    num_fat_sectors = header->_csectFat;
+
+    if (result->file_size & ((1 << shift) - 1))
+        problems |= 1U << TRIAGE_PARTIAL_SECTOR;
+
+    if (header->_uDllVersion == 3 ? header->_csectDir != 0 :
+            header->_csectDir > num_file_sectors)
+        problems |= 1U << TRIAGE_DIR_COUNT;
+
+    if (num_fat_sectors == 0)
+        problems |= 1U << TRIAGE_NO_FAT;
+    else if (num_fat_sectors > num_file_sectors)
+        problems |= 1U << TRIAGE_FAT_COUNT;
+    else if (num_fat_sectors * entries_per_sector < num_file_sectors)
+        problems |= 1U << TRIAGE_FAT_TOO_SMALL;
+
+    if (header->_csectDif > num_file_sectors)
+        problems |= 1U << TRIAGE_DIFAT_COUNT;
+    if (header->_csectMiniFat > num_file_sectors)
+        problems |= 1U << TRIAGE_MINIFAT_COUNT;
+
+    /* Each DIFAT sector holds the positions of entries_per_sector - 1 FAT
+     * sectors, the last entry being the next DIFAT sector */
+    if (num_fat_sectors > 109)
+        num_difat_needed = (num_fat_sectors - 109 + entries_per_sector - 2) /
+            (entries_per_sector - 1);
+    else
+        num_difat_needed = 0;
+    if (header->_csectDif < num_difat_needed)
+        problems |= 1U << TRIAGE_DIFAT_SHORT;
+    else if (header->_csectDif > num_difat_needed)
+        problems |= 1U << TRIAGE_DIFAT_EXTRA;
+
+    for (unsigned long i = 0; i < 109; ++i) {
+        if (i < num_fat_sectors) {
+            if (header->_sectFat[i] >= num_file_sectors)
+                problems |= 1U << TRIAGE_FAT_START;
+        }
+        else if (header->_sectFat[i] != CFBF_FREESECT) {
+            problems |= 1U << TRIAGE_FAT_ARRAY;
+        }
+    }
+
+    if (header->_csectDif > 0 && header->_sectDifStart >= num_file_sectors)
+        problems |= 1U << TRIAGE_DIFAT_START;
+    if (header->_csectMiniFat > 0 && header->_sectMiniFatStart >= num_file_sectors)
+        problems |= 1U << TRIAGE_MINIFAT_START;
+    if (header->_sectDirStart >= num_file_sectors)
+        problems |= 1U << TRIAGE_DIR_START;
+
+    result->class = (problems & TRIAGE_FATAL_PROBLEMS) ? TRIAGE_DAMAGED : TRIAGE_CFB;
+    result->problems = problems;
+}
+
+/* Triage one file, opened relative to dir_fd unless its name is absolute */
+static void
+triage_file(int dir_fd, const char *name, struct triage_result *result) {
+    struct StructuredStorageHeader header;
+    struct stat st;
+    ssize_t len;
+    int fd;
+
+    memset(result, 0, sizeof(*result));
+
+    fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0)
+        goto fail;
+    if (fstat(fd, &st) < 0)
+        goto fail;
+    if (!S_ISREG(st.st_mode)) {
+        errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+        goto fail;
+    }
+    result->file_size = st.st_size;
+
+    len = pread(fd, &header, sizeof(header), 0);
+    if (len < 0)
+        goto fail;
+    close(fd);
+
+    triage_header(&header, len, result);
+    return;
+
+fail:
+    result->class = TRIAGE_ERROR;
+    result->err = errno;
+    if (fd >= 0)
+        close(fd);
+}
+
+static void
+print_triage_result(struct triage_state *state, const char *dir,
+        const char *name, const struct triage_result *result) {
+    FILE *out = state->out;
+
+    if (dir != NULL)
+        fprintf(out, "%s/%s\t%s\t", dir, name, triage_class_names[result->class]);
+    else
+        fprintf(out, "%s\t%s\t", name, triage_class_names[result->class]);
+
+    if (result->have_header)
+        fprintf(out, "%u\t", result->major_version);
+    else
+        fprintf(out, "-\t");
+    if (result->sector_shift != 0)
+        fprintf(out, "%d\t", 1 << result->sector_shift);
+    else
+        fprintf(out, "-\t");
+
+    if (result->class == TRIAGE_ERROR) {
+        fprintf(out, "-\t%s\n", strerror(result->err));
+    }
+    else if (result->problems == 0) {
+        fprintf(out, "%lld\t-\n", (long long) result->file_size);
+    }
+    else {
+        const char *sep = "";
+        fprintf(out, "%lld\t", (long long) result->file_size);
+        for (int i = 0; i < TRIAGE_NUM_PROBLEMS; ++i) {
+            if (result->problems & (1U << i)) {
+                fprintf(out, "%s%s", sep, triage_problem_names[i]);
+                sep = ",";
+            }
+        }
+        putc('\n', out);
+    }
+
+    state->class_counts[result->class]++;
+    if (result->class == TRIAGE_CFB &&
+            (result->major_version == 3 || result->major_version == 4))
+        state->version_counts[result->major_version - 3]++;
+}
+
+static int
+triage_dir_job(void *cookie, int job_index) {
+    struct triage_dir_state *dir_state = cookie;
+    triage_file(dir_state->dir_fd, dir_state->names[job_index],
+            &dir_state->results[job_index]);
+    return 0;
+}
+
+static int
+compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static int
+add_name(char ***names, int *num_names, int *max_names, const char *name) {
+    if (*num_names >= *max_names) {
+        int new_max = *max_names ? *max_names * 2 : 64;
+        char **new_names = realloc(*names, new_max * sizeof(char *));
+        if (new_names == NULL)
+            return -1;
+        *names = new_names;
+        *max_names = new_max;
+    }
+    if (((*names)[*num_names] = strdup(name)) == NULL)
+        return -1;
+    ++*num_names;
+    return 0;
+}
+
+/* Triage every regular file under path. Symbolic links aren't followed. */
+static int
+triage_dir(struct triage_state *state, const char *path) {
+    struct triage_dir_state dir_state;
+    char **subdirs = NULL;
+    int num_files = 0, max_files = 0;
+    int num_subdirs = 0, max_subdirs = 0;
+    struct dirent *ent;
+    DIR *dir;
+    int fd;
+    int retval = 0;
+
+    memset(&dir_state, 0, sizeof(dir_state));
+
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || (dir = fdopendir(fd)) == NULL) {
+        error(0, errno, "%s", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    dir_state.dir_fd = fd;
+
+    while (errno = 0, (ent = readdir(dir)) != NULL) {
+        unsigned char type = ent->d_type;
+
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                error(0, errno, "%s/%s", path, ent->d_name);
+                retval = -1;
+                continue;
+            }
+            type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+        }
+
+        if (type == DT_REG) {
+            if (add_name(&dir_state.names, &num_files, &max_files, ent->d_name) < 0)
+                goto fail;
+        }
+        else if (type == DT_DIR) {
+            if (add_name(&subdirs, &num_subdirs, &max_subdirs, ent->d_name) < 0)
+                goto fail;
+        }
+    }
+    if (errno != 0) {
+        error(0, errno, "%s", path);
+        retval = -1;
+    }
+
+    if (num_subdirs > 0)
+        qsort(subdirs, num_subdirs, sizeof(char *), compare_names);
+
+    if (num_files > 0) {
+        qsort(dir_state.names, num_files, sizeof(char *), compare_names);
+        dir_state.results = malloc(num_files * sizeof(struct triage_result));
+        if (dir_state.results == NULL)
+            goto fail;
+        cfbf_run_parallel(state->num_threads, num_files, triage_dir_job, &dir_state);
+        for (int i = 0; i < num_files; ++i)
+            print_triage_result(state, path, dir_state.names[i], &dir_state.results[i]);
+    }
+
+    /* Don't hold this directory open while going through the ones below */
+    closedir(dir);
+    dir = NULL;
+
+    for (int i = 0; i < num_subdirs; ++i) {
+        char *subdir_path;
+        if (asprintf(&subdir_path, "%s/%s", path, subdirs[i]) < 0)
+            goto fail;
+        if (triage_dir(state, subdir_path) < 0)
+            retval = -1;
+        free(subdir_path);
+    }
+
+end:
+    if (dir != NULL)
+        closedir(dir);
+    for (int i = 0; i < num_files; ++i)
+        free(dir_state.names[i]);
+    free(dir_state.names);
+    free(dir_state.results);
+    for (int i = 0; i < num_subdirs; ++i)
+        free(subdirs[i]);
+    free(subdirs);
+    return retval;
+
+fail:
+    error(0, errno, "%s", path);
+    retval = -1;
+    goto end;
+}
+
+/* Triage each file given, and every regular file under each directory
+ * given, writing one line for each to out. With verbosity > 0, also write
+ * a count of each class of file to stderr.
+ *
+ * Returns 0 if every file could be read, or -1 if not. */
+int
+cfbf_triage(const char * const *operands, int num_operands, int num_threads,
+        int verbosity, FILE *out) {
+    struct triage_state state;
+    struct triage_result result;
+    struct stat st;
+    int retval = 0;
+
+    memset(&state, 0, sizeof(state));
+    state.out = out;
+    state.num_threads = num_threads;
+
+    for (int i = 0; i < num_operands; ++i) {
+        if (stat(operands[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            /* Strip trailing slashes, so "dir/" doesn't give "dir//file" */
+            char *path = strdup(operands[i]);
+            size_t len;
+            if (path == NULL) {
+                error(0, errno, "cfbf_triage()");
+                return -1;
+            }
+            for (len = strlen(path); len > 1 && path[len - 1] == '/'; --len)
+                path[len - 1] = '\0';
+            if (triage_dir(&state, path) < 0)
+                retval = -1;
+            free(path);
+        }
+        else {
+            triage_file(AT_FDCWD, operands[i], &result);
+            print_triage_result(&state, NULL, operands[i], &result);
+        }
+    }
+
+    if (state.class_counts[TRIAGE_ERROR] > 0)
+        retval = -1;
+
+    if (verbosity > 0) {
+        fprintf(stderr, "%ld files: %ld cfb (%ld version 3, %ld version 4), "
+                "%ld damaged, %ld not cfb, %ld unreadable\n",
+                state.class_counts[TRIAGE_CFB] + state.class_counts[TRIAGE_DAMAGED] +
+                state.class_counts[TRIAGE_NOT_CFB] + state.class_counts[TRIAGE_ERROR],
+                state.class_counts[TRIAGE_CFB], state.version_counts[0],
+                state.version_counts[1], state.class_counts[TRIAGE_DAMAGED],
+                state.class_counts[TRIAGE_NOT_CFB], state.class_counts[TRIAGE_ERROR]);
+    }
+
+    return retval;
+}
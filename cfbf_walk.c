@@ -6,14 +6,26 @@
 #include <iconv.h>
 
 #include "cfbf.h"
-
-struct walk_sector {
-    struct DirEntry *entry;
-    FSINDEX sector_index;
-    unsigned int is_difsect : 1;
-    unsigned int is_fatsect : 1;
-    unsigned int is_visited : 1;
-};
+#include "cfbf_trace.h"
+
+/* What we've found each sector to be used for. The map has one of these
+ * per sector in the file, so keep it to a byte. */
+#define WALK_SECTOR_VISITED 0x01
+#define WALK_SECTOR_STREAM  0x02
+#define WALK_SECTOR_FAT     0x04
+#define WALK_SECTOR_DIFAT   0x08
+
+static const char *
+walk_sector_use(unsigned char flags) {
+    if (flags & WALK_SECTOR_STREAM)
+        return "a stream or the directory";
+    else if (flags & WALK_SECTOR_FAT)
+        return "the FAT";
+    else if (flags & WALK_SECTOR_DIFAT)
+        return "the DIFAT";
+    else
+        return "something else";
+}
 
 int
 utf16_to_utf8(char *in, size_t in_size, char *out, size_t out_size) {
@@ -23,6 +35,7 @@ utf16_to_utf8(char *in, size_t in_size, char *out, size_t out_size) {
         return -1;
     }
 
+    CFBF_STAT_ADD(CFBF_STAT_ICONV_CALLS, 1);
     if (iconv(cd, &in, &in_size, &out, &out_size) == (size_t) -1) {
         error(0, errno, "iconv()");
         iconv_close(cd);
@@ -38,9 +51,9 @@ utf16_to_utf8(char *in, size_t in_size, char *out, size_t out_size) {
 /* Mark this sector as visited in the map, and complain if something else has
  * already visited it */
 int
-visit_sector(struct walk_sector *sector_map, SECT num_sectors, SECT sector_num,
-        FSINDEX sector_index, struct DirEntry *ent, int special) {
-    struct walk_sector *sector;
+visit_sector(unsigned char *sector_map, SECT num_sectors, SECT sector_num,
+        struct DirEntry *ent, int special) {
+    unsigned char *sector;
 
     if (sector_num >= num_sectors) {
         error(0, 0, "sector %lu is off the end of the map (%d)", (unsigned long) sector_num, num_sectors);
@@ -49,44 +62,34 @@ visit_sector(struct walk_sector *sector_map, SECT num_sectors, SECT sector_num,
     
     sector = &sector_map[sector_num];
 
-    if (sector->entry) {
-        error(0, 0, "sector %lu: this is already in use by another entry! (start sector %lu)", (unsigned long) sector_num, (unsigned long) sector->entry->start_sector);
-        return -1;
-    }
-
-    if (sector->is_visited) {
-        error(0, 0, "sector %lu: this sector has already been visited! entry %p, sector_index %lu, is_difsect %u, is_fatsect %u, is_visited %u",
-                (unsigned long) sector_num, sector->entry,
-                (unsigned long) sector->sector_index,
-                (unsigned int) sector->is_difsect,
-                (unsigned int) sector->is_fatsect,
-                (unsigned int) sector->is_visited);
+    if (*sector & WALK_SECTOR_VISITED) {
+        CFBF_TRACE2(walk_conflict, sector_num, walk_sector_use(*sector));
+        error(0, 0, "sector %lu: this sector has already been visited! It is already in use by %s.",
+                (unsigned long) sector_num, walk_sector_use(*sector));
         return -1;
     }
 
     if (ent) {
-        sector->entry = ent;
-        sector->sector_index = sector_index;
+        *sector |= WALK_SECTOR_STREAM;
     }
     else if (special == CFBF_FATSECT) {
-        sector->is_fatsect = 1;
+        *sector |= WALK_SECTOR_FAT;
     }
     else if (special == CFBF_DIFSECT) {
-        sector->is_difsect = 1;
+        *sector |= WALK_SECTOR_DIFAT;
     }
-    sector->is_visited = 1;
+    *sector |= WALK_SECTOR_VISITED;
 
     return 0;
 }
 
 int
-cfbf_walk_entry(struct cfbf *cfbf, struct walk_sector *sector_map,
+cfbf_walk_entry(struct cfbf *cfbf, unsigned char *sector_map,
         SECT num_sectors, struct DirEntry *ent, FILE *out, int verbosity) {
     SECT sect, last_sect = CFBF_END_OF_CHAIN;
     struct cfbf_fat *fat;
     int64_t bytes_read = 0;
     int use_mini = 0;
-    FSINDEX sector_index = 0;
 
     /* 0 means this is the directory chain and ent is a fake entry, and 5
      * means it's the root entry. Either way, the chain is in the main FAT
@@ -107,7 +110,7 @@ cfbf_walk_entry(struct cfbf *cfbf, struct walk_sector *sector_map,
         if (verbosity > 1)
             fprintf(stderr, "  sector %10lu\r", (unsigned long) sect);
         if (!use_mini) {
-            if (visit_sector(sector_map, num_sectors, sect, sector_index, ent, 0) < 0) {
+            if (visit_sector(sector_map, num_sectors, sect, ent, 0) < 0) {
                 return -1;
             }
         }
@@ -116,7 +119,6 @@ cfbf_walk_entry(struct cfbf *cfbf, struct walk_sector *sector_map,
             return -1;
         }
         last_sect = sect;
-        sector_index++;
         if (ent->stream_size - bytes_read < fat->sector_size) 
             bytes_read += ent->stream_size - bytes_read;
         else
@@ -142,32 +144,45 @@ cfbf_walk(struct cfbf *cfbf, FILE *out, int verbosity) {
     int num_dir_secs;
     int sector_size;
     int retval = 0;
-    struct walk_sector *sector_map;
+    unsigned char *sector_map;
     SECT num_sectors;
     struct DirEntry fake_dir_entry_for_dir_chain;
+    struct cfbf_arena_mark mark;
 
     if (out == NULL)
         out = stderr;
 
     sector_size = cfbf_get_sector_size(cfbf);
 
-    num_sectors = (cfbf->file_size - sector_size) / sector_size;
-
-    sector_map = malloc(sizeof(struct walk_sector) * num_sectors);
-    if (cfbf->file_size > cfbf->fat.sector_entries_count * sector_size + sizeof(struct StructuredStorageHeader)) {
+    /* No sector number can be bigger than MAXREGSECT, whatever size the
+     * file is */
+    if ((cfbf->file_size - sector_size) / sector_size > CFBF_MAXREGSECT + 1ULL)
+        num_sectors = CFBF_MAXREGSECT + 1;
+    else
+        num_sectors = (cfbf->file_size - sector_size) / sector_size;
+
+    mark = cfbf_arena_mark(&cfbf->arena);
+    sector_map = cfbf_arena_alloc(&cfbf->arena, num_sectors);
+    if (sector_map == NULL) {
+        error(0, 0, "cfbf_walk(): can't allocate map of %lu sectors", (unsigned long) num_sectors);
+        return -1;
+    }
+    if (cfbf->file_size > (long long) cfbf->fat.sector_entries_count * sector_size + sizeof(struct StructuredStorageHeader)) {
         error(0, 0, "warning: sector count in FAT, %lld, is less than what we'd expect from file size %lld", (long long) cfbf->fat.sector_entries_count, (long long) cfbf->file_size);
     }
 
-    memset(sector_map, 0, sizeof(struct walk_sector) * num_sectors);
+    memset(sector_map, 0, num_sectors);
     
-    dir_chain = cfbf_get_chain_ptrs(cfbf, cfbf->header->_sectDirStart, &num_dir_secs);
-    if (dir_chain == NULL) {
-        return -1;
+    dir_chain = cfbf_dir_get_chain(cfbf, &num_dir_secs);
+
+    if (cfbf->num_dir_sectors > 0 && num_dir_secs != cfbf->num_dir_sectors) {
+        error(0, 0, "directory chain has %d sectors, but the header says it has %lu", num_dir_secs, (unsigned long) cfbf->num_dir_sectors);
+        retval = -1;
     }
 
     memset(&fake_dir_entry_for_dir_chain, 0, sizeof(fake_dir_entry_for_dir_chain));
     fake_dir_entry_for_dir_chain.start_sector = cfbf->header->_sectDirStart;
-    fake_dir_entry_for_dir_chain.stream_size = num_dir_secs * sector_size;
+    fake_dir_entry_for_dir_chain.stream_size = (int64_t) num_dir_secs * sector_size;
     fake_dir_entry_for_dir_chain.object_type = 0;
 
     /* Walk the chain from _sectDirStart, in order to mark those sectors
@@ -226,7 +241,7 @@ cfbf_walk(struct cfbf *cfbf, FILE *out, int verbosity) {
     for (int i = 0; i < num_start_fat_sectors; ++i) {
         SECT sect = cfbf->header->_sectFat[i];
         SECT fat_entry = cfbf_fat_get_sector_entry(&cfbf->fat, sect);
-        if (visit_sector(sector_map, num_sectors, sect, 0, NULL, CFBF_FATSECT) < 0) {
+        if (visit_sector(sector_map, num_sectors, sect, NULL, CFBF_FATSECT) < 0) {
             retval = -1;
         }
         if (verbosity > 1)
@@ -262,7 +277,7 @@ cfbf_walk(struct cfbf *cfbf, FILE *out, int verbosity) {
         if (verbosity > 0)
             fprintf(out, "  Reading DIFAT sector %lu...\n", (unsigned long) difat_sect);
 
-        if (visit_sector(sector_map, num_sectors, difat_sect, 0, NULL, CFBF_DIFSECT) < 0) {
+        if (visit_sector(sector_map, num_sectors, difat_sect, NULL, CFBF_DIFSECT) < 0) {
             retval = -1;
         }
 
@@ -280,7 +295,7 @@ cfbf_walk(struct cfbf *cfbf, FILE *out, int verbosity) {
                 // of the file
             }
             else {
-                if (visit_sector(sector_map, num_sectors, fat_sect, 0, NULL, CFBF_FATSECT) < 0) {
+                if (visit_sector(sector_map, num_sectors, fat_sect, NULL, CFBF_FATSECT) < 0) {
                     retval = -1;
                 }
                 num_fat_sectors_seen++;
@@ -316,8 +331,7 @@ cfbf_walk(struct cfbf *cfbf, FILE *out, int verbosity) {
     int num_unvisited_not_unused = 0;
 
     for (SECT sec = 0; sec < num_sectors; ++sec) {
-        struct walk_sector *s = &sector_map[sec];
-        if (!s->is_visited) {
+        if (!(sector_map[sec] & WALK_SECTOR_VISITED)) {
             SECT fat_entry = cfbf_fat_get_sector_entry(&cfbf->fat, sec);
             if (verbosity >= 0) {
                 if (num_unvisited_sectors > 0)
@@ -349,8 +363,7 @@ cfbf_walk(struct cfbf *cfbf, FILE *out, int verbosity) {
     }
 
 end:
-    free(dir_chain);
-    free(sector_map);
+    cfbf_arena_release(&cfbf->arena, mark);
     return retval;
 
 fail:
@@ -0,0 +1,593 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <error.h>
+
+#include "cfbf.h"
+
+/* Watch mode.
+ *
+ * cfbf_watch() waits for files to arrive in a directory and carries out the
+ * actions on each, until it gets SIGINT or SIGTERM. inotify tells us when a
+ * file written there is closed (IN_CLOSE_WRITE), or one is moved in
+ * (IN_MOVED_TO), so nothing is polled.
+ *
+ * A file is often written in several goes, or written and then renamed, so
+ * each file waits until there have been no events for it for debounce_ms
+ * before it's queued. However many events come in for it meanwhile, it's
+ * processed once. If it changes again while it's being processed, it's
+ * processed again afterwards. Files whose names begin with "." are taken
+ * to be still being written, and are left alone.
+ *
+ * The queued files are shared out between a pool of worker threads. Each
+ * file's output is collected in memory, and written out in one go once its
+ * actions are done, so the output of files processed at the same time
+ * doesn't get mixed up. With an output directory, each file's output goes
+ * to a file of its own there, named after it with ".out" on the end,
+ * which appears only once it's complete. Otherwise it goes where the
+ * actions' -o options say, headed with the file's name as for --batch.
+ *
+ * If the kernel's queue of events overflows, some events are lost, so
+ * every file in the directory is queued again.
+ */
+
+enum watch_file_state {
+    /* Waiting for events to stop before it's queued */
+    WATCH_WAITING,
+    WATCH_QUEUED,
+    WATCH_RUNNING
+};
+
+struct watch_file {
+    char *name;
+    enum watch_file_state state;
+
+    /* When a waiting file is to be queued */
+    uint64_t due_ns;
+
+    /* Set if the file changed while it was being processed */
+    int again;
+
+    struct watch_file *next;
+    struct watch_file *queue_next;
+};
+
+struct watcher {
+    const char *dir;
+    const struct cfbf_watch_options *opts;
+    const struct cfbf_action *actions;
+    int num_actions;
+    FILE **action_out;
+    struct cfbf_action_options action_opts;
+    const struct cfbf_open_options *open_opts;
+
+    /* Tells the main thread a worker has put a file back to wait */
+    int wake_fd;
+
+    /* Protects everything below */
+    pthread_mutex_t lock;
+
+    /* Every file we know of, in whatever state */
+    struct watch_file *files;
+
+    /* Files waiting for a worker */
+    pthread_cond_t queue_cond;
+    struct watch_file *queue_head, *queue_tail;
+    int shutting_down;
+
+    /* Held while writing a file's output to action_out */
+    pthread_mutex_t output_lock;
+    int num_written;
+};
+
+static uint64_t
+now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Note an event for name: start it waiting, or wait longer. Called with
+ * the lock held. */
+static void
+file_event(struct watcher *w, const char *name) {
+    struct watch_file *f;
+
+    if (name[0] == '.')
+        return;
+
+    for (f = w->files; f != NULL; f = f->next) {
+        if (!strcmp(f->name, name))
+            break;
+    }
+
+    if (f == NULL) {
+        f = calloc(1, sizeof(*f));
+        if (f == NULL || (f->name = strdup(name)) == NULL) {
+            error(0, errno, "%s", name);
+            free(f);
+            return;
+        }
+        f->state = WATCH_WAITING;
+        f->next = w->files;
+        w->files = f;
+    }
+
+    if (f->state == WATCH_WAITING)
+        f->due_ns = now_ns() + (uint64_t) w->opts->debounce_ms * 1000000;
+    else if (f->state == WATCH_RUNNING)
+        f->again = 1;
+    /* A queued file hasn't been read yet, so it'll be read as it is now */
+}
+
+/* Queue the files which have waited long enough, and return how many
+ * milliseconds until the next one will have, or -1 if none are waiting.
+ * Called with the lock held. */
+static int
+queue_due_files(struct watcher *w) {
+    uint64_t now = now_ns();
+    uint64_t next_due = UINT64_MAX;
+
+    for (struct watch_file *f = w->files; f != NULL; f = f->next) {
+        if (f->state != WATCH_WAITING)
+            continue;
+        if (f->due_ns > now) {
+            if (f->due_ns < next_due)
+                next_due = f->due_ns;
+            continue;
+        }
+
+        f->state = WATCH_QUEUED;
+        f->queue_next = NULL;
+        if (w->queue_tail != NULL)
+            w->queue_tail->queue_next = f;
+        else
+            w->queue_head = f;
+        w->queue_tail = f;
+        pthread_cond_signal(&w->queue_cond);
+    }
+
+    if (next_due == UINT64_MAX)
+        return -1;
+    return (next_due - now + 999999) / 1000000;
+}
+
+/* Forget a file which is done with. Called with the lock held. */
+static void
+file_remove(struct watcher *w, struct watch_file *file) {
+    for (struct watch_file **p = &w->files; *p != NULL; p = &(*p)->next) {
+        if (*p == file) {
+            *p = file->next;
+            break;
+        }
+    }
+    free(file->name);
+    free(file);
+}
+
+/* Write a file's output to a file of its own in the output directory,
+ * under a temporary name until it's complete */
+static int
+process_to_output_dir(struct watcher *w, struct cfbf *cfbf, const char *path,
+        const char *name) {
+    char *dest = NULL, *temp = NULL;
+    FILE *out = NULL;
+    int fd = -1;
+    int retval = -1;
+
+    if (asprintf(&dest, "%s/%s.out", w->opts->output_dir, name) < 0) {
+        error(0, errno, "%s", path);
+        dest = NULL;
+        goto end;
+    }
+    if (asprintf(&temp, "%s/.%s.out.XXXXXX", w->opts->output_dir, name) < 0) {
+        error(0, errno, "%s", path);
+        temp = NULL;
+        goto end;
+    }
+
+    fd = mkostemp(temp, O_CLOEXEC);
+    if (fd < 0) {
+        error(0, errno, "%s", dest);
+        free(temp);
+        temp = NULL;
+        goto end;
+    }
+    fchmod(fd, 0644);
+    out = fdopen(fd, "w");
+    if (out == NULL) {
+        error(0, errno, "%s", temp);
+        goto end;
+    }
+    fd = -1;
+
+    retval = 0;
+    for (int i = 0; i < w->num_actions; ++i) {
+        if (cfbf_run_action(cfbf, path, &w->actions[i], out, &w->action_opts) < 0)
+            retval = -1;
+    }
+
+    if (fclose(out) == EOF) {
+        error(0, errno, "%s", temp);
+        out = NULL;
+        retval = -1;
+        goto end;
+    }
+    out = NULL;
+
+    if (rename(temp, dest) < 0) {
+        error(0, errno, "%s", dest);
+        retval = -1;
+        goto end;
+    }
+    free(temp);
+    temp = NULL;
+
+end:
+    if (out != NULL)
+        fclose(out);
+    if (fd >= 0)
+        close(fd);
+    if (temp != NULL)
+        unlink(temp);
+    free(temp);
+    free(dest);
+    return retval;
+}
+
+/* Collect a file's output for each of the actions' outputs in memory, then
+ * write it all out at once */
+static int
+process_to_streams(struct watcher *w, struct cfbf *cfbf, const char *path) {
+    int n = w->num_actions;
+    char **bufs = calloc(n, sizeof(char *));
+    size_t *sizes = calloc(n, sizeof(size_t));
+    FILE **streams = calloc(n, sizeof(FILE *));
+    int *owner = calloc(n, sizeof(int));
+    int retval = 0;
+
+    if (bufs == NULL || sizes == NULL || streams == NULL || owner == NULL) {
+        error(0, errno, "%s", path);
+        retval = -1;
+        goto end;
+    }
+
+    /* Actions sharing an output share a stream, which belongs to the first
+     * of them */
+    for (int i = 0; i < n; ++i) {
+        for (owner[i] = 0; w->action_out[owner[i]] != w->action_out[i]; ++owner[i])
+            ;
+        if (owner[i] == i) {
+            streams[i] = open_memstream(&bufs[i], &sizes[i]);
+            if (streams[i] == NULL) {
+                error(0, errno, "%s", path);
+                retval = -1;
+                goto end;
+            }
+        }
+    }
+
+    for (int i = 0; i < n; ++i) {
+        if (cfbf_run_action(cfbf, path, &w->actions[i], streams[owner[i]],
+                    &w->action_opts) < 0)
+            retval = -1;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        if (streams[i] != NULL) {
+            fclose(streams[i]);
+            streams[i] = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&w->output_lock);
+    for (int i = 0; i < n; ++i) {
+        if (owner[i] != i)
+            continue;
+        fprintf(w->action_out[i], "%s==> %s <==\n",
+                w->num_written > 0 ? "\n" : "", path);
+        fwrite(bufs[i], 1, sizes[i], w->action_out[i]);
+        if (fflush(w->action_out[i]) == EOF) {
+            error(0, errno, "writing output for %s", path);
+            retval = -1;
+        }
+    }
+    w->num_written++;
+    pthread_mutex_unlock(&w->output_lock);
+
+end:
+    for (int i = 0; streams != NULL && i < n; ++i) {
+        if (streams[i] != NULL)
+            fclose(streams[i]);
+    }
+    for (int i = 0; bufs != NULL && i < n; ++i)
+        free(bufs[i]);
+    free(bufs);
+    free(sizes);
+    free(streams);
+    free(owner);
+    return retval;
+}
+
+static void
+process_file(struct watcher *w, const char *name) {
+    struct cfbf cfbf;
+    struct stat st;
+    char *path;
+
+    if (asprintf(&path, "%s/%s", w->dir, name) < 0) {
+        error(0, errno, "%s", name);
+        return;
+    }
+
+    /* It may have gone again, or be something other than a file */
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        free(path);
+        return;
+    }
+
+    if (cfbf_open_with_options(path, &cfbf, w->open_opts) == 0) {
+        if (w->opts->output_dir != NULL)
+            process_to_output_dir(w, &cfbf, path, name);
+        else
+            process_to_streams(w, &cfbf, path);
+        cfbf_close(&cfbf);
+    }
+
+    free(path);
+}
+
+static void *
+watch_worker(void *arg) {
+    struct watcher *w = (struct watcher *) arg;
+
+    for (;;) {
+        struct watch_file *f;
+
+        pthread_mutex_lock(&w->lock);
+        while (w->queue_head == NULL && !w->shutting_down)
+            pthread_cond_wait(&w->queue_cond, &w->lock);
+        f = w->queue_head;
+        if (f != NULL) {
+            w->queue_head = f->queue_next;
+            if (w->queue_head == NULL)
+                w->queue_tail = NULL;
+            f->state = WATCH_RUNNING;
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        if (f == NULL)
+            break;
+
+        /* The name is only freed by this thread while it's running */
+        process_file(w, f->name);
+
+        pthread_mutex_lock(&w->lock);
+        if (f->again) {
+            uint64_t one = 1;
+
+            f->again = 0;
+            f->state = WATCH_WAITING;
+            f->due_ns = now_ns() + (uint64_t) w->opts->debounce_ms * 1000000;
+            if (write(w->wake_fd, &one, sizeof(one)) < 0)
+                error(0, errno, "eventfd");
+        }
+        else {
+            file_remove(w, f);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    return NULL;
+}
+
+/* Some events were lost, so treat every file in the directory as new */
+static void
+rescan_dir(struct watcher *w) {
+    DIR *d = opendir(w->dir);
+    struct dirent *de;
+
+    if (d == NULL) {
+        error(0, errno, "%s", w->dir);
+        return;
+    }
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_type == DT_REG || de->d_type == DT_UNKNOWN)
+            file_event(w, de->d_name);
+    }
+    closedir(d);
+}
+
+/* Read what inotify has for us. Returns 0, or -1 if the directory has gone
+ * or the inotify descriptor has failed. */
+static int
+read_events(struct watcher *w, int inotify_fd) {
+    char buf[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    int retval = 0;
+
+    len = read(inotify_fd, buf, sizeof(buf));
+    if (len < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return 0;
+        error(0, errno, "inotify");
+        return -1;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    for (char *p = buf; p < buf + len; ) {
+        const struct inotify_event *ev = (const struct inotify_event *) p;
+
+        if (ev->mask & IN_Q_OVERFLOW) {
+            error(0, 0, "%s: too many events at once, looking at every file again", w->dir);
+            rescan_dir(w);
+        }
+        else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+            error(0, 0, "%s: directory has gone", w->dir);
+            retval = -1;
+        }
+        else if (ev->len > 0 && !(ev->mask & IN_ISDIR)) {
+            file_event(w, ev->name);
+        }
+        p += sizeof(struct inotify_event) + ev->len;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return retval;
+}
+
+/* Carry out the actions on every file which arrives in dir, until SIGINT
+ * or SIGTERM. Without an output directory in opts, the output goes to
+ * action_out, as for --batch. Returns 0 on being told to stop, or -1 if
+ * the directory can't be watched. */
+int
+cfbf_watch(const char *dir, const struct cfbf_watch_options *opts,
+        const struct cfbf_action *actions, int num_actions, FILE **action_out,
+        const struct cfbf_action_options *action_opts,
+        const struct cfbf_open_options *open_opts) {
+    struct watcher *w;
+    pthread_t *workers;
+    int num_workers = 0;
+    int inotify_fd = -1, signal_fd = -1;
+    sigset_t signals;
+    int retval = 0;
+
+    w = calloc(1, sizeof(*w));
+    workers = calloc(opts->num_workers, sizeof(pthread_t));
+    if (w == NULL || workers == NULL) {
+        error(0, errno, "cfbf_watch()");
+        free(w);
+        free(workers);
+        return -1;
+    }
+
+    w->dir = dir;
+    w->opts = opts;
+    w->actions = actions;
+    w->num_actions = num_actions;
+    w->action_out = action_out;
+    w->action_opts = *action_opts;
+    w->open_opts = open_opts;
+
+    /* The parallelism is between files, not within them */
+    w->action_opts.num_threads = 1;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_mutex_init(&w->output_lock, NULL);
+    pthread_cond_init(&w->queue_cond, NULL);
+
+    /* SIGINT and SIGTERM come to us through signal_fd, so the workers
+     * created after this must have them blocked too */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inotify_fd < 0 || signal_fd < 0 || w->wake_fd < 0) {
+        error(0, errno, "cfbf_watch()");
+        retval = -1;
+        goto end;
+    }
+
+    if (inotify_add_watch(inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO |
+                IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR) < 0) {
+        error(0, errno, "%s", dir);
+        retval = -1;
+        goto end;
+    }
+
+    for (int i = 0; i < opts->num_workers; ++i) {
+        int ret = pthread_create(&workers[i], NULL, watch_worker, w);
+        if (ret != 0) {
+            error(0, ret, "cfbf_watch(): pthread_create");
+            break;
+        }
+        ++num_workers;
+    }
+    if (num_workers == 0) {
+        retval = -1;
+        goto end;
+    }
+
+    for (;;) {
+        struct pollfd fds[3];
+        int timeout;
+
+        pthread_mutex_lock(&w->lock);
+        timeout = queue_due_files(w);
+        pthread_mutex_unlock(&w->lock);
+
+        fds[0].fd = inotify_fd;
+        fds[1].fd = signal_fd;
+        fds[2].fd = w->wake_fd;
+        for (int i = 0; i < 3; ++i)
+            fds[i].events = POLLIN;
+
+        if (poll(fds, 3, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            error(0, errno, "poll()");
+            retval = -1;
+            break;
+        }
+
+        if (fds[1].revents & POLLIN)
+            break;
+        if (fds[2].revents & POLLIN) {
+            uint64_t count;
+            if (read(w->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                error(0, errno, "eventfd");
+        }
+        if ((fds[0].revents & POLLIN) && read_events(w, inotify_fd) < 0) {
+            retval = -1;
+            break;
+        }
+    }
+
+end:
+    /* Finish the files already queued, but not those still waiting */
+    pthread_mutex_lock(&w->lock);
+    w->shutting_down = 1;
+    pthread_cond_broadcast(&w->queue_cond);
+    pthread_mutex_unlock(&w->lock);
+
+    for (int i = 0; i < num_workers; ++i)
+        pthread_join(workers[i], NULL);
+
+    while (w->files != NULL)
+        file_remove(w, w->files);
+
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+    if (signal_fd >= 0)
+        close(signal_fd);
+    if (w->wake_fd >= 0)
+        close(w->wake_fd);
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+    pthread_cond_destroy(&w->queue_cond);
+    pthread_mutex_destroy(&w->output_lock);
+    pthread_mutex_destroy(&w->lock);
+    free(workers);
+    free(w);
+
+    return retval;
+}
@@ -0,0 +1,355 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+
+#include "cfbf.h"
+
+/* Writing CFB files.
+ *
+ * The writer lays the file out in the order the sectors are written. When
+ * the writer is opened, the caller says how many sectors of data it will
+ * write, so that the writer can work out how big the FAT and DIFAT need to
+ * be and reserve space for them at the start of the file. Sectors are then
+ * appended one at a time with cfbf_writer_append_sector(), or a chain at a
+ * time with cfbf_writer_write_chain(), and the FAT is built up in memory.
+ * cfbf_writer_finish() goes back and writes the header, FAT and DIFAT.
+ *
+ * File layout:
+ *     header
+ *     FAT sectors, contiguous
+ *     DIFAT sectors, contiguous
+ *     data sectors, in the order they were appended
+ */
+
+static SECT
+difat_sectors_needed(SECT num_fat_sectors, SECT entries_per_sector) {
+    if (num_fat_sectors <= 109)
+        return 0;
+    return (num_fat_sectors - 109 + entries_per_sector - 2) / (entries_per_sector - 1);
+}
+
+/* Open filename for writing as a CFB file with sectors of 2^sector_shift
+ * bytes, which will have num_data_sectors sectors of data in it, not
+ * counting the FAT and DIFAT.
+ * Returns 0 on success or -1 on failure. */
+int
+cfbf_writer_open(struct cfbf_writer *w, const char *filename,
+        int sector_shift, SECT num_data_sectors) {
+    SECT entries_per_sector;
+    SECT num_fat_sectors = 1, num_difat_sectors = 0;
+
+    memset(w, 0, sizeof(*w));
+
+    if (sector_shift != 9 && sector_shift != 12) {
+        error(0, 0, "%s: can't write a CFB file with sector shift %d", filename, sector_shift);
+        return -1;
+    }
+
+    w->filename = filename;
+    w->sector_shift = sector_shift;
+    w->sector_size = 1 << sector_shift;
+    entries_per_sector = w->sector_size / sizeof(SECT);
+
+    /* The FAT has to cover its own sectors and the DIFAT's as well as the
+     * data, so keep going until the sizes stop changing */
+    for (;;) {
+        uint64_t total = (uint64_t) num_data_sectors + num_fat_sectors + num_difat_sectors;
+        SECT new_fat = (total + entries_per_sector - 1) / entries_per_sector;
+        SECT new_difat = difat_sectors_needed(new_fat, entries_per_sector);
+
+        if (total >= CFBF_MAXREGSID) {
+            error(0, 0, "%s: too many sectors for a CFB file", filename);
+            return -1;
+        }
+        if (new_fat == num_fat_sectors && new_difat == num_difat_sectors)
+            break;
+        num_fat_sectors = new_fat;
+        num_difat_sectors = new_difat;
+    }
+
+    w->num_fat_sectors = num_fat_sectors;
+    w->num_difat_sectors = num_difat_sectors;
+    w->num_sectors = num_fat_sectors + num_difat_sectors + num_data_sectors;
+    w->fat_size = num_fat_sectors * entries_per_sector;
+
+    w->fat = malloc(w->fat_size * sizeof(SECT));
+    w->zero_sector = calloc(1, w->sector_size);
+    if (w->fat == NULL || w->zero_sector == NULL) {
+        error(0, errno, "cfbf_writer_open()");
+        goto fail;
+    }
+    for (SECT i = 0; i < w->fat_size; ++i)
+        w->fat[i] = CFBF_FREESECT;
+    for (SECT i = 0; i < num_fat_sectors; ++i)
+        w->fat[i] = CFBF_FATSECT;
+    for (SECT i = 0; i < num_difat_sectors; ++i)
+        w->fat[num_fat_sectors + i] = CFBF_DIFSECT;
+
+    w->next_sector = num_fat_sectors + num_difat_sectors;
+
+    w->out = fopen(filename, "w");
+    if (w->out == NULL) {
+        error(0, errno, "%s", filename);
+        goto fail;
+    }
+
+    /* Skip the header, FAT and DIFAT for now - cfbf_writer_finish() will
+     * come back and fill them in */
+    if (fseeko(w->out, ((off_t) w->next_sector + 1) << sector_shift, SEEK_SET) < 0) {
+        error(0, errno, "%s", filename);
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    cfbf_writer_abort(w);
+    return -1;
+}
+
+/* Return the sector number that the next appended sector will get */
+SECT
+cfbf_writer_next_sector(struct cfbf_writer *w) {
+    return w->next_sector;
+}
+
+/* Append a sector to the file containing the first length bytes of data,
+ * padded out with zeroes. If prev_sector is a sector, the FAT entry for
+ * prev_sector is pointed at the new sector. The new sector is the end of
+ * its chain until another sector is appended after it.
+ * Returns the new sector's number, or CFBF_FREESECT on failure. */
+SECT
+cfbf_writer_append_sector(struct cfbf_writer *w, const void *data,
+        int length, SECT prev_sector) {
+    SECT sector = w->next_sector;
+
+    if (sector >= w->num_sectors) {
+        error(0, 0, "%s: writing more sectors than the %lu planned", w->filename, (unsigned long) w->num_sectors);
+        return CFBF_FREESECT;
+    }
+
+    if (length > 0 && fwrite(data, 1, length, w->out) != length) {
+        error(0, errno, "%s", w->filename);
+        return CFBF_FREESECT;
+    }
+    if (length < w->sector_size &&
+            fwrite(w->zero_sector, 1, w->sector_size - length, w->out) != w->sector_size - length) {
+        error(0, errno, "%s", w->filename);
+        return CFBF_FREESECT;
+    }
+
+    w->fat[sector] = CFBF_END_OF_CHAIN;
+    if (CFBF_IS_SECTOR(prev_sector))
+        w->fat[prev_sector] = sector;
+    w->next_sector++;
+
+    return sector;
+}
+
+void
+cfbf_writer_chain_begin(struct cfbf_writer_chain *chain) {
+    memset(chain, 0, sizeof(*chain));
+    chain->first_sector = CFBF_END_OF_CHAIN;
+    chain->last_sector = CFBF_END_OF_CHAIN;
+}
+
+static int
+chain_append(struct cfbf_writer *w, struct cfbf_writer_chain *chain,
+        const void *data, int length) {
+    SECT sector = cfbf_writer_append_sector(w, data, length, chain->last_sector);
+
+    if (sector == CFBF_FREESECT)
+        return -1;
+    if (chain->first_sector == CFBF_END_OF_CHAIN)
+        chain->first_sector = sector;
+    chain->last_sector = sector;
+
+    return 0;
+}
+
+/* Add length bytes to the end of a chain being written. The chain's sectors
+ * are contiguous, so nothing else may be appended to the file between
+ * cfbf_writer_chain_begin() and cfbf_writer_chain_end(). */
+int
+cfbf_writer_chain_write(struct cfbf_writer *w, struct cfbf_writer_chain *chain,
+        const void *data, size_t length) {
+    const char *p = (const char *) data;
+
+    if (chain->buf == NULL) {
+        chain->buf = malloc(w->sector_size);
+        if (chain->buf == NULL) {
+            error(0, errno, "cfbf_writer_chain_write()");
+            return -1;
+        }
+    }
+
+    while (length > 0) {
+        if (chain->buf_len == 0 && length >= w->sector_size) {
+            /* Whole sector, no need to copy it into the buffer first */
+            if (chain_append(w, chain, p, w->sector_size) < 0)
+                return -1;
+            p += w->sector_size;
+            length -= w->sector_size;
+        }
+        else {
+            size_t to_copy = w->sector_size - chain->buf_len;
+            if (to_copy > length)
+                to_copy = length;
+            memcpy(chain->buf + chain->buf_len, p, to_copy);
+            chain->buf_len += to_copy;
+            p += to_copy;
+            length -= to_copy;
+            if (chain->buf_len == w->sector_size) {
+                if (chain_append(w, chain, chain->buf, w->sector_size) < 0)
+                    return -1;
+                chain->buf_len = 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Finish writing a chain, padding its last sector with zeroes. Returns the
+ * first sector of the chain, which is CFBF_END_OF_CHAIN if nothing was
+ * written, or CFBF_FREESECT on failure. */
+SECT
+cfbf_writer_chain_end(struct cfbf_writer *w, struct cfbf_writer_chain *chain) {
+    SECT first_sector;
+
+    if (chain->buf_len > 0 && chain_append(w, chain, chain->buf, chain->buf_len) < 0)
+        first_sector = CFBF_FREESECT;
+    else
+        first_sector = chain->first_sector;
+
+    free(chain->buf);
+    chain->buf = NULL;
+    chain->buf_len = 0;
+
+    return first_sector;
+}
+
+/* Write a whole chain of contiguous sectors holding size bytes of data.
+ * Returns the first sector, CFBF_END_OF_CHAIN if size is 0, or
+ * CFBF_FREESECT on failure. */
+SECT
+cfbf_writer_write_chain(struct cfbf_writer *w, const void *data, size_t size) {
+    struct cfbf_writer_chain chain;
+
+    cfbf_writer_chain_begin(&chain);
+    if (cfbf_writer_chain_write(w, &chain, data, size) < 0) {
+        cfbf_writer_chain_end(w, &chain);
+        return CFBF_FREESECT;
+    }
+    return cfbf_writer_chain_end(w, &chain);
+}
+
+/* Write the header, FAT and DIFAT, and close the file.
+ *
+ * header supplies the fields which the writer doesn't decide for itself:
+ * CLSID, version numbers, byte order, mini-sector shift, mini-stream
+ * cutoff, directory start sector and count, and the mini-FAT start sector
+ * and count. Everything to do with the FAT and DIFAT is filled in here.
+ *
+ * Returns 0 on success or -1 on failure. Either way, the writer is
+ * finished with. */
+int
+cfbf_writer_finish(struct cfbf_writer *w,
+        const struct StructuredStorageHeader *header) {
+    struct StructuredStorageHeader h;
+    SECT entries_per_sector = w->sector_size / sizeof(SECT);
+    SECT *difat_buf = NULL;
+    int retval = 0;
+
+    memcpy(&h, header, sizeof(h));
+    memcpy(h._abSig, "\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1", 8);
+    h._uByteOrder = 0xfffe;
+    h._uSectorShift = w->sector_shift;
+    h._usReserved = 0;
+    h._ulReserved1 = 0;
+    h._signature = 0;
+    h._csectFat = w->num_fat_sectors;
+    h._csectDif = w->num_difat_sectors;
+    h._sectDifStart = w->num_difat_sectors ? w->num_fat_sectors : CFBF_END_OF_CHAIN;
+    if (w->sector_shift == 9)
+        h._csectDir = 0;
+
+    for (int i = 0; i < 109; ++i) {
+        if (i < w->num_fat_sectors)
+            h._sectFat[i] = i;
+        else
+            h._sectFat[i] = CFBF_FREESECT;
+    }
+
+    if (fseeko(w->out, 0, SEEK_SET) < 0) {
+        error(0, errno, "%s", w->filename);
+        goto fail;
+    }
+
+    /* Header, padded to a whole sector */
+    if (fwrite(&h, sizeof(h), 1, w->out) != 1 ||
+            fwrite(w->zero_sector, 1, w->sector_size - sizeof(h), w->out) != w->sector_size - sizeof(h)) {
+        error(0, errno, "%s", w->filename);
+        goto fail;
+    }
+
+    /* FAT */
+    if (fwrite(w->fat, sizeof(SECT), w->fat_size, w->out) != w->fat_size) {
+        error(0, errno, "%s", w->filename);
+        goto fail;
+    }
+
+    /* DIFAT: the FAT sectors after the first 109, then a pointer to the
+     * next DIFAT sector */
+    difat_buf = malloc(w->sector_size);
+    if (difat_buf == NULL) {
+        error(0, errno, "cfbf_writer_finish()");
+        goto fail;
+    }
+    SECT fat_sector = 109;
+    for (SECT i = 0; i < w->num_difat_sectors; ++i) {
+        for (SECT j = 0; j < entries_per_sector - 1; ++j) {
+            if (fat_sector < w->num_fat_sectors)
+                difat_buf[j] = fat_sector++;
+            else
+                difat_buf[j] = CFBF_FREESECT;
+        }
+        if (i + 1 < w->num_difat_sectors)
+            difat_buf[entries_per_sector - 1] = w->num_fat_sectors + i + 1;
+        else
+            difat_buf[entries_per_sector - 1] = CFBF_END_OF_CHAIN;
+
+        if (fwrite(difat_buf, 1, w->sector_size, w->out) != w->sector_size) {
+            error(0, errno, "%s", w->filename);
+            goto fail;
+        }
+    }
+
+end:
+    free(difat_buf);
+    if (w->out != NULL && fclose(w->out) == EOF) {
+        error(0, errno, "%s", w->filename);
+        retval = -1;
+    }
+    w->out = NULL;
+    cfbf_writer_abort(w);
+    return retval;
+
+fail:
+    retval = -1;
+    goto end;
+}
+
+/* Free the writer's resources without finishing the file */
+void
+cfbf_writer_abort(struct cfbf_writer *w) {
+    if (w->out != NULL)
+        fclose(w->out);
+    free(w->fat);
+    free(w->zero_sector);
+    w->out = NULL;
+    w->fat = NULL;
+    w->zero_sector = NULL;
+}
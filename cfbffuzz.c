@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <errno.h>
+#include <error.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "cfbf.h"
+
+/* Performance fuzzing harness.
+ *
+ * A damaged file which makes cfbfinfo take seconds or gigabytes is nearly
+ * as bad as one which crashes it, so as well as running each input, this
+ * measures what it cost. fuzz_one() opens the input with cfbf_open_memory(),
+ * runs every action on it, and records three costs: the instructions it
+ * took (or the CPU time, if the kernel won't count instructions for us),
+ * the work counted by cfbf_stats (sectors touched, callbacks and directory
+ * lookups), and the most memory the file's arena ever held.
+ *
+ * Built with clang -fsanitize=fuzzer ("make cfbffuzz-libfuzzer"), this is a
+ * libFuzzer target. Each cost is reported to libFuzzer through its extra
+ * counters, with one counter per range of values, so an input which costs
+ * more than any before it counts as new coverage and is kept. libFuzzer's
+ * own -timeout, -rss_limit_mb and -malloc_limit_mb catch the worst.
+ *
+ * Built as an ordinary program ("make cfbffuzz"), it runs each file named
+ * on the command line in the same way and prints its costs. fuzz/slow/
+ * holds the worst input known for each hot spot, and "make fuzz-bench"
+ * replays them, so a change which makes any of them slower again shows up.
+ */
+
+/* Each cost goes in one of these, four to each power of two */
+#define COST_BUCKETS 256
+
+enum fuzz_cost_type {
+    FUZZ_COST_INSTRUCTIONS,
+    FUZZ_COST_WORK,
+    FUZZ_COST_PEAK_ARENA,
+    FUZZ_NUM_COSTS
+};
+
+#ifdef CFBF_LIBFUZZER
+/* libFuzzer treats every byte in this section as a coverage counter */
+static uint8_t cost_counters[FUZZ_NUM_COSTS][COST_BUCKETS]
+    __attribute__((section("__libfuzzer_extra_counters"), used));
+#endif
+
+static const enum cfbf_action_type fuzz_action_types[] = {
+    CFBF_ACTION_HEADER,
+    CFBF_ACTION_LIST,
+    CFBF_ACTION_WALK,
+    CFBF_ACTION_DUMP,
+    CFBF_ACTION_TEXT,
+    CFBF_ACTION_SEGMENTS,
+    CFBF_ACTION_EXTRACT,
+    CFBF_ACTION_TAR,
+    CFBF_ACTION_HASH,
+    CFBF_ACTION_REPACK,
+    CFBF_ACTION_FRAG,
+};
+
+#define FUZZ_NUM_ACTIONS (sizeof(fuzz_action_types) / sizeof(fuzz_action_types[0]))
+
+#define FUZZ_CONTENTS_PATH "Root Entry/Quill/QuillSub/CONTENTS"
+
+struct fuzz_state {
+    struct cfbf_action actions[FUZZ_NUM_ACTIONS];
+    struct cfbf_action_options opts;
+    FILE *null_out;
+
+    /* Where --extract and --repack write, removed at exit */
+    char scratch_dir[64];
+    char extract_dir[80];
+    char repack_file[80];
+
+    /* perf event counting our instructions, or -1 to use the CPU clock */
+    int perf_fd;
+};
+
+static struct fuzz_state fuzz_state;
+
+static int
+remove_scratch_entry(const char *path, const struct stat *st, int flag,
+        struct FTW *ftw) {
+    remove(path);
+    return 0;
+}
+
+static void
+remove_scratch_dir(void) {
+    nftw(fuzz_state.scratch_dir, remove_scratch_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static int
+open_instruction_counter(void) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int
+fuzz_init(void) {
+    struct fuzz_state *state = &fuzz_state;
+    const char *tmpdir = getenv("TMPDIR");
+
+    memset(state, 0, sizeof(*state));
+
+    state->null_out = fopen("/dev/null", "w");
+    if (state->null_out == NULL) {
+        error(0, errno, "/dev/null");
+        return -1;
+    }
+
+    snprintf(state->scratch_dir, sizeof(state->scratch_dir), "%s/cfbffuzz.XXXXXX",
+            tmpdir ? tmpdir : "/tmp");
+    if (mkdtemp(state->scratch_dir) == NULL) {
+        error(0, errno, "%s", state->scratch_dir);
+        return -1;
+    }
+    atexit(remove_scratch_dir);
+    snprintf(state->extract_dir, sizeof(state->extract_dir), "%s/extract", state->scratch_dir);
+    snprintf(state->repack_file, sizeof(state->repack_file), "%s/repack.cfb", state->scratch_dir);
+
+    for (int i = 0; i < FUZZ_NUM_ACTIONS; ++i) {
+        state->actions[i].type = fuzz_action_types[i];
+        if (fuzz_action_types[i] == CFBF_ACTION_DUMP)
+            state->actions[i].arg = FUZZ_CONTENTS_PATH;
+        else if (fuzz_action_types[i] == CFBF_ACTION_EXTRACT)
+            state->actions[i].arg = state->extract_dir;
+        else if (fuzz_action_types[i] == CFBF_ACTION_REPACK)
+            state->actions[i].arg = state->repack_file;
+    }
+
+    /* One thread, so every instruction is counted and runs are repeatable */
+    state->opts.publisher_contents_path = FUZZ_CONTENTS_PATH;
+    state->opts.convert_text_to_utf8 = 1;
+    state->opts.num_threads = 1;
+    state->opts.frag_top_n = 20;
+    state->opts.seek_latency_ms = 8;
+    state->opts.read_window = 64 * 1024 * 1024;
+
+    state->perf_fd = open_instruction_counter();
+
+    return 0;
+}
+
+static uint64_t
+cpu_time_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Open data as a CFB file, run every action on it, and fill in costs */
+static void
+fuzz_one(const uint8_t *data, size_t size, uint64_t costs[FUZZ_NUM_COSTS]) {
+    struct fuzz_state *state = &fuzz_state;
+    struct cfbf cfbf;
+    uint64_t start_ns = 0;
+    long long instructions = 0;
+    size_t padded_size = CFBF_MEMORY_PADDED_SIZE(size);
+    uint8_t *padded;
+
+    memset(costs, 0, FUZZ_NUM_COSTS * sizeof(costs[0]));
+
+    /* The input may end partway through a sector, which is read whole, so
+     * give cfbf_open_memory() a copy with the zeros after it that it
+     * wants. This isn't counted. */
+    padded = malloc(padded_size > 0 ? padded_size : 1);
+    if (padded == NULL)
+        abort();
+    memcpy(padded, data, size);
+    memset(padded + size, 0, padded_size - size);
+
+    cfbf_stats_enable();
+
+    if (state->perf_fd >= 0) {
+        ioctl(state->perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(state->perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    else {
+        start_ns = cpu_time_ns();
+    }
+
+    if (cfbf_open_memory(padded, size, "input", &cfbf) == 0) {
+        for (int i = 0; i < FUZZ_NUM_ACTIONS; ++i)
+            cfbf_run_action(&cfbf, "input", &state->actions[i],
+                    state->null_out, &state->opts);
+        cfbf_close(&cfbf);
+    }
+
+    if (state->perf_fd >= 0) {
+        ioctl(state->perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(state->perf_fd, &instructions, sizeof(instructions)) != sizeof(instructions))
+            instructions = 0;
+        costs[FUZZ_COST_INSTRUCTIONS] = instructions;
+    }
+    else {
+        costs[FUZZ_COST_INSTRUCTIONS] = cpu_time_ns() - start_ns;
+    }
+    free(padded);
+
+    /* This includes a file which failed to open, which is freed before
+     * cfbf_open_memory() returns */
+    costs[FUZZ_COST_PEAK_ARENA] = cfbf_stats.arena_peak_bytes;
+    costs[FUZZ_COST_WORK] = cfbf_stats.counters[CFBF_STAT_SECTORS] +
+        cfbf_stats.counters[CFBF_STAT_CALLBACKS] +
+        cfbf_stats.counters[CFBF_STAT_DIR_LOOKUPS];
+}
+
+#ifdef CFBF_LIBFUZZER
+
+/* Which bucket a cost goes in: four to each power of two, so that a cost
+ * only counts as new once it's grown by a quarter */
+static int
+cost_bucket(uint64_t cost) {
+    int msb;
+
+    if (cost < 4)
+        return cost;
+    msb = 63 - __builtin_clzll(cost);
+    return msb * 4 + ((cost >> (msb - 2)) & 3);
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static int initialised = 0;
+    uint64_t costs[FUZZ_NUM_COSTS];
+
+    if (!initialised) {
+        if (fuzz_init() < 0)
+            abort();
+        initialised = 1;
+    }
+
+    fuzz_one(data, size, costs);
+
+    for (int i = 0; i < FUZZ_NUM_COSTS; ++i)
+        cost_counters[i][cost_bucket(costs[i])] = 1;
+
+    return 0;
+}
+
+#else
+
+static int
+read_file(const char *filename, uint8_t **data_r, size_t *size_r) {
+    FILE *f;
+    uint8_t *data = NULL;
+    size_t size = 0, alloc = 0, got;
+
+    f = fopen(filename, "r");
+    if (f == NULL) {
+        error(0, errno, "%s", filename);
+        return -1;
+    }
+
+    do {
+        if (size == alloc) {
+            uint8_t *new_data;
+
+            alloc = alloc ? alloc * 2 : 65536;
+            new_data = realloc(data, alloc);
+            if (new_data == NULL) {
+                error(0, errno, "%s", filename);
+                goto fail;
+            }
+            data = new_data;
+        }
+        got = fread(data + size, 1, alloc - size, f);
+        size += got;
+    } while (got > 0);
+
+    if (ferror(f)) {
+        error(0, errno, "%s", filename);
+        goto fail;
+    }
+
+    fclose(f);
+    *data_r = data;
+    *size_r = size;
+    return 0;
+
+fail:
+    fclose(f);
+    free(data);
+    return -1;
+}
+
+static void
+print_help(FILE *out) {
+    fprintf(out, "Run every cfbfinfo action on each file and print what it cost\n");
+    fprintf(out, "Usage: cfbffuzz file...\n");
+    fprintf(out, "One line is written for each file, tab-separated: the file name, its\n");
+    fprintf(out, "size, the instructions executed (or CPU nanoseconds, if instructions\n");
+    fprintf(out, "can't be counted), the sectors touched, callbacks and directory\n");
+    fprintf(out, "lookups, and the peak size of the file's arena in bytes.\n");
+}
+
+int main(int argc, char **argv) {
+    int exit_status = 0;
+
+    if (argc < 2 || !strcmp(argv[1], "-h")) {
+        print_help(argc < 2 ? stderr : stdout);
+        exit(argc < 2 ? 1 : 0);
+    }
+
+    if (fuzz_init() < 0)
+        exit(1);
+
+    printf("file\tbytes\t%s\twork\tpeak_arena_bytes\n",
+            fuzz_state.perf_fd >= 0 ? "instructions" : "cpu_ns");
+
+    for (int i = 1; i < argc; ++i) {
+        uint8_t *data;
+        size_t size;
+        uint64_t costs[FUZZ_NUM_COSTS];
+
+        if (read_file(argv[i], &data, &size) < 0) {
+            exit_status = 1;
+            continue;
+        }
+
+        fuzz_one(data, size, costs);
+        printf("%s\t%zu\t%llu\t%llu\t%llu\n", argv[i], size,
+                (unsigned long long) costs[FUZZ_COST_INSTRUCTIONS],
+                (unsigned long long) costs[FUZZ_COST_WORK],
+                (unsigned long long) costs[FUZZ_COST_PEAK_ARENA]);
+        fflush(stdout);
+        free(data);
+    }
+
+    return exit_status;
+}
+
+#endif
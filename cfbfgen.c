@@ -0,0 +1,997 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <error.h>
+
+#include "cfbf.h"
+
+/* Synthetic CFB file generator, for benchmarking cfbfinfo.
+ *
+ * Writes a valid compound file with the given sector size, number of
+ * streams, range of stream sizes, directory shape and DIFAT depth. Streams
+ * under the mini-stream cutoff go in the mini-stream. With --frag, the
+ * sectors of different chains are interleaved instead of each chain being
+ * contiguous, and with --publisher, a Publisher-style CONTENTS stream full
+ * of TEXT segments is added at Root Entry/Quill/QuillSub/CONTENTS.
+ *
+ * Everything is derived from the seed, so the same arguments always give
+ * the same file.
+ *
+ * The whole layout is planned before anything is written: which entry goes
+ * where in the directory, and in which order the chains' sectors are to be
+ * appended. That tells us every chain's first sector, so the directory can
+ * be filled in and written like any other chain. The file itself is then
+ * written with the writer in cfbf_write.c.
+ */
+
+#define MINI_SECTOR_SHIFT 6
+#define MINI_SECTOR_SIZE (1 << MINI_SECTOR_SHIFT)
+#define MINI_STREAM_CUTOFF 4096
+
+/* Don't let a mistyped --depth or --width fill the disk with directory */
+#define MAX_ENTRIES (1 << 22)
+
+struct gen_options {
+    int sector_shift;
+    int num_streams;
+    int64_t min_size;
+    int64_t max_size;
+    int mini_share;
+    int depth;
+    int width;
+    int difat_sectors;
+    int frag;
+    int publisher_kb;
+    uint64_t seed;
+    int verbosity;
+};
+
+struct gen_entry {
+    char name[32];
+    int object_type;
+    int parent;
+    uint64_t size;
+
+    /* Where the stream's data comes from: this buffer if it isn't NULL,
+     * otherwise pseudo-random bytes derived from the seed and entry ID */
+    const char *data;
+
+    /* Index into the list of chains, or -1 if the stream is in the
+     * mini-stream or empty */
+    int chain;
+    SECT start_sector;
+
+    SID left, right, child;
+    int colour;
+};
+
+struct gen_chain {
+    uint64_t size;
+    uint64_t written;
+    SECT first_sector;
+    SECT last_sector;
+
+    /* Either a directory entry whose data this is, or a buffer */
+    int entry;
+    const char *data;
+};
+
+struct gen_state {
+    const struct gen_options *opts;
+    uint64_t rng;
+
+    struct gen_entry *entries;
+    int num_entries;
+
+    struct gen_chain *chains;
+    int num_chains;
+
+    char *mini_stream;
+    uint64_t mini_stream_size;
+    SECT *mini_fat;
+    SECT mini_fat_entries;
+
+    char *contents;
+    char *directory;
+};
+
+static uint64_t
+splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t
+gen_random(struct gen_state *state) {
+    state->rng = splitmix64(state->rng);
+    return state->rng;
+}
+
+/* Random number from lo to hi inclusive */
+static uint64_t
+gen_random_range(struct gen_state *state, uint64_t lo, uint64_t hi) {
+    if (hi <= lo)
+        return lo;
+    return lo + gen_random(state) % (hi - lo + 1);
+}
+
+/* Random size from lo to hi, with each power of two as likely as any
+ * other, so there are many more small streams than big ones */
+static uint64_t
+gen_random_size(struct gen_state *state, uint64_t lo, uint64_t hi) {
+    int lo_bits = 0, hi_bits = 0, bits;
+    uint64_t from, to;
+
+    if (hi <= lo)
+        return lo;
+
+    while ((lo >> lo_bits) > 1)
+        ++lo_bits;
+    while ((hi >> hi_bits) > 1)
+        ++hi_bits;
+
+    bits = gen_random_range(state, lo_bits, hi_bits);
+    from = (uint64_t) 1 << bits;
+    to = (from << 1) - 1;
+    if (from < lo)
+        from = lo;
+    if (to > hi)
+        to = hi;
+
+    return gen_random_range(state, from, to);
+}
+
+/* Copy length bytes of a stream's data, starting at offset, to dest */
+static void
+gen_fill(const struct gen_state *state, const struct gen_entry *e,
+        int entry_id, uint64_t offset, char *dest, size_t length) {
+    if (e->data != NULL) {
+        memcpy(dest, e->data + offset, length);
+        return;
+    }
+
+    /* Each eight bytes of the stream is a hash of the seed, the entry ID
+     * and its position, so any part can be made without the rest */
+    while (length > 0) {
+        uint64_t word = splitmix64(state->opts->seed ^ ((uint64_t) entry_id << 40) ^ (offset >> 3));
+        int in_word = offset & 7;
+        size_t n = 8 - in_word;
+
+        if (n > length)
+            n = length;
+        memcpy(dest, (char *) &word + in_word, n);
+        dest += n;
+        offset += n;
+        length -= n;
+    }
+}
+
+static int
+gen_add_entry(struct gen_state *state, const char *name, int object_type,
+        int parent, uint64_t size) {
+    struct gen_entry *e;
+
+    if (state->num_entries >= MAX_ENTRIES) {
+        error(0, 0, "too many directory entries, the limit is %d", MAX_ENTRIES);
+        return -1;
+    }
+
+    if ((state->num_entries & (state->num_entries - 1)) == 0) {
+        int new_size = state->num_entries ? state->num_entries * 2 : 1;
+        struct gen_entry *new_entries = realloc(state->entries, new_size * sizeof(struct gen_entry));
+        if (new_entries == NULL) {
+            error(0, errno, "gen_add_entry()");
+            return -1;
+        }
+        state->entries = new_entries;
+    }
+
+    e = &state->entries[state->num_entries];
+    memset(e, 0, sizeof(*e));
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    e->object_type = object_type;
+    e->parent = parent;
+    e->size = size;
+    e->colour = 1;
+    e->chain = -1;
+    e->start_sector = CFBF_END_OF_CHAIN;
+    e->left = e->right = e->child = CFBF_NOSTREAM;
+
+    return state->num_entries++;
+}
+
+/* Add a chain to the list of those to be written to the main FAT. Returns
+ * its index, or -1 on failure. */
+static int
+gen_add_chain(struct gen_state *state, uint64_t size, int entry,
+        const char *data) {
+    struct gen_chain *c;
+
+    if ((state->num_chains & (state->num_chains - 1)) == 0) {
+        int new_size = state->num_chains ? state->num_chains * 2 : 1;
+        struct gen_chain *new_chains = realloc(state->chains, new_size * sizeof(struct gen_chain));
+        if (new_chains == NULL) {
+            error(0, errno, "gen_add_chain()");
+            return -1;
+        }
+        state->chains = new_chains;
+    }
+
+    c = &state->chains[state->num_chains];
+    memset(c, 0, sizeof(*c));
+    c->size = size;
+    c->entry = entry;
+    c->data = data;
+    c->first_sector = CFBF_END_OF_CHAIN;
+    c->last_sector = CFBF_END_OF_CHAIN;
+
+    return state->num_chains++;
+}
+
+static const char *gen_words[] = {
+    "the", "of", "and", "a", "to", "in", "is", "you", "that", "it", "he",
+    "was", "for", "on", "are", "as", "with", "his", "they", "at", "be",
+    "this", "have", "from", "or", "one", "had", "by", "word", "but", "not",
+    "what", "all", "were", "we", "when", "your", "can", "said", "there",
+    "newsletter", "church", "summer", "fete", "raffle", "tickets",
+    "available", "committee", "meeting", "village", "hall", "Thursday",
+};
+
+/* Make a Publisher CONTENTS stream holding about text_size bytes of UTF-16
+ * text, split into TEXT segments with other kinds of segment in between,
+ * laid out the way pub_contents_index_load() expects. Returns the stream
+ * size, or 0 on failure. */
+static uint64_t
+gen_make_contents(struct gen_state *state, uint64_t text_size) {
+    const int first_list_max = (512 - 24 - 8) / 24;
+    const int list_max = (512 - 8) / 24;
+    const uint32_t text_segment_size = 4096;
+    const uint32_t other_segment_size = 256;
+    int num_text = (text_size + text_segment_size - 1) / text_segment_size;
+    int num_segments, num_lists;
+    uint64_t size, offset;
+    char *p;
+
+    if (num_text == 0)
+        num_text = 1;
+    num_segments = num_text * 2;
+    if (num_segments > 65535) {
+        error(0, 0, "--publisher: too much text for one CONTENTS stream");
+        return 0;
+    }
+
+    num_lists = 1;
+    if (num_segments > first_list_max)
+        num_lists += (num_segments - first_list_max + list_max - 1) / list_max;
+
+    size = (uint64_t) num_lists * 512 + (uint64_t) num_text * (text_segment_size + other_segment_size);
+    state->contents = calloc(size, 1);
+    if (state->contents == NULL) {
+        error(0, errno, "gen_make_contents()");
+        return 0;
+    }
+    p = state->contents;
+
+    /* Header */
+    memcpy(p, "CHNKINK ", 8);
+    *(uint32_t *) (p + 8) = 4;
+    *(uint16_t *) (p + 12) = num_segments;
+    *(uint16_t *) (p + 14) = 0;
+    *(uint32_t *) (p + 16) = (uint32_t) num_lists << 9;
+    *(uint32_t *) (p + 20) = size;
+
+    /* Segment lists, the first straight after the header and the rest at
+     * the start of each following 512 bytes, then the segments' data */
+    offset = (uint64_t) num_lists * 512;
+    for (int list = 0, seg = 0; list < num_lists; ++list) {
+        char *header = p + (list == 0 ? 24 : list * 512);
+        int max = list == 0 ? first_list_max : list_max;
+        int count = num_segments - seg < max ? num_segments - seg : max;
+
+        *(uint16_t *) header = 0x1f8;
+        *(uint16_t *) (header + 2) = count;
+        *(uint32_t *) (header + 4) = list + 1 < num_lists ? (list + 1) * 512 : 0xffffffff;
+
+        for (int i = 0; i < count; ++i, ++seg) {
+            struct pub_contents_segment_desc desc;
+            int is_text = (seg & 1) == 0;
+
+            memset(&desc, 0, sizeof(desc));
+            desc.tag = PUB_CONTENTS_SEGMENT_TAG;
+            memcpy(desc.data_type, is_text ? "TEXT" : "SYID", 4);
+            memcpy(desc.data_format, is_text ? "TEXT" : "SYID", 4);
+            desc.data_type_args[1] = 1;
+            desc.offset = offset;
+            desc.length = is_text ? text_segment_size : other_segment_size;
+
+            if (is_text) {
+                /* Words separated by spaces, with a paragraph break every
+                 * so often, as little-endian UTF-16 */
+                uint16_t *text = (uint16_t *) (p + offset);
+                int n = 0, max_chars = text_segment_size / 2;
+
+                while (n < max_chars) {
+                    const char *word;
+                    uint64_t r = gen_random(state);
+
+                    word = gen_words[r % (sizeof(gen_words) / sizeof(gen_words[0]))];
+                    while (*word && n < max_chars)
+                        text[n++] = (unsigned char) *word++;
+                    if (n < max_chars)
+                        text[n++] = ((r >> 32) % 16 == 0) ? '\r' : ' ';
+                }
+            }
+            else {
+                gen_fill(state, &state->entries[0], 0, offset, p + offset, other_segment_size);
+            }
+
+            memcpy(header + 8 + i * sizeof(desc), &desc, sizeof(desc));
+            offset += desc.length;
+        }
+    }
+
+    return size;
+}
+
+/* Compare two directory entries' names the way the red-black trees of
+ * siblings are ordered: shorter names first, then by upper-case code
+ * point. Our names are all ASCII. */
+static int
+gen_compare_names(const char *a, const char *b) {
+    size_t la = strlen(a), lb = strlen(b);
+
+    if (la != lb)
+        return la < lb ? -1 : 1;
+    for (size_t i = 0; i < la; ++i) {
+        int ca = (a[i] >= 'a' && a[i] <= 'z') ? a[i] - 32 : a[i];
+        int cb = (b[i] >= 'a' && b[i] <= 'z') ? b[i] - 32 : b[i];
+        if (ca != cb)
+            return ca < cb ? -1 : 1;
+    }
+    return 0;
+}
+
+static struct gen_entry *gen_sort_entries;
+
+static int
+gen_compare_ids(const void *a, const void *b) {
+    return gen_compare_names(gen_sort_entries[*(const int *) a].name,
+            gen_sort_entries[*(const int *) b].name);
+}
+
+/* Make a balanced binary tree of the sorted siblings ids[lo..hi), and
+ * return the ID of its root. Nodes on the deepest level are red and the
+ * rest black, which makes it a valid red-black tree. */
+static SID
+gen_build_tree(struct gen_entry *entries, const int *ids, int lo, int hi,
+        int depth, int max_depth) {
+    int mid;
+    struct gen_entry *e;
+
+    if (lo >= hi)
+        return CFBF_NOSTREAM;
+
+    mid = lo + (hi - lo) / 2;
+    e = &entries[ids[mid]];
+    e->left = gen_build_tree(entries, ids, lo, mid, depth + 1, max_depth);
+    e->right = gen_build_tree(entries, ids, mid + 1, hi, depth + 1, max_depth);
+    e->colour = (depth > 0 && depth == max_depth) ? 0 : 1;
+
+    return ids[mid];
+}
+
+/* Link each storage's children into a tree of siblings */
+static int
+gen_link_directory(struct gen_state *state) {
+    int *ids, *count, *start;
+    int n = state->num_entries;
+    int retval = 0;
+
+    ids = malloc(n * sizeof(int));
+    count = calloc(n + 1, sizeof(int));
+    start = calloc(n + 1, sizeof(int));
+    if (ids == NULL || count == NULL || start == NULL) {
+        error(0, errno, "gen_link_directory()");
+        retval = -1;
+        goto end;
+    }
+
+    /* Group the entries by parent */
+    for (int i = 1; i < n; ++i)
+        count[state->entries[i].parent]++;
+    for (int i = 1; i <= n; ++i)
+        start[i] = start[i - 1] + count[i - 1];
+    memset(count, 0, (n + 1) * sizeof(int));
+    for (int i = 1; i < n; ++i) {
+        int parent = state->entries[i].parent;
+        ids[start[parent] + count[parent]++] = i;
+    }
+
+    gen_sort_entries = state->entries;
+    for (int i = 0; i < n; ++i) {
+        int max_depth = 0;
+
+        if (count[i] == 0)
+            continue;
+
+        qsort(ids + start[i], count[i], sizeof(int), gen_compare_ids);
+        while ((2 << max_depth) - 1 < count[i])
+            ++max_depth;
+        state->entries[i].child = gen_build_tree(state->entries, ids + start[i],
+                0, count[i], 0, max_depth);
+    }
+
+end:
+    free(ids);
+    free(count);
+    free(start);
+    return retval;
+}
+
+/* Decide what's in the file: the storage tree, the streams and their
+ * sizes, and which chains they need */
+static int
+gen_plan_entries(struct gen_state *state) {
+    const struct gen_options *opts = state->opts;
+    int num_storages = 0;
+    int level_start = 0, level_end = 1;
+    uint64_t small_lo, small_hi, big_lo, big_hi;
+    char name[32];
+
+    if (gen_add_entry(state, "Root Entry", 5, -1, 0) < 0)
+        return -1;
+
+    /* Storages, width to a storage, depth levels deep */
+    for (int level = 0; level < opts->depth; ++level) {
+        for (int parent = level_start; parent < level_end; ++parent) {
+            for (int i = 0; i < opts->width; ++i) {
+                snprintf(name, sizeof(name), "Storage%d", ++num_storages);
+                if (gen_add_entry(state, name, 1, parent, 0) < 0)
+                    return -1;
+            }
+        }
+        level_start = level_end;
+        level_end = state->num_entries;
+    }
+
+    /* Streams, spread evenly over the root and the storages. The first is
+     * always in the root and always max_size bytes, so there's one stream
+     * every file has for -r to read. */
+    small_lo = opts->min_size > 0 ? opts->min_size : 1;
+    small_hi = opts->max_size < MINI_STREAM_CUTOFF - 1 ? opts->max_size : MINI_STREAM_CUTOFF - 1;
+    big_lo = opts->min_size > MINI_STREAM_CUTOFF ? opts->min_size : MINI_STREAM_CUTOFF;
+    big_hi = opts->max_size;
+
+    for (int i = 0; i < opts->num_streams; ++i) {
+        uint64_t size;
+        int small = (int) (gen_random(state) % 100) < opts->mini_share;
+
+        if (i == 0)
+            size = opts->max_size;
+        else if ((small && small_lo <= small_hi) || big_lo > big_hi)
+            size = gen_random_size(state, small_lo, small_hi);
+        else
+            size = gen_random_size(state, big_lo, big_hi);
+
+        snprintf(name, sizeof(name), "Stream%d", i);
+        if (gen_add_entry(state, name, 2, i % (num_storages + 1), size) < 0)
+            return -1;
+    }
+
+    if (opts->publisher_kb > 0) {
+        int quill, quill_sub;
+        uint64_t size = gen_make_contents(state, (uint64_t) opts->publisher_kb * 1024);
+
+        if (size == 0)
+            return -1;
+        quill = gen_add_entry(state, "Quill", 1, 0, 0);
+        quill_sub = quill < 0 ? -1 : gen_add_entry(state, "QuillSub", 1, quill, 0);
+        if (quill_sub < 0 || gen_add_entry(state, "CONTENTS", 2, quill_sub, size) < 0)
+            return -1;
+        state->entries[state->num_entries - 1].data = state->contents;
+    }
+
+    return 0;
+}
+
+/* Lay out the streams under the cutoff in the mini-stream, and make the
+ * mini-FAT. Every other non-empty stream gets a chain of its own. */
+static int
+gen_plan_mini_stream(struct gen_state *state, int sector_size) {
+    SECT next_mini_sector = 0;
+    SECT mini_fat_size;
+
+    for (int i = 1; i < state->num_entries; ++i) {
+        struct gen_entry *e = &state->entries[i];
+        if (e->object_type == 2 && e->size > 0 && e->size < MINI_STREAM_CUTOFF)
+            state->mini_stream_size += (e->size + MINI_SECTOR_SIZE - 1) & ~(uint64_t) (MINI_SECTOR_SIZE - 1);
+    }
+
+    state->mini_fat_entries = state->mini_stream_size / MINI_SECTOR_SIZE;
+    mini_fat_size = ((uint64_t) state->mini_fat_entries * sizeof(SECT) + sector_size - 1) / sector_size * sector_size / sizeof(SECT);
+    if (state->mini_stream_size > 0) {
+        state->mini_stream = calloc(state->mini_stream_size, 1);
+        state->mini_fat = malloc(mini_fat_size * sizeof(SECT));
+        if (state->mini_stream == NULL || state->mini_fat == NULL) {
+            error(0, errno, "gen_plan_mini_stream()");
+            return -1;
+        }
+        for (SECT i = 0; i < mini_fat_size; ++i)
+            state->mini_fat[i] = CFBF_FREESECT;
+    }
+
+    for (int i = 1; i < state->num_entries; ++i) {
+        struct gen_entry *e = &state->entries[i];
+        SECT num_mini_sectors;
+
+        if (e->object_type != 2 || e->size == 0)
+            continue;
+
+        if (e->size >= MINI_STREAM_CUTOFF) {
+            e->chain = gen_add_chain(state, e->size, i, NULL);
+            if (e->chain < 0)
+                return -1;
+            continue;
+        }
+
+        num_mini_sectors = (e->size + MINI_SECTOR_SIZE - 1) / MINI_SECTOR_SIZE;
+        e->start_sector = next_mini_sector;
+        gen_fill(state, e, i, 0, state->mini_stream + (uint64_t) next_mini_sector * MINI_SECTOR_SIZE, e->size);
+        for (SECT s = 0; s < num_mini_sectors; ++s) {
+            state->mini_fat[next_mini_sector + s] = s + 1 < num_mini_sectors ?
+                    next_mini_sector + s + 1 : CFBF_END_OF_CHAIN;
+        }
+        next_mini_sector += num_mini_sectors;
+    }
+
+    return 0;
+}
+
+/* Fill in the directory, now that every chain's first sector is known */
+static void
+gen_fill_directory(struct gen_state *state, int mini_stream_chain) {
+    struct DirEntry *dir = (struct DirEntry *) state->directory;
+
+    for (int i = 0; i < state->num_entries; ++i) {
+        struct gen_entry *e = &state->entries[i];
+        struct DirEntry *d = &dir[i];
+        int len = strlen(e->name);
+
+        for (int c = 0; c < len; ++c)
+            d->name[c] = (unsigned char) e->name[c];
+        d->name_length = (len + 1) * 2;
+        d->object_type = e->object_type;
+        d->colour = e->colour;
+        d->left_sibling_id = e->left;
+        d->right_sibling_id = e->right;
+        d->child_id = e->child;
+
+        if (e->object_type == 5) {
+            d->start_sector = mini_stream_chain >= 0 ?
+                    state->chains[mini_stream_chain].first_sector : CFBF_END_OF_CHAIN;
+            d->stream_size = state->mini_stream_size;
+        }
+        else if (e->object_type == 2) {
+            d->start_sector = e->chain >= 0 ? state->chains[e->chain].first_sector : e->start_sector;
+            d->stream_size = e->size;
+        }
+    }
+}
+
+/* Decide the order in which chains' sectors are appended to the file.
+ * Normally each chain is written in one go, but with --frag, before each
+ * sector there's that percent chance of switching to another chain chosen
+ * at random. Returns an array giving the chain of each data sector. */
+static int *
+gen_schedule(struct gen_state *state, SECT num_data_sectors) {
+    int *schedule;
+    int *active;
+    uint64_t *remaining;
+    int num_active = 0, current = 0;
+    int sector_size = 1 << state->opts->sector_shift;
+
+    schedule = malloc((size_t) num_data_sectors * sizeof(int));
+    active = malloc((state->num_chains + 1) * sizeof(int));
+    remaining = malloc((state->num_chains + 1) * sizeof(uint64_t));
+    if (schedule == NULL || active == NULL || remaining == NULL) {
+        error(0, errno, "gen_schedule()");
+        free(schedule);
+        schedule = NULL;
+        goto end;
+    }
+
+    for (int i = 0; i < state->num_chains; ++i) {
+        remaining[i] = (state->chains[i].size + sector_size - 1) / sector_size;
+        if (remaining[i] > 0)
+            active[num_active++] = i;
+    }
+
+    for (SECT s = 0; s < num_data_sectors; ++s) {
+        int chain;
+
+        if (state->opts->frag > 0 && (int) (gen_random(state) % 100) < state->opts->frag)
+            current = gen_random(state) % num_active;
+
+        chain = active[current];
+        schedule[s] = chain;
+        if (state->chains[chain].first_sector == CFBF_END_OF_CHAIN)
+            state->chains[chain].first_sector = s;
+
+        if (--remaining[chain] == 0) {
+            active[current] = active[--num_active];
+            if (current >= num_active)
+                current = 0;
+        }
+    }
+
+end:
+    free(active);
+    free(remaining);
+    return schedule;
+}
+
+static int
+gen_write(struct gen_state *state, const char *filename) {
+    const struct gen_options *opts = state->opts;
+    int sector_size = 1 << opts->sector_shift;
+    SECT entries_per_sector = sector_size / sizeof(SECT);
+    int mini_stream_chain = -1, mini_fat_chain = -1, dir_chain, padding = -1;
+    uint64_t num_dir_entries, dir_size;
+    uint64_t total;
+    SECT num_data_sectors = 0, base;
+    struct StructuredStorageHeader header;
+    struct cfbf_writer w;
+    int writer_open = 0;
+    int *schedule = NULL;
+    char *buf = NULL;
+    int retval = 0;
+
+    if (state->mini_stream_size > 0) {
+        mini_stream_chain = gen_add_chain(state, state->mini_stream_size, -1, state->mini_stream);
+        mini_fat_chain = gen_add_chain(state,
+                ((uint64_t) state->mini_fat_entries * sizeof(SECT) + sector_size - 1) / sector_size * sector_size,
+                -1, (const char *) state->mini_fat);
+        if (mini_stream_chain < 0 || mini_fat_chain < 0)
+            goto fail;
+    }
+
+    /* With --difat, the file may need padding out, which is done with a
+     * stream in the root whose size we'll know in a moment */
+    if (opts->difat_sectors > 0) {
+        padding = gen_add_entry(state, "Padding", 2, 0, 0);
+        if (padding < 0)
+            goto fail;
+    }
+
+    num_dir_entries = (state->num_entries + (sector_size / sizeof(struct DirEntry)) - 1)
+            / (sector_size / sizeof(struct DirEntry)) * (sector_size / sizeof(struct DirEntry));
+    dir_size = num_dir_entries * sizeof(struct DirEntry);
+    state->directory = calloc(dir_size, 1);
+    if (state->directory == NULL) {
+        error(0, errno, "gen_write()");
+        goto fail;
+    }
+    for (uint64_t i = state->num_entries; i < num_dir_entries; ++i) {
+        struct DirEntry *d = (struct DirEntry *) state->directory + i;
+        d->left_sibling_id = d->right_sibling_id = d->child_id = CFBF_NOSTREAM;
+    }
+    dir_chain = gen_add_chain(state, dir_size, -1, state->directory);
+    if (dir_chain < 0)
+        goto fail;
+
+    total = 0;
+    for (int i = 0; i < state->num_chains; ++i)
+        total += (state->chains[i].size + sector_size - 1) / sector_size;
+
+    /* The writer makes the FAT as small as it can be. For it to need more
+     * than fat_needed - 1 sectors, those and the DIFAT sectors that go
+     * with them have to be too few to cover the file. */
+    if (padding >= 0) {
+        uint64_t fat_needed = 109 + (uint64_t) (opts->difat_sectors - 1) * (entries_per_sector - 1) + 1;
+        uint64_t data_needed = (fat_needed - 1) * entries_per_sector + 1
+                - (fat_needed - 1) - (opts->difat_sectors - 1);
+
+        if (total < data_needed) {
+            uint64_t pad = data_needed - total;
+
+            if (pad * sector_size < MINI_STREAM_CUTOFF)
+                pad = MINI_STREAM_CUTOFF / sector_size;
+            state->entries[padding].size = pad * sector_size;
+            state->entries[padding].chain = gen_add_chain(state, pad * sector_size, padding, NULL);
+            if (state->entries[padding].chain < 0)
+                goto fail;
+            total += pad;
+        }
+    }
+
+    if (total >= CFBF_MAXREGSECT) {
+        error(0, 0, "%s: too much data for a CFB file", filename);
+        goto fail;
+    }
+    num_data_sectors = total;
+
+    if (cfbf_writer_open(&w, filename, opts->sector_shift, num_data_sectors) < 0)
+        goto fail;
+    writer_open = 1;
+
+    schedule = gen_schedule(state, num_data_sectors);
+    if (schedule == NULL)
+        goto fail;
+
+    /* gen_schedule() numbered the sectors from 0. Now we know where the
+     * data starts, turn those into sector numbers. */
+    base = cfbf_writer_next_sector(&w);
+    for (int i = 0; i < state->num_chains; ++i) {
+        if (state->chains[i].first_sector != CFBF_END_OF_CHAIN)
+            state->chains[i].first_sector += base;
+    }
+
+    if (gen_link_directory(state) < 0)
+        goto fail;
+    gen_fill_directory(state, mini_stream_chain);
+
+    buf = malloc(sector_size);
+    if (buf == NULL) {
+        error(0, errno, "gen_write()");
+        goto fail;
+    }
+
+    for (SECT s = 0; s < num_data_sectors; ++s) {
+        struct gen_chain *c = &state->chains[schedule[s]];
+        uint64_t length = c->size - c->written;
+        SECT sector;
+
+        if (length > sector_size)
+            length = sector_size;
+
+        if (c->data != NULL)
+            memcpy(buf, c->data + c->written, length);
+        else if (c->entry >= 0)
+            gen_fill(state, &state->entries[c->entry], c->entry, c->written, buf, length);
+        else
+            memset(buf, 0, length);
+
+        sector = cfbf_writer_append_sector(&w, buf, length, c->last_sector);
+        if (sector == CFBF_FREESECT)
+            goto fail;
+        c->last_sector = sector;
+        c->written += length;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header._uMinorVersion = 0x3e;
+    header._uDllVersion = opts->sector_shift == 12 ? 4 : 3;
+    header._uMiniSectorShift = MINI_SECTOR_SHIFT;
+    header._ulMiniSectorCutoff = MINI_STREAM_CUTOFF;
+    header._sectDirStart = state->chains[dir_chain].first_sector;
+    header._csectDir = dir_size / sector_size;
+    if (mini_fat_chain >= 0) {
+        header._sectMiniFatStart = state->chains[mini_fat_chain].first_sector;
+        header._csectMiniFat = state->chains[mini_fat_chain].size / sector_size;
+    }
+    else {
+        header._sectMiniFatStart = CFBF_END_OF_CHAIN;
+        header._csectMiniFat = 0;
+    }
+
+    if (opts->verbosity > 0) {
+        fprintf(stderr, "%s: %d entries, %d chains, %lu data sectors, %lu FAT sectors, %lu DIFAT sectors, %llu bytes in mini-stream\n",
+                filename, state->num_entries, state->num_chains,
+                (unsigned long) num_data_sectors,
+                (unsigned long) w.num_fat_sectors,
+                (unsigned long) w.num_difat_sectors,
+                (unsigned long long) state->mini_stream_size);
+    }
+
+    writer_open = 0;
+    if (cfbf_writer_finish(&w, &header) < 0)
+        goto fail;
+
+end:
+    if (writer_open)
+        cfbf_writer_abort(&w);
+    free(buf);
+    free(schedule);
+    return retval;
+
+fail:
+    retval = -1;
+    goto end;
+}
+
+static void
+gen_state_free(struct gen_state *state) {
+    free(state->entries);
+    free(state->chains);
+    free(state->mini_stream);
+    free(state->mini_fat);
+    free(state->contents);
+    free(state->directory);
+    memset(state, 0, sizeof(*state));
+}
+
+static int64_t
+parse_size(const char *arg) {
+    char *end;
+    int64_t size = strtoll(arg, &end, 10);
+
+    switch (*end) {
+        case 'k': case 'K': size *= 1024; ++end; break;
+        case 'm': case 'M': size *= 1024 * 1024; ++end; break;
+        case 'g': case 'G': size *= 1024 * 1024 * 1024; ++end; break;
+    }
+    if (*end != '\0' || size < 0)
+        error(1, 0, "invalid size: %s", arg);
+    return size;
+}
+
+static void
+print_help(FILE *out) {
+    fprintf(out, "Synthetic CFB file generator\n");
+    fprintf(out, "Usage: cfbfgen [options] output.cfb\n");
+    fprintf(out, "Options:\n");
+    fprintf(out, "    -h         Show this help\n");
+    fprintf(out, "    -s <n>     Sector shift, 9 for 512-byte sectors or 12 for 4096\n");
+    fprintf(out, "               (default 9)\n");
+    fprintf(out, "    -n <n>     Number of streams (default 100)\n");
+    fprintf(out, "    --min-size <size>\n");
+    fprintf(out, "    --max-size <size>\n");
+    fprintf(out, "               Range of stream sizes, with K, M or G suffix if wanted\n");
+    fprintf(out, "               (default 1 to 1M). The first stream, Root Entry/Stream0,\n");
+    fprintf(out, "               is always the maximum size.\n");
+    fprintf(out, "    --mini-share <percent>\n");
+    fprintf(out, "               Percentage of streams to make small enough for the\n");
+    fprintf(out, "               mini-stream (default 50)\n");
+    fprintf(out, "    --depth <n>\n");
+    fprintf(out, "    --width <n>\n");
+    fprintf(out, "               Make a tree of storages <depth> levels deep, with <width>\n");
+    fprintf(out, "               storages in each, and spread the streams among them\n");
+    fprintf(out, "               (default 0 and 4: every stream in the root)\n");
+    fprintf(out, "    --difat <n>\n");
+    fprintf(out, "               Make the FAT big enough to need at least <n> DIFAT\n");
+    fprintf(out, "               sectors, padding the file out if necessary (default 0)\n");
+    fprintf(out, "    --frag <percent>\n");
+    fprintf(out, "               Chance of switching to another chain before each sector\n");
+    fprintf(out, "               written, 0 for every chain contiguous (default 0)\n");
+    fprintf(out, "    --publisher <KB>\n");
+    fprintf(out, "               Add a Publisher CONTENTS stream at\n");
+    fprintf(out, "               Root Entry/Quill/QuillSub/CONTENTS with about <KB>\n");
+    fprintf(out, "               kilobytes of text in it (default 0, none)\n");
+    fprintf(out, "    --seed <n> Seed for the random choices (default 1)\n");
+    fprintf(out, "    -v         Describe the file written\n");
+}
+
+enum {
+    OPT_MIN_SIZE = 256,
+    OPT_MAX_SIZE,
+    OPT_MINI_SHARE,
+    OPT_DEPTH,
+    OPT_WIDTH,
+    OPT_DIFAT,
+    OPT_FRAG,
+    OPT_PUBLISHER,
+    OPT_SEED
+};
+
+static const struct option long_options[] = {
+    { "min-size", required_argument, NULL, OPT_MIN_SIZE },
+    { "max-size", required_argument, NULL, OPT_MAX_SIZE },
+    { "mini-share", required_argument, NULL, OPT_MINI_SHARE },
+    { "depth", required_argument, NULL, OPT_DEPTH },
+    { "width", required_argument, NULL, OPT_WIDTH },
+    { "difat", required_argument, NULL, OPT_DIFAT },
+    { "frag", required_argument, NULL, OPT_FRAG },
+    { "publisher", required_argument, NULL, OPT_PUBLISHER },
+    { "seed", required_argument, NULL, OPT_SEED },
+    { NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char **argv) {
+    int c;
+    struct gen_options opts;
+    struct gen_state state;
+    int exit_status = 0;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.sector_shift = 9;
+    opts.num_streams = 100;
+    opts.min_size = 1;
+    opts.max_size = 1024 * 1024;
+    opts.mini_share = 50;
+    opts.width = 4;
+    opts.seed = 1;
+
+    while ((c = getopt_long(argc, argv, "hs:n:v", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'h':
+                print_help(stdout);
+                exit(0);
+
+            case 's':
+                opts.sector_shift = atoi(optarg);
+                if (opts.sector_shift != 9 && opts.sector_shift != 12)
+                    error(1, 0, "-s: sector shift must be 9 or 12");
+                break;
+
+            case 'n':
+                opts.num_streams = atoi(optarg);
+                if (opts.num_streams < 1)
+                    error(1, 0, "-n: there must be at least one stream");
+                break;
+
+            case OPT_MIN_SIZE:
+                opts.min_size = parse_size(optarg);
+                break;
+
+            case OPT_MAX_SIZE:
+                opts.max_size = parse_size(optarg);
+                break;
+
+            case OPT_MINI_SHARE:
+                opts.mini_share = atoi(optarg);
+                break;
+
+            case OPT_DEPTH:
+                opts.depth = atoi(optarg);
+                break;
+
+            case OPT_WIDTH:
+                opts.width = atoi(optarg);
+                break;
+
+            case OPT_DIFAT:
+                opts.difat_sectors = atoi(optarg);
+                break;
+
+            case OPT_FRAG:
+                opts.frag = atoi(optarg);
+                break;
+
+            case OPT_PUBLISHER:
+                opts.publisher_kb = atoi(optarg);
+                break;
+
+            case OPT_SEED:
+                opts.seed = strtoull(optarg, NULL, 10);
+                break;
+
+            case 'v':
+                opts.verbosity++;
+                break;
+
+            default:
+                exit(1);
+        }
+    }
+
+    if (optind >= argc) {
+        print_help(stderr);
+        exit(1);
+    }
+    if (opts.min_size > opts.max_size)
+        error(1, 0, "--min-size is bigger than --max-size");
+    if (opts.depth < 0 || opts.width < 1 || opts.difat_sectors < 0 ||
+            opts.frag < 0 || opts.frag > 100 ||
+            opts.mini_share < 0 || opts.mini_share > 100 ||
+            opts.publisher_kb < 0)
+        error(1, 0, "invalid option value; run cfbfgen -h for help");
+
+    memset(&state, 0, sizeof(state));
+    state.opts = &opts;
+    state.rng = opts.seed;
+
+    if (gen_plan_entries(&state) < 0 ||
+            gen_plan_mini_stream(&state, 1 << opts.sector_shift) < 0 ||
+            gen_write(&state, argv[optind]) < 0) {
+        exit_status = 1;
+    }
+
+    gen_state_free(&state);
+
+    return exit_status;
+}